@@ -0,0 +1,68 @@
+#define _POSIX_C_SOURCE 200809L
+#include "aot.h"
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Aot {
+  void *handle;
+  const AotCode *code;
+  int rom_banks; // 16 KB banks in the ROM, for the bank at 0x4000
+  AotHost host;
+};
+
+void AOT_path(Cartridge *cart, const char *dir, char *buf, size_t len) {
+  snprintf(buf, len, AOT_FILE, dir, (unsigned long long)cart_hash(cart));
+}
+
+Aot *AOT_load(Cartridge *cart, const char *dir) {
+  char path[4096];
+  AOT_path(cart, dir, path, sizeof(path));
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!handle)
+    return NULL;
+  const AotCode *code = dlsym(handle, AOT_SYMBOL);
+  if (!code || code->abi != AOT_ABI || code->rom_hash != cart_hash(cart)) {
+    dlclose(handle);
+    return NULL;
+  }
+  Aot *aot = calloc(1, sizeof(Aot));
+  if (!aot) {
+    dlclose(handle);
+    return NULL;
+  }
+  aot->handle = handle;
+  aot->code = code;
+  aot->rom_banks = (cart->rom_size + 0x3FFF) / 0x4000;
+  aot->host = (AotHost){CPU_read_memory, CPU_write_memory, CPU_execute,
+                        CPU_opcode_hooks()};
+  return aot;
+}
+
+void AOT_free(Aot *aot) {
+  if (!aot)
+    return;
+  dlclose(aot->handle);
+  free(aot);
+}
+
+bool AOT_run(CPU *cpu) {
+  Aot *aot = cpu->aot;
+  uint16_t pc = cpu->PC;
+  // where the interpreter has to fetch the opcode itself
+  if (pc >= 0x8000 || cpu->halted || cpu->bus_pages[pc >> 8] || cpu->trace ||
+      cpu->debug || (cpu->IME && (cpu->if_reg & cpu->ie_reg)))
+    return false;
+
+  // cart_read wraps the bank at 0x4000 around the ROM
+  int bank = pc < 0x4000 ? 0 : (cpu->cart->rom_bank & 0x1F) % aot->rom_banks;
+  if (bank >= aot->code->banks)
+    return false;
+  AotBlock block =
+      aot->code->block[bank * AOT_BLOCKS + (pc & 0x3FFF) / AOT_BLOCK];
+  if (!block)
+    return false;
+  uint64_t start = cpu->cycle_count;
+  block(cpu, &aot->host);
+  return cpu->cycle_count != start;
+}
@@ -0,0 +1,274 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ROM code compiled ahead of time. tools/recompile follows a ROM's code from
+// the entry point, the interrupt vectors and the RST targets, across banks,
+// writes it out as C, a function per AOT_BLOCK bytes of a bank with a label
+// per instruction, and builds that into DIR/<rom hash>.so; --aot DIR loads
+// it with dlopen. Jumps within a block are gotos, the others go back
+// through AOT_run; a function per bank would be faster still, but takes the
+// compiler minutes on a big one.
+//
+// The compiled code does what the interpreter does, instruction for
+// instruction: the same 4 cycles and timer step after each, the bus through
+// CPU_read_memory and CPU_write_memory but for WRAM and HRAM, which it
+// reaches itself. It hands back to the interpreter at the end of the run,
+// when an interrupt is due, on HALT, when a write may have switched the
+// bank or locked the bus, and wherever it has no code: RAM, addresses the
+// walk did not reach, jumps into the middle of an instruction. An opcode
+// with a hook on it (idle loop skipping, the profiler) goes through the
+// hook. Traced or debugged CPUs are interpreted.
+
+// bumped when the generated code changes, with the CPU layout it is built
+// against makes up the key a .so must match
+#define AOT_VERSION 1
+#define AOT_ABI                                                                \
+  ((uint64_t)AOT_VERSION << 48 | (uint64_t)sizeof(CPU) << 24 |                 \
+   (uint64_t)offsetof(CPU, _memory))
+#define AOT_SYMBOL "gb_aot_code"
+#define AOT_FILE "%s/%016llx.so" // the directory, cart_hash
+
+// what the compiled code calls back into
+typedef struct {
+  uint8_t (*read)(CPU *cpu, uint16_t addr);
+  void (*write)(CPU *cpu, uint16_t addr, uint8_t val);
+  void (*execute)(CPU *cpu, uint8_t opcode); // CPU_execute
+  const uint8_t *hooked;                     // CPU_opcode_hooks
+} AotHost;
+
+#define AOT_BLOCK 0x400                 // bytes of ROM a function covers
+#define AOT_BLOCKS (0x4000 / AOT_BLOCK) // per 16 KB bank
+
+// runs the block's code from cpu->PC, returns at once when it has none there
+typedef void (*AotBlock)(CPU *cpu, const AotHost *host);
+
+// the symbol AOT_SYMBOL of a compiled ROM
+typedef struct {
+  uint64_t abi;      // AOT_ABI
+  uint64_t rom_hash; // cart_hash
+  int banks;
+  // banks * AOT_BLOCKS, by bank then address, NULL for a block without code
+  const AotBlock *block;
+} AotCode;
+
+typedef struct Aot Aot;
+
+// DIR/<hash>.so for cart, NULL when there is none or it was built for
+// another ROM or emulator; one Aot serves any number of CPUs
+Aot *AOT_load(Cartridge *cart, const char *dir);
+void AOT_free(Aot *aot);
+// the path AOT_load looks for, in buf
+void AOT_path(Cartridge *cart, const char *dir, char *buf, size_t len);
+// runs compiled code from PC, false when there is none to run there
+bool AOT_run(CPU *cpu);
+
+// For the generated code. The bus fast paths and flag helpers mirror
+// CPU_bus_read, CPU_write_memory and the handlers of cpu.c, quirks and all.
+
+static inline uint8_t AOT_read(CPU *cpu, const AotHost *host, uint16_t addr) {
+  if (!cpu->bus_pages[addr >> 8]) {
+    if (addr >= 0xC000 && addr < 0xFE00)
+      return cpu->_memory[MEM_WRAM + (addr & 0x1FFF)];
+    if (addr >= 0xFF80 && addr != 0xFFFF)
+      return cpu->_memory[MEM_HIGH + (addr & 0xFF)];
+  }
+  return host->read(cpu, addr);
+}
+
+static inline void AOT_write(CPU *cpu, const AotHost *host, uint16_t addr,
+                             uint8_t val) {
+  if (!cpu->bus_pages[addr >> 8]) {
+    if (addr >= 0xC000 && addr < 0xFE00) {
+      uint16_t i = MEM_WRAM + (addr & 0x1FFF);
+      cpu->_memory[i] = val;
+      cpu->written[i >> 8] = 1;
+      return;
+    }
+    if (addr >= 0xFF80 && addr != 0xFFFF) {
+      cpu->_memory[MEM_HIGH + (addr & 0xFF)] = val;
+      return;
+    }
+  }
+  host->write(cpu, addr, val);
+}
+
+// the interpreter takes over before the next instruction
+static inline bool AOT_exit(const CPU *cpu) {
+  return cpu->cycle_count >= cpu->run_end ||
+         (cpu->IME && (cpu->if_reg & cpu->ie_reg));
+}
+
+static inline void AOT_cycles(CPU *cpu) {
+  CPU_timer(cpu, 4);
+  cpu->cycle_count += 4;
+}
+
+// the end of an instruction, on to the next one at pc
+#define AOT_NEXT(pc)                                                           \
+  do {                                                                         \
+    AOT_cycles(cpu);                                                           \
+    if (AOT_exit(cpu)) {                                                       \
+      cpu->PC = (pc);                                                          \
+      return;                                                                  \
+    }                                                                          \
+  } while (0)
+// the same after a write, which may have switched the bank or locked the bus
+#define AOT_NEXT_STORE(pc)                                                     \
+  do {                                                                         \
+    AOT_cycles(cpu);                                                           \
+    if (AOT_exit(cpu) || cpu->bus_pages[(pc) >> 8] ||                          \
+        cpu->cart->rom_bank != rom_bank) {                                     \
+      cpu->PC = (pc);                                                          \
+      return;                                                                  \
+    }                                                                          \
+  } while (0)
+// a jump to a label of this bank
+#define AOT_GOTO(pc, label)                                                    \
+  do {                                                                         \
+    AOT_NEXT(pc);                                                              \
+    goto label;                                                                \
+  } while (0)
+// a jump anywhere else
+#define AOT_LEAVE(pc)                                                          \
+  do {                                                                         \
+    AOT_cycles(cpu);                                                           \
+    cpu->PC = (pc);                                                            \
+    return;                                                                    \
+  } while (0)
+// an instruction the interpreter's handler runs, PC is where it left it
+#define AOT_EXECUTE(pc, opcode)                                                \
+  do {                                                                         \
+    cpu->PC = (pc) + 1;                                                        \
+    host->execute(cpu, (opcode));                                              \
+    AOT_cycles(cpu);                                                           \
+    if (AOT_exit(cpu) || cpu->halted || cpu->bus_pages[cpu->PC >> 8] ||        \
+        cpu->cart->rom_bank != rom_bank)                                       \
+      return;                                                                  \
+  } while (0)
+
+// an opcode a hook stands in for runs through it
+#define AOT_HOOK(pc, opcode)                                                   \
+  do {                                                                         \
+    if (host->hooked[(opcode)]) {                                              \
+      AOT_EXECUTE((pc), (opcode));                                             \
+      goto dispatch;                                                           \
+    }                                                                          \
+  } while (0)
+
+static inline uint8_t AOT_inc(CPU *cpu, uint8_t src) {
+  uint8_t result = src + 1;
+  cpu->F = (cpu->F & 0x10) | (result == 0 ? 0x80 : 0) |
+           ((src & 0xF) == 0xF ? 0x20 : 0);
+  return result;
+}
+
+static inline uint8_t AOT_dec(CPU *cpu, uint8_t src) {
+  uint8_t result = src - 1;
+  cpu->F = (cpu->F & 0x10) | (result == 0 ? 0x80 : 0) | 0x40 |
+           ((src & 0xF) == 0 ? 0x20 : 0);
+  return result;
+}
+
+static inline void AOT_add_hl(CPU *cpu, uint16_t src) {
+  uint32_t result = cpu->HL + src;
+  cpu->F = (cpu->F & 0x80) |
+           (((cpu->HL & 0xFFF) + (src & 0xFFF)) > 0xFFF ? 0x20 : 0) |
+           (result > 0xFFFF ? 0x10 : 0);
+  cpu->HL = result & 0xFFFF;
+}
+
+static inline void AOT_add(CPU *cpu, uint8_t src) {
+  uint16_t result = cpu->A + src;
+  cpu->F = (cpu->F & 0x10) | ((result & 0xFF) == 0 ? 0x80 : 0) |
+           (((cpu->A & 0xF) + (src & 0xF)) > 0xF ? 0x20 : 0) |
+           (result > 0xFF ? 0x10 : 0);
+  cpu->A = result & 0xFF;
+}
+
+static inline void AOT_adc(CPU *cpu, uint8_t src) {
+  uint8_t carry = (cpu->F & 0x10) ? 1 : 0;
+  uint16_t result = cpu->A + src + carry;
+  cpu->F = ((result & 0xFF) == 0 ? 0x80 : 0) |
+           (((cpu->A & 0xF) + (src & 0xF) + carry) > 0xF ? 0x20 : 0) |
+           (result > 0xFF ? 0x10 : 0);
+  cpu->A = result & 0xFF;
+}
+
+static inline void AOT_sub(CPU *cpu, uint8_t src) {
+  uint16_t result = cpu->A - src;
+  cpu->F = 0x40 | ((result & 0xFF) == 0 ? 0x80 : 0) |
+           ((cpu->A & 0xF) < (src & 0xF) ? 0x20 : 0) |
+           (cpu->A < src ? 0x10 : 0);
+  cpu->A = result & 0xFF;
+}
+
+static inline void AOT_sbc(CPU *cpu, uint8_t src) {
+  uint8_t carry = (cpu->F & 0x10) ? 1 : 0;
+  uint16_t result = cpu->A - (src + carry);
+  cpu->F = 0x40 | ((result & 0xFF) == 0 ? 0x80 : 0) |
+           ((cpu->A & 0xF) < ((src & 0xF) + carry) ? 0x20 : 0) |
+           (cpu->A < (src + carry) ? 0x10 : 0);
+  cpu->A = result & 0xFF;
+}
+
+static inline void AOT_cp(CPU *cpu, uint8_t src) {
+  uint8_t result = cpu->A - src;
+  cpu->F = 0x40 | (result == 0 ? 0x80 : 0) |
+           ((cpu->A & 0xF) < (src & 0xF) ? 0x20 : 0) |
+           (cpu->A < src ? 0x10 : 0);
+}
+
+static inline void AOT_and(CPU *cpu, uint8_t src) {
+  cpu->A &= src;
+  cpu->F = (cpu->A == 0 ? 0x80 : 0) | 0x20;
+}
+
+static inline void AOT_xor(CPU *cpu, uint8_t src) {
+  cpu->A ^= src;
+  cpu->F = cpu->A == 0 ? 0x80 : 0;
+}
+
+static inline void AOT_or(CPU *cpu, uint8_t src) {
+  cpu->A |= src;
+  cpu->F = cpu->A == 0 ? 0x80 : 0;
+}
+
+// add sp, e and ld hl, sp + e
+static inline uint16_t AOT_sp_offset(CPU *cpu, int8_t offset) {
+  cpu->F = (((cpu->SP & 0xF) + (offset & 0xF)) > 0xF ? 0x20 : 0) |
+           (((cpu->SP & 0xFF) + (offset & 0xFF)) > 0xFF ? 0x10 : 0);
+  return cpu->SP + offset;
+}
+
+// the CB prefixed rotates and shifts, only rl and rr set more than C
+static inline uint8_t AOT_cb_carry(CPU *cpu, uint8_t result, bool carry) {
+  cpu->F = carry ? cpu->F | 0x10 : cpu->F & ~0x10;
+  return result;
+}
+
+static inline uint8_t AOT_rl(CPU *cpu, uint8_t reg) {
+  uint8_t result = (reg << 1) | ((cpu->F & 0x10) ? 1 : 0);
+  cpu->F = (result == 0 ? 0x80 : 0) | ((reg & 0x80) ? 0x10 : 0);
+  return result;
+}
+
+static inline uint8_t AOT_rr(CPU *cpu, uint8_t reg) {
+  uint8_t result = (reg >> 1) | ((cpu->F & 0x10) ? 0x80 : 0);
+  cpu->F = (result == 0 ? 0x80 : 0) | ((reg & 0x01) ? 0x10 : 0);
+  return result;
+}
+
+static inline uint8_t AOT_swap(CPU *cpu, uint8_t src) {
+  uint8_t result = (src >> 4) | (src << 4);
+  cpu->F = result == 0 ? cpu->F | 0x80 : cpu->F & ~0x80;
+  return result;
+}
+
+static inline void AOT_bit(CPU *cpu, uint8_t src, int bit) {
+  cpu->F = (src & (1 << bit)) ? cpu->F & ~0x80 : cpu->F | 0x80;
+  cpu->F = (cpu->F & ~0x40) | 0x20;
+}
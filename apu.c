@@ -0,0 +1,465 @@
+#include "apu.h"
+#include "cpu.h"
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NR10 0xFF10
+#define NR30 0xFF1A
+#define NR50 0xFF24
+#define NR51 0xFF25
+#define NR52 0xFF26
+#define WAVE 0xFF30
+
+// a sound register, in the FFxx page of _memory
+#define IO(cpu, address) ((cpu)->_memory[MEM_HIGH + ((address) & 0xFF)])
+
+#define APU_TAPS 16      // band-limited step width in output samples
+#define APU_PHASES 64    // sub-sample positions of the step
+#define APU_BUFFER 512   // output samples one batch can span
+#define APU_RING 8192    // stereo frames queued for the device, power of two
+#define APU_MAX_RATE 96000
+#define APU_PI 3.14159265358979323846
+
+// the waveform each channel is making
+typedef struct {
+  uint64_t next; // cycle of the next step
+  uint16_t lfsr; // noise
+  uint8_t pos;   // duty step or wave sample
+  float left, right;
+} ApuVoice;
+
+// single producer (the emulator) and single consumer (the audio callback),
+// head and tail only ever grow
+struct ApuOutput {
+  int16_t ring[APU_RING][2];
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+
+  // emulator side
+  ApuVoice voice[4];
+  uint64_t time;  // cycle the samples are made up to
+  uint64_t first; // output sample of delta[0]
+  double ratio;   // output samples per cycle
+  float delta[2][APU_BUFFER + APU_TAPS];
+  float sum[2]; // the deltas integrated
+  float dc[2];  // what the high pass takes out
+  float dc_rate;
+};
+
+// windowed sinc, each phase sums to 1
+static float kernel[APU_PHASES][APU_TAPS];
+
+// DMG values for the bits that read back as 1
+static const uint8_t read_mask[0x20] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF, 0x7F,
+    0xFF, 0x9F, 0xFF, 0xBF, 0xFF, 0xFF, 0x00, 0x00, 0xBF, 0x00, 0x00,
+    0x70, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+static const uint8_t duty[4] = {0x01, 0x81, 0x87, 0x7E}; // bit 7 first
+
+// NRx0-NRx4 of a channel
+static uint8_t *APU_regs(CPU *cpu, int c) {
+  return &IO(cpu, NR10 + c * 5);
+}
+
+static bool APU_dac(CPU *cpu, int c) {
+  if (c == 2)
+    return IO(cpu, NR30) & 0x80;
+  return APU_regs(cpu, c)[2] & 0xF8;
+}
+
+// cycles between two steps of the waveform
+static uint64_t APU_period(CPU *cpu, int c) {
+  uint16_t freq = cpu->apu.ch[c].freq;
+  if (c == 3) {
+    uint8_t nr43 = APU_regs(cpu, 3)[3];
+    int divisor = nr43 & 0x07 ? (nr43 & 0x07) * 16 : 8;
+    return (uint64_t)divisor << (nr43 >> 4);
+  }
+  return (2048 - freq) * (c == 2 ? 2 : 4);
+}
+
+// ch1 frequency after one sweep, past 2047 turns the channel off
+static uint16_t APU_sweep(CPU *cpu) {
+  Apu *a = &cpu->apu;
+  uint8_t nr10 = IO(cpu, NR10);
+  uint16_t delta = a->sweep_freq >> (nr10 & 0x07);
+  uint16_t freq = nr10 & 0x08 ? a->sweep_freq - delta : a->sweep_freq + delta;
+  if (freq > 2047)
+    a->ch[0].on = 0;
+  return freq;
+}
+
+static void APU_trigger(CPU *cpu, int c) {
+  Apu *a = &cpu->apu;
+  ApuChannel *ch = &a->ch[c];
+  uint8_t *regs = APU_regs(cpu, c);
+  ch->on = APU_dac(cpu, c);
+  if (ch->length == 0)
+    ch->length = c == 2 ? 256 : 64;
+  ch->volume = regs[2] >> 4;
+  ch->env_timer = regs[2] & 0x07;
+  if (c == 0) {
+    uint8_t nr10 = regs[0];
+    a->sweep_freq = ch->freq;
+    a->sweep_timer = (nr10 >> 4 & 0x07) ? (nr10 >> 4 & 0x07) : 8;
+    a->sweep_on = (nr10 & 0x77) != 0;
+    if (nr10 & 0x07)
+      APU_sweep(cpu);
+  }
+
+  // the waveform starts over
+  if (cpu->audio) {
+    ApuVoice *v = &cpu->audio->voice[c];
+    v->next = cpu->cycle_count + APU_period(cpu, c);
+    v->pos = 0;
+    v->lfsr = 0x7FFF;
+  }
+}
+
+// one 512 Hz step: lengths at 256 Hz, the sweep at 128 Hz, envelopes at
+// 64 Hz
+static void APU_step(CPU *cpu) {
+  Apu *a = &cpu->apu;
+  unsigned step = a->seq++ & 7;
+  if (!(IO(cpu, NR52) & 0x80))
+    return;
+
+  if (!(step & 1)) {
+    for (int c = 0; c < 4; c++) {
+      ApuChannel *ch = &a->ch[c];
+      if ((APU_regs(cpu, c)[4] & 0x40) && ch->length && --ch->length == 0)
+        ch->on = 0;
+    }
+  }
+
+  if ((step == 2 || step == 6) && --a->sweep_timer == 0) {
+    uint8_t nr10 = IO(cpu, NR10);
+    uint8_t period = nr10 >> 4 & 0x07;
+    a->sweep_timer = period ? period : 8;
+    if (a->sweep_on && period) {
+      uint16_t freq = APU_sweep(cpu);
+      if (freq <= 2047 && (nr10 & 0x07)) {
+        a->sweep_freq = freq;
+        a->ch[0].freq = freq;
+        IO(cpu, NR10 + 3) = freq;
+        IO(cpu, NR10 + 4) = (IO(cpu, NR10 + 4) & 0xF8) | freq >> 8;
+        APU_sweep(cpu);
+      }
+    }
+  }
+
+  if (step == 7) {
+    for (int c = 0; c < 4; c++) {
+      if (c == 2)
+        continue;
+      ApuChannel *ch = &a->ch[c];
+      uint8_t nrx2 = APU_regs(cpu, c)[2];
+      if (!(nrx2 & 0x07) || --ch->env_timer)
+        continue;
+      ch->env_timer = nrx2 & 0x07;
+      if (nrx2 & 0x08 && ch->volume < 15)
+        ch->volume++;
+      else if (!(nrx2 & 0x08) && ch->volume > 0)
+        ch->volume--;
+    }
+  }
+}
+
+// sample synthesis
+
+static void APU_kernel(void) {
+  if (kernel[0][0] != 0)
+    return;
+  const double cutoff = 0.9; // of the output Nyquist frequency
+  for (int p = 0; p < APU_PHASES; p++) {
+    double frac = (double)p / APU_PHASES, total = 0;
+    for (int k = 0; k < APU_TAPS; k++) {
+      double x = k - APU_TAPS / 2 - frac;
+      double s = x == 0 ? 1 : sin(APU_PI * cutoff * x) / (APU_PI * cutoff * x);
+      double w = (k + 1 - frac) / (APU_TAPS + 1);
+      w = 0.42 - 0.5 * cos(2 * APU_PI * w) + 0.08 * cos(4 * APU_PI * w);
+      kernel[p][k] = s * w;
+      total += s * w;
+    }
+    for (int k = 0; k < APU_TAPS; k++)
+      kernel[p][k] /= total;
+  }
+}
+
+// the output sample the step at cycle t starts in, the whole step goes
+// APU_TAPS / 2 samples later
+static void APU_delta(ApuOutput *out, uint64_t t, float left, float right) {
+  double pos = t * out->ratio - out->first;
+  int i = (int)pos;
+  const float *k = kernel[(int)((pos - i) * APU_PHASES)];
+  float *l = out->delta[0] + i, *r = out->delta[1] + i;
+  for (int j = 0; j < APU_TAPS; j++) {
+    l[j] += k[j] * left;
+    r[j] += k[j] * right;
+  }
+}
+
+// digital output 0-15 of channel c right now
+static int APU_digital(CPU *cpu, int c, const ApuVoice *v) {
+  ApuChannel *ch = &cpu->apu.ch[c];
+  switch (c) {
+  case 2: {
+    uint8_t byte = IO(cpu, WAVE + v->pos / 2);
+    uint8_t sample = v->pos & 1 ? byte & 0x0F : byte >> 4;
+    int code = IO(cpu, NR30 + 2) >> 5 & 0x03;
+    return code ? sample >> (code - 1) : 0;
+  }
+  case 3:
+    return v->lfsr & 1 ? 0 : ch->volume;
+  default:
+    return duty[APU_regs(cpu, c)[1] >> 6] << v->pos & 0x80 ? ch->volume : 0;
+  }
+}
+
+// the DAC, mixer and master volume
+static void APU_level(CPU *cpu, int c, ApuVoice *v, uint64_t t) {
+  ApuOutput *out = cpu->audio;
+  float left = 0, right = 0;
+  if (APU_dac(cpu, c)) {
+    float level = cpu->apu.ch[c].on ? APU_digital(cpu, c, v) / 7.5f - 1 : -1;
+    uint8_t nr50 = IO(cpu, NR50), nr51 = IO(cpu, NR51);
+    if (nr51 & 0x10 << c)
+      left = level * ((nr50 >> 4 & 0x07) + 1) / 32;
+    if (nr51 & 0x01 << c)
+      right = level * ((nr50 & 0x07) + 1) / 32;
+  }
+  if (left != v->left || right != v->right) {
+    APU_delta(out, t, left - v->left, right - v->right);
+    v->left = left;
+    v->right = right;
+  }
+}
+
+// only the edges of the waveform cost anything
+static void APU_voice(CPU *cpu, int c, uint64_t from, uint64_t to) {
+  ApuVoice *v = &cpu->audio->voice[c];
+  APU_level(cpu, c, v, from);
+  // off, or noise with a shift of 14 or 15, which does not clock the LFSR
+  if (!cpu->apu.ch[c].on || !(IO(cpu, NR52) & 0x80) ||
+      (c == 3 && (APU_regs(cpu, 3)[3] >> 4) >= 14)) {
+    v->next = to;
+    return;
+  }
+  uint64_t period = APU_period(cpu, c);
+  uint8_t width7 = c == 3 && (APU_regs(cpu, 3)[3] & 0x08);
+  if (v->next < from)
+    v->next = from;
+  while (v->next < to) {
+    if (c == 3) {
+      uint16_t bit = (v->lfsr ^ v->lfsr >> 1) & 1;
+      v->lfsr = v->lfsr >> 1 | bit << 14;
+      if (width7)
+        v->lfsr = (v->lfsr & ~0x40) | bit << 6;
+    } else {
+      v->pos = (v->pos + 1) & (c == 2 ? 31 : 7);
+    }
+    APU_level(cpu, c, v, v->next);
+    v->next += period;
+  }
+}
+
+// the finished samples go to the ring, a full ring loses them
+static void APU_flush(ApuOutput *out, uint64_t to) {
+  int count = (int)((uint64_t)(to * out->ratio) - out->first);
+  uint64_t head = atomic_load_explicit(&out->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&out->tail, memory_order_acquire);
+  for (int i = 0; i < count; i++) {
+    int16_t sample[2];
+    for (int s = 0; s < 2; s++) {
+      out->sum[s] += out->delta[s][i];
+      out->dc[s] += (out->sum[s] - out->dc[s]) * out->dc_rate;
+      float x = (out->sum[s] - out->dc[s]) * 32767;
+      sample[s] = x > 32767 ? 32767 : x < -32768 ? -32768 : (int16_t)x;
+    }
+    if (head - tail < APU_RING) {
+      memcpy(out->ring[head & (APU_RING - 1)], sample, sizeof(sample));
+      head++;
+    }
+  }
+  atomic_store_explicit(&out->head, head, memory_order_release);
+
+  for (int s = 0; s < 2; s++) {
+    memmove(out->delta[s], out->delta[s] + count, APU_TAPS * sizeof(float));
+    memset(out->delta[s] + APU_TAPS, 0, count * sizeof(float));
+  }
+  out->first += count;
+}
+
+static void APU_restart(CPU *cpu, uint64_t now) {
+  ApuOutput *out = cpu->audio;
+  out->time = now;
+  out->first = (uint64_t)(now * out->ratio);
+  memset(out->delta, 0, sizeof(out->delta));
+  memset(out->sum, 0, sizeof(out->sum));
+  memset(out->dc, 0, sizeof(out->dc));
+  for (int c = 0; c < 4; c++)
+    out->voice[c] = (ApuVoice){.next = now, .lfsr = 0x7FFF};
+}
+
+static void APU_synth(CPU *cpu, uint64_t to) {
+  ApuOutput *out = cpu->audio;
+  // a batch never spans more than a sequencer step, anything else is a
+  // loaded state with nothing to join up with
+  if (to < out->time || to - out->time > APU_SEQ_CYCLES)
+    APU_restart(cpu, to);
+  for (int c = 0; c < 4; c++)
+    APU_voice(cpu, c, out->time, to);
+  out->time = to;
+  APU_flush(out, to);
+}
+
+void APU_sync(CPU *cpu) {
+  Apu *a = &cpu->apu;
+  uint64_t now = cpu->cycle_count;
+  // the synthesis stops at every sequencer step, the envelope or the length
+  // counter may change the output there
+  while ((a->seq + 1) * APU_SEQ_CYCLES <= now) {
+    if (cpu->audio)
+      APU_synth(cpu, (a->seq + 1) * APU_SEQ_CYCLES);
+    APU_step(cpu);
+  }
+  if (cpu->audio)
+    APU_synth(cpu, now);
+}
+
+// registers
+
+void APU_reset(CPU *cpu) {
+  static const uint8_t boot[0x17] = {
+      0x80, 0xBF, 0xF3, 0xFF, 0xBF, 0x00, 0x3F, 0x00, 0xFF, 0xBF, 0x7F, 0xFF,
+      0x9F, 0xFF, 0xBF, 0x00, 0xFF, 0x00, 0x00, 0xBF, 0x77, 0xF3, 0xF1};
+  Apu *a = &cpu->apu;
+  memcpy(&IO(cpu, NR10), boot, sizeof(boot));
+  memset(a, 0, sizeof(Apu));
+  for (int c = 0; c < 4; c++) {
+    uint8_t *regs = APU_regs(cpu, c);
+    a->ch[c].freq = regs[3] | (regs[4] & 0x07) << 8;
+  }
+  a->ch[0].on = 1; // the boot beep has faded out but is still playing
+  a->seq = cpu->cycle_count / APU_SEQ_CYCLES;
+}
+
+uint8_t APU_read(CPU *cpu, uint16_t address) {
+  if (address >= WAVE)
+    return IO(cpu, address);
+  if (address == NR52) {
+    APU_sync(cpu);
+    uint8_t status = IO(cpu, NR52) & 0x80;
+    for (int c = 0; c < 4; c++)
+      status |= cpu->apu.ch[c].on << c;
+    return status | 0x70;
+  }
+  return IO(cpu, address) | read_mask[address - NR10];
+}
+
+void APU_write(CPU *cpu, uint16_t address, uint8_t val) {
+  Apu *a = &cpu->apu;
+  APU_sync(cpu);
+  if (address >= WAVE) {
+    IO(cpu, address) = val;
+    return;
+  }
+  if (address == NR52) {
+    if (!(val & 0x80)) {
+      // powering off clears every register
+      memset(&IO(cpu, NR10), 0, NR52 - NR10);
+      for (int c = 0; c < 4; c++)
+        a->ch[c].on = 0;
+    }
+    IO(cpu, NR52) = val & 0x80;
+    return;
+  }
+  if (address > NR52)
+    return; // unused
+  bool power = IO(cpu, NR52) & 0x80;
+  if (address >= NR50) {
+    if (power)
+      IO(cpu, address) = val;
+    return;
+  }
+
+  int c = (address - NR10) / 5, r = (address - NR10) % 5;
+  ApuChannel *ch = &a->ch[c];
+  if (!power) {
+    // only the length counters can be loaded while powered off
+    if (r == 1)
+      ch->length = c == 2 ? 256 - val : 64 - (val & 0x3F);
+    return;
+  }
+  IO(cpu, address) = val;
+  if (r == 0 && c != 0 && c != 2)
+    return; // FF15 and FF1F are unused
+  switch (r) {
+  case 1:
+    ch->length = c == 2 ? 256 - val : 64 - (val & 0x3F);
+    break;
+  case 2:
+    if (!APU_dac(cpu, c))
+      ch->on = 0;
+    break;
+  case 3:
+    if (c != 3)
+      ch->freq = (ch->freq & 0x700) | val;
+    break;
+  case 4:
+    if (c != 3)
+      ch->freq = (ch->freq & 0xFF) | (val & 0x07) << 8;
+    if (val & 0x80)
+      APU_trigger(cpu, c);
+    break;
+  default: // NR30
+    if (c == 2 && !(val & 0x80))
+      ch->on = 0;
+    break;
+  }
+}
+
+// output
+
+ApuOutput *APU_output_new(int rate) {
+  if (rate <= 0 || rate > APU_MAX_RATE)
+    return NULL;
+  ApuOutput *out = aligned_alloc(_Alignof(ApuOutput), sizeof(ApuOutput));
+  if (!out)
+    return NULL;
+  memset(out, 0, sizeof(ApuOutput));
+  out->ratio = (double)rate / APU_CLOCK;
+  // a one pole high pass at about 20 Hz, like the capacitor on the output
+  out->dc_rate = 1 - expf(-2 * (float)APU_PI * 20 / rate);
+  APU_kernel();
+  return out;
+}
+
+void APU_output_free(ApuOutput *out) { free(out); }
+
+void APU_attach(CPU *cpu, ApuOutput *out) {
+  cpu->audio = out;
+  if (out)
+    APU_restart(cpu, cpu->cycle_count);
+}
+
+int APU_pull(ApuOutput *out, int16_t *samples, int frames) {
+  uint64_t tail = atomic_load_explicit(&out->tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&out->head, memory_order_acquire);
+  int count = head - tail < (uint64_t)frames ? (int)(head - tail) : frames;
+  for (int i = 0; i < count; i++)
+    memcpy(samples + i * 2, out->ring[(tail + i) & (APU_RING - 1)],
+           2 * sizeof(int16_t));
+  memset(samples + count * 2, 0,
+         (size_t)(frames - count) * 2 * sizeof(int16_t));
+  atomic_store_explicit(&out->tail, tail + count, memory_order_release);
+  return count;
+}
+
+int APU_queued(ApuOutput *out) {
+  return (int)(atomic_load_explicit(&out->head, memory_order_acquire) -
+               atomic_load_explicit(&out->tail, memory_order_acquire));
+}
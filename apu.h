@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Audio processing unit, the four DMG channels behind FF10-FF3F. Nothing
+// runs per cycle: the registers live in the IO page and the APU catches up
+// with the CPU lazily, on a sound register access and at the end of every
+// frame, in one batch.
+//
+// What the game can observe (the NR52 status bits through the length
+// counters, the sweep and the envelope) is always emulated, so a movie or a
+// saved state plays the same with or without sound. The samples are only
+// made while an ApuOutput is attached: each channel is walked from one
+// waveform edge to the next and every edge is added to the output as a
+// band-limited step at 48 kHz (or whatever the device asks for), so there
+// is no per-cycle mixing and no aliasing. The samples go into a lock-free
+// ring the audio device callback drains.
+
+#define APU_CLOCK 4194304
+#define APU_SEQ_CYCLES 8192 // frame sequencer step, 512 Hz
+
+typedef struct CPU CPU;
+
+typedef struct {
+  uint16_t length; // length counter, stops the channel at 0 when enabled
+  uint16_t freq;   // 11 bit period of NRx3/NRx4, the sweep writes ch1's
+  uint8_t on;      // NR52 status bit
+  uint8_t volume;  // envelope volume
+  uint8_t env_timer;
+  uint8_t pad;
+} ApuChannel;
+
+// the state a saved state carries, laid out without padding
+typedef struct {
+  ApuChannel ch[4];
+  uint64_t seq;        // frame sequencer steps done, cycle_count / 8192
+  uint16_t sweep_freq; // ch1 sweep shadow register
+  uint8_t sweep_timer;
+  uint8_t sweep_on;
+  uint8_t pad[4];
+} Apu;
+
+typedef struct ApuOutput ApuOutput;
+
+// post boot ROM register values
+void APU_reset(CPU *cpu);
+uint8_t APU_read(CPU *cpu, uint16_t address);
+void APU_write(CPU *cpu, uint16_t address, uint8_t val);
+// catch up with cpu->cycle_count
+void APU_sync(CPU *cpu);
+
+// stereo 16 bit samples at rate Hz
+ApuOutput *APU_output_new(int rate);
+void APU_output_free(ApuOutput *out);
+// start making samples into out, NULL stops (mute)
+void APU_attach(CPU *cpu, ApuOutput *out);
+// the audio thread side, fills frames stereo frames and returns how many
+// were queued; the rest is silence
+int APU_pull(ApuOutput *out, int16_t *samples, int frames);
+// stereo frames queued
+int APU_queued(ApuOutput *out);
@@ -0,0 +1,823 @@
+// benchmark suite, see `make bench`
+//
+//   bench [--out file] [--baseline file] [--threshold percent]
+//         [--aot dir] [rom...]
+//   bench --parity-rom file
+//
+// Every result is in nanoseconds per operation, lower is better, and the
+// best of BENCH_REPEAT runs. Results are written as "name value" lines; with
+// a baseline in the same format, any result more than threshold percent
+// slower than its baseline fails the run. The ROMs are also run with
+// run-ahead, which fails the run unless it ends in the same state, and with
+// the line renderer on and off its thread, which must show the same frames.
+//
+// With --aot, the parity ROM (written by --parity-rom) and the ROMs are also
+// run with their code compiled by tools/recompile into dir, and any
+// difference from the interpreter fails the run.
+
+#define _POSIX_C_SOURCE 199309L
+#include "../apu.h"
+#include "../cartridge.h"
+#include "../cpu.h"
+#include "../env.h"
+#include "../idle.h"
+#include "../lines.h"
+#include "../ppu.h"
+#include "../render.h"
+#include "../runahead.h"
+#include "../scale.h"
+#include "../state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_REPEAT 5
+#define BENCH_OPS 2000000     // handler calls per opcode class run
+#define BENCH_READS 4000000   // memory accesses per bus run
+#define BENCH_RENDERS 500     // frames per renderer run
+#define BENCH_SCALES 500      // frames per scaler run
+#define BENCH_SOUNDS 2000     // frames of sound per APU run
+#define BENCH_SNAPSHOTS 20000 // snapshots per run-ahead run
+#define BENCH_FRAMES 600      // emulated frames per ROM run
+#define BENCH_AHEAD 2         // frames thrown away per run-ahead frame
+#define BENCH_LOOPS 20        // copy or fill loops per run
+#define BENCH_PARITY_FRAMES 600 // frames compared per ROM
+#define BENCH_PARITY_ROM "bench/parity.gb"
+#define BENCH_MAX 64
+
+#define CODE 0xC000 // opcodes run from WRAM
+
+typedef struct {
+  char name[48];
+  double ns;
+} Result;
+
+static Result results[BENCH_MAX];
+static int result_count;
+static volatile uint32_t sink;
+
+static uint64_t BENCH_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void BENCH_result(const char *name, double ns) {
+  if (result_count == BENCH_MAX)
+    return;
+  Result *r = &results[result_count++];
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->ns = ns;
+  printf("  %-28s %10.2f ns\n", name, ns);
+}
+
+static Cartridge *BENCH_cart(void) {
+  Cartridge *cart = calloc(1, sizeof(Cartridge));
+  cart->rom_size = 0x10000; // 4 banks
+  cart->rom = calloc(1, cart->rom_size);
+  for (size_t i = 0; i < cart->rom_size; i++)
+    cart->rom[i] = i * 7;
+  cart->rom_bank = 1;
+  return cart;
+}
+
+// cpu.c handlers called directly, PC already past the opcode like after a
+// fetch; registers point at WRAM so memory operands stay in plain RAM
+typedef struct {
+  const char *name;
+  uint8_t ops[256];
+  int count;
+  bool prefix; // ops are CB xx
+} OpcodeClass;
+
+static void BENCH_add(OpcodeClass *c, int op) { c->ops[c->count++] = op; }
+
+static void BENCH_classes(OpcodeClass *classes, int *count) {
+  OpcodeClass *c;
+  int n = 0;
+
+  c = &classes[n++];
+  c->name = "op.ld_r8_r8";
+  for (int op = 0x40; op < 0x80; op++)
+    if ((op & 7) != 6 && ((op >> 3) & 7) != 6)
+      BENCH_add(c, op);
+
+  c = &classes[n++];
+  c->name = "op.ld_hl_mem";
+  for (int op = 0x40; op < 0x80; op++)
+    if (op != 0x76 && ((op & 7) == 6 || ((op >> 3) & 7) == 6))
+      BENCH_add(c, op);
+
+  c = &classes[n++];
+  c->name = "op.alu_r8";
+  for (int op = 0x80; op < 0xC0; op++)
+    if ((op & 7) != 6)
+      BENCH_add(c, op);
+
+  c = &classes[n++];
+  c->name = "op.alu_imm8";
+  for (int op = 0xC6; op <= 0xFE; op += 8)
+    BENCH_add(c, op);
+
+  c = &classes[n++];
+  c->name = "op.inc_dec_r8";
+  for (int r = 0; r < 8; r++) {
+    if (r != 6) {
+      BENCH_add(c, 0x04 | (r << 3));
+      BENCH_add(c, 0x05 | (r << 3));
+    }
+  }
+
+  c = &classes[n++];
+  c->name = "op.r16";
+  for (int r = 0; r < 4; r++) {
+    BENCH_add(c, 0x01 | (r << 4)); // ld r16, imm16
+    BENCH_add(c, 0x03 | (r << 4)); // inc r16
+    BENCH_add(c, 0x09 | (r << 4)); // add hl, r16
+    BENCH_add(c, 0x0B | (r << 4)); // dec r16
+  }
+
+  c = &classes[n++];
+  c->name = "op.jump_call";
+  static const uint8_t jumps[] = {0x18, 0x20, 0x28, 0x30, 0x38, 0xC3, 0xC2,
+                                  0xCA, 0xCD, 0xC4, 0xC9, 0xC0, 0xE9, 0xEF};
+  for (size_t i = 0; i < sizeof(jumps); i++)
+    BENCH_add(c, jumps[i]);
+
+  c = &classes[n++];
+  c->name = "op.push_pop";
+  for (int r = 0; r < 4; r++) {
+    BENCH_add(c, 0xC5 | (r << 4));
+    BENCH_add(c, 0xC1 | (r << 4));
+  }
+
+  c = &classes[n++];
+  c->name = "op.ldh_io";
+  BENCH_add(c, 0xE0);
+  BENCH_add(c, 0xF0);
+  BENCH_add(c, 0xE2);
+  BENCH_add(c, 0xF2);
+
+  c = &classes[n++];
+  c->name = "op.cb_prefix";
+  c->prefix = true;
+  for (int op = 0; op < 256; op++)
+    BENCH_add(c, op);
+
+  *count = n;
+}
+
+static void BENCH_opcodes(CPU *cpu) {
+  OpcodeClass classes[16];
+  int count;
+  memset(classes, 0, sizeof(classes));
+  BENCH_classes(classes, &count);
+
+  printf("opcode handlers:\n");
+  for (int k = 0; k < count; k++) {
+    OpcodeClass *c = &classes[k];
+    double best = 1e30;
+    for (int rep = 0; rep < BENCH_REPEAT; rep++) {
+      uint64_t start = BENCH_now();
+      for (int i = 0; i < BENCH_OPS; i++) {
+        uint8_t op = c->ops[i % c->count];
+        // operands: 0x80 for imm8 (HRAM for ldh), 0xC080 for imm16
+        cpu->_memory[CPU_mem(CODE + 1)] = c->prefix ? op : 0x80;
+        cpu->_memory[CPU_mem(CODE + 2)] = 0xC0;
+        cpu->PC = CODE + 1;
+        cpu->SP = 0xDFF0;
+        cpu->HL = 0xC100;
+        cpu->C = 0x80;
+        if (c->prefix)
+          CPU_opcode_handler(0xCB)(cpu, 0xCB);
+        else
+          CPU_opcode_handler(op)(cpu, op);
+      }
+      double ns = (double)(BENCH_now() - start) / BENCH_OPS;
+      best = ns < best ? ns : best;
+    }
+    BENCH_result(c->name, best);
+  }
+}
+
+typedef struct {
+  const char *name;
+  uint16_t base;
+  uint16_t span;
+  int kind; // 0 CPU_read_memory, 1 cart_read, 2 CPU_write_memory, 3 DMA
+} BusBench;
+
+static void BENCH_bus(CPU *cpu) {
+  static const BusBench benches[] = {
+      {"bus.read_rom0", 0x0000, 0x4000, 0},
+      {"bus.read_romx", 0x4000, 0x4000, 0},
+      {"bus.read_vram", 0x8000, 0x2000, 0},
+      {"bus.read_wram", 0xC000, 0x2000, 0},
+      {"bus.read_hram", 0xFF80, 0x7F, 0},
+      {"bus.read_io", 0xFF40, 0x0C, 0},
+      {"bus.cart_read_rom", 0x0000, 0x8000, 1},
+      {"bus.write_wram", 0xC000, 0x2000, 2},
+      {"bus.oam_dma", 0xFF46, 1, 3},
+  };
+
+  printf("memory bus:\n");
+  for (size_t k = 0; k < sizeof(benches) / sizeof(benches[0]); k++) {
+    const BusBench *b = &benches[k];
+    double best = 1e30;
+    for (int rep = 0; rep < BENCH_REPEAT; rep++) {
+      uint32_t sum = 0;
+      uint64_t start = BENCH_now();
+      for (int i = 0; i < BENCH_READS; i++) {
+        uint16_t addr = b->base + (i * 37) % b->span;
+        if (b->kind == 0)
+          sum += CPU_read_memory(cpu, addr);
+        else if (b->kind == 1)
+          sum += cart_read(cpu->cart, addr);
+        else if (b->kind == 2)
+          CPU_write_memory(cpu, addr, i);
+        else
+          CPU_write_memory(cpu, addr, 0xC0 + (i & 0x0F));
+      }
+      double ns = (double)(BENCH_now() - start) / BENCH_READS;
+      // the DMA bench leaves the bus locked
+      CPU_bus_lock(cpu, 0);
+      sink += sum;
+      best = ns < best ? ns : best;
+    }
+    BENCH_result(b->name, best);
+  }
+}
+
+typedef void (*RenderKernel)(uint8_t *frame, CPU *cpu);
+
+static void BENCH_render(CPU *cpu) {
+  // random tiles and maps, the window in the lower right and 40 sprites
+  uint32_t seed = 1;
+  for (int i = 0; i < 0x2000; i++) {
+    seed = seed * 1103515245 + 12345;
+    cpu->_memory[MEM_VRAM + i] = seed >> 16;
+  }
+  for (int i = 0; i < 40; i++) {
+    cpu->_memory[MEM_OAM + i * 4] = 16 + (i * 13) % 144;
+    cpu->_memory[MEM_OAM + i * 4 + 1] = 8 + (i * 29) % 160;
+    cpu->_memory[MEM_OAM + i * 4 + 2] = i;
+    cpu->_memory[MEM_OAM + i * 4 + 3] = (i & 7) << 4;
+  }
+  cpu->lcdc = 0xF3; // everything on, 8x8 sprites
+  cpu->bgp = 0xE4;
+  cpu->obp0 = 0xD2;
+  cpu->obp1 = 0x1E;
+  cpu->scx = 3;
+  cpu->scy = 5;
+  cpu->wx = 87;
+  cpu->wy = 72;
+
+  static const struct {
+    const char *name;
+    RenderKernel kernel;
+  } kernels[] = {
+      {"render.background", DISPLAY_render_background},
+      {"render.window", DISPLAY_render_window},
+      {"render.sprites", DISPLAY_render_sprites},
+      {"render.frame", DISPLAY_gbmemory_to_sdl},
+  };
+
+  uint8_t frame[DISPLAY_WIDTH * DISPLAY_HEIGHT] = {0};
+  printf("renderer:\n");
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    double best = 1e30;
+    for (int rep = 0; rep < BENCH_REPEAT; rep++) {
+      uint64_t start = BENCH_now();
+      for (int i = 0; i < BENCH_RENDERS; i++)
+        kernels[k].kernel(frame, cpu);
+      double ns = (double)(BENCH_now() - start) / BENCH_RENDERS;
+      sink += frame[rep];
+      best = ns < best ? ns : best;
+    }
+    BENCH_result(kernels[k].name, best);
+  }
+
+  // the palette lookup into ARGB, what the window does at 1x
+  uint32_t lut[DISPLAY_SHADES];
+  DISPLAY_palette("grey", lut);
+  uint32_t *argb = calloc(DISPLAY_WIDTH * DISPLAY_HEIGHT, sizeof(uint32_t));
+  double best = 1e30;
+  for (int rep = 0; rep < BENCH_REPEAT; rep++) {
+    uint64_t start = BENCH_now();
+    for (int i = 0; i < BENCH_RENDERS; i++)
+      DISPLAY_expand(frame, lut, argb, DISPLAY_WIDTH * sizeof(uint32_t));
+    double ns = (double)(BENCH_now() - start) / BENCH_RENDERS;
+    sink += argb[rep];
+    best = ns < best ? ns : best;
+  }
+  BENCH_result("render.expand", best);
+  free(argb);
+}
+
+// every filter at 5x, the default window size, with a thread per core, on
+// the frame of BENCH_render
+static void BENCH_scale(CPU *cpu) {
+  uint8_t frame[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+  uint32_t lut[DISPLAY_SHADES];
+  uint32_t *out = calloc(DISPLAY_WIDTH * DISPLAY_HEIGHT * 25, sizeof(uint32_t));
+  DISPLAY_gbmemory_to_sdl(frame, cpu);
+  DISPLAY_palette("grey", lut);
+
+  printf("scalers:\n");
+  for (int f = 0; f < SCALE_FILTERS; f++) {
+    static const char *names[SCALE_FILTERS] = {
+        "scale.nearest", "scale.scale2x", "scale.scale3x", "scale.hq2x",
+        "scale.lcd"};
+    Scaler *s = SCALE_new(f, 0);
+    double best = 1e30;
+    for (int rep = 0; rep < BENCH_REPEAT; rep++) {
+      uint64_t start = BENCH_now();
+      for (int i = 0; i < BENCH_SCALES; i++)
+        SCALE_run(s, frame, lut, 5, out,
+                  DISPLAY_WIDTH * 5 * sizeof(uint32_t));
+      double ns = (double)(BENCH_now() - start) / BENCH_SCALES;
+      sink += out[rep];
+      best = ns < best ? ns : best;
+    }
+    BENCH_result(names[f], best);
+    SCALE_free(s);
+  }
+  free(out);
+}
+
+// a frame of sound with all four channels playing, made into 48 kHz samples
+// and with no output at all (the registers only)
+static void BENCH_apu(void) {
+  static const uint8_t regs[][2] = {
+      {0x26, 0x80}, {0x24, 0x77}, {0x25, 0xFF}, {0x10, 0x00}, {0x11, 0x80},
+      {0x12, 0xF0}, {0x13, 0x00}, {0x14, 0x87}, {0x16, 0x40}, {0x17, 0xF0},
+      {0x18, 0x80}, {0x19, 0x86}, {0x1A, 0x80}, {0x1C, 0x20}, {0x1D, 0x00},
+      {0x1E, 0x87}, {0x21, 0xF0}, {0x22, 0x21}, {0x23, 0x80}};
+  static int16_t samples[4096 * 2];
+
+  printf("apu:\n");
+  for (int muted = 0; muted < 2; muted++) {
+    CPU *cpu = CPU_new();
+    ApuOutput *out = muted ? NULL : APU_output_new(48000);
+    APU_attach(cpu, out);
+    for (int i = 0; i < 16; i++)
+      CPU_write_memory(cpu, 0xFF30 + i, i * 0x11);
+    for (size_t i = 0; i < sizeof(regs) / sizeof(regs[0]); i++)
+      CPU_write_memory(cpu, 0xFF00 | regs[i][0], regs[i][1]);
+    double best = 1e30;
+    for (int rep = 0; rep < BENCH_REPEAT; rep++) {
+      uint64_t start = BENCH_now();
+      for (int i = 0; i < BENCH_SOUNDS; i++) {
+        cpu->cycle_count += 70224;
+        APU_sync(cpu);
+        if (out)
+          sink += APU_pull(out, samples, 4096);
+      }
+      double ns = (double)(BENCH_now() - start) / BENCH_SOUNDS;
+      best = ns < best ? ns : best;
+    }
+    BENCH_result(muted ? "apu.frame.muted" : "apu.frame", best);
+    APU_output_free(out);
+    free(cpu);
+  }
+}
+
+// the in-memory snapshot run-ahead takes and restores every frame
+static void BENCH_snapshot(CPU *cpu) {
+  Snapshot *snap = malloc(sizeof(Snapshot));
+  printf("snapshots and forks:\n");
+  for (int restore = 0; restore < 2; restore++) {
+    double best = 1e30;
+    for (int rep = 0; rep < BENCH_REPEAT; rep++) {
+      uint64_t start = BENCH_now();
+      for (int i = 0; i < BENCH_SNAPSHOTS; i++) {
+        if (restore)
+          STATE_restore(cpu, snap);
+        else
+          STATE_snapshot(cpu, snap);
+      }
+      double ns = (double)(BENCH_now() - start) / BENCH_SNAPSHOTS;
+      sink += snap->cpu._memory[rep];
+      best = ns < best ? ns : best;
+    }
+    BENCH_result(restore ? "state.restore" : "state.snapshot", best);
+  }
+  free(snap);
+
+  // a fork after writes to 8 pages, and going back and forth between two
+  // forks 8 pages apart
+  Fork *forks[2];
+  forks[0] = STATE_fork(cpu);
+  for (int k = 0; k < 8; k++)
+    CPU_write_memory(cpu, 0xC000 + k * STATE_PAGE, k);
+  forks[1] = STATE_fork(cpu);
+  for (int enter = 0; enter < 2; enter++) {
+    double best = 1e30;
+    for (int rep = 0; rep < BENCH_REPEAT; rep++) {
+      uint64_t start = BENCH_now();
+      for (int i = 0; i < BENCH_SNAPSHOTS; i++) {
+        if (enter) {
+          STATE_fork_enter(cpu, forks[i & 1]);
+          continue;
+        }
+        for (int k = 0; k < 8; k++)
+          CPU_write_memory(cpu, 0xC000 + k * STATE_PAGE, i);
+        STATE_fork_free(STATE_fork(cpu));
+      }
+      double ns = (double)(BENCH_now() - start) / BENCH_SNAPSHOTS;
+      best = ns < best ? ns : best;
+    }
+    BENCH_result(enter ? "state.fork_enter" : "state.fork", best);
+  }
+  STATE_fork_forget(cpu);
+  STATE_fork_free(forks[0]);
+  STATE_fork_free(forks[1]);
+}
+
+// copy and fill loops as games write them, in ns per byte: run in bulk
+// by idle.c and, for comparison, one instruction at a time
+static void BENCH_loops(void) {
+  static const struct {
+    const char *name;
+    bool bulk;
+    uint8_t code[24];
+  } loops[] = {
+      // ld de,$4000 / ld hl,$8000 / ld bc,$1800 / ld a,[de] / ld [hli],a /
+      // inc de / dec bc / ld a,b / or c / jr nz / jr @
+      {"loop.copy", true, {0x11, 0x00, 0x40, 0x21, 0x00, 0x80, 0x01, 0x00,
+                           0x18, 0x1A, 0x22, 0x13, 0x0B, 0x78, 0xB1, 0x20,
+                           0xF8, 0x18, 0xFE}},
+      {"loop.copy.plain", false, {0x11, 0x00, 0x40, 0x21, 0x00, 0x80, 0x01,
+                                  0x00, 0x18, 0x1A, 0x22, 0x13, 0x0B, 0x78,
+                                  0xB1, 0x20, 0xF8, 0x18, 0xFE}},
+      // ld hl,$C000 / ld bc,$1800 / xor a / ld [hli],a / dec bc / ld a,b /
+      // or c / jr nz / jr @
+      {"loop.fill", true, {0x21, 0x00, 0xC0, 0x01, 0x00, 0x18, 0xAF, 0x22,
+                           0x0B, 0x78, 0xB1, 0x20, 0xF9, 0x18, 0xFE}},
+  };
+  Cartridge *cart = BENCH_cart();
+  printf("copy loops:\n");
+  for (size_t k = 0; k < sizeof(loops) / sizeof(loops[0]); k++) {
+    memcpy(&cart->rom[0x150], loops[k].code, sizeof(loops[k].code));
+    uint16_t end = 0x150;
+    while (cart->rom[end] != 0x18 || cart->rom[end + 1] != 0xFE)
+      end++;
+    double best = 1e30;
+    for (int rep = 0; rep < BENCH_REPEAT; rep++) {
+      CPU *cpu = CPU_new();
+      cpu->cart = cart;
+      if (loops[k].bulk)
+        IDLE_start(cpu, NULL);
+      uint64_t start = BENCH_now();
+      for (int i = 0; i < BENCH_LOOPS; i++) {
+        cpu->PC = 0x150;
+        // the mode lengths of a scanline, as CPU_frame runs them
+        while (cpu->PC != end) {
+          CPU_run(cpu, 80);
+          CPU_run(cpu, 172);
+          CPU_run(cpu, 204);
+        }
+      }
+      double ns = (double)(BENCH_now() - start) / (BENCH_LOOPS * 0x1800);
+      best = ns < best ? ns : best;
+      sink += cpu->_memory[MEM_VRAM];
+      IDLE_stop(cpu);
+      free(cpu);
+    }
+    BENCH_result(loops[k].name, best);
+  }
+  cart_free(cart);
+}
+
+// how BENCH_rom runs a ROM
+typedef enum {
+  BENCH_FAST,        // the fast renderer
+  BENCH_DOT,         // the dot accurate PPU
+  BENCH_RUNAHEAD,    // the fast renderer, BENCH_AHEAD frames ahead
+  BENCH_LINE,        // the line renderer on its thread
+  BENCH_LINE_INLINE, // the line renderer on the emulation thread
+} BenchMode;
+
+static const char *bench_modes[] = {"", ".dot", ".runahead", ".line",
+                                    ".line.inline"};
+
+typedef struct {
+  uint64_t state;  // STATE_hash at the end
+  uint64_t frames; // of every frame shown, in the first run
+} BenchRun;
+
+static uint64_t BENCH_fnv(uint64_t hash, const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001B3ull;
+  }
+  return hash;
+}
+
+// whole frames, emulation plus rendering to ARGB, from power on without
+// input; all zero when the ROM does not load
+static BenchRun BENCH_rom(const char *path, BenchMode mode) {
+  BenchRun run = {0, 0};
+  Cartridge *cart = cart_load(path);
+  if (!cart) {
+    printf("  %s: cannot load, skipped\n", path);
+    return run;
+  }
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  char name[48];
+  snprintf(name, sizeof(name), "frame.%.*s%s", (int)strcspn(base, "."), base,
+           bench_modes[mode]);
+
+  uint8_t frame[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+  uint32_t lut[DISPLAY_SHADES];
+  DISPLAY_palette("grey", lut);
+  uint32_t *pixels = calloc(DISPLAY_WIDTH * DISPLAY_HEIGHT, sizeof(uint32_t));
+  double best = 1e30;
+  run.frames = 0xCBF29CE484222325ull;
+  for (int rep = 0; rep < BENCH_REPEAT; rep++) {
+    CPU *cpu = CPU_new();
+    cpu->cart = cart;
+    cart->rom_bank = 1;
+    if (mode == BENCH_DOT)
+      PPU_start(cpu);
+    if (mode == BENCH_LINE || mode == BENCH_LINE_INLINE)
+      LINES_start(cpu, mode == BENCH_LINE);
+    RunAhead *ra =
+        mode == BENCH_RUNAHEAD ? RUNAHEAD_new(BENCH_AHEAD, UINT64_MAX) : NULL;
+    uint64_t start = BENCH_now();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+      const uint8_t *shown = frame;
+      if (ra) {
+        RUNAHEAD_frame(ra, cpu, 1, frame);
+      } else {
+        CPU_frame(cpu, 1);
+        if (cpu->ppu)
+          shown = PPU_pixels(cpu);
+        else if (cpu->lines)
+          shown = LINES_pixels(cpu);
+        else
+          DISPLAY_gbmemory_to_sdl(frame, cpu);
+      }
+      DISPLAY_expand(shown, lut, pixels, DISPLAY_WIDTH * sizeof(uint32_t));
+      // the first run only, the best is from the others then
+      if (rep == 0)
+        run.frames =
+            BENCH_fnv(run.frames, shown, DISPLAY_WIDTH * DISPLAY_HEIGHT);
+    }
+    double ns = (double)(BENCH_now() - start) / BENCH_FRAMES;
+    best = ns < best ? ns : best;
+    run.state = STATE_hash(cpu);
+    RUNAHEAD_free(ra);
+    LINES_stop(cpu);
+    PPU_stop(cpu);
+    free(cpu);
+  }
+  BENCH_result(name, best);
+  printf("  %-28s %10.0f fps (state %016llx)\n", "", 1e9 / best,
+         (unsigned long long)run.state);
+  free(pixels);
+  cart_free(cart);
+  return run;
+}
+
+// whether an opcode reads or writes memory at HL, BC or DE, which must
+// point at WRAM then
+static bool BENCH_at_hl(uint8_t op) {
+  return (op >= 0x40 && op < 0xC0 && (op & 0x07) == 6) ||
+         (op >= 0x70 && op < 0x78) || op == 0x22 || op == 0x2A ||
+         op == 0x32 || op == 0x3A || op == 0x34 || op == 0x35 || op == 0x36;
+}
+
+// every data opcode and every CB opcode, each on pseudo-random registers
+// and flags with its results pushed down the stack through WRAM, for
+// tools/recompile and BENCH_parity
+static bool BENCH_parity_rom(const char *path) {
+  uint8_t *rom = calloc(1, 0x8000);
+  if (!rom)
+    return false;
+  uint32_t seed = 0x2545F491;
+#define RANDOM() (seed = seed * 1103515245 + 12345, (uint8_t)(seed >> 16))
+  int at = 0x100;
+#define EMIT(b) (rom[at++] = (b))
+  EMIT(0x00), EMIT(0xC3), EMIT(0x50), EMIT(0x01); // nop / jp $0150
+  at = 0x150;
+  EMIT(0x31), EMIT(0x00), EMIT(0xE0); // ld sp,$E000
+
+  for (int test = 0; test < 512; test++) {
+    bool cb = test >= 256;
+    uint8_t op = test & 0xFF;
+    if (!cb &&
+        !((op >= 0x40 && op < 0xC0 && op != 0x76) || (op & 0xC7) == 0xC6 ||
+          (op < 0x40 && (op & 0x07) >= 4 && (op & 0x07) <= 6) ||
+          (op < 0x40 && (op & 0x0F) == 0x01 && op != 0x31) ||
+          (op < 0x40 && ((op & 0x0F) == 0x03 || (op & 0x0F) == 0x0B) &&
+           op != 0x33 && op != 0x3B) ||
+          (op < 0x40 && ((op & 0x0F) == 0x02 || (op & 0x0F) == 0x0A ||
+                         (op & 0x0F) == 0x09 || (op & 0x07) == 0x07)) ||
+          op == 0x08 || op == 0x20 || op == 0x28 || op == 0x30 ||
+          op == 0x38 || op == 0xE0 || op == 0xF0 || op == 0xE2 ||
+          op == 0xF2 || op == 0xEA || op == 0xFA || op == 0xF8))
+      continue;
+    // AF through the stack for random flags, then BC; DE and HL carry
+    // over from the last test unless the operand needs them in WRAM
+    EMIT(0x01), EMIT(RANDOM()), EMIT(RANDOM()); // ld bc,n16
+    EMIT(0xC5), EMIT(0xF1);                    // push bc / pop af
+    EMIT(0x01), EMIT(RANDOM()), EMIT(RANDOM());
+    if (cb ? (op & 0x07) == 6 : BENCH_at_hl(op)) {
+      EMIT(0x21), EMIT(RANDOM()), EMIT(0xC0); // ld hl,$C0xx
+      EMIT(0x36), EMIT(RANDOM());             // ld [hl],n8
+    }
+    if (op == 0x02 || op == 0x0A)
+      EMIT(0x01), EMIT(RANDOM()), EMIT(0xC0);
+    if (op == 0x12 || op == 0x1A)
+      EMIT(0x11), EMIT(RANDOM()), EMIT(0xC0);
+    if (op == 0xE2 || op == 0xF2)
+      EMIT(0x0E), EMIT(0x80 | (RANDOM() & 0x7E)); // ld c,$80-$FE
+    if (cb) {
+      EMIT(0xCB), EMIT(op);
+    } else if (op == 0x20 || op == 0x28 || op == 0x30 || op == 0x38) {
+      EMIT(op), EMIT(0x01), EMIT(0x04); // jr cc,+1 / inc b
+    } else if (op == 0x08 || op == 0xEA || op == 0xFA) {
+      EMIT(op), EMIT(RANDOM()), EMIT(0xC0);
+    } else if (op == 0xE0 || op == 0xF0) {
+      EMIT(op), EMIT(0x80 | (RANDOM() & 0x7E));
+    } else {
+      EMIT(op);
+      if ((op & 0xC7) == 0xC6 || (op < 0x40 && (op & 0x07) == 6) ||
+          op == 0xF8)
+        EMIT(RANDOM());
+      else if (op < 0x40 && (op & 0x0F) == 0x01)
+        EMIT(RANDOM()), EMIT(RANDOM());
+    }
+    EMIT(0xF5), EMIT(0xC5), EMIT(0xD5), EMIT(0xE5); // push af/bc/de/hl
+  }
+  EMIT(0x18), EMIT(0xFE); // jr @
+#undef EMIT
+#undef RANDOM
+
+  FILE *f = fopen(path, "wb");
+  bool ok = f && fwrite(rom, 1, 0x8000, f) == 0x8000;
+  ok = f && fclose(f) == 0 && ok;
+  free(rom);
+  return ok;
+}
+
+// the ROM interpreted and compiled side by side, WRAM, HRAM and the whole
+// state compared after every frame; a missing ROM fails when required
+static int BENCH_parity(const char *path, const char *aot_dir,
+                        bool required) {
+  EnvRange ranges[] = {{0xC000, 0x2000}, {0xFF80, 0x80}};
+  EnvBatch *plain = ENV_new(path, 1, 1, ranges, 2);
+  EnvBatch *compiled = ENV_new(path, 1, 1, ranges, 2);
+  if (!plain || !compiled) {
+    printf("  %s: cannot load%s\n", path, required ? "" : ", skipped");
+    ENV_free(plain);
+    ENV_free(compiled);
+    return required;
+  }
+  int failed = 0;
+  if (!ENV_aot(compiled, aot_dir)) {
+    printf("  %-28s no compiled code in %s\n", path, aot_dir);
+    failed = 1;
+  }
+  size_t stride;
+  for (int i = 0; !failed && i < BENCH_PARITY_FRAMES; i++) {
+    // a press now and then for the ROMs that wait for one
+    uint8_t input = i % 60 < 5 ? 0x7F : 0xFF;
+    ENV_step(plain, &input, 1);
+    ENV_step(compiled, &input, 1);
+    const uint8_t *a = ENV_ram(plain, &stride), *b = ENV_ram(compiled, NULL);
+    CPU *x = ENV_cpu(plain, 0), *y = ENV_cpu(compiled, 0);
+    if (memcmp(a, b, stride) != 0 || STATE_hash(x) != STATE_hash(y)) {
+      size_t at = 0;
+      while (at < stride && a[at] == b[at])
+        at++;
+      printf("  %-28s differs at frame %d: PC %04X/%04X AF %04X/%04X, "
+             "byte %zu of the RAM\n",
+             path, i, x->PC, y->PC, x->AF, y->AF, at);
+      failed = 1;
+    }
+  }
+  if (!failed)
+    printf("  %-28s same as the interpreter for %d frames\n", path,
+           BENCH_PARITY_FRAMES);
+  ENV_free(plain);
+  ENV_free(compiled);
+  return failed;
+}
+
+static int BENCH_compare(const char *path, double threshold) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    printf("no baseline at %s\n", path);
+    return 0;
+  }
+  int regressions = 0;
+  char name[48];
+  double base;
+  printf("against %s (threshold %.0f%%):\n", path, threshold);
+  while (fscanf(f, "%47s %lf", name, &base) == 2) {
+    for (int i = 0; i < result_count; i++) {
+      if (strcmp(results[i].name, name) != 0)
+        continue;
+      double change = 100.0 * (results[i].ns - base) / base;
+      bool slower = change > threshold;
+      regressions += slower;
+      printf("  %-28s %+7.1f%%%s\n", name, change,
+             slower ? "  REGRESSION" : "");
+    }
+  }
+  fclose(f);
+  return regressions;
+}
+
+int main(int argc, char **argv) {
+  const char *out = "bench/results.txt";
+  const char *baseline = NULL;
+  double threshold = 10;
+  const char *aot_dir = NULL;
+  int first_rom = argc;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--parity-rom") == 0 && i + 1 < argc) {
+      if (!BENCH_parity_rom(argv[++i])) {
+        printf("cannot write %s\n", argv[i]);
+        return 1;
+      }
+      return 0;
+    } else if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc) {
+      aot_dir = argv[++i];
+    } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+      out = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline = argv[++i];
+    } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+      threshold = strtod(argv[++i], NULL);
+    } else {
+      first_rom = i;
+      break;
+    }
+  }
+
+  CPU *cpu = CPU_new();
+  cpu->cart = BENCH_cart();
+  BENCH_opcodes(cpu);
+  BENCH_bus(cpu);
+  BENCH_render(cpu);
+  BENCH_scale(cpu);
+  BENCH_apu();
+  BENCH_snapshot(cpu);
+  BENCH_loops();
+  printf("roms:\n");
+  int modes_differ = 0;
+  for (int i = first_rom; i < argc; i++) {
+    BenchRun fast = BENCH_rom(argv[i], BENCH_FAST);
+    BENCH_rom(argv[i], BENCH_DOT);
+    // the frames run ahead are thrown away, they must leave nothing behind
+    if (BENCH_rom(argv[i], BENCH_RUNAHEAD).state != fast.state) {
+      printf("  %s: run-ahead ends in another state\n", argv[i]);
+      modes_differ++;
+    }
+    // the worker thread draws the same lines as the emulation thread
+    BenchRun threaded = BENCH_rom(argv[i], BENCH_LINE);
+    BenchRun unthreaded = BENCH_rom(argv[i], BENCH_LINE_INLINE);
+    if (threaded.frames != unthreaded.frames ||
+        threaded.state != unthreaded.state) {
+      printf("  %s: the render thread draws other frames\n", argv[i]);
+      modes_differ++;
+    }
+  }
+
+  int differ = 0;
+  if (aot_dir) {
+    printf("compiled code:\n");
+    differ += BENCH_parity(BENCH_PARITY_ROM, aot_dir, true);
+    for (int i = first_rom; i < argc; i++)
+      differ += BENCH_parity(argv[i], aot_dir, false);
+  }
+
+  FILE *f = fopen(out, "w");
+  if (!f) {
+    printf("cannot write %s\n", out);
+    return 1;
+  }
+  for (int i = 0; i < result_count; i++)
+    fprintf(f, "%s %.3f\n", results[i].name, results[i].ns);
+  fclose(f);
+  printf("results written to %s\n", out);
+
+  if (differ) {
+    printf("compiled code differs from the interpreter\n");
+    return 1;
+  }
+  if (modes_differ) {
+    printf("run-ahead or the render thread changes the emulation\n");
+    return 1;
+  }
+  if (baseline && BENCH_compare(baseline, threshold)) {
+    printf("performance regressed\n");
+    return 1;
+  }
+  return 0;
+}
@@ -9,69 +9,118 @@
 typedef struct {
   uint8_t *rom;
   size_t rom_size;
-  uint8_t ram[MAX_RAM_SIZE];
+  // as much as the header asks for, up to MAX_RAM_SIZE, right after the
+  // struct; NULL for none
+  uint8_t *ram;
+  size_t ram_size;
 
   uint8_t rom_bank;
   uint8_t ram_bank;
   uint8_t ram_enable;
   uint8_t banking_mode;
+  // the same for the 256 byte pages of ram, for forks
+  uint8_t written[MAX_RAM_SIZE / 256];
 } Cartridge;
 
-Cartridge *cart_load(const char *filename) {
-  Cartridge *cart = calloc(1, sizeof(Cartridge));
-  if (!cart)
-    return NULL;
+// the RAM size code at 0x149 of the header
+static size_t cart_ram_size(const uint8_t *rom, size_t rom_size) {
+  static const size_t sizes[] = {0, 2048, 8192, 32768, 131072, 65536};
+  if (rom_size <= 0x149 || rom[0x149] >= sizeof(sizes) / sizeof(sizes[0]))
+    return 0;
+  size_t size = sizes[rom[0x149]];
+  return size < MAX_RAM_SIZE ? size : MAX_RAM_SIZE; // MBC1 has 4 banks
+}
 
+Cartridge *cart_load(const char *filename) {
   FILE *f = fopen(filename, "rb");
-  if (!f) {
-    free(cart);
+  if (!f)
     return NULL;
-  }
 
   fseek(f, 0, SEEK_END);
-  cart->rom_size = ftell(f);
+  size_t rom_size = ftell(f);
   rewind(f);
 
-  if (cart->rom_size > MAX_ROM_SIZE) {
+  if (rom_size > MAX_ROM_SIZE) {
     fclose(f);
-    free(cart);
     return NULL;
   }
 
-  cart->rom = malloc(cart->rom_size);
-  if (!cart->rom) {
+  uint8_t *rom = malloc(rom_size);
+  if (!rom) {
     fclose(f);
-    free(cart);
     return NULL;
   }
 
-  if (fread(cart->rom, 1, cart->rom_size, f) != cart->rom_size) {
+  if (fread(rom, 1, rom_size, f) != rom_size) {
     fprintf(stderr, "error: failed to fully read ROM\n");
-    free(cart->rom);
-    free(cart);
+    free(rom);
     fclose(f);
     return NULL;
   }
-
   fclose(f);
+
+  size_t ram_size = cart_ram_size(rom, rom_size);
+  Cartridge *cart = calloc(1, sizeof(Cartridge) + ram_size);
+  if (!cart) {
+    free(rom);
+    return NULL;
+  }
+  cart->rom = rom;
+  cart->rom_size = rom_size;
+  cart->ram = ram_size ? (uint8_t *)(cart + 1) : NULL;
+  cart->ram_size = ram_size;
   cart->rom_bank = 1;
   return cart;
 }
 
+size_t cart_size(const Cartridge *cart) {
+  return sizeof(Cartridge) + cart->ram_size;
+}
+
+Cartridge *cart_share(const Cartridge *cart, void *memory) {
+  Cartridge *copy = memory;
+  memset(copy, 0, cart_size(cart));
+  copy->rom = cart->rom;
+  copy->rom_size = cart->rom_size;
+  copy->ram = cart->ram_size ? (uint8_t *)(copy + 1) : NULL;
+  copy->ram_size = cart->ram_size;
+  copy->rom_bank = 1;
+  return copy;
+}
+
 uint8_t cart_read(Cartridge *cart, uint16_t addr) {
   if (addr < 0x4000) {
     return cart->rom[addr];
   } else if (addr < 0x8000) {
     size_t offset = (cart->rom_bank & 0x1F) * 0x4000 + (addr - 0x4000);
     return cart->rom[offset % cart->rom_size];
-  } else if (addr >= 0xA000 && addr < 0xC000 && cart->ram_enable) {
+  } else if (addr >= 0xA000 && addr < 0xC000 && cart->ram_enable &&
+             cart->ram_size) {
     size_t offset =
         (cart->banking_mode ? cart->ram_bank : 0) * 0x2000 + (addr - 0xA000);
-    return cart->ram[offset % MAX_RAM_SIZE];
+    return cart->ram[offset % cart->ram_size];
   }
   return 0xFF;
 }
 
+// where size bytes from addr live, NULL when they are not one plain run of
+// ROM or enabled RAM
+uint8_t *cart_pointer(Cartridge *cart, uint16_t addr, size_t size) {
+  size_t offset;
+  if (addr < 0x4000) {
+    offset = addr;
+  } else if (addr < 0x8000) {
+    offset = (cart->rom_bank & 0x1F) * 0x4000 + (addr - 0x4000);
+  } else if (addr >= 0xA000 && addr < 0xC000 && cart->ram_enable) {
+    offset =
+        (cart->banking_mode ? cart->ram_bank : 0) * 0x2000 + (addr - 0xA000);
+    return offset + size <= cart->ram_size ? &cart->ram[offset] : NULL;
+  } else {
+    return NULL;
+  }
+  return offset + size <= cart->rom_size ? &cart->rom[offset] : NULL;
+}
+
 void cart_write(Cartridge *cart, uint16_t addr, uint8_t val) {
   // printf("cart write called, addr: %04X, val: %02X\n", addr, val);
   if (addr < 0x2000) {
@@ -86,10 +135,13 @@ void cart_write(Cartridge *cart, uint16_t addr, uint8_t val) {
       cart->rom_bank = (cart->rom_bank & 0x1F) | ((val & 0x03) << 5);
   } else if (addr < 0x8000) {
     cart->banking_mode = val & 0x01;
-  } else if (addr >= 0xA000 && addr < 0xC000 && cart->ram_enable) {
+  } else if (addr >= 0xA000 && addr < 0xC000 && cart->ram_enable &&
+             cart->ram_size) {
     size_t offset =
         (cart->banking_mode ? cart->ram_bank : 0) * 0x2000 + (addr - 0xA000);
-    cart->ram[offset % MAX_RAM_SIZE] = val;
+    offset %= cart->ram_size;
+    cart->ram[offset] = val;
+    cart->written[offset >> 8] = 1;
   }
 }
 
@@ -99,3 +151,13 @@ void cart_free(Cartridge *cart) {
   free(cart->rom);
   free(cart);
 }
+
+// FNV-1a over the whole ROM, identifies the game in movies and states
+uint64_t cart_hash(Cartridge *cart) {
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (size_t i = 0; i < cart->rom_size; i++) {
+    hash ^= cart->rom[i];
+    hash *= 0x100000001B3ull;
+  }
+  return hash;
+}
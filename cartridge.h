@@ -8,15 +8,27 @@
 typedef struct {
   uint8_t *rom;
   size_t rom_size;
-  uint8_t ram[MAX_RAM_SIZE];
+  // as much as the header asks for, up to MAX_RAM_SIZE, right after the
+  // struct; NULL for none
+  uint8_t *ram;
+  size_t ram_size;
 
   uint8_t rom_bank;
   uint8_t ram_bank;
   uint8_t ram_enable;
   uint8_t banking_mode;
+  // the same for the 256 byte pages of ram, for forks
+  uint8_t written[MAX_RAM_SIZE / 256];
 } Cartridge;
 
 Cartridge *cart_load(const char *filename);
+// the bytes a cartridge and its RAM take
+size_t cart_size(const Cartridge *cart);
+// a cartridge in memory the caller owns, cart_size bytes, sharing cart's ROM
+// and with its own RAM, cleared; freed with that memory
+Cartridge *cart_share(const Cartridge *cart, void *memory);
 void cart_free(Cartridge *cart);
 uint8_t cart_read(Cartridge *cart, uint16_t addr);
 void cart_write(Cartridge *cart, uint16_t addr, uint8_t val);
+uint8_t *cart_pointer(Cartridge *cart, uint16_t addr, size_t size);
+uint64_t cart_hash(Cartridge *cart);
@@ -1,5 +1,13 @@
 #include "cpu.h"
+#include "aot.h"
 #include "cartridge.h"
+#include "debug.h"
+#include "input.h"
+#include "lines.h"
+#include "profiler.h"
+#include "ppu.h"
+#include "trace.h"
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,10 +19,25 @@
 #define F_h 0x20 // half carry flag (BCD)
 #define F_c 0x10
 
+#define DMA_BYTES 0xA0
+#define DMA_CYCLES 320
+
+// the fields every instruction touches share a cache line
+_Static_assert(offsetof(CPU, trace) + sizeof(Trace *) <= CPU_ALIGN,
+               "hot CPU fields spill out of the first cache line");
+
+size_t CPU_size(void) {
+  return (sizeof(CPU) + CPU_ALIGN - 1) / CPU_ALIGN * CPU_ALIGN;
+}
+
 CPU *CPU_new() {
-  CPU *cpu = calloc(1, sizeof(CPU));
-  if (!cpu)
-    return NULL;
+  void *memory = aligned_alloc(CPU_ALIGN, CPU_size());
+  return memory ? CPU_init(memory) : NULL;
+}
+
+CPU *CPU_init(void *memory) {
+  CPU *cpu = memory;
+  memset(cpu, 0, sizeof(CPU));
 
   cpu->AF = 0x01B0;
   cpu->BC = 0x0013;
@@ -35,18 +58,64 @@ CPU *CPU_new() {
   cpu->tma = 0;  // 0xFF06 – Timer modulo (reload value)
   cpu->tac = 0;  // 0xFF07 – Timer control
 
-  cpu->stat = 0; // 0xFF41 – LCD STAT
-  cpu->lyc = 0;  // 0xFF45 – LYC compare value
+  cpu->lcdc = 0x91; // 0xFF40 – LCD on, as the boot ROM leaves it
+  cpu->stat = 0;    // 0xFF41 – LCD STAT
+  cpu->lyc = 0;     // 0xFF45 – LYC compare value
 
   cpu->IME = 0;
   cpu->pending_IME = 0;
   cpu->cycle_count = 0;
   cpu->halted = 0;
 
+  APU_reset(cpu); // 0xFF10-0xFF3F
+
   return cpu;
 }
 
+// OAM DMA copies 160 bytes from val << 8 into OAM. The copy is done at once;
+// for its duration the CPU only reaches the FFxx page, which CPU_run lifts
+// as an event at dma_end. On hardware it takes 160 M-cycles, the length of
+// the usual `ld a, 40 / dec a / jr nz` wait; as every instruction costs 4
+// cycles here that wait takes DMA_CYCLES, so the lock matches it.
+static void CPU_dma(CPU *cpu, uint8_t val) {
+  uint16_t source = val << 8;
+  uint8_t *src = NULL;
+  if (source < 0x8000 || (source >= 0xA000 && source < 0xC000))
+    src = cart_pointer(cpu->cart, source, DMA_BYTES);
+  else if (source < 0xFE00)
+    src = &cpu->_memory[CPU_mem(source)];
+
+  // a new transfer can start while one is running
+  uint8_t lock = cpu->bus_lock & ~BUS_DMA;
+  uint8_t *oam = &cpu->_memory[MEM_OAM];
+  cpu->written[MEM_OAM / 256] = 1;
+  if (src) {
+    bool changed = memcmp(oam, src, DMA_BYTES) != 0;
+    cpu->screen_dirty |= changed;
+    cpu->vram_dirty |= changed;
+    memcpy(oam, src, DMA_BYTES);
+  } else {
+    CPU_bus_lock(cpu, 0);
+    for (int i = 0; i < DMA_BYTES; i++) {
+      uint8_t byte = CPU_read_memory(cpu, source + i);
+      cpu->screen_dirty |= oam[i] != byte;
+      cpu->vram_dirty |= oam[i] != byte;
+      oam[i] = byte;
+    }
+  }
+
+  // the writing instruction is charged after this returns
+  CPU_bus_lock(cpu, lock | BUS_DMA);
+  cpu->dma_end = cpu->cycle_count + 4 + DMA_CYCLES;
+  if (cpu->dma_end < cpu->run_end)
+    cpu->run_end = cpu->dma_end;
+}
+
 void hw_write(CPU *cpu, uint16_t address, uint8_t val) {
+  if (address >= 0xFF10 && address <= 0xFF3F) {
+    APU_write(cpu, address, val);
+    return;
+  }
   switch (address) {
   case 0xFF44:
     // vblank
@@ -78,59 +147,69 @@ void hw_write(CPU *cpu, uint16_t address, uint8_t val) {
     break;
   case 0xFF40:
     // lcdc
+    cpu->screen_dirty |= cpu->lcdc != val;
     cpu->lcdc = val;
     break;
   case 0xFF42:
     // scy
+    cpu->screen_dirty |= cpu->scy != val;
     cpu->scy = val;
     break;
   case 0xFF43:
     // scx
+    cpu->screen_dirty |= cpu->scx != val;
     cpu->scx = val;
     break;
   case 0xFF4A:
     // wy
+    cpu->screen_dirty |= cpu->wy != val;
     cpu->wy = val;
     break;
   case 0xFF4B:
     // wx
+    cpu->screen_dirty |= cpu->wx != val;
     cpu->wx = val;
     break;
   case 0xFF47:
     // bgp
+    cpu->screen_dirty |= cpu->bgp != val;
     cpu->bgp = val;
     break;
   case 0xFF48:
     // obp0
+    cpu->screen_dirty |= cpu->obp0 != val;
     cpu->obp0 = val;
     break;
   case 0xFF49:
     // obp1
+    cpu->screen_dirty |= cpu->obp1 != val;
     cpu->obp1 = val;
     break;
   case 0xFF41:
-    cpu->stat = val;
+    // the mode and LYC=LY bits are read only
+    cpu->stat = (cpu->stat & 0x07) | (val & 0x78);
     break;
   case 0xFF45:
     cpu->lyc = val;
     break;
   case 0xFF46:
     // DMA transfer
-    address = val << 8;
-    for (int i = 0; i < 0xA0; i++) {
-      cpu->_memory[0xFE00 + i] = CPU_read_memory(cpu, address + i);
-    }
+    CPU_dma(cpu, val);
     break;
   }
 }
 
 uint8_t hw_read(CPU *cpu, uint16_t address) {
+  if (address >= 0xFF10 && address <= 0xFF3F)
+    return APU_read(cpu, address);
   switch (address) {
   case 0xFF44:
     // vblank
     return cpu->ly;
   case 0xFF00: {
-    // joyp
+    // joyp, the input is taken in as late as possible
+    if (cpu->input)
+      INPUT_latch(cpu);
     uint8_t select = cpu->joyp & 0xF0;
 
     if (!(select & 0x10)) {
@@ -182,6 +261,15 @@ uint8_t hw_read(CPU *cpu, uint16_t address) {
   }
 }
 
+void CPU_joypad(CPU *cpu, uint8_t joypad) {
+  uint8_t old = cpu->direction_state | cpu->button_state << 4;
+  // on hardware only a selected line going low raises it, here any press
+  if (old & ~joypad)
+    cpu->if_reg |= 0x10;
+  cpu->direction_state = joypad & 0x0F;
+  cpu->button_state = joypad >> 4;
+}
+
 void CPU_check_stat_interrupt(CPU *cpu, uint8_t mode) {
   if (cpu->ly == cpu->lyc) {
     cpu->stat |= 0x04; // LYC=LY flag
@@ -239,24 +327,84 @@ void CPU_core_dump(CPU *cpu) {
 
 uint8_t *CPU_memory(CPU *cpu) { return cpu->_memory; };
 
-uint8_t CPU_read_memory(CPU *cpu, uint16_t addr) {
-  // MMIO / hardware registers
-  if (((addr >= 0xFF00 && addr <= 0xFF7F) || addr == 0xFFFF)) {
-    return hw_read(cpu, addr);
+// the locks are below the FFxx page: OAM DMA takes everything, the
+// accurate PPU takes VRAM in mode 3 and OAM in modes 2 and 3
+static void CPU_bus_pages(CPU *cpu, int first, int last) {
+  for (int i = first; i <= last; i++) {
+    bool locked = (cpu->bus_lock & BUS_DMA) ||
+                  (i >= 0x80 && i < 0xA0 && (cpu->bus_lock & BUS_VRAM)) ||
+                  (i == 0xFE && (cpu->bus_lock & BUS_OAM));
+    cpu->bus_pages[i] = (locked && i < 0xFF ? BUS_LOCKED : 0) |
+                        (cpu->debug ? cpu->debug->pages[i] : 0);
   }
+}
 
-  // ROM or external RAM (handled by MBC)
-  if (addr < 0x8000 || (addr >= 0xA000 && addr < 0xC000)) {
-    return cart_read(cpu->cart, addr);
+void CPU_bus_lock(CPU *cpu, uint8_t lock) {
+  uint8_t changed = cpu->bus_lock ^ lock;
+  cpu->bus_lock = lock;
+  if (changed & BUS_DMA) {
+    CPU_bus_pages(cpu, 0x00, 0xFE);
+    return;
   }
+  if (changed & BUS_VRAM)
+    CPU_bus_pages(cpu, 0x80, 0x9F);
+  if (changed & BUS_OAM)
+    CPU_bus_pages(cpu, 0xFE, 0xFE);
+}
+
+void CPU_bus_update(CPU *cpu) { CPU_bus_pages(cpu, 0x00, 0xFF); }
 
-  // Normal RAM
-  return cpu->_memory[addr];
+// the slow path of the bus: the watchpoints on the page, then its lock
+static inline bool CPU_bus_locked(CPU *cpu, uint16_t addr, uint8_t access,
+                                  uint8_t val) {
+  uint8_t page = cpu->bus_pages[addr >> 8];
+  // run-ahead takes the debugger away for the frames it throws away
+  if ((page & access) && cpu->debug)
+    DEBUG_access(cpu, addr, access, val);
+  return page & BUS_LOCKED;
+}
+
+// a read or, for the opcode of an instruction, a fetch
+static inline uint8_t CPU_bus_read(CPU *cpu, uint16_t addr, uint8_t access) {
+  // OAM DMA or the PPU holds the bus, or a watchpoint is on the page
+  if (cpu->bus_pages[addr >> 8] && CPU_bus_locked(cpu, addr, access, 0))
+    return 0xFF;
+
+  if (addr >= 0xFF00) {
+    // MMIO / hardware registers
+    if (addr <= 0xFF7F || addr == 0xFFFF)
+      return hw_read(cpu, addr);
+    return cpu->_memory[MEM_HIGH + (addr & 0xFF)];
+  }
+
+  // ROM or external RAM (handled by MBC), else the region the address is
+  // in, which the branches here have already found
+  if (addr < 0x8000)
+    return cart_read(cpu->cart, addr);
+  if (addr < 0xA000)
+    return cpu->_memory[MEM_VRAM + (addr & 0x1FFF)];
+  if (addr < 0xC000)
+    return cart_read(cpu->cart, addr);
+  if (addr < 0xFE00)
+    return cpu->_memory[MEM_WRAM + (addr & 0x1FFF)];
+  return cpu->_memory[MEM_OAM + (addr & 0xFF)];
+}
+
+uint8_t CPU_read_memory(CPU *cpu, uint16_t addr) {
+  return CPU_bus_read(cpu, addr, DEBUG_READ);
 }
 
 void CPU_write_memory(CPU *cpu, uint16_t addr, uint8_t val) {
-  if (((addr >= 0xFF00 && addr <= 0xFF7F) || addr == 0xFFFF)) {
-    hw_write(cpu, addr, val);
+  if (cpu->bus_pages[addr >> 8] &&
+      CPU_bus_locked(cpu, addr, DEBUG_WRITE, val))
+    return;
+
+  if (addr >= 0xFF00) {
+    // MMIO / hardware registers
+    if (addr <= 0xFF7F || addr == 0xFFFF)
+      hw_write(cpu, addr, val);
+    else
+      cpu->_memory[MEM_HIGH + (addr & 0xFF)] = val;
     return;
   }
 
@@ -266,12 +414,41 @@ void CPU_write_memory(CPU *cpu, uint16_t addr, uint8_t val) {
     return;
   }
 
-  // Normal RAM
-  cpu->_memory[addr] = val;
+  // Normal RAM, VRAM and OAM are what the screen is drawn from
+  uint16_t i = CPU_mem(addr);
+  if (addr < 0xA000 || (addr >= 0xFE00 && addr < 0xFEA0)) {
+    bool changed = cpu->_memory[i] != val;
+    cpu->screen_dirty |= changed;
+    cpu->vram_dirty |= changed;
+  }
+  cpu->_memory[i] = val;
+  cpu->written[i >> 8] = 1;
+}
+
+void CPU_gather(CPU *cpu, uint16_t address, uint32_t length, uint8_t *out) {
+  uint32_t at = address;
+  while (length) {
+    uint32_t end = at < 0x8000   ? 0x8000
+                   : at < 0xA000 ? 0xA000
+                   : at < 0xC000 ? 0xC000
+                   : at < 0xE000 ? 0xE000
+                   : at < 0xFE00 ? 0xFE00
+                                 : 0x10000;
+    uint32_t n = end - at < length ? end - at : length;
+    if (at < 0x8000 || (at >= 0xA000 && at < 0xC000)) {
+      for (uint32_t i = 0; i < n; i++)
+        out[i] = cart_read(cpu->cart, at + i);
+    } else {
+      memcpy(out, &cpu->_memory[CPU_mem(at)], n);
+    }
+    at += n;
+    length -= n;
+    out += n;
+  }
 }
 
 uint8_t *CPU_io_pointer(CPU *cpu, uint16_t address) {
-  return &cpu->_memory[address];
+  return &cpu->_memory[CPU_mem(address)];
 }
 
 // register sets:
@@ -1088,8 +1265,6 @@ void CPU_invalid(CPU *cpu, uint8_t opcode) {
   exit(1);
 };
 
-typedef void (*OpcodeHandler)(CPU *, uint8_t opcode);
-
 static OpcodeHandler prefixTable[256] = {
     [0x00] = CPU_rlc_r8,  [0x01] = CPU_rlc_r8,  [0x02] = CPU_rlc_r8,
     [0x03] = CPU_rlc_r8,  [0x04] = CPU_rlc_r8,  [0x05] = CPU_rlc_r8,
@@ -1144,39 +1319,39 @@ static OpcodeHandler prefixTable[256] = {
     [0x96] = CPU_res_r8,  [0x97] = CPU_res_r8,  [0x98] = CPU_res_r8,
     [0x99] = CPU_res_r8,  [0x9A] = CPU_res_r8,  [0x9B] = CPU_res_r8,
     [0x9C] = CPU_res_r8,  [0x9D] = CPU_res_r8,  [0x9E] = CPU_res_r8,
-    [0x9F] = CPU_res_r8,  [0xA0] = CPU_set_r8,  [0xA1] = CPU_set_r8,
-    [0xA2] = CPU_set_r8,  [0xA3] = CPU_set_r8,  [0xA4] = CPU_set_r8,
-    [0xA5] = CPU_set_r8,  [0xA6] = CPU_set_r8,  [0xA7] = CPU_set_r8,
-    [0xA8] = CPU_set_r8,  [0xA9] = CPU_set_r8,  [0xAA] = CPU_set_r8,
-    [0xAB] = CPU_set_r8,  [0xAC] = CPU_set_r8,  [0xAD] = CPU_set_r8,
-    [0xAE] = CPU_set_r8,  [0xAF] = CPU_set_r8,  [0xB0] = CPU_set_r8,
-    [0xB1] = CPU_set_r8,  [0xB2] = CPU_set_r8,  [0xB3] = CPU_set_r8,
-    [0xB4] = CPU_set_r8,  [0xB5] = CPU_set_r8,  [0xB6] = CPU_set_r8,
-    [0xB7] = CPU_set_r8,  [0xB8] = CPU_set_r8,  [0xB9] = CPU_set_r8,
-    [0xBA] = CPU_set_r8,  [0xBB] = CPU_set_r8,  [0xBC] = CPU_set_r8,
-    [0xBD] = CPU_set_r8,  [0xBE] = CPU_set_r8,  [0xBF] = CPU_set_r8,
-    [0xC0] = CPU_bit_r8,  [0xC1] = CPU_bit_r8,  [0xC2] = CPU_bit_r8,
-    [0xC3] = CPU_bit_r8,  [0xC4] = CPU_bit_r8,  [0xC5] = CPU_bit_r8,
-    [0xC6] = CPU_bit_r8,  [0xC7] = CPU_bit_r8,  [0xC8] = CPU_bit_r8,
-    [0xC9] = CPU_bit_r8,  [0xCA] = CPU_bit_r8,  [0xCB] = CPU_bit_r8,
-    [0xCC] = CPU_bit_r8,  [0xCD] = CPU_bit_r8,  [0xCE] = CPU_bit_r8,
-    [0xCF] = CPU_bit_r8,  [0xD0] = CPU_bit_r8,  [0xD1] = CPU_bit_r8,
-    [0xD2] = CPU_bit_r8,  [0xD3] = CPU_bit_r8,  [0xD4] = CPU_bit_r8,
-    [0xD5] = CPU_bit_r8,  [0xD6] = CPU_bit_r8,  [0xD7] = CPU_bit_r8,
-    [0xD8] = CPU_bit_r8,  [0xD9] = CPU_bit_r8,  [0xDA] = CPU_bit_r8,
-    [0xDB] = CPU_bit_r8,  [0xDC] = CPU_bit_r8,  [0xDD] = CPU_bit_r8,
-    [0xDE] = CPU_bit_r8,  [0xDF] = CPU_bit_r8,  [0xE0] = CPU_bit_r8,
-    [0xE1] = CPU_bit_r8,  [0xE2] = CPU_bit_r8,  [0xE3] = CPU_bit_r8,
-    [0xE4] = CPU_bit_r8,  [0xE5] = CPU_bit_r8,  [0xE6] = CPU_bit_r8,
-    [0xE7] = CPU_bit_r8,  [0xE8] = CPU_bit_r8,  [0xE9] = CPU_bit_r8,
-    [0xEA] = CPU_bit_r8,  [0xEB] = CPU_bit_r8,  [0xEC] = CPU_bit_r8,
-    [0xED] = CPU_bit_r8,  [0xEE] = CPU_bit_r8,  [0xEF] = CPU_bit_r8,
-    [0xF0] = CPU_bit_r8,  [0xF1] = CPU_bit_r8,  [0xF2] = CPU_bit_r8,
-    [0xF3] = CPU_bit_r8,  [0xF4] = CPU_bit_r8,  [0xF5] = CPU_bit_r8,
-    [0xF6] = CPU_bit_r8,  [0xF7] = CPU_bit_r8,  [0xF8] = CPU_bit_r8,
-    [0xF9] = CPU_bit_r8,  [0xFA] = CPU_bit_r8,  [0xFB] = CPU_bit_r8,
-    [0xFC] = CPU_bit_r8,  [0xFD] = CPU_bit_r8,  [0xFE] = CPU_bit_r8,
-    [0xFF] = CPU_bit_r8,
+    [0x9F] = CPU_res_r8,  [0xA0] = CPU_res_r8,  [0xA1] = CPU_res_r8,
+    [0xA2] = CPU_res_r8,  [0xA3] = CPU_res_r8,  [0xA4] = CPU_res_r8,
+    [0xA5] = CPU_res_r8,  [0xA6] = CPU_res_r8,  [0xA7] = CPU_res_r8,
+    [0xA8] = CPU_res_r8,  [0xA9] = CPU_res_r8,  [0xAA] = CPU_res_r8,
+    [0xAB] = CPU_res_r8,  [0xAC] = CPU_res_r8,  [0xAD] = CPU_res_r8,
+    [0xAE] = CPU_res_r8,  [0xAF] = CPU_res_r8,  [0xB0] = CPU_res_r8,
+    [0xB1] = CPU_res_r8,  [0xB2] = CPU_res_r8,  [0xB3] = CPU_res_r8,
+    [0xB4] = CPU_res_r8,  [0xB5] = CPU_res_r8,  [0xB6] = CPU_res_r8,
+    [0xB7] = CPU_res_r8,  [0xB8] = CPU_res_r8,  [0xB9] = CPU_res_r8,
+    [0xBA] = CPU_res_r8,  [0xBB] = CPU_res_r8,  [0xBC] = CPU_res_r8,
+    [0xBD] = CPU_res_r8,  [0xBE] = CPU_res_r8,  [0xBF] = CPU_res_r8,
+    [0xC0] = CPU_set_r8,  [0xC1] = CPU_set_r8,  [0xC2] = CPU_set_r8,
+    [0xC3] = CPU_set_r8,  [0xC4] = CPU_set_r8,  [0xC5] = CPU_set_r8,
+    [0xC6] = CPU_set_r8,  [0xC7] = CPU_set_r8,  [0xC8] = CPU_set_r8,
+    [0xC9] = CPU_set_r8,  [0xCA] = CPU_set_r8,  [0xCB] = CPU_set_r8,
+    [0xCC] = CPU_set_r8,  [0xCD] = CPU_set_r8,  [0xCE] = CPU_set_r8,
+    [0xCF] = CPU_set_r8,  [0xD0] = CPU_set_r8,  [0xD1] = CPU_set_r8,
+    [0xD2] = CPU_set_r8,  [0xD3] = CPU_set_r8,  [0xD4] = CPU_set_r8,
+    [0xD5] = CPU_set_r8,  [0xD6] = CPU_set_r8,  [0xD7] = CPU_set_r8,
+    [0xD8] = CPU_set_r8,  [0xD9] = CPU_set_r8,  [0xDA] = CPU_set_r8,
+    [0xDB] = CPU_set_r8,  [0xDC] = CPU_set_r8,  [0xDD] = CPU_set_r8,
+    [0xDE] = CPU_set_r8,  [0xDF] = CPU_set_r8,  [0xE0] = CPU_set_r8,
+    [0xE1] = CPU_set_r8,  [0xE2] = CPU_set_r8,  [0xE3] = CPU_set_r8,
+    [0xE4] = CPU_set_r8,  [0xE5] = CPU_set_r8,  [0xE6] = CPU_set_r8,
+    [0xE7] = CPU_set_r8,  [0xE8] = CPU_set_r8,  [0xE9] = CPU_set_r8,
+    [0xEA] = CPU_set_r8,  [0xEB] = CPU_set_r8,  [0xEC] = CPU_set_r8,
+    [0xED] = CPU_set_r8,  [0xEE] = CPU_set_r8,  [0xEF] = CPU_set_r8,
+    [0xF0] = CPU_set_r8,  [0xF1] = CPU_set_r8,  [0xF2] = CPU_set_r8,
+    [0xF3] = CPU_set_r8,  [0xF4] = CPU_set_r8,  [0xF5] = CPU_set_r8,
+    [0xF6] = CPU_set_r8,  [0xF7] = CPU_set_r8,  [0xF8] = CPU_set_r8,
+    [0xF9] = CPU_set_r8,  [0xFA] = CPU_set_r8,  [0xFB] = CPU_set_r8,
+    [0xFC] = CPU_set_r8,  [0xFD] = CPU_set_r8,  [0xFE] = CPU_set_r8,
+    [0xFF] = CPU_set_r8,
 };
 
 void CPU_prefix(CPU *cpu, uint8_t opcode) {
@@ -1447,88 +1622,193 @@ static OpcodeHandler opcodeTable[256] = {
     [0xFF] = CPU_rst,
 };
 
-static int div_counter = 0;
-static int tima_counter = 0;
-
 // cycles elapsed by instruction for real per-instruction cycle counts
 void CPU_update_timer(CPU *cpu, int cycles_elapsed) {
-  // --- DIV logic ---
-  div_counter += cycles_elapsed;
-  while (div_counter >= 256) {
-    div_counter -= 256;
-    cpu->divr++;
-  }
-
-  // --- TIMA logic ---
-  if (!(cpu->tac & 0x04))
-    return; // timer disabled
-
-  int freq_select = cpu->tac & 0x03;
-  int threshold;
-  switch (freq_select) {
-  case 0:
-    threshold = 1024;
-    break;
-  case 1:
-    threshold = 16;
-    break;
-  case 2:
-    threshold = 64;
-    break;
-  case 3:
-    threshold = 256;
-    break;
-  }
-
-  tima_counter += cycles_elapsed;
-  while (tima_counter >= threshold) {
-    tima_counter -= threshold;
-
-    if (cpu->tima == 0xFF) {
-      cpu->tima = cpu->tma;
-      cpu->if_reg |= 0x04; // timer interrupt
-    } else {
-      cpu->tima++;
-    }
-  }
+  CPU_timer(cpu, cycles_elapsed);
 }
 
-void CPU_instruction(CPU *cpu) {
-  uint8_t opcode = CPU_read_memory(cpu, cpu->PC++);
+static inline void CPU_handle(CPU *cpu, uint8_t opcode) {
   OpcodeHandler handler = opcodeTable[opcode];
   handler(cpu, opcode);
   if (cpu->pending_IME) {
     cpu->IME = 1;
     cpu->pending_IME = 0;
   }
+}
+
+void CPU_execute(CPU *cpu, uint8_t opcode) { CPU_handle(cpu, opcode); }
+
+void CPU_instruction(CPU *cpu) {
+  uint16_t pc = cpu->PC;
+  uint8_t opcode = CPU_bus_read(cpu, pc, DEBUG_EXEC);
+  // a breakpoint stops before the instruction, ending the run there
+  if (cpu->run_end <= cpu->cycle_count && DEBUG_paused(cpu))
+    return;
+  if (cpu->trace)
+    TRACE_record(cpu);
+  cpu->PC = pc + 1;
+  CPU_handle(cpu, opcode);
   // 4 is an average cycle time
-  CPU_update_timer(cpu, 4);
+  CPU_timer(cpu, 4);
+  cpu->cycle_count += 4;
 };
 
-void CPU_run(CPU *cpu, int cycles) {
-  for (int i = 0; i < cycles / 4; i++) {
-    // handle interrupts if IME is set and if interrupt is pending
-    if (cpu->IME && (cpu->if_reg & cpu->ie_reg)) {
-      for (int j = 0; j < 5; j++) {
-        if ((cpu->if_reg & (1 << j)) && (cpu->ie_reg & (1 << j))) {
-          // printf("if_reg, ie_reg, i: %08b, %08b, %d\n", cpu->if_reg,
-          //        cpu->ie_reg, j);
-          cpu->IME = 0;
-          cpu->if_reg &= ~(1 << j);
-
-          // push return address
-          CPU_write_memory(cpu, --cpu->SP, (cpu->PC >> 8) & 0xFF);
-          CPU_write_memory(cpu, --cpu->SP, cpu->PC & 0xFF);
-          cpu->PC = 0x40 + j * 8; // jump to ISR
-          cpu->halted = 0;
-          break;
-        }
+OpcodeHandler CPU_opcode_handler(uint8_t opcode) { return opcodeTable[opcode]; }
+
+// the handlers before any hook, NULL for opcodes never hooked
+static OpcodeHandler opcodeOriginal[256];
+static uint8_t opcodeHooked[256];
+
+// swaps in a handler for an opcode and returns the one it replaced
+OpcodeHandler CPU_hook_opcode(uint8_t opcode, OpcodeHandler handler) {
+  OpcodeHandler previous = opcodeTable[opcode];
+  if (!opcodeOriginal[opcode])
+    opcodeOriginal[opcode] = previous;
+  opcodeTable[opcode] = handler;
+  opcodeHooked[opcode] = handler != opcodeOriginal[opcode];
+  return previous;
+}
+
+const uint8_t *CPU_opcode_hooks(void) { return opcodeHooked; }
+
+// takes a pending interrupt, then runs one instruction or 4 cycles of halt
+static inline void CPU_tick(CPU *cpu) {
+  // handle interrupts if IME is set and if interrupt is pending
+  if (cpu->IME && (cpu->if_reg & cpu->ie_reg)) {
+    for (int j = 0; j < 5; j++) {
+      if ((cpu->if_reg & (1 << j)) && (cpu->ie_reg & (1 << j))) {
+        // printf("if_reg, ie_reg, i: %08b, %08b, %d\n", cpu->if_reg,
+        //        cpu->ie_reg, j);
+        cpu->IME = 0;
+        cpu->if_reg &= ~(1 << j);
+
+        // push return address
+        CPU_write_memory(cpu, --cpu->SP, (cpu->PC >> 8) & 0xFF);
+        CPU_write_memory(cpu, --cpu->SP, cpu->PC & 0xFF);
+        cpu->PC = 0x40 + j * 8; // jump to ISR
+        cpu->halted = 0;
+        PROFILE_INTERRUPT(cpu, j);
+        break;
       }
     }
-    // printf("pc: %04X\n", cpu->PC);
-    // CPU_display(cpu);
-    if (!cpu->halted) {
-      CPU_instruction(cpu);
+  }
+  if (!cpu->halted) {
+    CPU_instruction(cpu);
+  } else {
+    cpu->cycle_count += 4;
+    PROFILE_HALTED(cpu, 4);
+  }
+}
+
+// runs instructions up to cpu->run_end, which an instruction may move closer
+static void CPU_run_until(CPU *cpu) {
+  if (cpu->aot) {
+    // the compiled code as far as it goes, the interpreter for the rest
+    while (cpu->cycle_count < cpu->run_end) {
+      if (!AOT_run(cpu))
+        CPU_tick(cpu);
+    }
+    return;
+  }
+  while (cpu->cycle_count < cpu->run_end)
+    CPU_tick(cpu);
+}
+
+// scheduled events that are due
+static void CPU_events(CPU *cpu) {
+  // OAM DMA done, the bus is free again
+  if ((cpu->bus_lock & BUS_DMA) && cpu->cycle_count >= cpu->dma_end)
+    CPU_bus_lock(cpu, cpu->bus_lock & ~BUS_DMA);
+}
+
+// a single step for callers keeping time themselves, such as the PPU
+void CPU_step(CPU *cpu) {
+  cpu->run_end = cpu->cycle_count + 4;
+  CPU_tick(cpu);
+  CPU_events(cpu);
+}
+
+// a deadline rather than a count so idle loop skipping can move time on
+static void CPU_run_to(CPU *cpu, uint64_t end) {
+  while (cpu->cycle_count < end && !DEBUG_paused(cpu)) {
+    // events inside the run cut it short
+    cpu->run_end = end;
+    if ((cpu->bus_lock & BUS_DMA) && cpu->dma_end < end)
+      cpu->run_end = cpu->dma_end;
+    CPU_run_until(cpu);
+    CPU_events(cpu);
+  }
+}
+
+void CPU_run(CPU *cpu, int cycles) {
+  CPU_run_to(cpu, cpu->cycle_count + cycles / 4 * 4);
+}
+
+// one frame of 154 scanlines, batches > 1 runs every line that many times;
+// a frame the debugger stopped goes on from the run it stopped in
+void CPU_frame(CPU *cpu, int batches) {
+  if (cpu->ppu) {
+    PPU_frame(cpu, batches);
+    if (!DEBUG_paused(cpu))
+      APU_sync(cpu);
+    return;
+  }
+  if (DEBUG_paused(cpu))
+    return;
+
+  // modes 2, 3 and 0 for each pass of the visible lines, then vblank
+  int visible = 144 * batches * 3, runs = visible + 10 * batches;
+  int run = 0;
+  uint64_t end = cpu->cycle_count;
+  if (cpu->frame_run) {
+    run = cpu->frame_run;
+    cpu->frame_run = 0;
+    end += cpu->frame_left;
+    CPU_run_to(cpu, end);
+  }
+  for (; run < runs && !DEBUG_paused(cpu); run++) {
+    if (run < visible) {
+      int pass = run / 3 % batches;
+      cpu->ly = run / 3 / batches;
+      switch (run % 3) {
+      case 0:
+        // mode 2, oam
+        CPU_check_stat_interrupt(cpu, 2);
+        end = cpu->cycle_count + 80;
+        break;
+      case 1:
+        // mode 3, lcd, the line renderer draws the last pass of the line
+        CPU_check_stat_interrupt(cpu, 3);
+        if (cpu->lines && pass == batches - 1)
+          LINES_capture(cpu, cpu->ly);
+        end = cpu->cycle_count + 172;
+        break;
+      default:
+        // mode 0, hblank
+        CPU_check_stat_interrupt(cpu, 0);
+        end = cpu->cycle_count + 204;
+        break;
+      }
+    } else {
+      // mode 1, vblank
+      cpu->ly = 144 + (run - visible) / batches;
+      CPU_check_stat_interrupt(cpu, 1);
+      if (cpu->ly == 144) {
+        // request vblank interrupt
+        cpu->if_reg |= 0x01;
+      }
+      end = cpu->cycle_count + 456;
     }
+    CPU_run_to(cpu, end);
   }
+  if (DEBUG_paused(cpu)) {
+    // the debugger stopped it, the next call finishes the frame
+    cpu->frame_run = run;
+    cpu->frame_left =
+        end > cpu->cycle_count ? (int)(end - cpu->cycle_count) : 0;
+    return;
+  }
+
+  // the sound of the frame, in one batch
+  APU_sync(cpu);
 }
@@ -1,10 +1,41 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include "apu.h"
 #include "cartridge.h" // Needed for Cartridge*
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#define BUS_DMA 0x01  // OAM DMA, only the FFxx page is reachable
+#define BUS_OAM 0x02  // PPU modes 2 and 3
+#define BUS_VRAM 0x04 // PPU mode 3
+// in bus_pages, the page is locked; the low bits are the DEBUG_* accesses
+// watched on it
+#define BUS_LOCKED 0x80
+
+typedef struct Trace Trace;
+typedef struct Idle Idle;
+typedef struct Ppu Ppu;
+typedef struct Lines Lines;
+typedef struct Input Input;
+typedef struct Fork Fork;
+typedef struct Debug Debug;
+typedef struct Aot Aot;
+
+// _memory holds what the CPU answers for, each region the size it is on
+// the hardware; the cartridge answers for 0x0000-0x7FFF and 0xA000-0xBFFF
+#define MEM_VRAM 0x0000 // 8000-9FFF
+#define MEM_WRAM 0x2000 // C000-DFFF, E000-FDFF echoes it
+#define MEM_OAM 0x4000  // FE00-FEFF, OAM and the unusable area after it
+#define MEM_HIGH 0x4100 // FF00-FFFF, the IO registers kept as bytes, HRAM
+#define MEM_SIZE 0x4200
+
+// CPU_new aligns a CPU to a cache line, and so must arenas of them
+#define CPU_ALIGN 64
+
 typedef struct CPU {
+  // what every instruction touches, together on the first cache line
   // Registers
   union {
     struct {
@@ -31,16 +62,42 @@ typedef struct CPU {
     uint16_t AF;
   };
   uint16_t SP, PC;
+  uint8_t IME;
+  uint8_t pending_IME;
+  uint8_t halted;
+
+  // interrupt registers
+  uint8_t if_reg;
+  uint8_t ie_reg;
+
+  // Timer registers
+  uint8_t divr; // 0xFF04 – Divider (increments every 256 cycles)
+  uint8_t tima; // 0xFF05 – Timer counter
+  uint8_t tma;  // 0xFF06 – Timer modulo (reload value)
+  uint8_t tac;  // 0xFF07 – Timer control
+
+  int div_counter;  // cycles towards the next DIV increment
+  int tima_counter; // cycles towards the next TIMA increment
+
+  uint64_t cycle_count;
+  uint64_t run_end; // cycle_count the current CPU_run stops at
+
+  // Cartridge
+  Cartridge *cart;
+
+  // execution trace, NULL when off
+  Trace *trace;
+
+  // per 256 byte page, whether the bus takes its slow path, which is the
+  // only check on the normal one: BUS_LOCKED or watched
+  uint8_t bus_pages[256];
 
   // Memory mapped IO
 
-  // interrupt registers
   uint8_t ly; // current scan line
   uint8_t direction_state;
   uint8_t button_state;
   uint8_t joyp;
-  uint8_t if_reg;
-  uint8_t ie_reg;
 
   // display registers
   uint8_t lcdc; // 0xFF40 – LCD control
@@ -51,38 +108,132 @@ typedef struct CPU {
   uint8_t bgp;  // 0xFF47 – BG palette data
   uint8_t obp0; // 0xFF48 – OBJ palette 0 data
   uint8_t obp1; // 0xFF49 – OBJ palette 1 data
-
-  // Timer registers
-  uint8_t divr; // 0xFF04 – Divider (increments every 256 cycles)
-  uint8_t tima; // 0xFF05 – Timer counter
-  uint8_t tma;  // 0xFF06 – Timer modulo (reload value)
-  uint8_t tac;  // 0xFF07 – Timer control
+  // a write changed VRAM, OAM or one of the registers above, the frontend
+  // clears it once it has drawn the frame
+  bool screen_dirty;
+  // the same for VRAM and OAM alone, the line renderer clears it when it
+  // copies them
+  bool vram_dirty;
 
   // LCD status registers
   uint8_t stat; // 0xFF41 – LCD STAT
   uint8_t lyc;  // 0xFF45 – LYC compare value
 
-  // Memory
-  uint8_t _memory[65536];
+  // parts of the bus the CPU cannot reach, OAM DMA lasts until dma_end
+  uint8_t bus_lock; // BUS_*
+  uint64_t dma_end;
 
-  // Other
-  uint8_t IME;
-  uint8_t pending_IME;
-  uint64_t cycle_count;
-  uint8_t halted;
+  // Sound, the registers themselves are in _memory
+  Apu apu;
 
-  // Cartridge
-  Cartridge *cart;
+  // Memory, MEM_* regions
+  uint8_t _memory[MEM_SIZE];
+  // a byte per 256 byte page of _memory, set when the page was written
+  // since the last fork (state.h); the FFxx page is never tracked
+  uint8_t written[MEM_SIZE / 256];
+
+  // dot accurate PPU, NULL for the fast scanline timing and frame renderer
+  Ppu *ppu;
+
+  // fast timings drawn line by line (lines.h), NULL for the frame renderer
+  Lines *lines;
+
+  // where the samples go, NULL when muted or headless
+  ApuOutput *audio;
+
+  // breakpoints and watchpoints, NULL when none is set
+  Debug *debug;
+  // where a CPU_frame the debugger stopped picks up: the run after the one
+  // it stopped in, 0 for none, and the cycles left in that one
+  int frame_run;
+  int frame_left;
+
+  // Idle loop skipping, NULL when off
+  Idle *idle;
+
+  // late joypad latching at JOYP reads, NULL when the frontend sets
+  // direction_state and button_state itself
+  Input *input;
+
+  // the fork _memory matches but for the written pages, NULL for none
+  Fork *fork;
+
+  // the ROM compiled ahead of time (aot.h), NULL to interpret everything
+  Aot *aot;
 } CPU;
 
+// where an address the CPU answers for is in _memory
+static inline uint16_t CPU_mem(uint16_t addr) {
+  // selects rather than branches, the bus does this for every RAM access
+  uint16_t offset = addr & 0x1FFF;
+  offset += addr >= 0xC000 ? MEM_WRAM : MEM_VRAM;
+  return addr >= 0xFE00 ? MEM_OAM + (addr & 0x1FF) : offset;
+}
+
+// DIV and TIMA over cycles, inline for the compiled code (aot.h) as well
+static inline void CPU_timer(CPU *cpu, int cycles_elapsed) {
+  // --- DIV logic ---
+  cpu->div_counter += cycles_elapsed;
+  while (cpu->div_counter >= 256) {
+    cpu->div_counter -= 256;
+    cpu->divr++;
+  }
+
+  // --- TIMA logic ---
+  if (!(cpu->tac & 0x04))
+    return; // timer disabled
+
+  static const int thresholds[4] = {1024, 16, 64, 256};
+  int threshold = thresholds[cpu->tac & 0x03];
+  cpu->tima_counter += cycles_elapsed;
+  while (cpu->tima_counter >= threshold) {
+    cpu->tima_counter -= threshold;
+
+    if (cpu->tima == 0xFF) {
+      cpu->tima = cpu->tma;
+      cpu->if_reg |= 0x04; // timer interrupt
+    } else {
+      cpu->tima++;
+    }
+  }
+}
+
 // Interface
+typedef void (*OpcodeHandler)(CPU *, uint8_t opcode);
+
 CPU *CPU_new();
+// a CPU in memory the caller owns, CPU_size() bytes aligned to CPU_ALIGN,
+// for arenas of many; freed with that memory
+CPU *CPU_init(void *memory);
+size_t CPU_size(void);
 void CPU_run(CPU *cpu, int);
+void CPU_frame(CPU *cpu, int batches);
+void CPU_step(CPU *cpu);
 uint8_t *CPU_memory(CPU *cpu);
 uint8_t CPU_read_memory(CPU *cpu, uint16_t address);
 void CPU_write_memory(CPU *cpu, uint16_t addr, uint8_t val);
 uint8_t *CPU_io_pointer(CPU *cpu, uint16_t address);
+// length bytes from address on as the bus sees them, without side effects:
+// the cartridge through its banks, the rest straight from _memory (the IO
+// registers kept in CPU fields are not there); address + length stays
+// within 0x10000
+void CPU_gather(CPU *cpu, uint16_t address, uint32_t length, uint8_t *out);
 void CPU_check_stat_interrupt(CPU *cpu, uint8_t mode);
+void CPU_update_timer(CPU *cpu, int cycles_elapsed);
+// runs the handler for an opcode already fetched, hooks and all, with PC
+// past the opcode
+void CPU_execute(CPU *cpu, uint8_t opcode);
+// direction_state in the low nibble and button_state in the high one (0 is
+// pressed), a press raises the joypad interrupt
+void CPU_joypad(CPU *cpu, uint8_t joypad);
+// sets bus_lock, and bus_pages with it
+void CPU_bus_lock(CPU *cpu, uint8_t lock);
+// bus_pages over again, after bus_lock or the watchpoints changed
+void CPU_bus_update(CPU *cpu);
 void CPU_display(CPU *cpu);
+OpcodeHandler CPU_opcode_handler(uint8_t opcode);
+OpcodeHandler CPU_hook_opcode(uint8_t opcode, OpcodeHandler handler);
+// a byte per opcode, set while a hook stands in for its handler
+const uint8_t *CPU_opcode_hooks(void);
 
 #endif // CPU_H
@@ -0,0 +1,130 @@
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the maps the bus looks at, out of the watches
+static void DEBUG_map(Debug *debug) {
+  memset(debug->pages, 0, sizeof(debug->pages));
+  memset(debug->access, 0, sizeof(debug->access));
+  for (int i = 0; i < DEBUG_WATCHES; i++) {
+    DebugWatch *w = &debug->watches[i];
+    if (!w->access)
+      continue;
+    for (uint32_t a = w->first; a <= w->last; a++) {
+      debug->access[a] |= w->access;
+      debug->pages[a >> 8] |= w->access;
+    }
+  }
+}
+
+// frees the Debug once nothing needs it: no watch, no hook running (one
+// removing its own watch is still reading them) and no stop to take
+static void DEBUG_done(CPU *cpu) {
+  Debug *debug = cpu->debug;
+  if (debug->inside || debug->stopped)
+    return;
+  for (int i = 0; i < DEBUG_WATCHES; i++) {
+    if (debug->watches[i].access)
+      return;
+  }
+  DEBUG_stop(cpu);
+}
+
+int DEBUG_watch(CPU *cpu, uint16_t first, uint16_t last, uint8_t access,
+                DebugHook hook, void *arg) {
+  access &= DEBUG_READ | DEBUG_WRITE | DEBUG_EXEC;
+  if (!access || last < first)
+    return -1;
+  if (!cpu->debug && !(cpu->debug = calloc(1, sizeof(Debug))))
+    return -1;
+  Debug *debug = cpu->debug;
+  for (int i = 0; i < DEBUG_WATCHES; i++) {
+    DebugWatch *w = &debug->watches[i];
+    if (w->access)
+      continue;
+    *w = (DebugWatch){first, last, access, hook, arg};
+    DEBUG_map(debug);
+    CPU_bus_update(cpu);
+    return i;
+  }
+  return -1;
+}
+
+int DEBUG_break(CPU *cpu, uint16_t pc) {
+  return DEBUG_watch(cpu, pc, pc, DEBUG_EXEC, NULL, NULL);
+}
+
+void DEBUG_unwatch(CPU *cpu, int id) {
+  Debug *debug = cpu->debug;
+  if (!debug || id < 0 || id >= DEBUG_WATCHES)
+    return;
+  debug->watches[id].access = 0;
+  DEBUG_map(debug);
+  CPU_bus_update(cpu);
+  DEBUG_done(cpu);
+}
+
+void DEBUG_stop(CPU *cpu) {
+  free(cpu->debug);
+  cpu->debug = NULL;
+  CPU_bus_update(cpu);
+}
+
+bool DEBUG_stopped(CPU *cpu) {
+  if (!cpu->debug || !cpu->debug->stopped)
+    return false;
+  cpu->debug->stopped = false;
+  DEBUG_done(cpu);
+  return true;
+}
+
+static bool DEBUG_print(CPU *cpu, uint16_t address, uint8_t access,
+                        uint8_t value) {
+  if (access == DEBUG_EXEC)
+    printf("break at %04X:", address);
+  else if (access == DEBUG_WRITE)
+    printf("write %02X to %04X, PC %04X:", value, address, cpu->PC);
+  else
+    printf("read from %04X, PC %04X:", address, cpu->PC);
+  printf(" AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X LY=%d cycle %llu\n",
+         cpu->AF, cpu->BC, cpu->DE, cpu->HL, cpu->SP, cpu->ly,
+         (unsigned long long)cpu->cycle_count);
+  return true;
+}
+
+void DEBUG_access(CPU *cpu, uint16_t address, uint8_t access, uint8_t value) {
+  Debug *debug = cpu->debug;
+  if (debug->inside || !(debug->access[address] & access))
+    return;
+  if (access == DEBUG_EXEC && debug->held) {
+    // the instruction stopped at, now running
+    debug->held = false;
+    if (address == debug->held_pc && cpu->cycle_count == debug->held_cycle)
+      return;
+  }
+  debug->inside = true;
+  bool stop = false;
+  for (int i = 0; i < DEBUG_WATCHES; i++) {
+    DebugWatch *w = &debug->watches[i];
+    if (!(w->access & access) || address < w->first || address > w->last)
+      continue;
+    if (w->hook)
+      stop |= w->hook(cpu, address, access, value, w->arg);
+    else
+      stop |= DEBUG_print(cpu, address, access, value);
+  }
+  debug->inside = false;
+  if (!stop) {
+    DEBUG_done(cpu);
+    return;
+  }
+  // the run ends with this instruction, or before it for a fetch
+  debug->stopped = true;
+  cpu->run_end = cpu->cycle_count;
+  if (access == DEBUG_EXEC) {
+    debug->held = true;
+    debug->held_pc = address;
+    debug->held_cycle = cpu->cycle_count;
+  }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Breakpoints, watchpoints and access hooks. The bus does not check for
+// them on its normal path: a 256 byte page with something set on it is
+// marked in bus_pages, the same as a page OAM DMA or the PPU locks, and
+// only accesses to it take the slow path. Instruction fetches are told
+// apart from reads, so a breakpoint is a watch on the opcode fetch.
+//
+// A stop ends the run there: a fetch stops before its instruction, a read
+// or write at the end of the instruction making it. CPU_run and CPU_frame
+// return at once while stopped, and the next CPU_frame after DEBUG_stopped
+// goes on with the rest of the frame.
+//
+// Iterations of idle loops that are skipped do not read anything, run with
+// --no-idle to see every read of a polled address.
+
+#define DEBUG_READ 0x01
+#define DEBUG_WRITE 0x02
+#define DEBUG_EXEC 0x04 // the opcode fetch of an instruction
+#define DEBUG_WATCHES 64
+
+// called as the access happens, before it, with value the byte being
+// written (0 for reads and fetches); returning true stops the emulation
+typedef bool (*DebugHook)(CPU *cpu, uint16_t address, uint8_t access,
+                          uint8_t value, void *arg);
+
+typedef struct {
+  uint16_t first, last;
+  uint8_t access; // DEBUG_*, 0 for a free slot
+  DebugHook hook; // NULL prints the access and stops
+  void *arg;
+} DebugWatch;
+
+struct Debug {
+  uint8_t pages[256];    // the accesses watched on each page, for the bus
+  uint8_t access[65536]; // the same for each address
+  DebugWatch watches[DEBUG_WATCHES];
+  bool inside; // in a hook, whose own accesses are not watched
+  bool stopped;
+  // the fetch a stop was at, which does not stop again when carrying on
+  bool held;
+  uint16_t held_pc;
+  uint64_t held_cycle;
+};
+
+// the first watch starts debugging, with nothing set it costs nothing;
+// returns the watch's id or -1 when all DEBUG_WATCHES are taken
+int DEBUG_watch(CPU *cpu, uint16_t first, uint16_t last, uint8_t access,
+                DebugHook hook, void *arg);
+// stops at an instruction, printing the registers
+int DEBUG_break(CPU *cpu, uint16_t pc);
+// the last watch gone ends debugging, once a stop it made is taken and
+// no hook is running; a hook may remove its own watch
+void DEBUG_unwatch(CPU *cpu, int id);
+void DEBUG_stop(CPU *cpu);
+// whether a hook asked to stop since the last call, which carries on
+bool DEBUG_stopped(CPU *cpu);
+// whether the emulation is stopped, leaving it so
+static inline bool DEBUG_paused(const CPU *cpu) {
+  return cpu->debug && cpu->debug->stopped;
+}
+// the slow path of the bus, an access to a page with something set
+void DEBUG_access(CPU *cpu, uint16_t address, uint8_t access, uint8_t value);
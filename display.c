@@ -1,265 +1,547 @@
+#include "aot.h"
+#include "apu.h"
 #include "cartridge.h"
 #include "cpu.h"
+#include "debug.h"
+#include "idle.h"
+#include "input.h"
+#include "lines.h"
+#include "movie.h"
+#include "perf.h"
+#include "ppu.h"
+#include "profiler.h"
+#include "render.h"
+#include "resume.h"
+#include "runahead.h"
+#include "scale.h"
+#include "state.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "video.h"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_events.h>
 #include <stdbool.h>
+#include <string.h>
 
-#define DISPLAY_WIDTH 160
-#define DISPLAY_HEIGHT 144
 #define DISPLAY_SCALE 5
-
-#define BUTTON_RIGHT 0x01
-#define BUTTON_LEFT 0x02
-#define BUTTON_UP 0x04
-#define BUTTON_DOWN 0x08
-#define BUTTON_A 0x01
-#define BUTTON_B 0x02
-#define BUTTON_SELECT 0x04
-#define BUTTON_START 0x08
-
-static uint32_t colors[4] = {
-    [0] = 0xFFFFFFFF,
-    [1] = 0xFF404040,
-    [2] = 0xFFBFBFBF,
-    [3] = 0xFF000000,
-};
-
-// Helper function to get tile address based on LCDC register
-uint8_t *get_tile_address(uint8_t tile_index, uint8_t lcdc, uint8_t *vram) {
-  // LCDC bit 4 controls which tile data table to use
-  if (lcdc & 0x10) {
-    // Use 0x8000-0x8FFF, tile index is unsigned (0-255)
-    return vram + tile_index * 16;
-  } else {
-    // Use 0x8800-0x97FF, tile index is signed (-128 to 127)
-    return vram + 0x1000 + ((int8_t)tile_index) * 16;
+#define DISPLAY_FRAME_NS 16742706 // 70224 cycles at 4194304 Hz
+#define DISPLAY_AUDIO_RATE 48000
+#define DISPLAY_AUDIO_SAMPLES 512 // per callback, about 11ms
+
+// bits of the joypad byte, directions low and buttons high
+#define BUTTON_RIGHT 0
+#define BUTTON_LEFT 1
+#define BUTTON_UP 2
+#define BUTTON_DOWN 3
+#define BUTTON_A 4
+#define BUTTON_B 5
+#define BUTTON_SELECT 6
+#define BUTTON_START 7
+
+// --break addr or --watch first[-last][:rw], hex
+static bool DISPLAY_watch_arg(const char *arg, bool at, DebugWatch *w) {
+  char *end;
+  w->first = w->last = strtol(arg, &end, 16);
+  w->access = at ? DEBUG_EXEC : DEBUG_READ | DEBUG_WRITE;
+  if (end == arg || at)
+    return end != arg && !*end;
+  if (*end == '-')
+    w->last = strtol(end + 1, &end, 16);
+  if (*end == ':') {
+    w->access = 0;
+    for (end++; *end == 'r' || *end == 'w'; end++)
+      w->access |= *end == 'r' ? DEBUG_READ : DEBUG_WRITE;
   }
+  return !*end && w->access && w->last >= w->first;
 }
 
-void DISPLAY_plot_tile(uint8_t *tile, int x, int y, uint32_t *pixels,
-                       uint8_t palette) {
-  for (int row = 0; row < 8; row++) {
-    uint8_t b0 = *tile++;
-    uint8_t b1 = *tile++;
-    for (int col = 0; col < 8; col++) {
-      uint8_t X = x + col;
-      uint8_t Y = y + row;
-      if (X >= DISPLAY_WIDTH || Y >= DISPLAY_HEIGHT) {
-        continue;
-      }
-      uint8_t colorindex = ((b0 & 0x80) >> 7) | ((b1 & 0x80) >> 6);
-      // Apply palette mapping
-      colorindex = (palette >> (colorindex * 2)) & 0x03;
-      uint32_t color = colors[colorindex];
-      pixels[Y * DISPLAY_WIDTH + X] = color;
-      b0 <<= 1;
-      b1 <<= 1;
-    }
+// --telemetry-ram first[-last], hex
+static bool DISPLAY_range_arg(const char *arg, TelemetryRange *r) {
+  char *end;
+  long first = strtol(arg, &end, 16), last = first;
+  if (end == arg)
+    return false;
+  if (*end == '-')
+    last = strtol(end + 1, &end, 16);
+  r->address = first;
+  r->length = last - first + 1;
+  return !*end && first >= 0 && last >= first && last <= 0xFFFF &&
+         last - first < 0xFFFF;
+}
+
+// called for every event as SDL pumps them, the joypad keys go straight
+// into the input queue stamped with the time SDL got them
+static int DISPLAY_watch(void *userdata, SDL_Event *event) {
+  if (event->type != SDL_KEYDOWN && event->type != SDL_KEYUP)
+    return 1;
+  int button;
+  switch (event->key.keysym.sym) {
+  case SDLK_w:
+    button = BUTTON_UP;
+    break;
+  case SDLK_s:
+    button = BUTTON_DOWN;
+    break;
+  case SDLK_a:
+    button = BUTTON_LEFT;
+    break;
+  case SDLK_d:
+    button = BUTTON_RIGHT;
+    break;
+  case SDLK_k:
+    button = BUTTON_A;
+    break;
+  case SDLK_j:
+    button = BUTTON_B;
+    break;
+  case SDLK_l:
+    button = BUTTON_SELECT;
+    break;
+  case SDLK_SEMICOLON:
+    button = BUTTON_START;
+    break;
+  default:
+    return 1;
   }
+  uint64_t now = PERF_now();
+  Uint32 age = SDL_GetTicks() - event->key.timestamp;
+  if (age < 1000 && (uint64_t)age * 1000000 < now)
+    now -= (uint64_t)age * 1000000;
+  INPUT_key(userdata, button, event->type == SDL_KEYDOWN, now);
+  return 1;
 }
 
-void DISPLAY_plot_sprite(uint8_t *tile, int x, int y, uint32_t *pixels,
-                         uint8_t attributes, uint8_t palette) {
-  bool xflip = attributes & 0x20;
-  bool yflip = attributes & 0x40;
-  bool priority = !(attributes & 0x80); // 0 means above background
+// runs in the middle of a frame, from a JOYP read
+static void DISPLAY_pump(void *arg) {
+  (void)arg;
+  SDL_PumpEvents();
+}
 
-  for (int row = 0; row < 8; row++) {
-    int actual_row = yflip ? 7 - row : row;
-    uint8_t b0 = tile[actual_row * 2];
-    uint8_t b1 = tile[actual_row * 2 + 1];
+// runs on SDL's audio thread, never touches the CPU
+static void DISPLAY_audio(void *userdata, Uint8 *stream, int len) {
+  APU_pull(userdata, (int16_t *)stream, len / (2 * sizeof(int16_t)));
+}
 
-    for (int col = 0; col < 8; col++) {
-      int actual_col = xflip ? 7 - col : col;
-      uint8_t pixel_x = x + col;
-      uint8_t pixel_y = y + row;
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("syntax: %s rom [options]\n"
+           "  --perf            print frame timings to stderr\n"
+           "  --perf-csv file   log the timings of every frame\n"
+           "  --trace file      trace every instruction from boot\n"
+           "  --state file      start from a save state\n"
+           "  --record file     record an input movie\n"
+           "  --play file       replay an input movie\n"
+           "  --frames n        stop after n frames\n"
+           "  --headless        run without a window, as fast as possible\n"
+           "  --no-idle         execute idle and copy loops one instruction\n"
+           "                    at a time\n"
+           "  --idle-report file  list the idle loops found on exit\n"
+           "  --accuracy mode   fast (default), line (fast timings drawn line\n"
+           "                    by line) or dot, a dot accurate PPU\n"
+           "  --no-render-thread  draw the lines of --accuracy line on the\n"
+           "                    emulation thread\n"
+           "  --scale n         initial window size, 5 by default\n"
+           "  --filter name     scaling filter: nearest (default), scale2x,\n"
+           "                    scale3x, hq2x or lcd\n"
+           "  --scale-threads n threads for the filter, 0 is one per core\n"
+           "  --video file      stream every frame to a file, - for stdout\n"
+           "  --video-format f  y4m (default) or rgb, raw RGB24\n"
+           "  --video-scale n   video size, 1 by default, with --filter\n"
+           "  --palette name    grey (default) or green, G switches\n"
+           "  --mute            no sound, M switches it off and on\n"
+           "  --audio-sync      pace the emulation on the sound card rather\n"
+           "                    than on vsync\n"
+           "  --latency         report the input latency on exit\n"
+           "  --run-ahead n     show n frames ahead of the game, up to 8\n"
+           "  --break addr      stop before the instruction at addr (hex)\n"
+           "  --watch a[-b][:rw]  print reads and writes of a to b and stop\n"
+           "  --sym file        symbols for the profiler (PROFILE=1), the\n"
+           "                    ROM's .sym or .map by default\n"
+           "  --aot dir         run the ROM's code compiled by\n"
+           "                    tools/recompile into dir\n"
+           "  --telemetry name  publish the registers and RAM every frame in\n"
+           "                    shared memory, for tools/telemetry\n"
+           "  --telemetry-ram a[-b]  a range to publish (hex), WRAM and HRAM\n"
+           "                    by default\n"
+           "  --resume dir      start from a snapshot past the intro kept in\n"
+           "                    dir, made on the first run\n"
+           "  --resume-at point where the snapshot is taken: a frame count\n"
+           "                    (60 by default) or pc:addr (hex)\n",
+           argv[0]);
+    exit(1);
+  };
 
-      if (pixel_x >= DISPLAY_WIDTH || pixel_y >= DISPLAY_HEIGHT) {
-        continue;
+  bool perf_report = false;
+  const char *perf_csv = NULL;
+  const char *trace_path = NULL;
+  const char *state_path = NULL;
+  const char *record_path = NULL;
+  const char *play_path = NULL;
+  long frames = -1;
+  bool headless = false;
+  bool idle = true;
+  const char *idle_report = NULL;
+  bool accurate = false;
+  bool lines = false;
+  bool render_thread = true;
+  int scale = DISPLAY_SCALE;
+  ScaleFilter filter = SCALE_NEAREST;
+  int scale_threads = 0;
+  const char *video_path = NULL;
+  VideoFormat video_format = VIDEO_Y4M;
+  int video_scale = 1;
+  bool green = false;
+  bool mute = false;
+  bool audio_sync = false;
+  bool latency = false;
+  int run_ahead = 0;
+  const char *symbol_path = NULL;
+  const char *aot_dir = NULL;
+  const char *telemetry_name = NULL;
+  TelemetryRange telemetry_ranges[TELEMETRY_RANGES];
+  int telemetry_range_count = 0;
+  const char *resume_dir = NULL;
+  ResumePoint resume_point = {RESUME_FRAMES, -1};
+  DebugWatch watches[DEBUG_WATCHES];
+  int watch_count = 0;
+  uint32_t lut[DISPLAY_SHADES];
+  DISPLAY_palette("grey", lut);
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--perf") == 0) {
+      perf_report = true;
+    } else if (strcmp(argv[i], "--perf-csv") == 0 && i + 1 < argc) {
+      perf_csv = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc) {
+      state_path = argv[++i];
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+      play_path = argv[++i];
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--no-idle") == 0) {
+      idle = false;
+    } else if (strcmp(argv[i], "--idle-report") == 0 && i + 1 < argc) {
+      idle_report = argv[++i];
+    } else if (strcmp(argv[i], "--accuracy") == 0 && i + 1 < argc) {
+      const char *mode = argv[++i];
+      if (strcmp(mode, "dot") == 0) {
+        accurate = true;
+      } else if (strcmp(mode, "line") == 0) {
+        lines = true;
+      } else if (strcmp(mode, "fast") != 0) {
+        printf("unknown accuracy %s, use fast, line or dot\n", mode);
+        exit(1);
       }
-
-      uint8_t colorindex = ((b0 >> (7 - actual_col)) & 1) |
-                           (((b1 >> (7 - actual_col)) & 1) << 1);
-      if (colorindex == 0)
-        continue; // Transparent pixel
-
-      // Apply palette mapping
-      colorindex = (palette >> (colorindex * 2)) & 0x03;
-      uint32_t color = colors[colorindex];
-
-      // Only draw if we have priority or the background is white
-      if (priority || pixels[pixel_y * DISPLAY_WIDTH + pixel_x] == colors[0]) {
-        pixels[pixel_y * DISPLAY_WIDTH + pixel_x] = color;
+    } else if (strcmp(argv[i], "--no-render-thread") == 0) {
+      render_thread = false;
+    } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      scale = strtol(argv[++i], NULL, 10);
+      if (scale < 1)
+        scale = 1;
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      if (!SCALE_parse(argv[++i], &filter)) {
+        printf("unknown filter %s\n", argv[i]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--scale-threads") == 0 && i + 1 < argc) {
+      scale_threads = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--video") == 0 && i + 1 < argc) {
+      video_path = argv[++i];
+    } else if (strcmp(argv[i], "--video-format") == 0 && i + 1 < argc) {
+      if (!VIDEO_parse(argv[++i], &video_format)) {
+        printf("unknown video format %s\n", argv[i]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--video-scale") == 0 && i + 1 < argc) {
+      video_scale = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--palette") == 0 && i + 1 < argc) {
+      if (!DISPLAY_palette(argv[++i], lut)) {
+        printf("unknown palette %s\n", argv[i]);
+        exit(1);
+      }
+      green = strcmp(argv[i], "green") == 0;
+    } else if (strcmp(argv[i], "--mute") == 0) {
+      mute = true;
+    } else if (strcmp(argv[i], "--audio-sync") == 0) {
+      audio_sync = true;
+    } else if (strcmp(argv[i], "--latency") == 0) {
+      latency = true;
+    } else if (strcmp(argv[i], "--sym") == 0 && i + 1 < argc) {
+      symbol_path = argv[++i];
+    } else if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc) {
+      aot_dir = argv[++i];
+    } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+      resume_dir = argv[++i];
+    } else if (strcmp(argv[i], "--resume-at") == 0 && i + 1 < argc) {
+      if (!RESUME_parse(argv[++i], &resume_point)) {
+        printf("bad --resume-at %s\n", argv[i]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc) {
+      telemetry_name = argv[++i];
+    } else if (strcmp(argv[i], "--telemetry-ram") == 0 && i + 1 < argc) {
+      if (telemetry_range_count == TELEMETRY_RANGES ||
+          !DISPLAY_range_arg(argv[++i],
+                             &telemetry_ranges[telemetry_range_count])) {
+        printf("bad %s %s\n", argv[i - 1], argv[i]);
+        exit(1);
       }
+      telemetry_range_count++;
+    } else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+      run_ahead = strtol(argv[++i], NULL, 10);
+    } else if ((strcmp(argv[i], "--break") == 0 ||
+                strcmp(argv[i], "--watch") == 0) &&
+               i + 1 < argc) {
+      bool at = argv[i][2] == 'b';
+      if (watch_count == DEBUG_WATCHES ||
+          !DISPLAY_watch_arg(argv[++i], at, &watches[watch_count])) {
+        printf("bad %s %s\n", argv[i - 1], argv[i]);
+        exit(1);
+      }
+      watch_count++;
+    } else {
+      printf("unknown option %s\n", argv[i]);
+      exit(1);
     }
   }
-}
-
-void DISPLAY_gbmemory_to_sdl(uint32_t *pixels, CPU *cpu) {
-  uint8_t *vram = CPU_memory(cpu) + 0x8000;
-
-  // Clear the screen with background color
-  for (int i = 0; i < DISPLAY_WIDTH * DISPLAY_HEIGHT; i++) {
-    pixels[i] = colors[cpu->bgp & 0x03]; // Color 0 from palette
+  if (headless && !play_path && frames < 0) {
+    printf("--headless needs --play or --frames\n");
+    exit(1);
   }
 
-  // Don't render anything if LCD is off
-  if (!(cpu->lcdc & 0x80))
-    return;
-
-  // 1. Render Background if enabled
-  if (cpu->lcdc & 0x01) {
-    // Select background map based on LCDC bit 3
-    const uint8_t *bg_map = vram + (cpu->lcdc & 0x08 ? 0x1C00 : 0x1800);
-
-    for (int y = 0; y < DISPLAY_HEIGHT; y++) {
-      for (int x = 0; x < DISPLAY_WIDTH; x++) {
-        // Calculate position in the 256x256 background map
-        uint8_t bg_x = (x + cpu->scx) & 0xFF;
-        uint8_t bg_y = (y + cpu->scy) & 0xFF;
-
-        // Get tile index from background map
-        uint8_t tile_x = bg_x / 8;
-        uint8_t tile_y = bg_y / 8;
-        uint8_t tile_index = bg_map[tile_y * 32 + tile_x];
-
-        // Get tile data address
-        uint8_t *tile = get_tile_address(tile_index, cpu->lcdc, vram);
-
-        // Plot single pixel from the tile
-        uint8_t tile_pixel_x = bg_x % 8;
-        uint8_t tile_pixel_y = bg_y % 8;
-
-        uint8_t b0 = tile[tile_pixel_y * 2];
-        uint8_t b1 = tile[tile_pixel_y * 2 + 1];
+  // first, so that with stdout nothing else gets into the stream; the
+  // window drops frames rather than slow down, headless runs wait
+  Video *video = NULL;
+  if (video_path && !(video = VIDEO_open(video_path, video_format,
+                                         video_scale, filter, headless))) {
+    printf("Failed to open %s\n", video_path);
+    return 1;
+  }
 
-        uint8_t colorindex = ((b0 >> (7 - tile_pixel_x)) & 1) |
-                             (((b1 >> (7 - tile_pixel_x)) & 1) << 1);
+  CPU *cpu = CPU_new();
 
-        // Apply palette mapping
-        colorindex = (cpu->bgp >> (colorindex * 2)) & 0x03;
-        pixels[y * DISPLAY_WIDTH + x] = colors[colorindex];
-      }
+  cpu->cart = cart_load(argv[1]);
+  if (!cpu->cart) {
+    printf("Failed to load ROM\n");
+    return 1;
+  }
+  printf("Loaded %zu bytes of ROM\n", cpu->cart->rom_size);
+  printf("Cartridge type: %02X\n", cpu->cart->rom[0x0147]);
+  if (accurate && !PPU_start(cpu)) {
+    printf("Failed to start the PPU\n");
+    return 1;
+  }
+  if (lines && !LINES_start(cpu, render_thread)) {
+    printf("Failed to start the line renderer\n");
+    return 1;
+  }
+  // without compiled code for this ROM and build the interpreter runs it all
+  if (aot_dir && !(cpu->aot = AOT_load(cpu->cart, aot_dir))) {
+    char path[4096];
+    AOT_path(cpu->cart, aot_dir, path, sizeof(path));
+    printf("No compiled code at %s, interpreting\n", path);
+  }
+  if (state_path && !STATE_load_file(cpu, state_path)) {
+    printf("Failed to load state %s\n", state_path);
+    return 1;
+  }
+  // a state or a movie says where to start already
+  if (resume_dir && !state_path && !play_path) {
+    char path[4096];
+    switch (RESUME_boot(cpu, resume_dir, resume_point, path, sizeof(path))) {
+    case RESUME_LOADED:
+      printf("Resumed from %s\n", path);
+      break;
+    case RESUME_SAVED:
+      printf("Saved %s\n", path);
+      break;
+    case RESUME_UNSAVED:
+      printf("Failed to save %s\n", path);
+      break;
+    case RESUME_FAILED:
+      printf("PC never reached %04X, starting from power on\n",
+             resume_point.pc);
+      break;
     }
   }
 
-  // 2. Render Window if enabled
-  if ((cpu->lcdc & 0x20) && cpu->wx <= 166 && cpu->wy < DISPLAY_HEIGHT) {
-    // Select window map based on LCDC bit 6
-    const uint8_t *win_map = vram + (cpu->lcdc & 0x40 ? 0x1C00 : 0x1800);
-
-    for (int y = 0; y < DISPLAY_HEIGHT - cpu->wy; y++) {
-      if (y + cpu->wy >= DISPLAY_HEIGHT)
-        break;
-
-      for (int x = 0; x < DISPLAY_WIDTH - (cpu->wx - 7); x++) {
-        if (x + cpu->wx - 7 < 0 || x + cpu->wx - 7 >= DISPLAY_WIDTH)
-          continue;
-
-        // Calculate position in the window
-        uint8_t win_x = x;
-        uint8_t win_y = y;
-
-        // Get tile index from window map
-        uint8_t tile_x = win_x / 8;
-        uint8_t tile_y = win_y / 8;
-        uint8_t tile_index = win_map[tile_y * 32 + tile_x];
-
-        // Get tile data address
-        uint8_t *tile = get_tile_address(tile_index, cpu->lcdc, vram);
-
-        // Plot single pixel from the tile
-        uint8_t tile_pixel_x = win_x % 8;
-        uint8_t tile_pixel_y = win_y % 8;
-
-        uint8_t b0 = tile[tile_pixel_y * 2];
-        uint8_t b1 = tile[tile_pixel_y * 2 + 1];
+  // a replay brings its own start state
+  Movie *movie = NULL;
+  if (play_path && !(movie = MOVIE_play(cpu, play_path))) {
+    printf("Failed to load movie %s\n", play_path);
+    return 1;
+  }
+  if (record_path && !play_path &&
+      !(movie = MOVIE_record(cpu, record_path))) {
+    printf("Failed to open %s\n", record_path);
+    return 1;
+  }
 
-        uint8_t colorindex = ((b0 >> (7 - tile_pixel_x)) & 1) |
-                             (((b1 >> (7 - tile_pixel_x)) & 1) << 1);
+  // the joypad is taken in when the game reads it, a movie records or
+  // replays it there
+  if (!(cpu->input = INPUT_new(latency && !headless))) {
+    printf("Failed to start the input queue\n");
+    return 1;
+  }
+  INPUT_movie(cpu->input, movie);
 
-        // Apply palette mapping
-        colorindex = (cpu->bgp >> (colorindex * 2)) & 0x03;
-        pixels[(y + cpu->wy) * DISPLAY_WIDTH + (x + cpu->wx - 7)] =
-            colors[colorindex];
-      }
+  PROFILE_INIT(cpu, argv[1], symbol_path);
+  if (trace_path && !TRACE_start(cpu, trace_path)) {
+    printf("Failed to open %s\n", trace_path);
+    return 1;
+  }
+  if (idle && !IDLE_start(cpu, idle_report)) {
+    printf("Failed to open %s\n", idle_report);
+    return 1;
+  }
+  if (!PERF_init(perf_csv, perf_report)) {
+    printf("Failed to open %s\n", perf_csv);
+    return 1;
+  }
+  for (int i = 0; i < watch_count; i++) {
+    DebugWatch *w = &watches[i];
+    if (DEBUG_watch(cpu, w->first, w->last, w->access, NULL, NULL) < 0) {
+      printf("Failed to set watchpoint %04X\n", w->first);
+      return 1;
     }
   }
+  // WRAM and HRAM unless told otherwise
+  if (telemetry_name && !telemetry_range_count) {
+    telemetry_ranges[0] = (TelemetryRange){0xC000, 0x2000, 0};
+    telemetry_ranges[1] = (TelemetryRange){0xFF80, 0x7F, 0};
+    telemetry_range_count = 2;
+  }
+  Telemetry *telemetry = NULL;
+  if (telemetry_name &&
+      !(telemetry = TELEMETRY_open(telemetry_name, telemetry_ranges,
+                                   telemetry_range_count))) {
+    printf("Failed to create telemetry %s\n", telemetry_name);
+    return 1;
+  }
 
-  // 3. Render Sprites if enabled
-  if (cpu->lcdc & 0x02) {
-    uint8_t sprite_height = (cpu->lcdc & 0x04) ? 16 : 8;
-    uint8_t *oam = cpu->_memory + 0xFE00; // Object Attribute Memory
-
-    // Process sprites in priority order (lower x has higher priority)
-    for (int sprite = 0; sprite < 40; sprite++) {
-      uint8_t y = oam[sprite * 4] - 16;         // Y position
-      uint8_t x = oam[sprite * 4 + 1] - 8;      // X position
-      uint8_t tile_index = oam[sprite * 4 + 2]; // Tile index
-      uint8_t attributes = oam[sprite * 4 + 3]; // Attributes
-
-      // Skip if sprite is off-screen
-      if (y >= DISPLAY_HEIGHT || x >= DISPLAY_WIDTH)
-        continue;
+  // default run speed
+  int batches = 1;
+  long frame = 0;
+  uint8_t screen[DISPLAY_WIDTH * DISPLAY_HEIGHT] = {0};
 
-      // For 8x16 sprites, last bit of tile index is ignored
-      if (sprite_height == 16) {
-        tile_index &= 0xFE;
+  if (headless) {
+    for (; frames < 0 || frame < frames; frame++) {
+      if (movie && !MOVIE_frame(movie, cpu, &batches))
+        break;
+      INPUT_frame(cpu);
+      CPU_frame(cpu, batches);
+      if (telemetry)
+        TELEMETRY_publish(telemetry, cpu, frame + 1);
+      PERF_mark(PERF_CPU);
+      if (video) {
+        // the dot accurate PPU has drawn the frame already, the last one
+        // rendered stands while nothing it is drawn from changes
+        const uint8_t *shown = screen;
+        if (cpu->ppu)
+          shown = PPU_pixels(cpu);
+        else if (cpu->lines)
+          shown = LINES_pixels(cpu);
+        else if (cpu->screen_dirty || frame == 0)
+          DISPLAY_gbmemory_to_sdl(screen, cpu);
+        cpu->screen_dirty = false;
+        VIDEO_frame(video, shown, lut, batches);
+        PERF_mark(PERF_RENDER);
       }
-
-      uint8_t *tile = vram + tile_index * 16;
-      uint8_t palette = (attributes & 0x10) ? cpu->obp1 : cpu->obp0;
-
-      DISPLAY_plot_sprite(tile, x, y, pixels, attributes, palette);
-
-      // For 8x16 sprites, draw the bottom half
-      if (sprite_height == 16) {
-        DISPLAY_plot_sprite(vram + (tile_index + 1) * 16, x, y + 8, pixels,
-                            attributes, palette);
+      PERF_frame(cpu->cycle_count);
+      // a breakpoint ends the run
+      if (DEBUG_stopped(cpu)) {
+        frame++;
+        break;
       }
     }
+    if (movie)
+      MOVIE_close(movie, cpu);
+    VIDEO_close(video);
+    TELEMETRY_close(telemetry);
+    printf("%ld frames, state %016llx\n", frame,
+           (unsigned long long)STATE_hash(cpu));
+    return 0;
   }
-}
-
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("syntax: %s rom\n", argv[0]);
-    exit(1);
-  };
-
-  CPU *cpu = CPU_new();
 
-  cpu->cart = cart_load(argv[1]);
-  if (!cpu->cart) {
-    printf("Failed to load ROM\n");
+  // the frame is scaled on the CPU into a texture of the window's size
+  // (rounded down to a multiple of the screen), so the renderer only copies
+  // it and does not need a GPU
+  Scaler *scaler = SCALE_new(filter, scale_threads);
+  if (!scaler) {
+    printf("Failed to start the scaler\n");
     return 1;
   }
-  printf("Loaded %zu bytes of ROM\n", cpu->cart->rom_size);
-  printf("Cartridge type: %02X\n", cpu->cart->rom[0x0147]);
+  // half a frame for the emulation, the rest for drawing and presenting
+  RunAhead *runahead = NULL;
+  if (run_ahead &&
+      !(runahead = RUNAHEAD_new(run_ahead, DISPLAY_FRAME_NS / 2))) {
+    printf("Failed to start run-ahead of %d frames\n", run_ahead);
+    return 1;
+  }
+  SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+  SDL_AddEventWatch(DISPLAY_watch, cpu->input);
+  INPUT_poll(cpu->input, DISPLAY_pump, NULL);
+
+  // the samples are made at the end of every frame and queued for the
+  // device; without a device the emulator runs as if muted
+  ApuOutput *output = NULL;
+  SDL_AudioDeviceID device = 0;
+  if (!mute) {
+    SDL_AudioSpec want = {0}, have;
+    want.freq = DISPLAY_AUDIO_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples = DISPLAY_AUDIO_SAMPLES;
+    want.callback = DISPLAY_audio;
+    want.userdata = output = APU_output_new(DISPLAY_AUDIO_RATE);
+    if (output)
+      device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if (device) {
+      APU_attach(cpu, output);
+      SDL_PauseAudioDevice(device, 0);
+    } else {
+      printf("no audio: %s\n", SDL_GetError());
+      APU_output_free(output);
+      output = NULL;
+    }
+  }
+  // with the sound card setting the pace about three frames stay queued
+  audio_sync = audio_sync && output;
+  int audio_ahead = DISPLAY_AUDIO_RATE / 20;
 
-  SDL_Init(SDL_INIT_VIDEO);
   SDL_Window *window = SDL_CreateWindow(
       "gameboy emulator", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-      DISPLAY_WIDTH * DISPLAY_SCALE, DISPLAY_HEIGHT * DISPLAY_SCALE, 0);
+      DISPLAY_WIDTH * scale, DISPLAY_HEIGHT * scale, SDL_WINDOW_RESIZABLE);
   SDL_Renderer *renderer = SDL_CreateRenderer(
-      window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-  SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
-                                           SDL_TEXTUREACCESS_STREAMING,
-                                           DISPLAY_WIDTH, DISPLAY_HEIGHT);
-  SDL_Rect dest_rect = {0, 0, DISPLAY_WIDTH * DISPLAY_SCALE,
-                        DISPLAY_HEIGHT * DISPLAY_SCALE};
-  uint32_t *pixels = malloc(DISPLAY_WIDTH * DISPLAY_HEIGHT * sizeof(uint32_t));
-  memset(pixels, 0, DISPLAY_WIDTH * DISPLAY_HEIGHT * sizeof(uint32_t));
-
-  // default run speed
-  int batches = 1;
-  while (1) {
+      window, -1,
+      SDL_RENDERER_ACCELERATED | (audio_sync ? 0 : SDL_RENDERER_PRESENTVSYNC));
+  if (!renderer)
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+  SDL_Texture *texture = NULL;
+  int factor = 0;
+
+  bool overlay = false;
+  // stopped by a breakpoint, until C, N runs one frame
+  bool paused = false, step = false;
+  // the screen needs drawing even if the emulated one did not change
+  bool redraw = true;
+  bool was_dirty = false;
+
+  for (; frames < 0 || frame < frames; frame++) {
+    uint64_t frame_start = PERF_now();
     // handle inputs
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
       if (event.type == SDL_QUIT) {
         exit(0);
       }
+      if (event.type == SDL_WINDOWEVENT)
+        redraw = true;
       if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
         bool pressed = (event.type == SDL_KEYDOWN) ? 0 : 1;
 
@@ -268,40 +550,60 @@ int main(int argc, char **argv) {
           // boost
           batches = pressed ? 1 : 10;
           break;
-        case SDLK_w:
-          cpu->direction_state =
-              (cpu->direction_state & ~BUTTON_UP) | (pressed ? BUTTON_UP : 0);
+        case SDLK_ESCAPE:
+          CPU_display(cpu);
           break;
-        case SDLK_s:
-          cpu->direction_state = (cpu->direction_state & ~BUTTON_DOWN) |
-                                 (pressed ? BUTTON_DOWN : 0);
+        case SDLK_p:
+          if (event.type == SDL_KEYDOWN)
+            PROFILE_DUMP();
           break;
-        case SDLK_a:
-          cpu->direction_state = (cpu->direction_state & ~BUTTON_LEFT) |
-                                 (pressed ? BUTTON_LEFT : 0);
+        case SDLK_t:
+          if (event.type != SDL_KEYDOWN)
+            break;
+          if (cpu->trace)
+            TRACE_stop(cpu);
+          else if (!TRACE_start(cpu, trace_path ? trace_path : "trace.bin"))
+            printf("Failed to start trace\n");
           break;
-        case SDLK_d:
-          cpu->direction_state = (cpu->direction_state & ~BUTTON_RIGHT) |
-                                 (pressed ? BUTTON_RIGHT : 0);
+        case SDLK_F5:
+          if (event.type == SDL_KEYDOWN)
+            printf(STATE_save_file(cpu, "state.bin") ? "state saved\n"
+                                                     : "state not saved\n");
           break;
-        case SDLK_k:
-          cpu->button_state =
-              (cpu->button_state & ~BUTTON_A) | (pressed ? BUTTON_A : 0);
+        case SDLK_F8:
+          // loading would break the movie being recorded or replayed
+          if (event.type == SDL_KEYDOWN && !movie) {
+            printf(STATE_load_file(cpu, "state.bin") ? "state loaded\n"
+                                                     : "state not loaded\n");
+            redraw = true;
+          }
           break;
-        case SDLK_j:
-          cpu->button_state =
-              (cpu->button_state & ~BUTTON_B) | (pressed ? BUTTON_B : 0);
+        case SDLK_o:
+          if (event.type == SDL_KEYDOWN) {
+            overlay = !overlay;
+            redraw = true;
+          }
           break;
-        case SDLK_l:
-          cpu->button_state = (cpu->button_state & ~BUTTON_SELECT) |
-                              (pressed ? BUTTON_SELECT : 0);
+        case SDLK_g:
+          // only a table swap, the frame is shades until the texture
+          if (event.type == SDL_KEYDOWN) {
+            green = !green;
+            DISPLAY_palette(green ? "green" : "grey", lut);
+            redraw = true;
+          }
           break;
-        case SDLK_SEMICOLON:
-          cpu->button_state = (cpu->button_state & ~BUTTON_START) |
-                              (pressed ? BUTTON_START : 0);
+        case SDLK_m:
+          // the registers carry on either way, only the samples stop
+          if (event.type == SDL_KEYDOWN && output)
+            APU_attach(cpu, cpu->audio ? NULL : output);
           break;
-        case SDLK_ESCAPE:
-          CPU_display(cpu);
+        case SDLK_c:
+          if (event.type == SDL_KEYDOWN)
+            paused = false;
+          break;
+        case SDLK_n:
+          if (event.type == SDL_KEYDOWN)
+            step = paused;
           break;
         case SDLK_q:
           exit(0);
@@ -309,44 +611,119 @@ int main(int argc, char **argv) {
         }
       }
     }
-
-    // cpu loop
-    for (int scanline = 0; scanline < 144; scanline++) {
-      cpu->ly = scanline;
-      for (int j = 0; j < batches; j++) {
-        // mode 2, oam
-        CPU_check_stat_interrupt(cpu, 2);
-        CPU_run(cpu, 80);
-
-        // mode 3, lcd
-        CPU_check_stat_interrupt(cpu, 3);
-        CPU_run(cpu, 172);
-
-        // mode 0, hblank
-        CPU_check_stat_interrupt(cpu, 0);
-        CPU_run(cpu, 204);
+    PERF_mark(PERF_EVENTS);
+
+    if (!paused || step) {
+      step = false;
+      if (movie && !MOVIE_frame(movie, cpu, &batches)) {
+        // replay is over, carry on with live input
+        MOVIE_close(movie, cpu);
+        movie = NULL;
+        INPUT_movie(cpu->input, NULL);
       }
+      INPUT_frame(cpu);
+      if (runahead)
+        RUNAHEAD_frame(runahead, cpu, batches, screen);
+      else
+        CPU_frame(cpu, batches);
+      if (telemetry)
+        TELEMETRY_publish(telemetry, cpu, frame + 1);
+      if (DEBUG_stopped(cpu) && !paused) {
+        paused = true;
+        printf("stopped, C continues, N runs one frame\n");
+      }
+    }
+    PERF_mark(PERF_CPU);
+
+    // the device drains the queue at its own clock, the boost runs ahead
+    // of it and loses what does not fit
+    if (audio_sync && batches == 1)
+      while (APU_queued(output) > audio_ahead)
+        SDL_Delay(1);
+
+    int width, height;
+    SDL_GetRendererOutputSize(renderer, &width, &height);
+    if (SCALE_fit(width, height) != factor) {
+      factor = SCALE_fit(width, height);
+      if (texture)
+        SDL_DestroyTexture(texture);
+      texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                  SDL_TEXTUREACCESS_STREAMING,
+                                  DISPLAY_WIDTH * factor,
+                                  DISPLAY_HEIGHT * factor);
+      redraw = true;
     }
 
-    // vblank loop
-    for (int scanline = 144; scanline < 154; scanline++) {
-      cpu->ly = scanline;
-      for (int j = 0; j < batches; j++) {
-        // mode 1, vblank
-        CPU_check_stat_interrupt(cpu, 1);
-        if (cpu->ly == 144) {
-          // request vblank interrupt
-          cpu->if_reg |= 0x01;
-        }
-        CPU_run(cpu, 456);
-      }
+    // nothing the screen is drawn from changed in this frame or the one
+    // before (the dot PPU spreads a change over two), so the window still
+    // shows it: no render, upload or present, and the rest of the frame
+    // is slept instead of waiting for vsync
+    bool dirty = cpu->screen_dirty;
+    cpu->screen_dirty = false;
+    if (!dirty && !was_dirty && !redraw && !overlay) {
+      if (video)
+        VIDEO_frame(video,
+                    runahead     ? screen
+                    : cpu->ppu   ? PPU_pixels(cpu)
+                    : cpu->lines ? LINES_pixels(cpu)
+                                 : screen,
+                    lut, batches);
+      PERF_mark(PERF_RENDER);
+      uint64_t elapsed = PERF_now() - frame_start;
+      if (!audio_sync && elapsed < DISPLAY_FRAME_NS)
+        SDL_Delay((DISPLAY_FRAME_NS - elapsed) / 1000000);
+      PERF_mark(PERF_PRESENT);
+      PERF_frame(cpu->cycle_count);
+      continue;
+    }
+    was_dirty = dirty;
+    redraw = false;
+
+    // draw screen, the dot accurate PPU, the line renderer or the
+    // run-ahead has drawn it already
+    const uint8_t *shown = screen;
+    if (cpu->ppu && !runahead)
+      shown = PPU_pixels(cpu);
+    else if (cpu->lines && !runahead)
+      shown = LINES_pixels(cpu);
+    else if (!runahead)
+      DISPLAY_gbmemory_to_sdl(screen, cpu);
+    if (video)
+      VIDEO_frame(video, shown, lut, batches);
+    if (overlay) {
+      if (shown != screen)
+        memcpy(screen, shown, sizeof(screen));
+      PERF_overlay(screen, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+      shown = screen;
+    }
+
+    void *texels;
+    int pitch;
+    if (SDL_LockTexture(texture, NULL, &texels, &pitch) == 0) {
+      // the palette is applied on the way into the texture
+      SCALE_run(scaler, shown, lut, factor, texels, pitch);
+      SDL_UnlockTexture(texture);
     }
+    PERF_mark(PERF_RENDER);
 
-    // draw screen
-    DISPLAY_gbmemory_to_sdl(pixels, cpu);
-    SDL_UpdateTexture(texture, NULL, pixels, 160 * sizeof(uint32_t));
+    // centered, the borders stay black
+    SDL_Rect dest_rect = {(width - DISPLAY_WIDTH * factor) / 2,
+                          (height - DISPLAY_HEIGHT * factor) / 2,
+                          DISPLAY_WIDTH * factor, DISPLAY_HEIGHT * factor};
+    SDL_RenderClear(renderer);
     SDL_RenderCopy(renderer, texture, NULL, &dest_rect);
     // wait for vsync
     SDL_RenderPresent(renderer);
+    INPUT_presented(cpu->input, PERF_now());
+    PERF_mark(PERF_PRESENT);
+    PERF_frame(cpu->cycle_count);
   }
+  if (movie)
+    MOVIE_close(movie, cpu);
+  VIDEO_close(video);
+  TELEMETRY_close(telemetry);
+  if (device)
+    SDL_CloseAudioDevice(device);
+  APU_output_free(output);
+  return 0;
 };
@@ -0,0 +1,261 @@
+#define _POSIX_C_SOURCE 200809L
+#include "env.h"
+#include "aot.h"
+#include "idle.h"
+#include "perf.h"
+#include "render.h"
+#include "state.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ENV_FRAME_CYCLES 70224
+
+struct EnvBatch {
+  int count;
+  CPU **cpus;
+  Cartridge *cart; // the one loaded, every instance shares its ROM
+  Aot *aot;        // its compiled code, NULL when interpreted
+  // every instance's CPU and cartridge, one after the other in one block
+  uint8_t *arena;
+  Snapshot *start; // what ENV_reset goes back to
+  uint8_t *frames;
+  uint8_t *ram;
+  size_t stride;
+  EnvRange ranges[ENV_MAX_RANGES];
+  int range_count;
+
+  // the pool, the caller is thread 0 and works like the others
+  int threads;
+  pthread_t workers[ENV_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t go, done;
+  uint64_t job; // bumped for every ENV_step
+  int pending;  // workers still busy with the job
+  bool stop;
+
+  // the job, instances are handed out one at a time so a slow one does not
+  // hold up a whole band
+  const uint8_t *inputs;
+  int frames_per_step;
+  _Atomic int next;
+
+  uint64_t steps;
+  uint64_t ns, last_ns;
+  int last_frames;
+};
+
+static void ENV_run(EnvBatch *b, int index) {
+  CPU *cpu = b->cpus[index];
+  CPU_joypad(cpu, b->inputs ? b->inputs[index] : 0xFF);
+  for (int i = 0; i < b->frames_per_step; i++)
+    CPU_frame(cpu, 1);
+  DISPLAY_gbmemory_to_sdl(b->frames + (size_t)index * ENV_FRAME_SIZE, cpu);
+  uint8_t *out = b->ram + b->stride * index;
+  for (int i = 0; i < b->range_count; i++) {
+    CPU_gather(cpu, b->ranges[i].address, b->ranges[i].length, out);
+    out += b->ranges[i].length;
+  }
+}
+
+static void ENV_work(EnvBatch *b) {
+  int i;
+  while ((i = atomic_fetch_add_explicit(&b->next, 1, memory_order_relaxed)) <
+         b->count)
+    ENV_run(b, i);
+}
+
+static void *ENV_worker(void *arg) {
+  EnvBatch *b = arg;
+  uint64_t seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    while (b->job == seen && !b->stop)
+      pthread_cond_wait(&b->go, &b->lock);
+    if (b->stop) {
+      pthread_mutex_unlock(&b->lock);
+      break;
+    }
+    seen = b->job;
+    pthread_mutex_unlock(&b->lock);
+
+    ENV_work(b);
+
+    pthread_mutex_lock(&b->lock);
+    if (--b->pending == 0)
+      pthread_cond_signal(&b->done);
+    pthread_mutex_unlock(&b->lock);
+  }
+  return NULL;
+}
+
+EnvBatch *ENV_new(const char *rom, int count, int threads,
+                  const EnvRange *ranges, int range_count) {
+  if (count < 1 || range_count < 0 || range_count > ENV_MAX_RANGES)
+    return NULL;
+  for (int i = 0; i < range_count; i++) {
+    if (ranges[i].address + ranges[i].length > 0x10000)
+      return NULL;
+  }
+  EnvBatch *b = calloc(1, sizeof(EnvBatch));
+  if (!b)
+    return NULL;
+  b->count = count;
+  memcpy(b->ranges, ranges, range_count * sizeof(EnvRange));
+  b->range_count = range_count;
+  for (int i = 0; i < range_count; i++)
+    b->stride += ranges[i].length;
+
+  b->cart = cart_load(rom);
+  b->cpus = calloc(count, sizeof(CPU *));
+  b->start = malloc(sizeof(Snapshot));
+  b->frames = calloc(count, ENV_FRAME_SIZE);
+  b->ram = calloc(count, b->stride ? b->stride : 1);
+  if (!b->cart || !b->cpus || !b->start || !b->frames || !b->ram) {
+    ENV_free(b);
+    return NULL;
+  }
+  size_t cart_bytes = cart_size(b->cart);
+  size_t instance =
+      CPU_size() + (cart_bytes + CPU_ALIGN - 1) / CPU_ALIGN * CPU_ALIGN;
+  b->arena = aligned_alloc(CPU_ALIGN, instance * count);
+  if (!b->arena) {
+    ENV_free(b);
+    return NULL;
+  }
+  for (int i = 0; i < count; i++) {
+    uint8_t *memory = b->arena + instance * i;
+    CPU *cpu = CPU_init(memory);
+    cpu->cart = cart_share(b->cart, memory + CPU_size());
+    b->cpus[i] = cpu;
+    // the opcode hooks are installed here, before any worker runs
+    if (!IDLE_start(cpu, NULL)) {
+      ENV_free(b);
+      return NULL;
+    }
+  }
+  STATE_snapshot(b->cpus[0], b->start);
+
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > count)
+    threads = count;
+  if (threads < 1)
+    threads = 1;
+  if (threads > ENV_MAX_THREADS)
+    threads = ENV_MAX_THREADS;
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->go, NULL);
+  pthread_cond_init(&b->done, NULL);
+  b->threads = 1;
+  while (b->threads < threads) {
+    if (pthread_create(&b->workers[b->threads], NULL, ENV_worker, b) != 0)
+      break;
+    b->threads++;
+  }
+  return b;
+}
+
+void ENV_free(EnvBatch *b) {
+  if (!b)
+    return;
+  if (b->threads) {
+    pthread_mutex_lock(&b->lock);
+    b->stop = true;
+    pthread_cond_broadcast(&b->go);
+    pthread_mutex_unlock(&b->lock);
+    for (int i = 1; i < b->threads; i++)
+      pthread_join(b->workers[i], NULL);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->go);
+    pthread_cond_destroy(&b->done);
+  }
+  for (int i = 0; b->cpus && i < b->count; i++) {
+    CPU *cpu = b->cpus[i];
+    if (!cpu)
+      continue;
+    IDLE_stop(cpu);
+    STATE_fork_forget(cpu);
+  }
+  free(b->arena); // the CPUs and their cartridges, the ROM is b->cart's
+  cart_free(b->cart);
+  AOT_free(b->aot);
+  free(b->cpus);
+  free(b->start);
+  free(b->frames);
+  free(b->ram);
+  free(b);
+}
+
+void ENV_step(EnvBatch *b, const uint8_t *inputs, int frames) {
+  if (frames < 1)
+    return;
+  uint64_t start = PERF_now();
+  b->inputs = inputs;
+  b->frames_per_step = frames;
+  atomic_store_explicit(&b->next, 0, memory_order_relaxed);
+
+  pthread_mutex_lock(&b->lock);
+  b->job++;
+  b->pending = b->threads - 1;
+  pthread_cond_broadcast(&b->go);
+  pthread_mutex_unlock(&b->lock);
+
+  ENV_work(b);
+
+  pthread_mutex_lock(&b->lock);
+  while (b->pending)
+    pthread_cond_wait(&b->done, &b->lock);
+  pthread_mutex_unlock(&b->lock);
+
+  b->last_ns = PERF_now() - start;
+  b->last_frames = frames;
+  b->ns += b->last_ns;
+  b->steps += (uint64_t)b->count * frames;
+}
+
+const uint8_t *ENV_frames(const EnvBatch *b) { return b->frames; }
+
+const uint8_t *ENV_ram(const EnvBatch *b, size_t *stride) {
+  if (stride)
+    *stride = b->stride;
+  return b->ram;
+}
+
+void ENV_reset(EnvBatch *b, int index) {
+  if (index >= 0 && index < b->count)
+    STATE_restore(b->cpus[index], b->start);
+}
+
+void ENV_mark_start(EnvBatch *b, int index) {
+  if (index >= 0 && index < b->count)
+    STATE_snapshot(b->cpus[index], b->start);
+}
+
+bool ENV_aot(EnvBatch *b, const char *dir) {
+  Aot *aot = AOT_load(b->cart, dir);
+  if (!aot)
+    return false;
+  for (int i = 0; i < b->count; i++)
+    b->cpus[i]->aot = aot;
+  AOT_free(b->aot);
+  b->aot = aot;
+  return true;
+}
+
+CPU *ENV_cpu(EnvBatch *b, int index) {
+  return index >= 0 && index < b->count ? b->cpus[index] : NULL;
+}
+
+void ENV_stats(const EnvBatch *b, EnvStats *stats) {
+  stats->steps = b->steps;
+  stats->seconds = b->ns / 1e9;
+  stats->steps_per_second = 0;
+  if (b->last_ns)
+    stats->steps_per_second =
+        (double)b->count * b->last_frames * 1e9 / b->last_ns;
+  stats->realtime =
+      stats->steps_per_second / ((double)APU_CLOCK / ENV_FRAME_CYCLES);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Batched emulation for automated play: count instances of one ROM, with no
+// window or sound, stepped together on a pool of threads, each with its own
+// input. After a step the frames of every instance lie back to back in one
+// buffer, and so do the RAM ranges picked at creation (WRAM, say), so an
+// agent reads the whole batch in place. The ROM is loaded once and shared.
+//
+//   EnvRange wram = {0xC000, 0x2000};
+//   EnvBatch *b = ENV_new("game.gb", 256, 0, &wram, 1);
+//   ENV_step(b, inputs, 4); // 4 frames each
+//   const uint8_t *frames = ENV_frames(b), *ram = ENV_ram(b, &stride);
+
+#define ENV_MAX_THREADS 64
+#define ENV_MAX_RANGES 8
+#define ENV_FRAME_SIZE (160 * 144) // render.h shades per instance
+
+typedef struct {
+  uint16_t address;
+  uint16_t length; // address + length stays within 0x10000
+} EnvRange;
+
+typedef struct {
+  uint64_t steps;          // instance frames since ENV_new
+  double seconds;          // time spent in ENV_step
+  double steps_per_second; // over the last ENV_step, for the whole batch
+  double realtime;         // the same as a multiple of one Game Boy
+} EnvStats;
+
+typedef struct EnvBatch EnvBatch;
+
+// threads 0 is one per core, the caller is one of them
+EnvBatch *ENV_new(const char *rom, int count, int threads,
+                  const EnvRange *ranges, int range_count);
+void ENV_free(EnvBatch *b);
+// inputs has a byte per instance laid out like a movie's (direction_state
+// in the low nibble, button_state high, 0 is pressed), NULL releases every
+// button; each instance runs frames frames and only the last is rendered
+void ENV_step(EnvBatch *b, const uint8_t *inputs, int frames);
+// count * ENV_FRAME_SIZE shades, valid until the next step
+const uint8_t *ENV_frames(const EnvBatch *b);
+// count * stride bytes, the ranges of each instance one after the other
+const uint8_t *ENV_ram(const EnvBatch *b, size_t *stride);
+// back to the start state, power on unless ENV_mark_start moved it
+void ENV_reset(EnvBatch *b, int index);
+// the current state of instance index becomes the start state of all
+void ENV_mark_start(EnvBatch *b, int index);
+// runs every instance on the ROM's code compiled into dir by
+// tools/recompile (aot.h), false when there is none for this ROM and build
+bool ENV_aot(EnvBatch *b, const char *dir);
+// the instance itself, to load a state into it for instance
+CPU *ENV_cpu(EnvBatch *b, int index);
+void ENV_stats(const EnvBatch *b, EnvStats *stats);
@@ -0,0 +1,652 @@
+#define _POSIX_C_SOURCE 200809L
+#include "idle.h"
+#include "cartridge.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IDLE_LOOPS 1024 // most backward branches kept, a power of two
+#define IDLE_FIRST 16   // table slots at the first loop, doubled at half full
+#define IDLE_BYTES 16   // longest loop body looked at
+#define IDLE_READS 8    // memory reads per loop body
+#define IDLE_CYCLES 4   // CPU_instruction charges 4 cycles for everything
+
+// flags as in cpu.c
+#define F_n 0x40
+#define F_h 0x20
+#define F_c 0x10
+
+// where a read in the loop body gets its address from
+enum { READ_ABS, READ_HL, READ_BC, READ_DE, READ_C };
+
+// where a copy loop gets its bytes: memory at DE or HL, or a register
+enum { COPY_DE, COPY_HL, COPY_A, COPY_D, COPY_E, COPY_ZERO };
+// the counter, BC tested with ld a,b / or c, or B or C with dec
+enum { COUNT_BC, COUNT_B, COUNT_C };
+
+// the copy and fill loops run in bulk, the bytes from the head up to the
+// jr nz or jp nz closing them; all are one byte instructions
+typedef struct {
+  const char *name; // for the report
+  uint8_t body[6];
+  uint8_t length;
+  uint8_t from;  // COPY_*
+  bool to_de;    // the writes go to DE rather than HL
+  uint8_t count; // COUNT_*
+} CopyShape;
+
+static const CopyShape copy_shapes[] = {
+    // ld a,[de] / ld [hli],a / inc de / dec bc / ld a,b / or c
+    {"copy de>hl", {0x1A, 0x22, 0x13, 0x0B, 0x78, 0xB1}, 6, COPY_DE, false,
+     COUNT_BC},
+    // ld a,[hli] / ld [de],a / inc de / dec bc / ld a,b / or c
+    {"copy hl>de", {0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1}, 6, COPY_HL, true,
+     COUNT_BC},
+    // xor a / ld [hli],a / dec bc / ld a,b / or c
+    {"fill 0", {0xAF, 0x22, 0x0B, 0x78, 0xB1}, 5, COPY_ZERO, false, COUNT_BC},
+    // ld a,d / ld [hli],a / dec bc / ld a,b / or c, and the same with e
+    {"fill d", {0x7A, 0x22, 0x0B, 0x78, 0xB1}, 5, COPY_D, false, COUNT_BC},
+    {"fill e", {0x7B, 0x22, 0x0B, 0x78, 0xB1}, 5, COPY_E, false, COUNT_BC},
+    // ld a,[de] / ld [hli],a / inc de / dec b, and with c
+    {"copy de>hl", {0x1A, 0x22, 0x13, 0x05}, 4, COPY_DE, false, COUNT_B},
+    {"copy de>hl", {0x1A, 0x22, 0x13, 0x0D}, 4, COPY_DE, false, COUNT_C},
+    // ld a,[hli] / ld [de],a / inc de / dec b, and with c
+    {"copy hl>de", {0x2A, 0x12, 0x13, 0x05}, 4, COPY_HL, true, COUNT_B},
+    {"copy hl>de", {0x2A, 0x12, 0x13, 0x0D}, 4, COPY_HL, true, COUNT_C},
+    // ld [hli],a / dec b, and with c
+    {"fill a", {0x22, 0x05}, 2, COPY_A, false, COUNT_B},
+    {"fill a", {0x22, 0x0D}, 2, COPY_A, false, COUNT_C},
+};
+
+typedef struct {
+  uint8_t from; // READ_*
+  uint16_t addr;
+} IdleRead;
+
+typedef struct {
+  bool used;
+  bool pure;    // body only reads memory, set once when first seen
+  uint8_t copy; // or it is copy_shapes[copy - 1]
+  uint8_t bank;
+  uint16_t head, branch;
+  uint8_t instructions;
+  uint8_t read_count;
+  IdleRead reads[IDLE_READS];
+
+  // state at the last arrival at the head
+  uint64_t cycle;
+  uint64_t run_end;
+  uint16_t regs[5]; // AF, BC, DE, HL, SP
+  uint8_t divr, tima, if_reg;
+
+  uint64_t iterations;
+  uint64_t skips;
+  uint64_t skipped_cycles;
+} IdleLoop;
+
+struct Idle {
+  // hash table of backward branches, grown as loops are found: every
+  // instance of an env.h batch has one, and a game has a few dozen loops
+  IdleLoop *loops;
+  int size; // slots, a power of two up to IDLE_LOOPS
+  int loop_count;
+  char *report;
+  uint64_t start_cycle;
+};
+
+static OpcodeHandler idle_original[256];
+static const int tima_threshold[4] = {1024, 16, 64, 256};
+
+// the CPU whose report is still to be written at exit
+static CPU *idled;
+
+// a byte of code, read around the bus: its watches and the side effects
+// of FFxx reads are not for the analysis
+static uint8_t IDLE_code(CPU *cpu, uint16_t address) {
+  uint8_t byte;
+  CPU_gather(cpu, address, 1, &byte);
+  return byte;
+}
+
+// checks that the body only touches registers: no writes, no stack, no
+// jumps other than forward exits out of the loop
+static bool IDLE_analyze(CPU *cpu, IdleLoop *l) {
+  uint16_t pc = l->head;
+  int count = 1; // the branch
+  while (pc != l->branch) {
+    if (pc > l->branch)
+      return false;
+    uint8_t op = IDLE_code(cpu, pc);
+    uint8_t arg = IDLE_code(cpu, pc + 1);
+    uint16_t imm16 = arg | (IDLE_code(cpu, pc + 2) << 8);
+    int length = 1;
+    int from = -1;
+    uint16_t addr = 0;
+    uint16_t target = 0xFFFF;
+
+    if (op >= 0x40 && op < 0xC0) {
+      if (op >= 0x70 && op < 0x78)
+        return false; // ld (hl), r8 and halt
+      if ((op & 0x07) == 6)
+        from = READ_HL;
+    } else if ((op & 0xC7) == 0x06) {
+      if (op == 0x36)
+        return false;
+      length = 2; // ld r8, imm8
+    } else if ((op & 0xC6) == 0x04) {
+      if (op == 0x34 || op == 0x35)
+        return false; // inc/dec (hl)
+    } else if ((op & 0xC7) == 0xC6) {
+      length = 2; // alu a, imm8
+    } else {
+      switch (op) {
+      case 0x00: // nop
+      case 0x07: // rlca
+      case 0x0F: // rrca
+      case 0x17: // rla
+      case 0x1F: // rra
+      case 0x2F: // cpl
+      case 0x37: // scf
+      case 0x3F: // ccf
+        break;
+      case 0x0A:
+        from = READ_BC;
+        break;
+      case 0x1A:
+        from = READ_DE;
+        break;
+      case 0xF0: // ldh a, [imm8]
+        length = 2;
+        from = READ_ABS;
+        addr = 0xFF00 | arg;
+        break;
+      case 0xF2: // ldh a, [c]
+        from = READ_C;
+        break;
+      case 0xFA: // ld a, [imm16]
+        length = 3;
+        from = READ_ABS;
+        addr = imm16;
+        break;
+      case 0xCB:
+        length = 2;
+        if ((arg & 0x07) == 6) {
+          if (arg < 0x40 || arg >= 0x80)
+            return false; // only bit n, (hl) leaves (hl) alone
+          from = READ_HL;
+        }
+        break;
+      case 0x20:
+      case 0x28:
+      case 0x30:
+      case 0x38:
+        length = 2;
+        target = pc + 2 + (int8_t)arg;
+        break;
+      case 0xC2:
+      case 0xCA:
+      case 0xD2:
+      case 0xDA:
+        length = 3;
+        target = imm16;
+        break;
+      default:
+        return false;
+      }
+    }
+
+    // a conditional branch may leave the loop but not jump inside it
+    if (target != 0xFFFF && target >= l->head && target <= l->branch)
+      return false;
+    if (from >= 0) {
+      if (l->read_count == IDLE_READS)
+        return false;
+      l->reads[l->read_count++] = (IdleRead){from, addr};
+    }
+    pc += length;
+    count++;
+  }
+  l->instructions = count;
+  return true;
+}
+
+// the copy loop shape the body has, 0 for none
+static uint8_t IDLE_shape(CPU *cpu, IdleLoop *l) {
+  uint8_t branch = IDLE_code(cpu, l->branch);
+  if (branch != 0x20 && branch != 0xC2) // jr nz, jp nz
+    return 0;
+  for (size_t i = 0; i < sizeof(copy_shapes) / sizeof(copy_shapes[0]); i++) {
+    const CopyShape *s = &copy_shapes[i];
+    if (l->branch - l->head != s->length)
+      continue;
+    int j = 0;
+    while (j < s->length && IDLE_code(cpu, l->head + j) == s->body[j])
+      j++;
+    if (j == s->length) {
+      l->instructions = s->length + 1;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+static uint16_t IDLE_address(const IdleRead *r, const uint16_t *regs) {
+  switch (r->from) {
+  case READ_HL:
+    return regs[3];
+  case READ_BC:
+    return regs[1];
+  case READ_DE:
+    return regs[2];
+  case READ_C:
+    return 0xFF00 | (regs[1] & 0xFF);
+  default:
+    return r->addr;
+  }
+}
+
+// the loop went once around without changing anything: run whole
+// iterations until something it could read changes
+static void IDLE_skip(CPU *cpu, IdleLoop *l) {
+  bool reads_div = false;
+  bool reads_tima = false;
+  bool reads_nr52 = false;
+  for (int i = 0; i < l->read_count; i++) {
+    uint16_t addr = IDLE_address(&l->reads[i], l->regs);
+    reads_div |= addr == 0xFF04;
+    reads_tima |= addr == 0xFF05;
+    reads_nr52 |= addr == 0xFF26;
+  }
+
+  // LY, STAT and IF only change between CPU_run calls, the timer in
+  // between; no interrupt can fire before either
+  uint64_t limit = cpu->run_end - cpu->cycle_count;
+  uint64_t next_div = 256 - cpu->div_counter;
+  if (reads_div && next_div < limit)
+    limit = next_div;
+  // a length counter can turn a channel off at the next sequencer step
+  uint64_t next_step = APU_SEQ_CYCLES - cpu->cycle_count % APU_SEQ_CYCLES;
+  if (reads_nr52 && next_step < limit)
+    limit = next_step;
+  if (cpu->tac & 0x04) {
+    uint64_t threshold = tima_threshold[cpu->tac & 0x03];
+    uint64_t next = threshold - cpu->tima_counter;
+    if (!reads_tima)
+      next += (0xFF - cpu->tima) * threshold; // overflow raises IF
+    if (next < limit)
+      limit = next;
+  }
+
+  // the branch that got here is charged after this returns
+  uint64_t period = l->instructions * IDLE_CYCLES;
+  if (limit < IDLE_CYCLES + period)
+    return;
+  uint64_t cycles = (limit - IDLE_CYCLES) / period * period;
+  cpu->cycle_count += cycles;
+  CPU_update_timer(cpu, (int)cycles);
+  l->skips++;
+  l->skipped_cycles += cycles;
+}
+
+// whether n bytes from addr are all in one part of the map (so ROM within
+// a bank, and one run of _memory), below the FFxx page and not watched
+static bool IDLE_plain(CPU *cpu, uint16_t addr, uint32_t n) {
+  static const uint32_t ends[] = {0x4000, 0x8000, 0xA000, 0xC000,
+                                  0xE000, 0xFE00, 0xFF00};
+  size_t i = 0;
+  while (i < sizeof(ends) / sizeof(ends[0]) && addr >= ends[i])
+    i++;
+  if (i == sizeof(ends) / sizeof(ends[0]) || addr + n > ends[i])
+    return false;
+  for (uint32_t page = addr >> 8; page <= (addr + n - 1) >> 8; page++) {
+    if (cpu->bus_pages[page])
+      return false;
+  }
+  return true;
+}
+
+// the memory a copy loop reads n bytes from, when reading it has no side
+// effects
+static const uint8_t *IDLE_source(CPU *cpu, uint16_t addr, uint32_t n) {
+  if (!IDLE_plain(cpu, addr, n))
+    return NULL;
+  if (addr < 0x8000 || (addr >= 0xA000 && addr < 0xC000))
+    return cart_pointer(cpu->cart, addr, n);
+  return &cpu->_memory[CPU_mem(addr)];
+}
+
+// the same for writes, which only go straight to VRAM or RAM
+static uint8_t *IDLE_target(CPU *cpu, uint16_t addr, uint32_t n) {
+  if (addr < 0x8000 || (addr >= 0xA000 && addr < 0xC000) ||
+      !IDLE_plain(cpu, addr, n))
+    return NULL;
+  return &cpu->_memory[CPU_mem(addr)];
+}
+
+// arrived at the head of a copy or fill loop: do as many of the iterations
+// as fit in the rest of the CPU_run at once, leaving the registers, flags,
+// memory and time as running them would. The last iteration is always
+// run, it is the one that falls through.
+static void IDLE_copy(CPU *cpu, IdleLoop *l) {
+  const CopyShape *s = &copy_shapes[l->copy - 1];
+  // an interrupt taken now would run in the middle of the loop
+  if (cpu->pending_IME || (cpu->IME && (cpu->if_reg & cpu->ie_reg)))
+    return;
+  for (uint32_t page = l->head >> 8; page <= (uint32_t)l->branch >> 8; page++) {
+    if (cpu->bus_pages[page])
+      return; // a breakpoint in the loop
+  }
+
+  uint32_t left = s->count == COUNT_BC ? cpu->BC
+                  : s->count == COUNT_B ? cpu->B
+                                        : cpu->C;
+  if (!left)
+    left = s->count == COUNT_BC ? 0x10000 : 0x100;
+  uint64_t n = left - 1;
+  uint64_t limit = cpu->run_end - cpu->cycle_count;
+  // the same for the timer's, when it would be taken
+  if (cpu->IME && (cpu->ie_reg & 0x04) && (cpu->tac & 0x04)) {
+    uint64_t threshold = tima_threshold[cpu->tac & 0x03];
+    uint64_t next = threshold - cpu->tima_counter +
+                    (uint64_t)(0xFF - cpu->tima) * threshold;
+    if (next < limit)
+      limit = next;
+  }
+  // the branch that got here is charged after this returns
+  uint64_t period = (s->length + 1) * IDLE_CYCLES;
+  if (limit < IDLE_CYCLES + period)
+    return;
+  if ((limit - IDLE_CYCLES) / period < n)
+    n = (limit - IDLE_CYCLES) / period;
+  if (n < 2)
+    return;
+
+  bool copy = s->from == COPY_DE || s->from == COPY_HL;
+  uint16_t to = s->to_de ? cpu->DE : cpu->HL;
+  uint16_t from = s->from == COPY_DE ? cpu->DE : cpu->HL;
+  uint8_t *dst = IDLE_target(cpu, to, n);
+  const uint8_t *src = copy ? IDLE_source(cpu, from, n) : NULL;
+  if (!dst || (copy && !src))
+    return;
+  // an overlap repeats bytes just written, which memcpy does not
+  if (copy && src < dst + n && dst < src + n)
+    return;
+
+  // VRAM and OAM are what the screen is drawn from
+  uint32_t lo = to, hi = to + n;
+  if (lo >= 0xC000) {
+    lo = lo > 0xFE00 ? lo : 0xFE00;
+    hi = hi < 0xFEA0 ? hi : 0xFEA0;
+  }
+  bool changed = false;
+  if (copy) {
+    if (lo < hi)
+      changed = memcmp(dst + (lo - to), src + (lo - to), hi - lo) != 0;
+    memcpy(dst, src, n);
+  } else {
+    uint8_t fill = s->from == COPY_A   ? cpu->A
+                   : s->from == COPY_D ? cpu->D
+                   : s->from == COPY_E ? cpu->E
+                                       : 0;
+    for (uint32_t i = lo; i < hi && !changed; i++)
+      changed = dst[i - to] != fill;
+    memset(dst, fill, n);
+  }
+  cpu->screen_dirty |= changed;
+  cpu->vram_dirty |= changed;
+  uint32_t first = dst - cpu->_memory;
+  for (uint32_t page = first >> 8; page <= (first + n - 1) >> 8; page++)
+    cpu->written[page] = 1;
+
+  if (copy && s->count != COUNT_BC)
+    cpu->A = src[n - 1];
+  if (s->to_de || s->from == COPY_DE)
+    cpu->DE += n;
+  if (!s->to_de || s->from == COPY_HL)
+    cpu->HL += n;
+  if (s->count == COUNT_BC) {
+    cpu->BC -= n;
+    cpu->A = cpu->B | cpu->C;
+    cpu->F = 0; // or c, not zero as the loop goes on
+  } else {
+    uint8_t *r = s->count == COUNT_B ? &cpu->B : &cpu->C;
+    *r -= n;
+    cpu->F = (cpu->F & F_c) | F_n | ((*r & 0x0F) == 0x0F ? F_h : 0);
+  }
+
+  uint64_t cycles = n * period;
+  cpu->cycle_count += cycles;
+  CPU_update_timer(cpu, (int)cycles);
+  l->skips++;
+  l->skipped_cycles += cycles;
+}
+
+static uint32_t IDLE_hash(uint16_t branch, uint8_t bank) {
+  return ((branch | (uint32_t)bank << 16) * 0x9E3779B1u) >> 16;
+}
+
+// doubles the table, or makes it at the first loop
+static bool IDLE_grow(Idle *idle) {
+  int size = idle->size ? idle->size * 2 : IDLE_FIRST;
+  IdleLoop *loops = calloc(size, sizeof(IdleLoop));
+  if (!loops)
+    return false;
+  for (int i = 0; i < idle->size; i++) {
+    const IdleLoop *l = &idle->loops[i];
+    if (!l->used)
+      continue;
+    uint32_t j = IDLE_hash(l->branch, l->bank) & (size - 1);
+    while (loops[j].used)
+      j = (j + 1) & (size - 1);
+    loops[j] = *l;
+  }
+  free(idle->loops);
+  idle->loops = loops;
+  idle->size = size;
+  return true;
+}
+
+static void IDLE_loop(CPU *cpu, uint16_t branch) {
+  Idle *idle = cpu->idle;
+  // code in RAM can change under us and a trace wants every instruction
+  if (branch >= 0x8000 || cpu->trace)
+    return;
+  uint8_t bank = branch >= 0x4000 ? cpu->cart->rom_bank & 0x1F : 0;
+
+  // half full at most, lookups stay short
+  if (idle->loop_count * 2 >= idle->size && idle->size < IDLE_LOOPS &&
+      !IDLE_grow(idle) && !idle->size)
+    return;
+  uint32_t i = IDLE_hash(branch, bank) & (idle->size - 1);
+  IdleLoop *l;
+  for (;; i = (i + 1) & (idle->size - 1)) {
+    l = &idle->loops[i];
+    if (!l->used) {
+      // keep one slot free so lookups always end
+      if (idle->loop_count == idle->size - 1)
+        return;
+      idle->loop_count++;
+      l->used = true;
+      l->bank = bank;
+      l->head = cpu->PC;
+      l->branch = branch;
+      l->pure = IDLE_analyze(cpu, l);
+      if (!l->pure) {
+        l->read_count = 0;
+        l->copy = IDLE_shape(cpu, l);
+      }
+      break;
+    }
+    if (l->branch == branch && l->bank == bank)
+      break;
+  }
+  if (l->copy) {
+    l->iterations++;
+    IDLE_copy(cpu, l);
+    return;
+  }
+  if (!l->pure)
+    return;
+
+  uint16_t regs[5] = {cpu->AF, cpu->BC, cpu->DE, cpu->HL, cpu->SP};
+  l->iterations++;
+  if (l->cycle + l->instructions * IDLE_CYCLES == cpu->cycle_count &&
+      l->run_end == cpu->run_end && memcmp(l->regs, regs, sizeof(regs)) == 0 &&
+      l->divr == cpu->divr && l->tima == cpu->tima && l->if_reg == cpu->if_reg)
+    IDLE_skip(cpu, l);
+
+  l->cycle = cpu->cycle_count;
+  l->run_end = cpu->run_end;
+  memcpy(l->regs, regs, sizeof(regs));
+  l->divr = cpu->divr;
+  l->tima = cpu->tima;
+  l->if_reg = cpu->if_reg;
+}
+
+static void IDLE_branch(CPU *cpu, uint8_t opcode) {
+  uint16_t branch = cpu->PC - 1;
+  idle_original[opcode](cpu, opcode);
+  if (cpu->idle && cpu->PC <= branch && branch - cpu->PC < IDLE_BYTES)
+    IDLE_loop(cpu, branch);
+}
+
+static void IDLE_name(char *buf, size_t size, uint16_t addr) {
+  static const struct {
+    uint16_t addr;
+    const char *name;
+  } names[] = {{0xFF00, "JOYP"}, {0xFF04, "DIV"},  {0xFF05, "TIMA"},
+               {0xFF0F, "IF"},   {0xFF26, "NR52"}, {0xFF41, "STAT"},
+               {0xFF44, "LY"},   {0xFFFF, "IE"}};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (names[i].addr == addr) {
+      snprintf(buf, size, "%s", names[i].name);
+      return;
+    }
+  }
+  snprintf(buf, size, "%04X", addr);
+}
+
+static int IDLE_by_skipped(const void *a, const void *b) {
+  const IdleLoop *x = *(const IdleLoop *const *)a;
+  const IdleLoop *y = *(const IdleLoop *const *)b;
+  if (x->skipped_cycles != y->skipped_cycles)
+    return x->skipped_cycles < y->skipped_cycles ? 1 : -1;
+  return x->iterations < y->iterations ? 1 : -1;
+}
+
+static void IDLE_report(CPU *cpu, const char *path) {
+  Idle *idle = cpu->idle;
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "idle: failed to write %s\n", path);
+    return;
+  }
+
+  IdleLoop *loops[IDLE_LOOPS];
+  int count = 0;
+  uint64_t skipped = 0;
+  for (int i = 0; i < idle->size; i++) {
+    if (idle->loops[i].used && (idle->loops[i].pure || idle->loops[i].copy)) {
+      loops[count++] = &idle->loops[i];
+      skipped += idle->loops[i].skipped_cycles;
+    }
+  }
+  qsort(loops, count, sizeof(loops[0]), IDLE_by_skipped);
+
+  char title[17] = {0};
+  if (cpu->cart->rom_size > 0x143)
+    memcpy(title, &cpu->cart->rom[0x134], 16);
+  uint64_t cycles = cpu->cycle_count - idle->start_cycle;
+  fprintf(f, "idle loops in \"%s\", rom hash %016llx\n", title,
+          (unsigned long long)cart_hash(cpu->cart));
+  fprintf(f, "cycles: %llu, %llu skipped (%.2f%%)\n",
+          (unsigned long long)cycles, (unsigned long long)skipped,
+          cycles ? 100.0 * skipped / cycles : 0.0);
+
+  fprintf(f, "\n  %-7s %-6s %6s %-20s %12s %10s %14s\n", "head", "branch",
+          "instrs", "reads", "iterations", "skips", "skipped cycles");
+  for (int i = 0; i < count; i++) {
+    IdleLoop *l = loops[i];
+    char reads[64] = "-";
+    if (l->copy)
+      snprintf(reads, sizeof(reads), "%s", copy_shapes[l->copy - 1].name);
+    size_t used = 0;
+    for (int j = 0; j < l->read_count; j++) {
+      char name[8];
+      IDLE_name(name, sizeof(name), IDLE_address(&l->reads[j], l->regs));
+      if (used < sizeof(reads))
+        used += snprintf(reads + used, sizeof(reads) - used, "%s%s",
+                         j ? "," : "", name);
+    }
+    char head[16];
+    if (l->head >= 0x4000)
+      snprintf(head, sizeof(head), "%02X:%04X", l->bank, l->head);
+    else
+      snprintf(head, sizeof(head), "%04X", l->head);
+    fprintf(f, "  %-7s %04X   %6u %-20s %12llu %10llu %14llu\n", head,
+            l->branch, l->instructions, reads,
+            (unsigned long long)l->iterations, (unsigned long long)l->skips,
+            (unsigned long long)l->skipped_cycles);
+  }
+  fclose(f);
+  printf("idle: %d loops, %.2f%% of cycles skipped, report written to %s\n",
+         count, cycles ? 100.0 * skipped / cycles : 0.0, path);
+}
+
+static void IDLE_exit(void) {
+  if (idled)
+    IDLE_stop(idled);
+}
+
+bool IDLE_start(CPU *cpu, const char *report) {
+  static bool registered;
+  if (cpu->idle)
+    return true;
+
+  Idle *idle = calloc(1, sizeof(Idle));
+  if (!idle)
+    return false;
+  if (report) {
+    // fail now rather than at exit
+    FILE *f = fopen(report, "w");
+    if (!f) {
+      free(idle);
+      return false;
+    }
+    fclose(f);
+    idle->report = strdup(report);
+  }
+  idle->start_cycle = cpu->cycle_count;
+
+  // every jump that can close a loop: jr, jr cc, jp, jp cc
+  static const uint8_t branches[] = {0x18, 0x20, 0x28, 0x30, 0x38,
+                                     0xC3, 0xC2, 0xCA, 0xD2, 0xDA};
+  for (size_t i = 0; i < sizeof(branches); i++) {
+    if (!idle_original[branches[i]])
+      idle_original[branches[i]] = CPU_hook_opcode(branches[i], IDLE_branch);
+  }
+
+  cpu->idle = idle;
+  if (report)
+    idled = cpu;
+  if (!registered) {
+    atexit(IDLE_exit);
+    registered = true;
+  }
+  return true;
+}
+
+void IDLE_stop(CPU *cpu) {
+  Idle *idle = cpu->idle;
+  if (!idle)
+    return;
+  if (idled == cpu)
+    idled = NULL;
+  if (idle->report)
+    IDLE_report(cpu, idle->report);
+  cpu->idle = NULL;
+  free(idle->report);
+  free(idle->loops);
+  free(idle);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+
+// Idle loop skipping. Short ROM loops that only read memory and registers,
+// like `ldh a,[rLY]; cp 144; jr c,.loop`, are found at their backward
+// branch. Once one iteration has left every register as it was, nothing
+// but LY, STAT, IF or the timer can end the loop, so whole iterations are
+// skipped up to the end of the current CPU_run or the next timer change the
+// loop could see. The result is the same as running them.
+//
+// Copy and fill loops of a few well known shapes, like `ld a,[de];
+// ld [hli],a; inc de; dec bc; ld a,b; or c; jr nz`, are found the same way
+// and run in bulk: the iterations that fit in the current CPU_run become a
+// memcpy or memset, with the registers, flags and cycles they would leave.
+//
+// With a report path the loops seen are written there when skipping stops.
+
+typedef struct Idle Idle;
+
+bool IDLE_start(CPU *cpu, const char *report);
+void IDLE_stop(CPU *cpu);
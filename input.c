@@ -0,0 +1,161 @@
+#include "input.h"
+#include "perf.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INPUT_RING 256     // queued changes, must be a power of two
+#define INPUT_WAITING 32   // presses latched but not on screen yet
+#define INPUT_SAMPLES 4096 // presses kept for the latency percentiles
+
+typedef struct {
+  uint64_t ns;
+  uint8_t joypad; // the whole joypad after the change, 0 is pressed
+} InputEvent;
+
+// single producer (the frontend) and single consumer (the emulator) like
+// the trace ring, head and tail only ever grow
+struct Input {
+  InputEvent ring[INPUT_RING];
+  _Alignas(64) _Atomic uint64_t head;
+  uint8_t keys; // producer side joypad
+  uint64_t lost;
+  _Alignas(64) _Atomic uint64_t tail;
+
+  // emulator side
+  uint8_t fresh; // pressed at the start of the frame, not read yet
+  void (*poll)(void *);
+  void *poll_arg;
+  uint64_t last_poll;
+  Movie *movie;
+
+  // latency measurement
+  bool measure;
+  uint64_t waiting[INPUT_WAITING];
+  int waiting_count;
+  float to_read[INPUT_SAMPLES], to_screen[INPUT_SAMPLES];
+  uint32_t read_count, screen_count;
+};
+
+// the queue being measured reports at exit
+static Input *measuring;
+
+static void INPUT_exit(void) {
+  if (measuring)
+    INPUT_free(measuring);
+}
+
+Input *INPUT_new(bool measure) {
+  static bool registered;
+  Input *in = aligned_alloc(_Alignof(Input), sizeof(Input));
+  if (!in)
+    return NULL;
+  memset(in, 0, sizeof(Input));
+  in->keys = 0xFF;
+  in->measure = measure;
+  if (measure) {
+    measuring = in;
+    if (!registered) {
+      atexit(INPUT_exit);
+      registered = true;
+    }
+  }
+  return in;
+}
+
+static int INPUT_compare(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+static void INPUT_report(const char *what, float *ms, uint32_t count) {
+  if (count > INPUT_SAMPLES)
+    count = INPUT_SAMPLES;
+  if (count == 0)
+    return;
+  qsort(ms, count, sizeof(float), INPUT_compare);
+  fprintf(stderr, "  press to %-6s p50 %6.2fms  p99 %6.2fms  max %6.2fms\n",
+          what, ms[count / 2], ms[count * 99 / 100], ms[count - 1]);
+}
+
+void INPUT_free(Input *in) {
+  if (!in)
+    return;
+  if (measuring == in)
+    measuring = NULL;
+  if (in->measure) {
+    fprintf(stderr, "input latency over %u presses (%llu changes lost):\n",
+            in->read_count, (unsigned long long)in->lost);
+    INPUT_report("JOYP", in->to_read, in->read_count);
+    INPUT_report("screen", in->to_screen, in->screen_count);
+  }
+  free(in);
+}
+
+void INPUT_poll(Input *in, void (*poll)(void *), void *arg) {
+  in->poll = poll;
+  in->poll_arg = arg;
+}
+
+void INPUT_movie(Input *in, Movie *movie) { in->movie = movie; }
+
+void INPUT_key(Input *in, int button, bool pressed, uint64_t ns) {
+  uint8_t keys = pressed ? in->keys & ~(1 << button) : in->keys | 1 << button;
+  if (keys == in->keys)
+    return; // key repeat
+  uint64_t head = atomic_load_explicit(&in->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&in->tail, memory_order_acquire) ==
+      INPUT_RING) {
+    in->lost++;
+    return;
+  }
+  in->keys = keys;
+  in->ring[head & (INPUT_RING - 1)] = (InputEvent){ns, keys};
+  atomic_store_explicit(&in->head, head + 1, memory_order_release);
+}
+
+static void INPUT_take(CPU *cpu, bool read) {
+  Input *in = cpu->input;
+  uint64_t now = PERF_now();
+  if (in->poll && now - in->last_poll >= INPUT_POLL_NS) {
+    in->last_poll = now;
+    in->poll(in->poll_arg);
+  }
+
+  uint8_t joypad = cpu->direction_state | cpu->button_state << 4;
+  // a press stays until a read (or a whole frame) has seen it
+  uint8_t hold = read ? in->fresh : 0, pressed = 0;
+  uint64_t tail = atomic_load_explicit(&in->tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&in->head, memory_order_acquire);
+  for (; tail != head; tail++) {
+    InputEvent *e = &in->ring[tail & (INPUT_RING - 1)];
+    if (~joypad & e->joypad & (hold | pressed))
+      break;
+    uint8_t down = joypad & ~e->joypad;
+    if (down && in->measure) {
+      in->to_read[in->read_count++ % INPUT_SAMPLES] = (now - e->ns) / 1e6f;
+      if (in->waiting_count < INPUT_WAITING)
+        in->waiting[in->waiting_count++] = e->ns;
+    }
+    pressed |= down;
+    joypad = e->joypad;
+  }
+  atomic_store_explicit(&in->tail, tail, memory_order_release);
+  in->fresh = read ? 0 : pressed;
+
+  if (in->movie)
+    MOVIE_input(in->movie, cpu, &joypad);
+  CPU_joypad(cpu, joypad);
+}
+
+void INPUT_latch(CPU *cpu) { INPUT_take(cpu, true); }
+
+void INPUT_frame(CPU *cpu) { INPUT_take(cpu, false); }
+
+void INPUT_presented(Input *in, uint64_t ns) {
+  for (int i = 0; i < in->waiting_count; i++)
+    in->to_screen[in->screen_count++ % INPUT_SAMPLES] =
+        (ns - in->waiting[i]) / 1e6f;
+  in->waiting_count = 0;
+}
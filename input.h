@@ -0,0 +1,42 @@
+#pragma once
+
+#include "cpu.h"
+#include "movie.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Late joypad latching. The frontend queues every joypad change with the
+// host time it happened and the game only takes them in when it reads JOYP
+// (and at the start of every frame), so a key pressed while a frame is
+// being emulated shows up in a read later in that same frame rather than
+// the next one. A press is held back until a read has seen it, so a tap
+// shorter than a frame is never lost between two reads. A movie records the
+// changes at the cycle they were taken in and replays them at the same
+// reads.
+//
+// With latency measurement on, the host time of every press is followed to
+// the read that took it in and to the present of the next frame drawn.
+
+#define INPUT_POLL_NS 500000 // host events are picked up every 0.5ms
+
+typedef struct Input Input;
+
+Input *INPUT_new(bool measure);
+// prints the latency report when measuring
+void INPUT_free(Input *in);
+// poll(arg) is called before a latch, at most every INPUT_POLL_NS, to pick
+// up host events as they come rather than once a frame
+void INPUT_poll(Input *in, void (*poll)(void *), void *arg);
+// recorded into or replayed from movie, NULL for none
+void INPUT_movie(Input *in, Movie *movie);
+// the producer side, one thread only: button 0-7 (the bits of a movie
+// input byte) went down or up at host time ns (PERF_now)
+void INPUT_key(Input *in, int button, bool pressed, uint64_t ns);
+// takes what is queued into cpu->direction_state and button_state, for a
+// JOYP read
+void INPUT_latch(CPU *cpu);
+// the same at the start of a frame, so interrupts and games that do not
+// read JOYP still get the input
+void INPUT_frame(CPU *cpu);
+// the frame with everything latched so far reached the screen at ns
+void INPUT_presented(Input *in, uint64_t ns);
@@ -0,0 +1,175 @@
+#define _POSIX_C_SOURCE 200809L
+#include "lines.h"
+#include "render.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LINES_JOBS 256   // queued lines, a power of two
+#define LINES_VERSIONS 4 // VRAM/OAM copies the queued lines can be drawn from
+#define LINES_OAM 0xA0
+
+typedef struct {
+  uint8_t vram[0x2000];
+  uint8_t oam[LINES_OAM];
+} LinesVersion;
+
+typedef struct {
+  DisplayLine regs;
+  uint8_t y;
+  uint8_t version; // index into versions
+} LinesJob;
+
+struct Lines {
+  bool thread;
+  uint8_t pixels[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+
+  // what each line was last drawn from, the version as a count of copies
+  DisplayLine drawn[DISPLAY_HEIGHT];
+  uint32_t drawn_version[DISPLAY_HEIGHT];
+  bool drawn_any[DISPLAY_HEIGHT];
+  uint32_t copies; // VRAM/OAM versions made, the current one is copies
+  int current;     // index of the current version
+
+  // the queue, jobs[head & mask] is the next free slot, jobs[tail & mask]
+  // the next line for the worker; only the emulation thread moves head and
+  // only the worker tail
+  LinesJob jobs[LINES_JOBS];
+  _Atomic uint32_t head, tail;
+  LinesVersion versions[LINES_VERSIONS];
+  uint32_t version_end[LINES_VERSIONS]; // head past the last job using it
+
+  pthread_t worker;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  _Atomic bool sleeping;
+  bool stop;
+};
+
+static void *LINES_work(void *arg) {
+  Lines *l = arg;
+  for (;;) {
+    uint32_t tail = atomic_load_explicit(&l->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&l->head, memory_order_acquire)) {
+      // the emulation thread signals when it sees sleeping set, and it
+      // cannot queue a line between the check and the wait
+      pthread_mutex_lock(&l->lock);
+      atomic_store(&l->sleeping, true);
+      while (!l->stop && tail == atomic_load(&l->head))
+        pthread_cond_wait(&l->wake, &l->lock);
+      atomic_store(&l->sleeping, false);
+      bool stop = l->stop;
+      pthread_mutex_unlock(&l->lock);
+      if (stop)
+        return NULL;
+      continue;
+    }
+    LinesJob *job = &l->jobs[tail & (LINES_JOBS - 1)];
+    LinesVersion *v = &l->versions[job->version];
+    DISPLAY_render_line(l->pixels + job->y * DISPLAY_WIDTH, job->y,
+                        &job->regs, v->vram, v->oam);
+    atomic_store_explicit(&l->tail, tail + 1, memory_order_release);
+  }
+}
+
+// waits until the worker is past job end (head numbering)
+static void LINES_wait(Lines *l, uint32_t end) {
+  while ((int32_t)(atomic_load_explicit(&l->tail, memory_order_acquire) -
+                   end) < 0)
+    sched_yield();
+}
+
+// a new version out of the CPU's VRAM and OAM, in a slot no queued line
+// uses any more
+static void LINES_copy(Lines *l, CPU *cpu) {
+  l->copies++;
+  if (!l->thread)
+    return; // the lines are drawn straight from _memory
+  int slot = (l->current + 1) % LINES_VERSIONS;
+  LINES_wait(l, l->version_end[slot]);
+  memcpy(l->versions[slot].vram, &cpu->_memory[MEM_VRAM], 0x2000);
+  memcpy(l->versions[slot].oam, &cpu->_memory[MEM_OAM], LINES_OAM);
+  l->current = slot;
+}
+
+void LINES_capture(CPU *cpu, int y) {
+  Lines *l = cpu->lines;
+  if (cpu->vram_dirty || !l->copies) {
+    cpu->vram_dirty = false;
+    LINES_copy(l, cpu);
+  }
+  DisplayLine regs = DISPLAY_line(cpu);
+  if (l->drawn_any[y] && l->drawn_version[y] == l->copies &&
+      memcmp(&l->drawn[y], &regs, sizeof(regs)) == 0)
+    return; // the row holds this line already
+  l->drawn[y] = regs;
+  l->drawn_version[y] = l->copies;
+  l->drawn_any[y] = true;
+
+  if (!l->thread) {
+    DISPLAY_render_line(l->pixels + y * DISPLAY_WIDTH, y, &regs,
+                        &cpu->_memory[MEM_VRAM], &cpu->_memory[MEM_OAM]);
+    return;
+  }
+  uint32_t head = atomic_load_explicit(&l->head, memory_order_relaxed);
+  LINES_wait(l, head - LINES_JOBS + 1); // a full queue
+  l->jobs[head & (LINES_JOBS - 1)] =
+      (LinesJob){regs, (uint8_t)y, (uint8_t)l->current};
+  l->version_end[l->current] = head + 1;
+  atomic_store(&l->head, head + 1);
+  if (atomic_load(&l->sleeping)) {
+    pthread_mutex_lock(&l->lock);
+    pthread_cond_signal(&l->wake);
+    pthread_mutex_unlock(&l->lock);
+  }
+}
+
+const uint8_t *LINES_pixels(CPU *cpu) {
+  Lines *l = cpu->lines;
+  if (l->thread)
+    LINES_wait(l, atomic_load_explicit(&l->head, memory_order_relaxed));
+  return l->pixels;
+}
+
+bool LINES_start(CPU *cpu, bool thread) {
+  if (cpu->lines)
+    return true;
+  Lines *l = calloc(1, sizeof(Lines));
+  if (!l)
+    return false;
+  // on a single core the worker only takes turns with the CPU, and the
+  // switches cost more than drawing on the spot
+  l->thread = thread && sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  if (l->thread) {
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->wake, NULL);
+    if (pthread_create(&l->worker, NULL, LINES_work, l) != 0) {
+      pthread_mutex_destroy(&l->lock);
+      pthread_cond_destroy(&l->wake);
+      free(l);
+      return false;
+    }
+  }
+  cpu->lines = l;
+  return true;
+}
+
+void LINES_stop(CPU *cpu) {
+  Lines *l = cpu->lines;
+  if (!l)
+    return;
+  if (l->thread) {
+    pthread_mutex_lock(&l->lock);
+    l->stop = true;
+    pthread_cond_signal(&l->wake);
+    pthread_mutex_unlock(&l->lock);
+    pthread_join(l->worker, NULL);
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->wake);
+  }
+  free(l);
+  cpu->lines = NULL;
+}
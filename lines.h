@@ -0,0 +1,34 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Line renderer, the "line" accuracy profile: the fast profile's timings,
+// but every visible line is drawn from the registers, VRAM and OAM as they
+// are when its mode 3 starts, so scroll, palette and window changes made
+// between lines show up, where the fast profile draws the whole frame
+// from its end.
+//
+// With a thread, the lines are drawn on it while the CPU goes on: at mode
+// 3 the emulation thread only puts the line's registers and a VRAM/OAM
+// version on a lock-free single producer queue. A version is a copy of
+// VRAM and OAM, made when they were written since the last one, which is
+// once a frame for a game that writes them in vblank; the worker draws from
+// the copy, so later writes do not reach lines still queued. Without a
+// thread each line is drawn on the spot, from the same renderer, so both
+// give the same frames. Either way a line whose registers and version are
+// those it was last drawn with is not drawn again.
+
+typedef struct Lines Lines;
+
+// thread: draw on a worker thread when there is a second core, else on
+// the emulation thread
+bool LINES_start(CPU *cpu, bool thread);
+void LINES_stop(CPU *cpu);
+// called by CPU_frame at mode 3 of each visible line when the renderer is
+// on
+void LINES_capture(CPU *cpu, int y);
+// the last frame once every line of it is drawn, DISPLAY_WIDTH x
+// DISPLAY_HEIGHT shades like render.c's
+const uint8_t *LINES_pixels(CPU *cpu);
@@ -0,0 +1,218 @@
+#define _POSIX_C_SOURCE 200809L
+#include "movie.h"
+#include "cartridge.h"
+#include "state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Movie {
+  bool recording;
+  char *path;
+  MovieHeader header;
+  uint8_t *state; // start state, NULL for power on
+  MovieEvent *events;
+  uint32_t capacity;
+  uint32_t next;  // replay: next event to apply
+  uint32_t frame; // frames run so far
+  uint64_t frame_cycle; // cycle_count at the start of the current frame
+  MovieEvent current;
+};
+
+// a recording still running at exit gets written out
+static Movie *recording;
+static CPU *recording_cpu;
+
+static void MOVIE_exit(void) {
+  if (recording)
+    MOVIE_close(recording, recording_cpu);
+}
+
+static void MOVIE_free(Movie *movie) {
+  free(movie->path);
+  free(movie->state);
+  free(movie->events);
+  free(movie);
+}
+
+Movie *MOVIE_record(CPU *cpu, const char *path) {
+  static bool registered;
+  Movie *movie = calloc(1, sizeof(Movie));
+  if (!movie)
+    return NULL;
+  movie->recording = true;
+  movie->path = strdup(path);
+  memcpy(movie->header.magic, MOVIE_MAGIC, sizeof(movie->header.magic));
+  movie->header.rom_hash = cart_hash(cpu->cart);
+  movie->header.accurate = cpu->ppu != NULL;
+
+  // a CPU that has not run yet is at power on and needs no state
+  if (cpu->cycle_count != 0) {
+    movie->header.state_size = STATE_size();
+    movie->state = malloc(movie->header.state_size);
+    if (!movie->state) {
+      MOVIE_free(movie);
+      return NULL;
+    }
+    STATE_save(cpu, movie->state);
+  }
+
+  // fail now rather than after a long session
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    MOVIE_free(movie);
+    return NULL;
+  }
+  fclose(f);
+
+  recording = movie;
+  recording_cpu = cpu;
+  if (!registered) {
+    atexit(MOVIE_exit);
+    registered = true;
+  }
+  return movie;
+}
+
+Movie *MOVIE_play(CPU *cpu, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return NULL;
+  Movie *movie = calloc(1, sizeof(Movie));
+  if (!movie) {
+    fclose(f);
+    return NULL;
+  }
+  movie->path = strdup(path);
+
+  MovieHeader *h = &movie->header;
+  bool ok = fread(h, sizeof(*h), 1, f) == 1 &&
+            memcmp(h->magic, MOVIE_MAGIC, sizeof(h->magic)) == 0 &&
+            h->rom_hash == cart_hash(cpu->cart);
+  if (ok && h->accurate != (cpu->ppu != NULL)) {
+    fprintf(stderr, "movie: recorded with --accuracy %s\n",
+            h->accurate ? "dot" : "fast");
+    ok = false;
+  }
+  if (ok && h->state_size) {
+    movie->state = malloc(h->state_size);
+    ok = movie->state &&
+         fread(movie->state, 1, h->state_size, f) == h->state_size &&
+         STATE_load(cpu, movie->state, h->state_size);
+  }
+  if (ok && h->events) {
+    movie->events = malloc(h->events * sizeof(MovieEvent));
+    ok = movie->events &&
+         fread(movie->events, sizeof(MovieEvent), h->events, f) == h->events;
+  }
+  fclose(f);
+  if (!ok) {
+    MOVIE_free(movie);
+    return NULL;
+  }
+
+  movie->current.input = cpu->direction_state | (cpu->button_state << 4);
+  movie->current.batches = 1;
+  return movie;
+}
+
+static void MOVIE_add(Movie *movie, MovieEvent e) {
+  if (movie->header.events == movie->capacity) {
+    uint32_t capacity = movie->capacity ? movie->capacity * 2 : 256;
+    MovieEvent *events = realloc(movie->events, capacity * sizeof(MovieEvent));
+    if (!events) {
+      fprintf(stderr, "movie: out of memory\n");
+      exit(1);
+    }
+    movie->events = events;
+    movie->capacity = capacity;
+  }
+  movie->events[movie->header.events++] = e;
+  movie->current = e;
+}
+
+// replay: the events up to cycle into frame
+static void MOVIE_advance(Movie *movie, uint32_t frame, uint32_t cycle) {
+  while (movie->next < movie->header.events) {
+    MovieEvent *e = &movie->events[movie->next];
+    if (e->frame > frame || (e->frame == frame && e->cycle > cycle))
+      break;
+    movie->current = *e;
+    movie->next++;
+  }
+}
+
+bool MOVIE_frame(Movie *movie, CPU *cpu, int *batches) {
+  movie->frame_cycle = cpu->cycle_count;
+  if (movie->recording) {
+    MovieEvent e = {movie->frame, 0,
+                    (cpu->direction_state & 0x0F) | (cpu->button_state << 4),
+                    *batches, {0}};
+    if (movie->header.events == 0 || e.input != movie->current.input ||
+        e.batches != movie->current.batches)
+      MOVIE_add(movie, e);
+    movie->frame++;
+    return true;
+  }
+
+  if (movie->frame >= movie->header.frames)
+    return false;
+  MOVIE_advance(movie, movie->frame, 0);
+  CPU_joypad(cpu, movie->current.input);
+  *batches = movie->current.batches;
+  movie->frame++;
+  return true;
+}
+
+void MOVIE_input(Movie *movie, CPU *cpu, uint8_t *joypad) {
+  if (movie->frame == 0)
+    return; // before the first frame, MOVIE_frame takes it
+  uint32_t frame = movie->frame - 1;
+  uint32_t cycle = cpu->cycle_count - movie->frame_cycle;
+  if (movie->recording) {
+    if (*joypad != movie->current.input)
+      MOVIE_add(movie, (MovieEvent){frame, cycle, *joypad,
+                                    movie->current.batches, {0}});
+    return;
+  }
+  if (movie->frame > movie->header.frames)
+    return; // the replay is over, live input takes over
+  MOVIE_advance(movie, frame, cycle);
+  *joypad = movie->current.input;
+}
+
+void MOVIE_close(Movie *movie, CPU *cpu) {
+  if (recording == movie)
+    recording = NULL;
+
+  uint64_t hash = STATE_hash(cpu);
+  if (movie->recording) {
+    MovieHeader *h = &movie->header;
+    h->frames = movie->frame;
+    h->final_hash = hash;
+    FILE *f = fopen(movie->path, "wb");
+    bool ok = f && fwrite(h, sizeof(*h), 1, f) == 1 &&
+              fwrite(movie->state, 1, h->state_size, f) == h->state_size &&
+              fwrite(movie->events, sizeof(MovieEvent), h->events, f) ==
+                  h->events;
+    if (f)
+      ok = fclose(f) == 0 && ok;
+    if (ok)
+      printf("movie: %u frames, %u input changes written to %s\n", h->frames,
+             h->events, movie->path);
+    else
+      fprintf(stderr, "movie: failed to write %s\n", movie->path);
+  } else if (movie->frame < movie->header.frames) {
+    printf("movie: replay stopped after %u of %u frames\n", movie->frame,
+           movie->header.frames);
+  } else if (hash == movie->header.final_hash) {
+    printf("movie: replay of %u frames matches the recording\n",
+           movie->frame);
+  } else {
+    printf("movie: replay of %u frames DESYNCED (state %016llx, recorded "
+           "%016llx)\n",
+           movie->frame, (unsigned long long)hash,
+           (unsigned long long)movie->header.final_hash);
+  }
+  MOVIE_free(movie);
+}
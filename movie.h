@@ -0,0 +1,49 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Input movies. A movie holds the ROM hash, the state emulation started
+// from and every change of the joypad (and boost) keyed by frame and cycle.
+// Replaying it from the same start reproduces the run exactly, which is
+// checked against the state hash stored when recording stopped.
+//
+// File layout, native endian: MovieHeader, state_size bytes of start state
+// (none when the movie starts at power on), then events in frame order.
+
+#define MOVIE_MAGIC "GBMOVIE2"
+
+typedef struct {
+  char magic[8];
+  uint64_t rom_hash;
+  uint64_t final_hash; // STATE_hash after the last frame
+  uint32_t frames;
+  uint32_t events;
+  uint32_t state_size;
+  uint32_t accurate; // recorded with the dot accurate PPU
+} MovieHeader;
+
+typedef struct {
+  uint32_t frame;
+  uint32_t cycle;  // cycles into the frame, 0 for the start of the frame
+  uint8_t input;   // direction_state in the low nibble, button_state high
+  uint8_t batches; // boost, scanlines run this many times
+  uint8_t pad[2];
+} MovieEvent;
+
+typedef struct Movie Movie;
+
+// starts recording from the current state of cpu
+Movie *MOVIE_record(CPU *cpu, const char *path);
+// loads the start state into cpu, NULL if the file is missing, broken or
+// made with another ROM or accuracy profile
+Movie *MOVIE_play(CPU *cpu, const char *path);
+// call before every frame: records the input, or replaces it with the
+// recorded input; returns false once a replay has run all its frames
+bool MOVIE_frame(Movie *movie, CPU *cpu, int *batches);
+// within a frame, where input.c latches the joypad: records a change of
+// joypad at the current cycle, or replaces it with the recorded one
+void MOVIE_input(Movie *movie, CPU *cpu, uint8_t *joypad);
+// writes a recording out, or reports whether a replay matched
+void MOVIE_close(Movie *movie, CPU *cpu);
@@ -0,0 +1,185 @@
+#define _POSIX_C_SOURCE 199309L
+#include "perf.h"
+#include "render.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CPU_HZ 4194304.0
+
+static const char *phase_names[PERF_PHASES] = {"events", "cpu", "render",
+                                               "present"};
+
+static struct {
+  FILE *csv;
+  bool report;
+  uint64_t last_mark;
+  uint64_t frame_start;
+  uint64_t last_cycles;
+  uint64_t phase[PERF_PHASES]; // current frame
+
+  // ring of the last PERF_WINDOW frames
+  uint64_t frame_ns[PERF_WINDOW];
+  uint64_t phase_ns[PERF_WINDOW][PERF_PHASES];
+  uint64_t cycles[PERF_WINDOW];
+  size_t filled;
+  size_t next;
+
+  PerfStats stats;
+} perf;
+
+uint64_t PERF_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+bool PERF_init(const char *csv, bool report) {
+  memset(&perf, 0, sizeof(perf));
+  if (csv) {
+    perf.csv = fopen(csv, "w");
+    if (!perf.csv)
+      return false;
+    fprintf(perf.csv, "frame,frame_ns,events_ns,cpu_ns,render_ns,present_ns,"
+                      "cycles\n");
+  }
+  perf.report = report;
+  perf.last_mark = perf.frame_start = PERF_now();
+  return true;
+}
+
+void PERF_mark(PerfPhase phase) {
+  uint64_t now = PERF_now();
+  perf.phase[phase] += now - perf.last_mark;
+  perf.last_mark = now;
+}
+
+static int PERF_compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void PERF_refresh(void) {
+  PerfStats *s = &perf.stats;
+  size_t n = perf.filled;
+  uint64_t sorted[PERF_WINDOW];
+  uint64_t total_ns = 0, total_cycles = 0;
+
+  memset(s->phase_ns, 0, sizeof(s->phase_ns));
+  memset(s->histogram, 0, sizeof(s->histogram));
+  for (size_t i = 0; i < n; i++) {
+    sorted[i] = perf.frame_ns[i];
+    total_ns += perf.frame_ns[i];
+    total_cycles += perf.cycles[i];
+    for (int p = 0; p < PERF_PHASES; p++)
+      s->phase_ns[p] += perf.phase_ns[i][p];
+    uint64_t ms = perf.frame_ns[i] / 1000000;
+    s->histogram[ms < PERF_BUCKETS ? ms : PERF_BUCKETS - 1]++;
+  }
+  for (int p = 0; p < PERF_PHASES; p++)
+    s->phase_ns[p] /= n;
+
+  qsort(sorted, n, sizeof(uint64_t), PERF_compare);
+  s->p50_ns = sorted[n / 2];
+  s->p99_ns = sorted[n * 99 / 100];
+  s->max_ns = sorted[n - 1];
+  s->speed = total_ns ? 100.0 * (total_cycles / CPU_HZ) / (total_ns / 1e9) : 0;
+
+  if (perf.report) {
+    fprintf(stderr,
+            "perf: speed %.1f%% frame p50 %.2f p99 %.2f max %.2f ms |",
+            s->speed, s->p50_ns / 1e6, s->p99_ns / 1e6, s->max_ns / 1e6);
+    for (int p = 0; p < PERF_PHASES; p++)
+      fprintf(stderr, " %s %.2f", phase_names[p], s->phase_ns[p] / 1e6);
+    fprintf(stderr, " ms\n");
+  }
+}
+
+void PERF_frame(uint64_t cycle_count) {
+  uint64_t now = PERF_now();
+  size_t i = perf.next;
+  perf.frame_ns[i] = now - perf.frame_start;
+  perf.cycles[i] = cycle_count - perf.last_cycles;
+  memcpy(perf.phase_ns[i], perf.phase, sizeof(perf.phase));
+
+  if (perf.csv) {
+    fprintf(perf.csv, "%llu,%llu", (unsigned long long)perf.stats.frames,
+            (unsigned long long)perf.frame_ns[i]);
+    for (int p = 0; p < PERF_PHASES; p++)
+      fprintf(perf.csv, ",%llu", (unsigned long long)perf.phase[p]);
+    fprintf(perf.csv, ",%llu\n", (unsigned long long)perf.cycles[i]);
+  }
+
+  perf.next = (i + 1) % PERF_WINDOW;
+  if (perf.filled < PERF_WINDOW)
+    perf.filled++;
+  perf.stats.frames++;
+  if (perf.stats.frames % PERF_INTERVAL == 0)
+    PERF_refresh();
+
+  memset(perf.phase, 0, sizeof(perf.phase));
+  perf.last_cycles = cycle_count;
+  perf.frame_start = perf.last_mark = now;
+}
+
+void PERF_query(PerfStats *stats) { *stats = perf.stats; }
+
+// 3x5 font, one row of 3 bits per byte
+static const uint8_t font[128][5] = {
+    ['0'] = {7, 5, 5, 5, 7}, ['1'] = {2, 6, 2, 2, 7}, ['2'] = {7, 1, 7, 4, 7},
+    ['3'] = {7, 1, 7, 1, 7}, ['4'] = {5, 5, 7, 1, 1}, ['5'] = {7, 4, 7, 1, 7},
+    ['6'] = {7, 4, 7, 5, 7}, ['7'] = {7, 1, 1, 1, 1}, ['8'] = {7, 5, 7, 5, 7},
+    ['9'] = {7, 5, 7, 1, 7}, ['A'] = {2, 5, 7, 5, 5}, ['B'] = {6, 5, 6, 5, 6},
+    ['C'] = {3, 4, 4, 4, 3}, ['D'] = {6, 5, 5, 5, 6}, ['E'] = {7, 4, 6, 4, 7},
+    ['F'] = {7, 4, 6, 4, 4}, ['G'] = {3, 4, 5, 5, 3}, ['H'] = {5, 5, 7, 5, 5},
+    ['I'] = {7, 2, 2, 2, 7}, ['J'] = {1, 1, 1, 5, 2}, ['K'] = {5, 5, 6, 5, 5},
+    ['L'] = {4, 4, 4, 4, 7}, ['M'] = {5, 7, 7, 5, 5}, ['N'] = {6, 5, 5, 5, 5},
+    ['O'] = {2, 5, 5, 5, 2}, ['P'] = {6, 5, 6, 4, 4}, ['Q'] = {2, 5, 5, 6, 3},
+    ['R'] = {6, 5, 6, 5, 5}, ['S'] = {3, 4, 2, 1, 6}, ['T'] = {7, 2, 2, 2, 2},
+    ['U'] = {5, 5, 5, 5, 7}, ['V'] = {5, 5, 5, 5, 2}, ['W'] = {5, 5, 7, 7, 5},
+    ['X'] = {5, 5, 2, 5, 5}, ['Y'] = {5, 5, 2, 2, 2}, ['Z'] = {7, 1, 2, 4, 7},
+    ['.'] = {0, 0, 0, 0, 2}, ['%'] = {5, 1, 2, 4, 5}, [':'] = {0, 2, 0, 2, 0},
+    ['-'] = {0, 0, 7, 0, 0},
+};
+
+static void PERF_text(uint8_t *frame, int width, int height, int x, int y,
+                      const char *text) {
+  for (; *text; text++, x += 4) {
+    const uint8_t *glyph = font[*text & 0x7F];
+    for (int row = 0; row < 5; row++) {
+      for (int col = 0; col < 3; col++) {
+        int px = x + col, py = y + row;
+        if (px < width && py < height && (glyph[row] >> (2 - col)) & 1)
+          frame[py * width + px] = DISPLAY_TEXT;
+      }
+    }
+  }
+}
+
+void PERF_overlay(uint8_t *frame, int width, int height) {
+  PerfStats *s = &perf.stats;
+  char lines[3][48];
+  snprintf(lines[0], sizeof(lines[0]), "SPEED %.0f%%", s->speed);
+  snprintf(lines[1], sizeof(lines[1]), "P50 %.1f P99 %.1f MAX %.1f",
+           s->p50_ns / 1e6, s->p99_ns / 1e6, s->max_ns / 1e6);
+  snprintf(lines[2], sizeof(lines[2]), "CPU %.1f GFX %.1f OUT %.1f EV %.1f",
+           s->phase_ns[PERF_CPU] / 1e6, s->phase_ns[PERF_RENDER] / 1e6,
+           s->phase_ns[PERF_PRESENT] / 1e6, s->phase_ns[PERF_EVENTS] / 1e6);
+
+  // darken the area behind the text so it stays readable
+  int box_w = 0, box_h = 3 * 6 + 1;
+  for (int i = 0; i < 3; i++) {
+    int w = (int)strlen(lines[i]) * 4 + 1;
+    box_w = w > box_w ? w : box_w;
+  }
+  for (int y = 0; y < box_h && y < height; y++) {
+    for (int x = 0; x < box_w && x < width; x++) {
+      uint8_t *p = &frame[y * width + x];
+      if (*p < DISPLAY_DIM)
+        *p += DISPLAY_DIM;
+    }
+  }
+  for (int i = 0; i < 3; i++)
+    PERF_text(frame, width, height, 1, 1 + i * 6, lines[i]);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Host side frame timing. The frontend marks the end of each phase of a
+// frame with PERF_mark and the end of the frame with PERF_frame; the
+// rolling statistics over the last PERF_WINDOW frames are refreshed every
+// PERF_INTERVAL frames.
+
+#define PERF_WINDOW 600  // frames kept for the percentiles, 10s at 60fps
+#define PERF_INTERVAL 60 // frames between refreshes of the statistics
+#define PERF_BUCKETS 34  // 1ms histogram buckets, the last one is 33ms+
+
+typedef enum {
+  PERF_EVENTS,  // SDL event polling
+  PERF_CPU,     // CPU_run for the whole frame
+  PERF_RENDER,  // DISPLAY_gbmemory_to_sdl, the overlay and the scaler
+  PERF_PRESENT, // texture copy and present (includes vsync)
+  PERF_PHASES
+} PerfPhase;
+
+typedef struct {
+  uint64_t frames;                  // frames since PERF_init
+  uint64_t p50_ns, p99_ns, max_ns;  // frame time over the window
+  uint64_t phase_ns[PERF_PHASES];   // average per frame over the window
+  uint32_t histogram[PERF_BUCKETS]; // frames per 1ms of frame time
+  double speed; // emulated time against host time, 100 is full speed
+} PerfStats;
+
+// csv (optional) gets one row per frame, report prints a summary line to
+// stderr on every refresh
+bool PERF_init(const char *csv, bool report);
+uint64_t PERF_now(void);
+void PERF_mark(PerfPhase phase);
+void PERF_frame(uint64_t cycle_count);
+void PERF_query(PerfStats *stats);
+// draws the statistics over a frame with the overlay shades of render.h
+void PERF_overlay(uint8_t *frame, int width, int height);
@@ -0,0 +1,343 @@
+#include "ppu.h"
+#include "debug.h"
+#include "render.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PPU_LINE 456           // dots per scanline
+#define PPU_LINES 154          // scanlines per frame, 144 visible
+#define PPU_OAM_SCAN 80        // dots of mode 2
+#define PPU_FRAME (PPU_LINE * PPU_LINES)
+#define PPU_SPRITES 10         // per line
+#define PPU_START_DELAY 7      // mode 3 dots before the first fetch
+#define PPU_FETCH 6            // dots to fetch 8 pixels of a tile
+
+struct Ppu {
+  uint8_t pixels[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+  bool lcd_on;
+  bool frame_done;
+  bool stat_line; // interrupts fire on its rising edge
+  int dot;        // dot in the current line
+  int mode;
+  int off_dots; // dots run with the LCD off
+
+  // mode 2: sprites on this line in OAM order, fetched ones have their bit
+  uint8_t sprites[PPU_SPRITES];
+  int sprite_count;
+  uint16_t sprites_done;
+
+  // mode 3
+  int lx;      // next screen column
+  int delay;   // dots until the fetcher starts
+  int discard; // pixels dropped for SCX or a window left of the screen
+  bool window_y; // WY matched LY this frame
+  bool window;   // fetching the window on this line
+  int window_line;
+
+  // background/window fetcher, reads a byte every 2 dots then waits for
+  // the FIFO to empty
+  int fetch_dot;
+  int fetch_x; // tile column
+  uint8_t tile, low, high;
+
+  uint8_t bg[8]; // color numbers
+  int bg_head, bg_count;
+
+  // sprite pixels line up with the next 8 background pixels, color 0 is
+  // transparent
+  uint8_t obj_color[8];
+  uint8_t obj_attr[8];
+  int obj_head;
+
+  int sprite; // selected sprite being fetched, -1 when none
+  int sprite_dot;
+};
+
+static void PPU_stat(CPU *cpu, Ppu *p) {
+  if (cpu->ly == cpu->lyc)
+    cpu->stat |= 0x04;
+  else
+    cpu->stat &= ~0x04;
+  cpu->stat = (cpu->stat & 0xFC) | p->mode;
+
+  bool line = ((cpu->stat & 0x08) && p->mode == 0) ||
+              ((cpu->stat & 0x10) && p->mode == 1) ||
+              ((cpu->stat & 0x20) && p->mode == 2) ||
+              ((cpu->stat & 0x40) && (cpu->stat & 0x04));
+  if (line && !p->stat_line)
+    cpu->if_reg |= 0x02;
+  p->stat_line = line;
+}
+
+static void PPU_mode(CPU *cpu, Ppu *p, int mode) {
+  static const uint8_t locks[4] = {0, 0, BUS_OAM, BUS_OAM | BUS_VRAM};
+  p->mode = mode;
+  CPU_bus_lock(cpu, (cpu->bus_lock & BUS_DMA) | locks[mode]);
+  PPU_stat(cpu, p);
+}
+
+static void PPU_line(CPU *cpu, Ppu *p) {
+  p->dot = 0;
+  if (cpu->ly < DISPLAY_HEIGHT) {
+    if (cpu->ly == cpu->wy)
+      p->window_y = true;
+    p->sprite_count = 0;
+    PPU_mode(cpu, p, 2);
+  } else if (cpu->ly == DISPLAY_HEIGHT) {
+    cpu->if_reg |= 0x01; // vblank
+    PPU_mode(cpu, p, 1);
+  } else {
+    PPU_stat(cpu, p);
+  }
+}
+
+static void PPU_mode3(CPU *cpu, Ppu *p) {
+  p->lx = 0;
+  p->delay = PPU_START_DELAY;
+  p->discard = cpu->scx & 0x07;
+  p->window = false;
+  p->fetch_dot = 0;
+  p->fetch_x = 0;
+  p->bg_count = 0;
+  memset(p->obj_color, 0, sizeof(p->obj_color));
+  p->sprite = -1;
+  p->sprites_done = 0;
+  PPU_mode(cpu, p, 3);
+}
+
+// one OAM entry every 2 dots
+static void PPU_scan(CPU *cpu, Ppu *p) {
+  if (p->dot & 1 || p->sprite_count == PPU_SPRITES)
+    return;
+  int index = p->dot / 2;
+  int height = cpu->lcdc & 0x04 ? 16 : 8;
+  int y = cpu->ly + 16 - cpu->_memory[MEM_OAM + index * 4];
+  if (y >= 0 && y < height)
+    p->sprites[p->sprite_count++] = index;
+}
+
+static void PPU_fetch_byte(CPU *cpu, Ppu *p) {
+  uint8_t *vram = &cpu->_memory[MEM_VRAM];
+  if (p->fetch_dot == 2) {
+    int x, y;
+    uint16_t map;
+    if (p->window) {
+      map = cpu->lcdc & 0x40 ? 0x1C00 : 0x1800;
+      x = p->fetch_x & 31;
+      y = p->window_line / 8;
+    } else {
+      map = cpu->lcdc & 0x08 ? 0x1C00 : 0x1800;
+      x = ((cpu->scx >> 3) + p->fetch_x) & 31;
+      y = (uint8_t)(cpu->ly + cpu->scy) / 8;
+    }
+    p->tile = vram[map + y * 32 + x];
+  } else {
+    int row = p->window ? p->window_line & 7 : (cpu->ly + cpu->scy) & 7;
+    uint8_t *data = get_tile_address(p->tile, cpu->lcdc, vram) + row * 2;
+    if (p->fetch_dot == 4)
+      p->low = data[0];
+    else
+      p->high = data[1];
+  }
+}
+
+static void PPU_fetch(CPU *cpu, Ppu *p) {
+  if (p->fetch_dot < PPU_FETCH && ++p->fetch_dot % 2 == 0)
+    PPU_fetch_byte(cpu, p);
+
+  if (p->fetch_dot == PPU_FETCH && p->bg_count == 0) {
+    for (int i = 0; i < 8; i++) {
+      int bit = 7 - i;
+      p->bg[i] = ((p->low >> bit) & 1) | (((p->high >> bit) & 1) << 1);
+    }
+    p->bg_head = 0;
+    p->bg_count = 8;
+    p->fetch_dot = 0;
+    p->fetch_x++;
+  }
+}
+
+// sprite pixels only fill slots still transparent, so sprites fetched
+// first (further left, or earlier in OAM) win
+static void PPU_fetch_sprite(CPU *cpu, Ppu *p, int index) {
+  uint8_t *oam = &cpu->_memory[MEM_OAM + index * 4];
+  int height = cpu->lcdc & 0x04 ? 16 : 8;
+  int row = cpu->ly + 16 - oam[0];
+  uint8_t tile = oam[2];
+  uint8_t attr = oam[3];
+  if (attr & 0x40)
+    row = height - 1 - row;
+  if (height == 16)
+    tile &= 0xFE;
+  uint8_t *data = &cpu->_memory[MEM_VRAM + tile * 16 + row * 2];
+
+  int skip = oam[1] < 8 ? 8 - oam[1] : 0;
+  for (int i = skip; i < 8; i++) {
+    int bit = attr & 0x20 ? i : 7 - i;
+    uint8_t color = ((data[0] >> bit) & 1) | (((data[1] >> bit) & 1) << 1);
+    int slot = (p->obj_head + i - skip) & 7;
+    if (color && !p->obj_color[slot]) {
+      p->obj_color[slot] = color;
+      p->obj_attr[slot] = attr;
+    }
+  }
+}
+
+static int PPU_sprite_at(CPU *cpu, Ppu *p) {
+  for (int i = 0; i < p->sprite_count; i++) {
+    if (p->sprites_done & (1 << i))
+      continue;
+    uint8_t x = cpu->_memory[MEM_OAM + p->sprites[i] * 4 + 1];
+    if (x == p->lx + 8 || (x > 0 && x < 8 && p->lx == 0))
+      return i;
+  }
+  return -1;
+}
+
+static void PPU_pixel(CPU *cpu, Ppu *p) {
+  uint8_t bg = p->bg[p->bg_head++];
+  p->bg_count--;
+  if (p->discard) {
+    p->discard--;
+    return;
+  }
+
+  uint8_t obj = p->obj_color[p->obj_head];
+  uint8_t attr = p->obj_attr[p->obj_head];
+  p->obj_color[p->obj_head] = 0;
+  p->obj_head = (p->obj_head + 1) & 7;
+
+  if (!(cpu->lcdc & 0x01))
+    bg = 0; // background off shows color 0, sprites stay
+  uint8_t shade;
+  if (obj && (cpu->lcdc & 0x02) && !((attr & 0x80) && bg))
+    shade = ((attr & 0x10 ? cpu->obp1 : cpu->obp0) >> (obj * 2)) & 0x03;
+  else
+    shade = (cpu->bgp >> (bg * 2)) & 0x03;
+  p->pixels[cpu->ly * DISPLAY_WIDTH + p->lx++] = shade;
+}
+
+static void PPU_draw(CPU *cpu, Ppu *p) {
+  if (p->delay) {
+    p->delay--;
+    return;
+  }
+
+  // the window restarts the fetcher where it begins
+  if (!p->window && !p->discard && (cpu->lcdc & 0x20) && p->window_y &&
+      cpu->wx <= 166 && p->lx + 7 >= cpu->wx) {
+    p->window = true;
+    p->fetch_dot = 0;
+    p->fetch_x = 0;
+    p->bg_count = 0;
+    if (cpu->wx < 7)
+      p->discard = 7 - cpu->wx;
+  }
+
+  // a sprite waits for the background fetch under way, then takes its own
+  if (p->sprite < 0 && !p->discard && (cpu->lcdc & 0x02))
+    p->sprite = PPU_sprite_at(cpu, p);
+  if (p->sprite >= 0) {
+    if (p->fetch_dot < PPU_FETCH || p->bg_count == 0) {
+      PPU_fetch(cpu, p);
+    } else if (++p->sprite_dot == PPU_FETCH) {
+      PPU_fetch_sprite(cpu, p, p->sprites[p->sprite]);
+      p->sprites_done |= 1 << p->sprite;
+      p->sprite = -1;
+      p->sprite_dot = 0;
+    }
+    return;
+  }
+
+  PPU_fetch(cpu, p);
+  if (p->bg_count)
+    PPU_pixel(cpu, p);
+  if (p->lx == DISPLAY_WIDTH) {
+    if (p->window)
+      p->window_line++;
+    PPU_mode(cpu, p, 0);
+  }
+}
+
+static void PPU_dot(CPU *cpu, Ppu *p) {
+  if (!(cpu->lcdc & 0x80)) {
+    // off: LY stays 0 and the screen blank, frames still come
+    if (p->lcd_on) {
+      p->lcd_on = false;
+      p->off_dots = 0;
+      cpu->ly = 0;
+      PPU_mode(cpu, p, 0);
+      memset(p->pixels, 0, sizeof(p->pixels));
+    }
+    if (++p->off_dots == PPU_FRAME) {
+      p->off_dots = 0;
+      p->frame_done = true;
+    }
+    return;
+  }
+  if (!p->lcd_on) {
+    p->lcd_on = true;
+    p->window_y = false;
+    p->window_line = 0;
+    cpu->ly = 0;
+    PPU_line(cpu, p);
+  }
+
+  switch (p->mode) {
+  case 2:
+    PPU_scan(cpu, p);
+    if (p->dot + 1 == PPU_OAM_SCAN)
+      PPU_mode3(cpu, p);
+    break;
+  case 3:
+    PPU_draw(cpu, p);
+    break;
+  }
+
+  if (++p->dot == PPU_LINE) {
+    if (++cpu->ly == PPU_LINES) {
+      cpu->ly = 0;
+      p->window_y = false;
+      p->window_line = 0;
+      p->frame_done = true;
+    }
+    PPU_line(cpu, p);
+  }
+}
+
+void PPU_frame(CPU *cpu, int batches) {
+  Ppu *p = cpu->ppu;
+  // a frame the debugger stopped goes on from the dot it stopped at
+  for (int i = 0; i < batches && !DEBUG_paused(cpu); i++) {
+    p->frame_done = false;
+    while (!p->frame_done && !DEBUG_paused(cpu)) {
+      uint64_t start = cpu->cycle_count;
+      CPU_step(cpu);
+      for (uint64_t dots = cpu->cycle_count - start; dots > 0; dots--)
+        PPU_dot(cpu, p);
+      // the CPU may have changed LYC or the STAT enables
+      PPU_stat(cpu, p);
+    }
+  }
+}
+
+bool PPU_start(CPU *cpu) {
+  if (cpu->ppu)
+    return true;
+  Ppu *p = calloc(1, sizeof(Ppu));
+  if (!p)
+    return false;
+  p->sprite = -1;
+  cpu->ppu = p;
+  return true;
+}
+
+void PPU_stop(CPU *cpu) {
+  if (!cpu->ppu)
+    return;
+  CPU_bus_lock(cpu, cpu->bus_lock & BUS_DMA);
+  free(cpu->ppu);
+  cpu->ppu = NULL;
+}
+
+const uint8_t *PPU_pixels(CPU *cpu) { return cpu->ppu->pixels; }
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Dot accurate PPU, the "dot" accuracy profile. It runs alongside the CPU
+// 4 dots per instruction: OAM scan, a pixel FIFO with the background/window
+// fetcher and sprite fetches, so mode 3 gets longer with SCX, the window
+// and sprites, and register writes show up mid scanline. The STAT interrupt
+// fires on the rising edge of its line, VRAM and OAM are locked to the CPU
+// while the PPU uses them.
+//
+// It drives the same registers as the fast profile and a frame ends at the
+// same point, where it holds no state of its own, so save states and
+// movies work with either profile.
+
+bool PPU_start(CPU *cpu);
+void PPU_stop(CPU *cpu);
+// called by CPU_frame when the PPU is on
+void PPU_frame(CPU *cpu, int batches);
+// the last frame, DISPLAY_WIDTH x DISPLAY_HEIGHT shades like render.c's
+const uint8_t *PPU_pixels(CPU *cpu);
@@ -0,0 +1,633 @@
+#include "profiler.h"
+
+#ifdef GB_PROFILE
+
+#include "cartridge.h"
+#include "cpu.h"
+#include "symbols.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_FILE "profile.txt"
+#define PROFILE_FOLDED "profile.folded"
+#define PROFILE_TOP 20
+#define PROFILE_NODES 65536 // call stacks told apart, a new one past that
+                            // is charged to its caller
+#define PROFILE_DEPTH 256   // shadow stack frames
+#define PROFILE_LABEL 64
+#define RAM_ENTRIES 0x8000 // 0x8000-0xFFFF, code running outside the ROM
+#define PROFILE_CYCLES 4   // CPU_instruction charges 4 cycles for everything
+
+typedef struct {
+  uint64_t starts;     // straight-line runs starting here
+  uint64_t cuts;       // runs left just before executing this address
+  uint32_t calls;      // entered through CALL, RST or an interrupt
+  uint32_t iterations; // reached through a backward jump
+  uint16_t loop_end;   // address of the backward jump closing the loop
+} ProfileEntry;
+
+// how an opcode transfers control; the unconditional kinds end a run
+enum {
+  OP_PLAIN,
+  OP_BRANCH,    // jr cc, jp cc
+  OP_CALL_COND, // call cc
+  OP_RET_COND,  // ret cc
+  OP_JUMP,      // jr, jp, jp hl
+  OP_CALL,      // call
+  OP_RST,       // rst
+  OP_RET,       // ret, reti
+};
+
+static uint8_t profile_kind[256];
+static OpcodeHandler profile_original[256];
+static uint8_t opcode_length[256];
+
+static CPU *profiled;
+static bool suspended; // the hooks record nothing
+static ProfileEntry *entries; // one per ROM byte, then RAM_ENTRIES
+static size_t rom_entries;
+static uint8_t mapped_bank;
+static size_t bank_base;
+
+static uint64_t vector_count[5];
+static uint64_t halted_cycles;
+
+static const char *vector_names[5] = {"vblank", "stat", "timer", "serial",
+                                      "joypad"};
+
+static Symbols *symbols; // NULL without a symbol file
+
+// the call tree, node 0 is the entry point; a node is a function (entry
+// index of its first instruction) reached through the stack of its parents
+typedef struct {
+  uint32_t parent;
+  uint32_t function;
+  uint64_t cycles; // executed while this was the stack, callees apart
+  uint64_t halted;
+} ProfileNode;
+
+// a shadow stack frame, sp is where its return address is on the guest
+// stack
+typedef struct {
+  uint32_t node;
+  uint16_t sp;
+} ProfileFrame;
+
+static ProfileNode *nodes;
+static uint32_t node_count;
+static uint32_t *node_table; // (parent, function) hash, node + 1, 0 is free
+static ProfileFrame frames[PROFILE_DEPTH];
+static int depth;
+static uint64_t charged; // cycle_count the stack was charged up to
+
+// ROM addresses are keyed by their file offset so each bank gets its own
+// counters
+static size_t PROFILE_index(CPU *cpu, uint16_t pc) {
+  size_t index;
+  if (pc < 0x4000) {
+    index = pc;
+  } else if (pc < 0x8000) {
+    uint8_t bank = cpu->cart->rom_bank & 0x1F;
+    if (bank != mapped_bank) {
+      mapped_bank = bank;
+      bank_base = (bank * 0x4000) % rom_entries;
+    }
+    index = bank_base + (pc - 0x4000);
+  } else {
+    return rom_entries + (pc - 0x8000);
+  }
+  return index < rom_entries ? index : index % rom_entries;
+}
+
+static uint16_t PROFILE_address(size_t index) {
+  if (index >= rom_entries)
+    return index - rom_entries + 0x8000;
+  return index < 0x4000 ? index : 0x4000 + index % 0x4000;
+}
+
+static void PROFILE_format(char *buf, size_t len, size_t index) {
+  if (index >= rom_entries)
+    snprintf(buf, len, "--:%04X", PROFILE_address(index));
+  else
+    snprintf(buf, len, "%02X:%04X", (unsigned)(index / 0x4000) & 0xFF,
+             PROFILE_address(index));
+}
+
+// the bank symbol files give an entry, RAM is bank 0
+static uint8_t PROFILE_bank(size_t index) {
+  return index >= rom_entries ? 0 : index / 0x4000;
+}
+
+// the label an entry is at or in, "" without symbols
+static void PROFILE_label(char *buf, size_t len, size_t index, bool local) {
+  buf[0] = '\0';
+  if (symbols)
+    SYM_format(symbols, PROFILE_bank(index), PROFILE_address(index), local,
+               buf, len);
+}
+
+// whether a global label starts at an entry
+static bool PROFILE_labelled(size_t index) {
+  uint16_t offset;
+  return symbols && SYM_lookup(symbols, PROFILE_bank(index),
+                               PROFILE_address(index), false, &offset) &&
+         !offset;
+}
+
+// entries belong to the same bank (or to the RAM area) as each other
+static size_t PROFILE_region(size_t index) {
+  return index >= rom_entries ? SIZE_MAX : index / 0x4000;
+}
+
+// memory read around the bus, whose watches and locks are not for the
+// profiler's own reads
+static uint8_t PROFILE_peek(CPU *cpu, uint16_t address) {
+  uint8_t byte;
+  CPU_gather(cpu, address, 1, &byte);
+  return byte;
+}
+
+// code bytes as they are now, I/O registers never hold code
+static uint8_t PROFILE_byte(size_t index) {
+  if (index < rom_entries)
+    return profiled->cart->rom[index];
+  uint16_t addr = PROFILE_address(index);
+  if ((addr >= 0xFF00 && addr <= 0xFF7F) || addr == 0xFFFF)
+    return 0;
+  return PROFILE_peek(profiled, addr);
+}
+
+static void PROFILE_start(CPU *cpu, uint16_t pc) {
+  entries[PROFILE_index(cpu, pc)].starts++;
+}
+
+static void PROFILE_cut(CPU *cpu, uint16_t pc) {
+  entries[PROFILE_index(cpu, pc)].cuts++;
+}
+
+static uint32_t PROFILE_node(void) {
+  return depth ? frames[depth - 1].node : 0;
+}
+
+// the cycles from the last charge up to now go to the stack as it is; a
+// snapshot put back (run-ahead) moves cycle_count back, which is skipped
+static void PROFILE_charge(uint64_t now) {
+  if (now > charged)
+    nodes[PROFILE_node()].cycles += now - charged;
+  charged = now;
+}
+
+// the node for function called from parent, parent itself once the tree
+// is full
+static uint32_t PROFILE_child(uint32_t parent, uint32_t function) {
+  uint32_t mask = PROFILE_NODES * 2 - 1;
+  uint32_t slot = (parent * 0x9E3779B1u ^ function * 0x85EBCA77u) & mask;
+  for (; node_table[slot]; slot = (slot + 1) & mask) {
+    ProfileNode *node = &nodes[node_table[slot] - 1];
+    if (node->parent == parent && node->function == function)
+      return node_table[slot] - 1;
+  }
+  if (node_count == PROFILE_NODES)
+    return parent;
+  nodes[node_count] = (ProfileNode){parent, function, 0, 0};
+  node_table[slot] = ++node_count;
+  return node_count - 1;
+}
+
+// a call, rst or interrupt to PC, its return address now at sp; frames
+// at or below sp were left without a return (the stack pointer was reset
+// or the return address dropped) and go first
+static void PROFILE_enter(CPU *cpu, uint16_t sp) {
+  PROFILE_charge(cpu->cycle_count);
+  while (depth && frames[depth - 1].sp <= sp)
+    depth--;
+  // with the shadow stack full the call stays with its caller, the same
+  // as the cycles it runs, so no stack is deeper than PROFILE_DEPTH
+  if (depth == PROFILE_DEPTH)
+    return;
+  uint32_t node = PROFILE_child(PROFILE_node(), PROFILE_index(cpu, cpu->PC));
+  frames[depth++] = (ProfileFrame){node, sp};
+}
+
+// a return that took its address from sp, which leaves every frame at or
+// below it
+static void PROFILE_leave(CPU *cpu, uint16_t sp) {
+  PROFILE_charge(cpu->cycle_count);
+  while (depth && frames[depth - 1].sp <= sp)
+    depth--;
+}
+
+// runs the real handler, then records where control went; kind is a
+// constant in each hook below so the checks fold away
+static inline void PROFILE_control(CPU *cpu, uint8_t opcode, int kind) {
+  uint16_t pc = cpu->PC - 1, sp = cpu->SP;
+  profile_original[opcode](cpu, opcode);
+  if (cpu != profiled || suspended)
+    return;
+
+  if (kind < OP_JUMP) {
+    // conditional, a run only ends here when the branch was taken
+    uint16_t next = pc + opcode_length[opcode];
+    if (cpu->PC == next)
+      return;
+    PROFILE_cut(cpu, next);
+  }
+  ProfileEntry *target = &entries[PROFILE_index(cpu, cpu->PC)];
+  target->starts++;
+
+  if (kind == OP_CALL || kind == OP_CALL_COND || kind == OP_RST) {
+    target->calls++;
+    PROFILE_enter(cpu, cpu->SP);
+  } else if (kind == OP_RET || kind == OP_RET_COND) {
+    PROFILE_leave(cpu, sp);
+  } else if ((kind == OP_JUMP || kind == OP_BRANCH) && cpu->PC <= pc) {
+    target->iterations++;
+    if (pc > target->loop_end)
+      target->loop_end = pc;
+  }
+}
+
+static void PROFILE_branch(CPU *cpu, uint8_t op) {
+  PROFILE_control(cpu, op, OP_BRANCH);
+}
+static void PROFILE_call_cond(CPU *cpu, uint8_t op) {
+  PROFILE_control(cpu, op, OP_CALL_COND);
+}
+static void PROFILE_ret_cond(CPU *cpu, uint8_t op) {
+  PROFILE_control(cpu, op, OP_RET_COND);
+}
+static void PROFILE_jump(CPU *cpu, uint8_t op) {
+  PROFILE_control(cpu, op, OP_JUMP);
+}
+static void PROFILE_call(CPU *cpu, uint8_t op) {
+  PROFILE_control(cpu, op, OP_CALL);
+}
+static void PROFILE_rst(CPU *cpu, uint8_t op) {
+  PROFILE_control(cpu, op, OP_RST);
+}
+static void PROFILE_ret(CPU *cpu, uint8_t op) {
+  PROFILE_control(cpu, op, OP_RET);
+}
+
+static const OpcodeHandler profile_hooks[] = {
+    [OP_BRANCH] = PROFILE_branch,
+    [OP_CALL_COND] = PROFILE_call_cond,
+    [OP_RET_COND] = PROFILE_ret_cond,
+    [OP_JUMP] = PROFILE_jump,
+    [OP_CALL] = PROFILE_call,
+    [OP_RST] = PROFILE_rst,
+    [OP_RET] = PROFILE_ret,
+};
+
+void PROFILE_init(CPU *cpu, const char *rom, const char *symbol_file) {
+  profiled = cpu;
+  rom_entries = cpu->cart->rom_size;
+  entries = calloc(rom_entries + RAM_ENTRIES, sizeof(ProfileEntry));
+  nodes = malloc(PROFILE_NODES * sizeof(ProfileNode));
+  node_table = calloc(PROFILE_NODES * 2, sizeof(uint32_t));
+  if (!entries || !nodes || !node_table) {
+    fprintf(stderr, "profiler: out of memory\n");
+    exit(1);
+  }
+  mapped_bank = 1;
+  bank_base = 0x4000 % rom_entries;
+
+  for (int op = 0; op < 256; op++)
+    opcode_length[op] = 1;
+  for (int r = 0; r < 8; r++) {
+    opcode_length[0x06 | (r << 3)] = 2; // ld r8, imm8
+    opcode_length[0xC6 | (r << 3)] = 2; // alu a, imm8
+  }
+  for (int r = 0; r < 4; r++)
+    opcode_length[0x01 | (r << 4)] = 3; // ld r16, imm16
+  static const uint8_t two[] = {0x18, 0x20, 0x28, 0x30, 0x38, 0xCB,
+                                0xE0, 0xE8, 0xF0, 0xF8};
+  static const uint8_t three[] = {0x08, 0xC2, 0xC3, 0xC4, 0xCA, 0xCC, 0xCD,
+                                  0xD2, 0xD4, 0xDA, 0xDC, 0xEA, 0xFA};
+  for (size_t i = 0; i < sizeof(two); i++)
+    opcode_length[two[i]] = 2;
+  for (size_t i = 0; i < sizeof(three); i++)
+    opcode_length[three[i]] = 3;
+
+  uint8_t *kind = profile_kind;
+  kind[0x18] = OP_JUMP; // jr
+  kind[0xC3] = OP_JUMP; // jp
+  kind[0xE9] = OP_JUMP; // jp hl
+  kind[0xCD] = OP_CALL;
+  kind[0xC9] = OP_RET;
+  kind[0xD9] = OP_RET; // reti
+  for (int cond = 0; cond < 4; cond++) {
+    kind[0x20 | (cond << 3)] = OP_BRANCH; // jr cc
+    kind[0xC2 | (cond << 3)] = OP_BRANCH; // jp cc
+    kind[0xC4 | (cond << 3)] = OP_CALL_COND;
+    kind[0xC0 | (cond << 3)] = OP_RET_COND;
+  }
+  for (int tgt = 0; tgt < 8; tgt++)
+    kind[0xC7 | (tgt << 3)] = OP_RST;
+  for (int op = 0; op < 256; op++) {
+    if (kind[op] && !profile_original[op])
+      profile_original[op] = CPU_hook_opcode(op, profile_hooks[kind[op]]);
+  }
+
+  symbols = symbol_file ? SYM_load(symbol_file) : SYM_load_for(rom);
+  if (symbol_file && !symbols)
+    fprintf(stderr, "profiler: no symbols in %s\n", symbol_file);
+  else if (symbols)
+    printf("profiler: %zu symbols\n", SYM_count(symbols));
+
+  // the entry point is a function even though nothing calls it, and the
+  // root of the call tree
+  entries[PROFILE_index(cpu, cpu->PC)].calls++;
+  PROFILE_start(cpu, cpu->PC);
+  nodes[node_count++] =
+      (ProfileNode){UINT32_MAX, PROFILE_index(cpu, cpu->PC), 0, 0};
+  charged = cpu->cycle_count;
+  atexit(PROFILE_dump);
+}
+
+void PROFILE_interrupt(CPU *cpu, int vector) {
+  if (cpu != profiled || suspended)
+    return;
+  // the return address was pushed just below SP
+  uint16_t ret =
+      PROFILE_peek(cpu, cpu->SP) | (PROFILE_peek(cpu, cpu->SP + 1) << 8);
+  vector_count[vector]++;
+  PROFILE_cut(cpu, ret);
+  PROFILE_start(cpu, cpu->PC);
+  entries[PROFILE_index(cpu, cpu->PC)].calls++;
+  PROFILE_enter(cpu, cpu->SP);
+}
+
+void PROFILE_suspend(CPU *cpu, bool suspend) {
+  if (cpu == profiled)
+    suspended = suspend;
+}
+
+void PROFILE_halted(CPU *cpu, int cycles) {
+  if (cpu != profiled || suspended)
+    return;
+  halted_cycles += cycles;
+  PROFILE_charge(cpu->cycle_count - cycles);
+  nodes[PROFILE_node()].halted += cycles;
+  charged = cpu->cycle_count;
+}
+
+// rebuild how often each address ran: runs flow from an instruction into
+// the one after it unless it ends in an unconditional transfer
+static uint64_t *PROFILE_counts(size_t n) {
+  uint64_t *counts = calloc(n, sizeof(uint64_t));
+  if (!counts)
+    return NULL;
+
+  // the run in progress has not reached the current PC yet
+  size_t current = PROFILE_index(profiled, profiled->PC);
+  entries[current].cuts++;
+
+  for (size_t i = 0; i < n; i++) {
+    uint64_t in = counts[i] + entries[i].starts;
+    counts[i] = in > entries[i].cuts ? in - entries[i].cuts : 0;
+    if (!counts[i])
+      continue;
+    uint8_t opcode = PROFILE_byte(i);
+    if (profile_kind[opcode] >= OP_JUMP)
+      continue;
+    size_t next = i + opcode_length[opcode];
+    if (next < n && PROFILE_region(next) == PROFILE_region(i))
+      counts[next] += counts[i];
+  }
+
+  entries[current].cuts--;
+  return counts;
+}
+
+typedef struct {
+  size_t index;
+  uint64_t cycles;
+  uint64_t instructions;
+} ProfileRow;
+
+static int PROFILE_by_cycles(const void *a, const void *b) {
+  const ProfileRow *ra = a, *rb = b;
+  if (ra->cycles != rb->cycles)
+    return ra->cycles < rb->cycles ? 1 : -1;
+  return ra->index < rb->index ? -1 : ra->index > rb->index;
+}
+
+static double PROFILE_percent(uint64_t part, uint64_t whole) {
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+static void PROFILE_top_addresses(FILE *f, ProfileRow *rows,
+                                  const uint64_t *counts, size_t n,
+                                  uint64_t total) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (counts[i])
+      rows[count++] = (ProfileRow){i, counts[i] * PROFILE_CYCLES, counts[i]};
+  }
+  qsort(rows, count, sizeof(ProfileRow), PROFILE_by_cycles);
+
+  fprintf(f, "\ntop addresses:\n");
+  fprintf(f, "  %-8s %14s %14s %7s\n", "address", "instructions", "cycles",
+          "%");
+  for (size_t i = 0; i < count && i < PROFILE_TOP; i++) {
+    char name[16], label[PROFILE_LABEL];
+    PROFILE_format(name, sizeof(name), rows[i].index);
+    PROFILE_label(label, sizeof(label), rows[i].index, true);
+    fprintf(f, "  %-8s %14llu %14llu %6.2f%%  %s\n", name,
+            (unsigned long long)rows[i].instructions,
+            (unsigned long long)rows[i].cycles,
+            PROFILE_percent(rows[i].cycles, total), label);
+  }
+}
+
+// functions are the targets of calls, rsts and interrupts and, with
+// symbols, the global labels; every executed address is charged to the
+// closest function entry below it in its bank
+static void PROFILE_top_functions(FILE *f, ProfileRow *rows,
+                                  const uint64_t *counts, size_t n,
+                                  uint64_t total) {
+  size_t count = 0;
+  size_t current = SIZE_MAX;
+  for (size_t i = 0; i < n; i++) {
+    if (current != SIZE_MAX &&
+        PROFILE_region(rows[current].index) != PROFILE_region(i))
+      current = SIZE_MAX;
+    if (entries[i].calls || PROFILE_labelled(i)) {
+      rows[count] = (ProfileRow){i, 0, 0};
+      current = count++;
+    }
+    if (current != SIZE_MAX) {
+      rows[current].cycles += counts[i] * PROFILE_CYCLES;
+      rows[current].instructions += counts[i];
+    }
+  }
+  qsort(rows, count, sizeof(ProfileRow), PROFILE_by_cycles);
+
+  fprintf(f, "\ntop functions (self time):\n");
+  fprintf(f, "  %-8s %10s %14s %14s %7s\n", "entry", "calls", "instructions",
+          "cycles", "%");
+  for (size_t i = 0; i < count && i < PROFILE_TOP; i++) {
+    if (!rows[i].cycles)
+      break;
+    char name[16], label[PROFILE_LABEL];
+    PROFILE_format(name, sizeof(name), rows[i].index);
+    PROFILE_label(label, sizeof(label), rows[i].index, false);
+    fprintf(f, "  %-8s %10u %14llu %14llu %6.2f%%  %s\n", name,
+            entries[rows[i].index].calls,
+            (unsigned long long)rows[i].instructions,
+            (unsigned long long)rows[i].cycles,
+            PROFILE_percent(rows[i].cycles, total), label);
+  }
+}
+
+// loops are backward jump targets, the body runs up to the furthest jump
+static void PROFILE_top_loops(FILE *f, ProfileRow *rows,
+                              const uint64_t *counts, size_t n,
+                              uint64_t total) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!entries[i].iterations)
+      continue;
+    ProfileRow row = {i, 0, 0};
+    size_t end = i + (uint16_t)(entries[i].loop_end - PROFILE_address(i));
+    for (size_t j = i; j <= end && j < n; j++) {
+      row.cycles += counts[j] * PROFILE_CYCLES;
+      row.instructions += counts[j];
+    }
+    rows[count++] = row;
+  }
+  qsort(rows, count, sizeof(ProfileRow), PROFILE_by_cycles);
+
+  fprintf(f, "\ntop loops:\n");
+  fprintf(f, "  %-8s %-6s %12s %14s %7s\n", "head", "end", "iterations",
+          "cycles", "%");
+  for (size_t i = 0; i < count && i < PROFILE_TOP; i++) {
+    char name[16], label[PROFILE_LABEL];
+    PROFILE_format(name, sizeof(name), rows[i].index);
+    PROFILE_label(label, sizeof(label), rows[i].index, true);
+    fprintf(f, "  %-8s %04X   %12u %14llu %6.2f%%  %s\n", name,
+            entries[rows[i].index].loop_end, entries[rows[i].index].iterations,
+            (unsigned long long)rows[i].cycles,
+            PROFILE_percent(rows[i].cycles, total), label);
+  }
+}
+
+// CB prefixed opcodes get rows 0x100-0x1FF instead of sharing the 0xCB row
+static void PROFILE_top_opcodes(FILE *f, ProfileRow *rows,
+                                const uint64_t *counts, size_t n,
+                                uint64_t total) {
+  for (unsigned op = 0; op < 512; op++)
+    rows[op] = (ProfileRow){op, 0, 0};
+  for (size_t i = 0; i < n; i++) {
+    if (!counts[i])
+      continue;
+    unsigned op = PROFILE_byte(i);
+    if (op == 0xCB && i + 1 < n)
+      op = 0x100 | PROFILE_byte(i + 1);
+    rows[op].instructions += counts[i];
+    rows[op].cycles += counts[i] * PROFILE_CYCLES;
+  }
+  qsort(rows, 512, sizeof(ProfileRow), PROFILE_by_cycles);
+
+  fprintf(f, "\ntop opcodes:\n");
+  fprintf(f, "  %-8s %14s %14s %7s\n", "opcode", "count", "cycles", "%");
+  for (size_t i = 0; i < 512 && i < PROFILE_TOP; i++) {
+    if (!rows[i].cycles)
+      break;
+    char name[16];
+    snprintf(name, sizeof(name), "%s%02X", rows[i].index & 0x100 ? "CB " : "",
+             (unsigned)rows[i].index & 0xFF);
+    fprintf(f, "  %-8s %14llu %14llu %6.2f%%\n", name,
+            (unsigned long long)rows[i].instructions,
+            (unsigned long long)rows[i].cycles,
+            PROFILE_percent(rows[i].cycles, total));
+  }
+}
+
+// the functions from the entry point down to node, "entry;caller;callee",
+// named by symbol or as BB:AAAA
+static void PROFILE_stack(FILE *f, uint32_t node) {
+  uint32_t stack[PROFILE_DEPTH + 1]; // the root and a node per frame
+  int n = 0;
+  for (; node != UINT32_MAX; node = nodes[node].parent)
+    stack[n++] = node;
+  while (n--) {
+    char name[PROFILE_LABEL];
+    size_t function = nodes[stack[n]].function;
+    SYM_format(symbols, PROFILE_bank(function), PROFILE_address(function),
+               false, name, sizeof(name));
+    fprintf(f, "%s%s", name, n ? ";" : "");
+  }
+}
+
+// one line per call stack that ran with its cycles, the halted ones under
+// a [halted] frame on top of the stack that halted
+static bool PROFILE_folded(void) {
+  FILE *f = fopen(PROFILE_FOLDED, "w");
+  if (!f)
+    return false;
+  for (uint32_t i = 0; i < node_count; i++) {
+    if (nodes[i].cycles) {
+      PROFILE_stack(f, i);
+      fprintf(f, " %llu\n", (unsigned long long)nodes[i].cycles);
+    }
+    if (nodes[i].halted) {
+      PROFILE_stack(f, i);
+      fprintf(f, ";[halted] %llu\n", (unsigned long long)nodes[i].halted);
+    }
+  }
+  return fclose(f) == 0;
+}
+
+void PROFILE_dump(void) {
+  if (!entries)
+    return;
+  size_t n = rom_entries + RAM_ENTRIES;
+  uint64_t *counts = PROFILE_counts(n);
+  ProfileRow *rows = malloc((n > 512 ? n : 512) * sizeof(ProfileRow));
+  FILE *f = counts && rows ? fopen(PROFILE_FILE, "w") : NULL;
+  if (!f) {
+    fprintf(stderr, "profiler: cannot write %s\n", PROFILE_FILE);
+    free(counts);
+    free(rows);
+    return;
+  }
+
+  uint64_t instructions = 0;
+  for (size_t i = 0; i < n; i++)
+    instructions += counts[i];
+  uint64_t cycles = instructions * PROFILE_CYCLES;
+
+  fprintf(f, "instructions: %llu\n", (unsigned long long)instructions);
+  fprintf(f, "cycles: %llu executed, %llu halted (%.2f%% halted)\n",
+          (unsigned long long)cycles, (unsigned long long)halted_cycles,
+          PROFILE_percent(halted_cycles, cycles + halted_cycles));
+
+  fprintf(f, "\ninterrupts:\n");
+  for (int j = 0; j < 5; j++) {
+    fprintf(f, "  %-8s %04X %10llu\n", vector_names[j], 0x40 + j * 8,
+            (unsigned long long)vector_count[j]);
+  }
+
+  PROFILE_top_addresses(f, rows, counts, n, cycles);
+  PROFILE_top_functions(f, rows, counts, n, cycles);
+  PROFILE_top_loops(f, rows, counts, n, cycles);
+  PROFILE_top_opcodes(f, rows, counts, n, cycles);
+
+  fclose(f);
+  free(counts);
+  free(rows);
+  printf("profile written to %s\n", PROFILE_FILE);
+
+  // the stacks are charged at transfers, the last one is still running
+  PROFILE_charge(profiled->cycle_count);
+  if (PROFILE_folded())
+    printf("call stacks written to %s\n", PROFILE_FOLDED);
+  else
+    fprintf(stderr, "profiler: cannot write %s\n", PROFILE_FOLDED);
+}
+
+#endif // GB_PROFILE
@@ -0,0 +1,51 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "cpu.h"
+
+// Guest profiler, built in with `make PROFILE=1`. It counts executed
+// instructions and cycles per (bank, PC), per opcode and per interrupt
+// vector, and writes a report to profile.txt on exit or on demand.
+// Without GB_PROFILE every hook below compiles to nothing.
+//
+// Only control transfers are recorded while the game runs: how often each
+// address starts a straight-line run and how often a run is cut short by a
+// taken branch or an interrupt. Per-instruction counts are rebuilt from
+// those when the report is written. Only the control flow opcodes are
+// hooked, so everything else runs at full speed.
+//
+// The same hooks keep a shadow call stack (CALL, RST and interrupts push,
+// RET and RETI pop what they return past), and the cycles between two
+// transfers, halted ones apart, are charged to the stack they ran in. The
+// stacks go to profile.folded as folded stacks for flame graph tools
+// (flamegraph.pl, speedscope, inferno). With the linker's symbols (a .sym
+// or .map, see symbols.h) functions and addresses are named in both files.
+
+#ifdef GB_PROFILE
+
+// symbols is the symbol file, NULL to look for one next to the ROM
+void PROFILE_init(CPU *cpu, const char *rom, const char *symbols);
+void PROFILE_interrupt(CPU *cpu, int vector);
+void PROFILE_halted(CPU *cpu, int cycles);
+void PROFILE_dump(void);
+// nothing is recorded while suspended, for frames that are thrown away
+void PROFILE_suspend(CPU *cpu, bool suspend);
+
+#define PROFILE_INIT(cpu, rom, symbols) PROFILE_init(cpu, rom, symbols)
+#define PROFILE_INTERRUPT(cpu, vector) PROFILE_interrupt(cpu, vector)
+#define PROFILE_HALTED(cpu, cycles) PROFILE_halted(cpu, cycles)
+#define PROFILE_DUMP() PROFILE_dump()
+#define PROFILE_SUSPEND(cpu, suspend) PROFILE_suspend(cpu, suspend)
+
+#else
+
+#define PROFILE_INIT(cpu, rom, symbols)                                        \
+  ((void)(cpu), (void)(rom), (void)(symbols))
+#define PROFILE_INTERRUPT(cpu, vector) ((void)(cpu), (void)(vector))
+#define PROFILE_HALTED(cpu, cycles) ((void)(cpu), (void)(cycles))
+#define PROFILE_DUMP() ((void)0)
+#define PROFILE_SUSPEND(cpu, suspend) ((void)(cpu), (void)(suspend))
+
+#endif // GB_PROFILE
+
+#endif // PROFILER_H
@@ -0,0 +1,334 @@
+#include "render.h"
+#include <stdbool.h>
+#include <string.h>
+
+static const struct {
+  const char *name;
+  uint32_t colors[4];
+} palettes[] = {
+    {"grey", {0xFFFFFFFF, 0xFF404040, 0xFFBFBFBF, 0xFF000000}},
+    {"green", {0xFF9BBC0F, 0xFF306230, 0xFF8BAC0F, 0xFF0F380F}},
+};
+
+bool DISPLAY_palette(const char *name, uint32_t *lut) {
+  for (size_t i = 0; i < sizeof(palettes) / sizeof(palettes[0]); i++) {
+    if (strcmp(name, palettes[i].name) != 0)
+      continue;
+    for (int shade = 0; shade < 4; shade++) {
+      uint32_t color = palettes[i].colors[shade];
+      lut[shade] = color;
+      lut[DISPLAY_DIM + shade] = 0xFF000000 | ((color >> 2) & 0x3F3F3F);
+    }
+    lut[DISPLAY_TEXT] = 0xFFFFFFFF;
+    return true;
+  }
+  return false;
+}
+
+void DISPLAY_expand(const uint8_t *frame, const uint32_t *lut, void *out,
+                    int pitch) {
+  for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+    uint32_t *row = (uint32_t *)((uint8_t *)out + (size_t)y * pitch);
+    for (int x = 0; x < DISPLAY_WIDTH; x++)
+      row[x] = lut[frame[y * DISPLAY_WIDTH + x]];
+  }
+}
+
+// Helper function to get tile address based on LCDC register
+uint8_t *get_tile_address(uint8_t tile_index, uint8_t lcdc, uint8_t *vram) {
+  // LCDC bit 4 controls which tile data table to use
+  if (lcdc & 0x10) {
+    // Use 0x8000-0x8FFF, tile index is unsigned (0-255)
+    return vram + tile_index * 16;
+  } else {
+    // Use 0x8800-0x97FF, tile index is signed (-128 to 127)
+    return vram + 0x1000 + ((int8_t)tile_index) * 16;
+  }
+}
+
+void DISPLAY_plot_tile(uint8_t *tile, int x, int y, uint8_t *frame,
+                       uint8_t palette) {
+  for (int row = 0; row < 8; row++) {
+    uint8_t b0 = *tile++;
+    uint8_t b1 = *tile++;
+    for (int col = 0; col < 8; col++) {
+      uint8_t X = x + col;
+      uint8_t Y = y + row;
+      if (X >= DISPLAY_WIDTH || Y >= DISPLAY_HEIGHT) {
+        continue;
+      }
+      uint8_t colorindex = ((b0 & 0x80) >> 7) | ((b1 & 0x80) >> 6);
+      // Apply palette mapping
+      colorindex = (palette >> (colorindex * 2)) & 0x03;
+      frame[Y * DISPLAY_WIDTH + X] = colorindex;
+      b0 <<= 1;
+      b1 <<= 1;
+    }
+  }
+}
+
+void DISPLAY_plot_sprite(uint8_t *tile, int x, int y, uint8_t *frame,
+                         uint8_t attributes, uint8_t palette) {
+  bool xflip = attributes & 0x20;
+  bool yflip = attributes & 0x40;
+  bool priority = !(attributes & 0x80); // 0 means above background
+
+  for (int row = 0; row < 8; row++) {
+    int actual_row = yflip ? 7 - row : row;
+    uint8_t b0 = tile[actual_row * 2];
+    uint8_t b1 = tile[actual_row * 2 + 1];
+
+    for (int col = 0; col < 8; col++) {
+      int actual_col = xflip ? 7 - col : col;
+      uint8_t pixel_x = x + col;
+      uint8_t pixel_y = y + row;
+
+      if (pixel_x >= DISPLAY_WIDTH || pixel_y >= DISPLAY_HEIGHT) {
+        continue;
+      }
+
+      uint8_t colorindex = ((b0 >> (7 - actual_col)) & 1) |
+                           (((b1 >> (7 - actual_col)) & 1) << 1);
+      if (colorindex == 0)
+        continue; // Transparent pixel
+
+      // Apply palette mapping
+      colorindex = (palette >> (colorindex * 2)) & 0x03;
+
+      // Only draw if we have priority or the background is white
+      if (priority || frame[pixel_y * DISPLAY_WIDTH + pixel_x] == 0) {
+        frame[pixel_y * DISPLAY_WIDTH + pixel_x] = colorindex;
+      }
+    }
+  }
+}
+
+void DISPLAY_render_background(uint8_t *frame, CPU *cpu) {
+  uint8_t *vram = &cpu->_memory[MEM_VRAM];
+  // Select background map based on LCDC bit 3
+  const uint8_t *bg_map = vram + (cpu->lcdc & 0x08 ? 0x1C00 : 0x1800);
+
+  for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+    for (int x = 0; x < DISPLAY_WIDTH; x++) {
+      // Calculate position in the 256x256 background map
+      uint8_t bg_x = (x + cpu->scx) & 0xFF;
+      uint8_t bg_y = (y + cpu->scy) & 0xFF;
+
+      // Get tile index from background map
+      uint8_t tile_x = bg_x / 8;
+      uint8_t tile_y = bg_y / 8;
+      uint8_t tile_index = bg_map[tile_y * 32 + tile_x];
+
+      // Get tile data address
+      uint8_t *tile = get_tile_address(tile_index, cpu->lcdc, vram);
+
+      // Plot single pixel from the tile
+      uint8_t tile_pixel_x = bg_x % 8;
+      uint8_t tile_pixel_y = bg_y % 8;
+
+      uint8_t b0 = tile[tile_pixel_y * 2];
+      uint8_t b1 = tile[tile_pixel_y * 2 + 1];
+
+      uint8_t colorindex = ((b0 >> (7 - tile_pixel_x)) & 1) |
+                           (((b1 >> (7 - tile_pixel_x)) & 1) << 1);
+
+      // Apply palette mapping
+      colorindex = (cpu->bgp >> (colorindex * 2)) & 0x03;
+      frame[y * DISPLAY_WIDTH + x] = colorindex;
+    }
+  }
+}
+
+void DISPLAY_render_window(uint8_t *frame, CPU *cpu) {
+  uint8_t *vram = &cpu->_memory[MEM_VRAM];
+  if (cpu->wx > 166 || cpu->wy >= DISPLAY_HEIGHT)
+    return;
+
+  // Select window map based on LCDC bit 6
+  const uint8_t *win_map = vram + (cpu->lcdc & 0x40 ? 0x1C00 : 0x1800);
+
+  for (int y = 0; y < DISPLAY_HEIGHT - cpu->wy; y++) {
+    if (y + cpu->wy >= DISPLAY_HEIGHT)
+      break;
+
+    for (int x = 0; x < DISPLAY_WIDTH - (cpu->wx - 7); x++) {
+      if (x + cpu->wx - 7 < 0 || x + cpu->wx - 7 >= DISPLAY_WIDTH)
+        continue;
+
+      // Calculate position in the window
+      uint8_t win_x = x;
+      uint8_t win_y = y;
+
+      // Get tile index from window map
+      uint8_t tile_x = win_x / 8;
+      uint8_t tile_y = win_y / 8;
+      uint8_t tile_index = win_map[tile_y * 32 + tile_x];
+
+      // Get tile data address
+      uint8_t *tile = get_tile_address(tile_index, cpu->lcdc, vram);
+
+      // Plot single pixel from the tile
+      uint8_t tile_pixel_x = win_x % 8;
+      uint8_t tile_pixel_y = win_y % 8;
+
+      uint8_t b0 = tile[tile_pixel_y * 2];
+      uint8_t b1 = tile[tile_pixel_y * 2 + 1];
+
+      uint8_t colorindex = ((b0 >> (7 - tile_pixel_x)) & 1) |
+                           (((b1 >> (7 - tile_pixel_x)) & 1) << 1);
+
+      // Apply palette mapping
+      colorindex = (cpu->bgp >> (colorindex * 2)) & 0x03;
+      frame[(y + cpu->wy) * DISPLAY_WIDTH + (x + cpu->wx - 7)] = colorindex;
+    }
+  }
+}
+
+void DISPLAY_render_sprites(uint8_t *frame, CPU *cpu) {
+  uint8_t *vram = &cpu->_memory[MEM_VRAM];
+  uint8_t sprite_height = (cpu->lcdc & 0x04) ? 16 : 8;
+  uint8_t *oam = &cpu->_memory[MEM_OAM]; // Object Attribute Memory
+
+  // Process sprites in priority order (lower x has higher priority)
+  for (int sprite = 0; sprite < 40; sprite++) {
+    uint8_t y = oam[sprite * 4] - 16;         // Y position
+    uint8_t x = oam[sprite * 4 + 1] - 8;      // X position
+    uint8_t tile_index = oam[sprite * 4 + 2]; // Tile index
+    uint8_t attributes = oam[sprite * 4 + 3]; // Attributes
+
+    // Skip if sprite is off-screen
+    if (y >= DISPLAY_HEIGHT || x >= DISPLAY_WIDTH)
+      continue;
+
+    // For 8x16 sprites, last bit of tile index is ignored
+    if (sprite_height == 16) {
+      tile_index &= 0xFE;
+    }
+
+    uint8_t *tile = vram + tile_index * 16;
+    uint8_t palette = (attributes & 0x10) ? cpu->obp1 : cpu->obp0;
+
+    DISPLAY_plot_sprite(tile, x, y, frame, attributes, palette);
+
+    // For 8x16 sprites, draw the bottom half
+    if (sprite_height == 16) {
+      DISPLAY_plot_sprite(vram + (tile_index + 1) * 16, x, y + 8, frame,
+                          attributes, palette);
+    }
+  }
+}
+
+void DISPLAY_gbmemory_to_sdl(uint8_t *frame, CPU *cpu) {
+  // Clear the screen with background color
+  memset(frame, cpu->bgp & 0x03, DISPLAY_WIDTH * DISPLAY_HEIGHT);
+
+  // Don't render anything if LCD is off
+  if (!(cpu->lcdc & 0x80))
+    return;
+
+  // 1. Render Background if enabled
+  if (cpu->lcdc & 0x01)
+    DISPLAY_render_background(frame, cpu);
+
+  // 2. Render Window if enabled
+  if (cpu->lcdc & 0x20)
+    DISPLAY_render_window(frame, cpu);
+
+  // 3. Render Sprites if enabled
+  if (cpu->lcdc & 0x02)
+    DISPLAY_render_sprites(frame, cpu);
+}
+
+DisplayLine DISPLAY_line(const CPU *cpu) {
+  return (DisplayLine){cpu->lcdc, cpu->scy, cpu->scx,  cpu->wy,
+                       cpu->wx,   cpu->bgp, cpu->obp0, cpu->obp1};
+}
+
+// one row of an 8 pixel wide sprite, as DISPLAY_plot_sprite draws it
+static void DISPLAY_sprite_row(uint8_t *row, const uint8_t *tile, int tile_row,
+                               int x, uint8_t attributes, uint8_t palette) {
+  bool xflip = attributes & 0x20;
+  bool priority = !(attributes & 0x80);
+  int actual_row = attributes & 0x40 ? 7 - tile_row : tile_row;
+  uint8_t b0 = tile[actual_row * 2];
+  uint8_t b1 = tile[actual_row * 2 + 1];
+  for (int col = 0; col < 8; col++) {
+    int actual_col = xflip ? 7 - col : col;
+    uint8_t pixel_x = x + col;
+    if (pixel_x >= DISPLAY_WIDTH)
+      continue;
+    uint8_t colorindex = ((b0 >> (7 - actual_col)) & 1) |
+                         (((b1 >> (7 - actual_col)) & 1) << 1);
+    if (colorindex == 0)
+      continue;
+    colorindex = (palette >> (colorindex * 2)) & 0x03;
+    if (priority || row[pixel_x] == 0)
+      row[pixel_x] = colorindex;
+  }
+}
+
+void DISPLAY_render_line(uint8_t *row, int y, const DisplayLine *line,
+                         const uint8_t *vram, const uint8_t *oam) {
+  uint8_t lcdc = line->lcdc;
+  memset(row, line->bgp & 0x03, DISPLAY_WIDTH);
+  if (!(lcdc & 0x80))
+    return;
+
+  if (lcdc & 0x01) {
+    const uint8_t *bg_map = vram + (lcdc & 0x08 ? 0x1C00 : 0x1800);
+    uint8_t bg_y = (y + line->scy) & 0xFF;
+    for (int x = 0; x < DISPLAY_WIDTH; x++) {
+      uint8_t bg_x = (x + line->scx) & 0xFF;
+      uint8_t tile_index = bg_map[(bg_y / 8) * 32 + bg_x / 8];
+      const uint8_t *tile =
+          get_tile_address(tile_index, lcdc, (uint8_t *)vram);
+      uint8_t b0 = tile[(bg_y % 8) * 2];
+      uint8_t b1 = tile[(bg_y % 8) * 2 + 1];
+      uint8_t colorindex = ((b0 >> (7 - bg_x % 8)) & 1) |
+                           (((b1 >> (7 - bg_x % 8)) & 1) << 1);
+      row[x] = (line->bgp >> (colorindex * 2)) & 0x03;
+    }
+  }
+
+  // the window's own line is how far below WY this one is
+  if ((lcdc & 0x20) && line->wx <= 166 && line->wy < DISPLAY_HEIGHT &&
+      y >= line->wy) {
+    const uint8_t *win_map = vram + (lcdc & 0x40 ? 0x1C00 : 0x1800);
+    uint8_t win_y = y - line->wy;
+    for (int x = 0; x < DISPLAY_WIDTH - (line->wx - 7); x++) {
+      int screen_x = x + line->wx - 7;
+      if (screen_x < 0 || screen_x >= DISPLAY_WIDTH)
+        continue;
+      uint8_t win_x = x;
+      uint8_t tile_index = win_map[(win_y / 8) * 32 + win_x / 8];
+      const uint8_t *tile =
+          get_tile_address(tile_index, lcdc, (uint8_t *)vram);
+      uint8_t b0 = tile[(win_y % 8) * 2];
+      uint8_t b1 = tile[(win_y % 8) * 2 + 1];
+      uint8_t colorindex = ((b0 >> (7 - win_x % 8)) & 1) |
+                           (((b1 >> (7 - win_x % 8)) & 1) << 1);
+      row[screen_x] = (line->bgp >> (colorindex * 2)) & 0x03;
+    }
+  }
+
+  // in OAM order like DISPLAY_render_sprites, 8x16 sprites as two halves
+  if (lcdc & 0x02) {
+    bool tall = lcdc & 0x04;
+    for (int sprite = 0; sprite < 40; sprite++) {
+      uint8_t sprite_y = oam[sprite * 4] - 16;
+      uint8_t sprite_x = oam[sprite * 4 + 1] - 8;
+      uint8_t tile_index = oam[sprite * 4 + 2];
+      uint8_t attributes = oam[sprite * 4 + 3];
+      if (sprite_y >= DISPLAY_HEIGHT || sprite_x >= DISPLAY_WIDTH)
+        continue;
+      int tile_row = y - sprite_y;
+      if (tile_row < 0 || tile_row >= (tall ? 16 : 8))
+        continue;
+      if (tall)
+        tile_index &= 0xFE;
+      uint8_t palette = attributes & 0x10 ? line->obp1 : line->obp0;
+      DISPLAY_sprite_row(row, vram + (tile_index + tile_row / 8) * 16,
+                         tile_row % 8, sprite_x, attributes, palette);
+    }
+  }
+}
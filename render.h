@@ -0,0 +1,53 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Frame renderer: turns VRAM, OAM and the LCD registers into a 160x144
+// frame. It does not depend on SDL so tools and benchmarks can use it.
+//
+// A frame holds one byte per pixel, the shade after the BGP/OBP palettes.
+// It only becomes ARGB on its way out, through a lookup table, straight
+// into the texture or the video, so the screen palette is a table swap.
+
+#define DISPLAY_WIDTH 160
+#define DISPLAY_HEIGHT 144
+
+// shades 0-3 are the screen, 4-7 the same dimmed and 8 white, the last
+// ones are for the perf overlay drawn over the frame
+#define DISPLAY_SHADES 9
+#define DISPLAY_DIM 4
+#define DISPLAY_TEXT 8
+
+// fills lut with DISPLAY_SHADES ARGB colors, name is grey or green (the
+// DMG screen)
+bool DISPLAY_palette(const char *name, uint32_t *lut);
+// ARGB out of a frame, pitch is in bytes
+void DISPLAY_expand(const uint8_t *frame, const uint32_t *lut, void *out,
+                    int pitch);
+
+uint8_t *get_tile_address(uint8_t tile_index, uint8_t lcdc, uint8_t *vram);
+void DISPLAY_plot_tile(uint8_t *tile, int x, int y, uint8_t *frame,
+                       uint8_t palette);
+void DISPLAY_plot_sprite(uint8_t *tile, int x, int y, uint8_t *frame,
+                         uint8_t attributes, uint8_t palette);
+// the three layers, drawn over what is already in frame
+void DISPLAY_render_background(uint8_t *frame, CPU *cpu);
+void DISPLAY_render_window(uint8_t *frame, CPU *cpu);
+void DISPLAY_render_sprites(uint8_t *frame, CPU *cpu);
+// a whole frame
+void DISPLAY_gbmemory_to_sdl(uint8_t *frame, CPU *cpu);
+
+// the registers a line is drawn from
+typedef struct {
+  uint8_t lcdc, scy, scx, wy, wx, bgp, obp0, obp1;
+} DisplayLine;
+
+// the registers as they are now
+DisplayLine DISPLAY_line(const CPU *cpu);
+// line y of a frame, DISPLAY_WIDTH shades into row, drawn as
+// DISPLAY_gbmemory_to_sdl draws it from vram (0x2000 bytes) and oam; a
+// frame of lines with the same registers and memory is the same frame
+void DISPLAY_render_line(uint8_t *row, int y, const DisplayLine *line,
+                         const uint8_t *vram, const uint8_t *oam);
@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 200809L
+#include "resume.h"
+#include "debug.h"
+#include "state.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint64_t RESUME_fnv(uint64_t hash, const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001B3ull;
+  }
+  return hash;
+}
+
+bool RESUME_parse(const char *arg, ResumePoint *point) {
+  char *end;
+  if (strncmp(arg, "pc:", 3) == 0) {
+    long pc = strtol(arg + 3, &end, 16);
+    *point = (ResumePoint){0, pc};
+    return end != arg + 3 && !*end && pc >= 0 && pc <= 0xFFFF;
+  }
+  long frames = strtol(arg, &end, 10);
+  *point = (ResumePoint){frames, -1};
+  return end != arg && !*end && frames >= 0 && frames <= RESUME_MAX_FRAMES;
+}
+
+uint64_t RESUME_build(void) {
+  static uint64_t build;
+  if (build)
+    return build;
+  // the layout of a state, then what produces it
+  size_t size = STATE_size();
+  build = RESUME_fnv(0xCBF29CE484222325ull, (const uint8_t *)&size,
+                     sizeof(size));
+  FILE *f = fopen("/proc/self/exe", "rb");
+  if (f) {
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      build = RESUME_fnv(build, buf, n);
+    fclose(f);
+  } else {
+    // no way to read the executable, the time this file was built will do
+    const char *when = __DATE__ " " __TIME__;
+    build = RESUME_fnv(build, (const uint8_t *)when, strlen(when));
+  }
+  return build;
+}
+
+static bool RESUME_load(CPU *cpu, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  size_t size = sizeof(ResumeHeader) + STATE_size();
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+    close(fd);
+    return false;
+  }
+  uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  ResumeHeader header;
+  memcpy(&header, map, sizeof(header));
+  const uint8_t *state = map + sizeof(header);
+  bool ok = memcmp(header.magic, RESUME_MAGIC, sizeof(header.magic)) == 0 &&
+            header.build == RESUME_build() &&
+            header.rom_hash == cart_hash(cpu->cart) &&
+            header.state_size == STATE_size() &&
+            header.checksum == RESUME_fnv(0xCBF29CE484222325ull, state,
+                                          header.state_size) &&
+            STATE_load(cpu, state, header.state_size);
+  munmap(map, size);
+  return ok;
+}
+
+// written next to it and renamed, so that runs started together never see
+// half a file
+static bool RESUME_save(CPU *cpu, const char *path) {
+  size_t state_size = STATE_size();
+  uint8_t *buf = malloc(sizeof(ResumeHeader) + state_size);
+  if (!buf)
+    return false;
+  uint8_t *state = buf + sizeof(ResumeHeader);
+  STATE_save(cpu, state);
+  ResumeHeader header = {
+      .build = RESUME_build(),
+      .rom_hash = cart_hash(cpu->cart),
+      .state_size = state_size,
+      .checksum = RESUME_fnv(0xCBF29CE484222325ull, state, state_size),
+  };
+  memcpy(header.magic, RESUME_MAGIC, sizeof(header.magic));
+  memcpy(buf, &header, sizeof(header));
+
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  FILE *f = fopen(tmp, "wb");
+  bool ok = f != NULL;
+  if (ok) {
+    ok = fwrite(buf, 1, sizeof(header) + state_size, f) ==
+         sizeof(header) + state_size;
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok)
+      remove(tmp);
+  }
+  free(buf);
+  return ok;
+}
+
+static bool RESUME_reached(CPU *cpu, uint16_t address, uint8_t access,
+                           uint8_t value, void *arg) {
+  (void)cpu, (void)address, (void)access, (void)value;
+  *(bool *)arg = true;
+  return true;
+}
+
+// runs from power on to point with no input, false when PC is never reached
+static bool RESUME_run(CPU *cpu, ResumePoint point) {
+  if (point.pc < 0) {
+    for (int i = 0; i < point.frames; i++)
+      CPU_frame(cpu, 1);
+    return true;
+  }
+
+  Snapshot *start = malloc(sizeof(Snapshot));
+  if (!start)
+    return false;
+  STATE_snapshot(cpu, start);
+  bool reached = false;
+  int id = DEBUG_watch(cpu, point.pc, point.pc, DEBUG_EXEC, RESUME_reached,
+                       &reached);
+  for (int i = 0; id >= 0 && !reached && i < RESUME_MAX_FRAMES; i++)
+    CPU_frame(cpu, 1);
+  DEBUG_unwatch(cpu, id);
+  if (reached) {
+    // the watch stopped the frame at PC; a state does not hold where in a
+    // frame it is (nor the dot PPU's position), so it is taken at the end
+    DEBUG_stopped(cpu);
+    CPU_frame(cpu, 1);
+  } else {
+    STATE_restore(cpu, start);
+  }
+  free(start);
+  return reached;
+}
+
+ResumeResult RESUME_boot(CPU *cpu, const char *dir, ResumePoint point,
+                         char *path, size_t len) {
+  // the dot accurate PPU times a frame differently
+  char where[32];
+  if (point.pc < 0)
+    snprintf(where, sizeof(where), "f%d", point.frames);
+  else
+    snprintf(where, sizeof(where), "pc%04X", point.pc);
+  snprintf(path, len, "%s/%016llx-%s%s.state", dir,
+           (unsigned long long)cart_hash(cpu->cart), where,
+           cpu->ppu ? "-dot" : "");
+
+  if (RESUME_load(cpu, path))
+    return RESUME_LOADED;
+  if (!RESUME_run(cpu, point))
+    return RESUME_FAILED;
+  mkdir(dir, 0755);
+  return RESUME_save(cpu, path) ? RESUME_SAVED : RESUME_UNSAVED;
+}
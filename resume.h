@@ -0,0 +1,49 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Instant resume. Games spend their first seconds in intros and setup that
+// are the same on every launch; --resume DIR keeps a save state of each ROM
+// past that point in DIR, made the first time by running there with no
+// input, and later launches start from it. The point is a frame count, or
+// the end of the frame in which PC first reaches an address (the game's
+// main loop, say).
+//
+// Files are DIR/<rom hash>-<point>.state: a ResumeHeader and a state.h
+// state, mapped in with mmap. One made by another build of the emulator
+// (its executable differs), for another ROM, or that fails its checksum is
+// stale; the ROM boots as usual and the file is made over again.
+
+#define RESUME_MAGIC "GBRESUM1"
+#define RESUME_FRAMES 60       // the point when none is given
+#define RESUME_MAX_FRAMES 3600 // a PC not reached by then is never reached
+
+typedef struct {
+  int frames; // frames run, with pc -1
+  int pc;     // the address to reach, -1 for none
+} ResumePoint;
+
+typedef struct {
+  char magic[8];
+  uint64_t build;      // RESUME_build
+  uint64_t rom_hash;   // cart_hash
+  uint64_t state_size; // STATE_size
+  uint64_t checksum;   // of the state after the header
+} ResumeHeader;
+
+typedef enum {
+  RESUME_LOADED,  // from the file
+  RESUME_SAVED,   // run to the point, the file made
+  RESUME_UNSAVED, // run to the point, the file could not be written
+  RESUME_FAILED,  // still at power on, PC was never reached
+} ResumeResult;
+
+// a frame count ("300") or pc:addr in hex ("pc:0150")
+bool RESUME_parse(const char *arg, ResumePoint *point);
+// puts a CPU that has not run yet at point; the path used goes into path
+ResumeResult RESUME_boot(CPU *cpu, const char *dir, ResumePoint point,
+                         char *path, size_t len);
+// a hash of the running executable, what a file must have been made by
+uint64_t RESUME_build(void);
@@ -0,0 +1,123 @@
+#include "runahead.h"
+#include "lines.h"
+#include "perf.h"
+#include "ppu.h"
+#include "profiler.h"
+#include "render.h"
+#include "state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct RunAhead {
+  int frames;
+  uint64_t budget_ns;
+  Snapshot *snap;
+
+  // keep up statistics, for the window and the whole run
+  uint64_t window_frames, window_late, window_ns;
+  uint64_t host_frames, late, total_ns;
+};
+
+// the run-ahead still going at exit prints its summary
+static RunAhead *running;
+
+static void RUNAHEAD_exit(void) {
+  if (running)
+    RUNAHEAD_free(running);
+}
+
+RunAhead *RUNAHEAD_new(int frames, uint64_t budget_ns) {
+  static bool registered;
+  if (frames < 1 || frames > RUNAHEAD_MAX)
+    return NULL;
+  RunAhead *ra = calloc(1, sizeof(RunAhead));
+  if (!ra)
+    return NULL;
+  // a snapshot is the size of a CPU, too big for the stack
+  ra->snap = malloc(sizeof(Snapshot));
+  if (!ra->snap) {
+    free(ra);
+    return NULL;
+  }
+  ra->frames = frames;
+  ra->budget_ns = budget_ns;
+  running = ra;
+  if (!registered) {
+    atexit(RUNAHEAD_exit);
+    registered = true;
+  }
+  return ra;
+}
+
+void RUNAHEAD_free(RunAhead *ra) {
+  if (!ra)
+    return;
+  if (running == ra)
+    running = NULL;
+  if (ra->host_frames)
+    fprintf(stderr,
+            "run-ahead: %d frames, %llu host frames, %.2fms each on "
+            "average, %llu late\n",
+            ra->frames, (unsigned long long)ra->host_frames,
+            ra->total_ns / 1e6 / ra->host_frames,
+            (unsigned long long)ra->late);
+  free(ra->snap);
+  free(ra);
+}
+
+static void RUNAHEAD_account(RunAhead *ra, uint64_t ns) {
+  bool late = ns > ra->budget_ns;
+  ra->host_frames++;
+  ra->late += late;
+  ra->total_ns += ns;
+  ra->window_frames++;
+  ra->window_late += late;
+  ra->window_ns += ns;
+  if (ra->window_frames < RUNAHEAD_WINDOW)
+    return;
+  if (ra->window_late * 100 > ra->window_frames * RUNAHEAD_LATE_PERCENT)
+    fprintf(stderr,
+            "run-ahead: the host cannot keep up, %llu of %llu frames over "
+            "%.1fms (%.2fms on average), try fewer than %d\n",
+            (unsigned long long)ra->window_late,
+            (unsigned long long)ra->window_frames, ra->budget_ns / 1e6,
+            ra->window_ns / 1e6 / ra->window_frames, ra->frames);
+  ra->window_frames = ra->window_late = ra->window_ns = 0;
+}
+
+void RUNAHEAD_frame(RunAhead *ra, CPU *cpu, int batches, uint8_t *frame) {
+  uint64_t start = PERF_now();
+  CPU_frame(cpu, batches);
+  STATE_snapshot(cpu, ra->snap);
+
+  // the frames ahead are thrown away: no sound, no new input (the queue
+  // stays for the next real frame), nothing traced, watched or profiled
+  ApuOutput *audio = cpu->audio;
+  Input *input = cpu->input;
+  Trace *trace = cpu->trace;
+  Debug *debug = cpu->debug;
+  cpu->audio = NULL;
+  cpu->input = NULL;
+  cpu->trace = NULL;
+  cpu->debug = NULL;
+  PROFILE_SUSPEND(cpu, true);
+  for (int i = 0; i < ra->frames; i++)
+    CPU_frame(cpu, batches);
+  if (cpu->ppu)
+    memcpy(frame, PPU_pixels(cpu), DISPLAY_WIDTH * DISPLAY_HEIGHT);
+  else if (cpu->lines)
+    memcpy(frame, LINES_pixels(cpu), DISPLAY_WIDTH * DISPLAY_HEIGHT);
+  else
+    DISPLAY_gbmemory_to_sdl(frame, cpu);
+  bool dirty = cpu->screen_dirty;
+  cpu->audio = audio;
+  cpu->input = input;
+  cpu->trace = trace;
+  cpu->debug = debug;
+  PROFILE_SUSPEND(cpu, false);
+
+  STATE_restore(cpu, ra->snap);
+  cpu->screen_dirty |= dirty;
+  RUNAHEAD_account(ra, PERF_now() - start);
+}
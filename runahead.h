@@ -0,0 +1,29 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Run-ahead. Games that react to a press a frame or more after reading it
+// feel laggy on top of vsync; run-ahead hides that delay. Every host frame
+// emulates the real frame, with sound and input, snapshots the machine,
+// runs frames more with the same input and no sound, renders the last of
+// them and restores the snapshot. What is shown is frames ahead of what is
+// heard, for frames + 1 times the emulation work.
+//
+// A host frame that takes longer than its budget is late; when more than
+// one in RUNAHEAD_LATE_PERCENT of a window is late a warning goes to
+// stderr, and a summary is printed on exit.
+
+#define RUNAHEAD_MAX 8
+#define RUNAHEAD_WINDOW 600 // host frames between keep up checks
+#define RUNAHEAD_LATE_PERCENT 5
+
+typedef struct RunAhead RunAhead;
+
+// budget_ns is the time the emulation may take in a host frame
+RunAhead *RUNAHEAD_new(int frames, uint64_t budget_ns);
+void RUNAHEAD_free(RunAhead *ra);
+// one host frame of batches, frame gets the render.h shades of the last
+// frame run ahead and cpu->screen_dirty covers the frames ahead as well
+void RUNAHEAD_frame(RunAhead *ra, CPU *cpu, int batches, uint8_t *frame);
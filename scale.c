@@ -0,0 +1,380 @@
+#define _POSIX_C_SOURCE 200809L
+#include "scale.h"
+#include "render.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// the source with a copy of its edge pixels around it, so the filters can
+// read the neighbours of every pixel without bounds checks
+#define SCALE_PITCH (DISPLAY_WIDTH + 2)
+#define SCALE_NATIVE_MAX 3
+// 4 pixel stores may run 3 pixels past the end of a line
+#define SCALE_LINE (DISPLAY_WIDTH * SCALE_MAX_FACTOR + 4)
+
+// 4 pixels, gcc turns the operations into SSE2/AVX or NEON instructions
+typedef uint32_t Vec __attribute__((vector_size(16)));
+
+typedef struct {
+  Scaler *s;
+  int band;
+  pthread_t thread;
+} ScaleWorker;
+
+struct Scaler {
+  ScaleFilter filter;
+  int bands; // the caller does band 0, a worker each of the others
+  ScaleWorker workers[SCALE_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  uint64_t job; // bumped for every SCALE_run
+  int pending;  // workers still busy with the job
+  bool stop;
+
+  // the job
+  uint32_t padded[(DISPLAY_HEIGHT + 2) * SCALE_PITCH];
+  int factor;
+  uint8_t *dst;
+  int pitch;
+  // output column to native column, for factors that are not a multiple
+  // of the native one and for the LCD grid
+  uint16_t map[DISPLAY_WIDTH * SCALE_MAX_FACTOR];
+  int map_factor;
+
+  // per band: the native row of the filter and the scaled line
+  uint32_t native[SCALE_MAX_THREADS][DISPLAY_WIDTH * SCALE_NATIVE_MAX];
+  uint32_t lines[SCALE_MAX_THREADS][SCALE_LINE];
+};
+
+static const struct {
+  const char *name;
+  int native; // output pixels per source pixel in a native row
+} filters[SCALE_FILTERS] = {
+    [SCALE_NEAREST] = {"nearest", 1}, [SCALE_2X] = {"scale2x", 2},
+    [SCALE_3X] = {"scale3x", 3},      [SCALE_HQ2X] = {"hq2x", 2},
+    [SCALE_LCD] = {"lcd", 2},
+};
+
+static inline Vec SCALE_load(const uint32_t *p) {
+  Vec v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void SCALE_store(uint32_t *p, Vec v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline Vec SCALE_eq(Vec a, Vec b) { return (Vec)(a == b); }
+
+static inline Vec SCALE_select(Vec mask, Vec a, Vec b) {
+  return (a & mask) | (b & ~mask);
+}
+
+// per channel (a + b) / 2, without carries between the channels
+static inline Vec SCALE_avg(Vec a, Vec b) {
+  return (a & b) + ((a ^ b) >> 1 & 0x7F7F7F7F);
+}
+
+// 75% brightness, alpha kept
+static inline Vec SCALE_dark(Vec p) {
+  return ((p >> 1 & 0x7F7F7F7F) + (p >> 2 & 0x3F3F3F3F)) | 0xFF000000;
+}
+
+// a0 b0 a1 b1 a2 b2 a3 b3
+static inline void SCALE_interleave2(uint32_t *out, Vec a, Vec b) {
+  SCALE_store(out, __builtin_shufflevector(a, b, 0, 4, 1, 5));
+  SCALE_store(out + 4, __builtin_shufflevector(a, b, 2, 6, 3, 7));
+}
+
+// a0 b0 c0 a1 b1 c1 ...
+static inline void SCALE_interleave3(uint32_t *out, Vec a, Vec b, Vec c) {
+  Vec ab_lo = __builtin_shufflevector(a, b, 0, 4, 1, 5);
+  Vec ab_hi = __builtin_shufflevector(a, b, 2, 6, 3, 7);
+  Vec bc_lo = __builtin_shufflevector(b, c, 0, 4, 1, 5);
+  SCALE_store(out, __builtin_shufflevector(ab_lo, c, 0, 1, 4, 2));
+  SCALE_store(out + 4, __builtin_shufflevector(bc_lo, ab_hi, 2, 3, 4, 5));
+  SCALE_store(out + 8, __builtin_shufflevector(ab_hi, c, 6, 2, 3, 7));
+}
+
+// The neighbourhood of pixel E is
+//   A B C
+//   D E F
+//   G H I
+// and the rules are the ones of Scale2x/Scale3x. The bottom rows of the
+// output are the top ones upside down, so they swap the rows above and
+// below.
+
+static void SCALE_2x(const uint32_t *b, const uint32_t *e, const uint32_t *h,
+                     bool blend, uint32_t *out) {
+  for (int x = 0; x < DISPLAY_WIDTH; x += 4) {
+    Vec B = SCALE_load(b + x), H = SCALE_load(h + x);
+    Vec D = SCALE_load(e + x - 1), E = SCALE_load(e + x);
+    Vec F = SCALE_load(e + x + 1);
+    Vec db = SCALE_eq(D, B), bf = SCALE_eq(B, F);
+    Vec dh = SCALE_eq(D, H), fh = SCALE_eq(F, H);
+    Vec left = D, right = F;
+    if (blend) {
+      left = SCALE_avg(D, E);
+      right = SCALE_avg(F, E);
+    }
+    Vec e0 = SCALE_select(db & ~bf & ~dh, left, E);
+    Vec e1 = SCALE_select(bf & ~db & ~fh, right, E);
+    SCALE_interleave2(out + x * 2, e0, e1);
+  }
+}
+
+static void SCALE_3x(const uint32_t *b, const uint32_t *e, const uint32_t *h,
+                     bool middle, uint32_t *out) {
+  for (int x = 0; x < DISPLAY_WIDTH; x += 4) {
+    Vec A = SCALE_load(b + x - 1), B = SCALE_load(b + x);
+    Vec C = SCALE_load(b + x + 1), D = SCALE_load(e + x - 1);
+    Vec E = SCALE_load(e + x), F = SCALE_load(e + x + 1);
+    Vec G = SCALE_load(h + x - 1), H = SCALE_load(h + x);
+    Vec I = SCALE_load(h + x + 1);
+    Vec db = SCALE_eq(D, B), bf = SCALE_eq(B, F);
+    Vec dh = SCALE_eq(D, H), fh = SCALE_eq(F, H);
+    // the four corners of the Scale2x rule
+    Vec tl = db & ~bf & ~dh, tr = bf & ~db & ~fh;
+    Vec bl = dh & ~db & ~fh, br = fh & ~dh & ~bf;
+    if (middle) {
+      Vec e3 = SCALE_select((tl & ~SCALE_eq(E, G)) | (bl & ~SCALE_eq(E, A)),
+                            D, E);
+      Vec e5 = SCALE_select((tr & ~SCALE_eq(E, I)) | (br & ~SCALE_eq(E, C)),
+                            F, E);
+      SCALE_interleave3(out + x * 3, e3, E, e5);
+    } else {
+      Vec e0 = SCALE_select(tl, D, E);
+      Vec e1 = SCALE_select((tl & ~SCALE_eq(E, C)) | (tr & ~SCALE_eq(E, A)),
+                            B, E);
+      Vec e2 = SCALE_select(tr, F, E);
+      SCALE_interleave3(out + x * 3, e0, e1, e2);
+    }
+  }
+}
+
+// each pixel followed by its dark copy, the grid column; the grid row is
+// dark throughout
+static void SCALE_lcd(const uint32_t *e, bool grid, uint32_t *out) {
+  for (int x = 0; x < DISPLAY_WIDTH; x += 4) {
+    Vec p = SCALE_load(e + x), dark = SCALE_dark(p);
+    SCALE_interleave2(out + x * 2, grid ? dark : p, dark);
+  }
+}
+
+// which native row output row y % factor comes from
+static int SCALE_row(ScaleFilter filter, int factor, int y) {
+  if (filter == SCALE_LCD)
+    return factor > 1 && y == factor - 1;
+  return y * filters[filter].native / factor;
+}
+
+static void SCALE_map(Scaler *s, int factor) {
+  int native = filters[s->filter].native;
+  for (int x = 0; x < DISPLAY_WIDTH * factor; x++) {
+    int px = x / factor, sub = x % factor;
+    if (s->filter == SCALE_LCD)
+      s->map[x] = px * 2 + (factor > 1 && sub == factor - 1);
+    else
+      s->map[x] = px * native + sub * native / factor;
+  }
+  s->map_factor = factor;
+}
+
+// output line for source row y and native row sub
+static void SCALE_line(Scaler *s, int band, int y, int sub) {
+  const uint32_t *e = s->padded + (y + 1) * SCALE_PITCH + 1;
+  const uint32_t *b = e - SCALE_PITCH, *h = e + SCALE_PITCH;
+  int factor = s->factor, native = filters[s->filter].native;
+  uint32_t *line = s->lines[band];
+  // at the native factor the filter writes the line itself
+  bool direct = factor == native && s->filter != SCALE_LCD &&
+                s->filter != SCALE_NEAREST;
+  uint32_t *out = direct ? line : s->native[band];
+  const uint32_t *row = out;
+
+  switch (s->filter) {
+  case SCALE_NEAREST:
+    row = e;
+    break;
+  case SCALE_2X:
+  case SCALE_HQ2X:
+    if (sub)
+      SCALE_2x(h, e, b, s->filter == SCALE_HQ2X, out);
+    else
+      SCALE_2x(b, e, h, s->filter == SCALE_HQ2X, out);
+    break;
+  case SCALE_3X:
+    if (sub == 2)
+      SCALE_3x(h, e, b, false, out);
+    else
+      SCALE_3x(b, e, h, sub == 1, out);
+    break;
+  case SCALE_LCD:
+    SCALE_lcd(e, sub, out);
+    break;
+  default:
+    break;
+  }
+  if (direct)
+    return;
+
+  if (s->filter == SCALE_LCD || factor % native) {
+    for (int x = 0; x < DISPLAY_WIDTH * factor; x++)
+      line[x] = row[s->map[x]];
+    return;
+  }
+  // every native pixel repeated, 4 at a time; the next one overwrites what
+  // a store wrote past its own
+  int repeat = factor / native;
+  if (repeat == 1) {
+    memcpy(line, row, DISPLAY_WIDTH * native * sizeof(uint32_t));
+    return;
+  }
+  for (int x = 0; x < DISPLAY_WIDTH * native; x++) {
+    Vec v = {row[x], row[x], row[x], row[x]};
+    for (int i = 0; i < repeat; i += 4)
+      SCALE_store(line + x * repeat + i, v);
+  }
+}
+
+static void SCALE_band(Scaler *s, int band) {
+  int factor = s->factor, rows = DISPLAY_HEIGHT * factor;
+  int first = rows * band / s->bands, last = rows * (band + 1) / s->bands;
+  size_t bytes = DISPLAY_WIDTH * factor * sizeof(uint32_t);
+  int built = -1;
+  for (int y = first; y < last; y++) {
+    int key = y / factor * SCALE_MAX_FACTOR +
+              SCALE_row(s->filter, factor, y % factor);
+    // rows repeated by the factor are copied from the line already built,
+    // the destination may be slow to read back
+    if (key != built) {
+      SCALE_line(s, band, y / factor, key % SCALE_MAX_FACTOR);
+      built = key;
+    }
+    memcpy(s->dst + (size_t)y * s->pitch, s->lines[band], bytes);
+  }
+}
+
+static void *SCALE_worker(void *arg) {
+  ScaleWorker *w = arg;
+  Scaler *s = w->s;
+  uint64_t seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    while (s->job == seen && !s->stop)
+      pthread_cond_wait(&s->start, &s->lock);
+    if (s->stop) {
+      pthread_mutex_unlock(&s->lock);
+      break;
+    }
+    seen = s->job;
+    pthread_mutex_unlock(&s->lock);
+
+    SCALE_band(s, w->band);
+
+    pthread_mutex_lock(&s->lock);
+    if (--s->pending == 0)
+      pthread_cond_signal(&s->done);
+    pthread_mutex_unlock(&s->lock);
+  }
+  return NULL;
+}
+
+bool SCALE_parse(const char *name, ScaleFilter *filter) {
+  for (int i = 0; i < SCALE_FILTERS; i++) {
+    if (strcmp(name, filters[i].name) == 0) {
+      *filter = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+Scaler *SCALE_new(ScaleFilter filter, int threads) {
+  Scaler *s = calloc(1, sizeof(Scaler));
+  if (!s)
+    return NULL;
+  s->filter = filter;
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads = 1;
+  if (threads > SCALE_MAX_THREADS)
+    threads = SCALE_MAX_THREADS;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->start, NULL);
+  pthread_cond_init(&s->done, NULL);
+
+  // with fewer threads the work is just split into fewer bands
+  s->bands = 1;
+  while (s->bands < threads) {
+    ScaleWorker *w = &s->workers[s->bands];
+    w->s = s;
+    w->band = s->bands;
+    if (pthread_create(&w->thread, NULL, SCALE_worker, w) != 0)
+      break;
+    s->bands++;
+  }
+  return s;
+}
+
+void SCALE_free(Scaler *s) {
+  if (!s)
+    return;
+  pthread_mutex_lock(&s->lock);
+  s->stop = true;
+  pthread_cond_broadcast(&s->start);
+  pthread_mutex_unlock(&s->lock);
+  for (int i = 1; i < s->bands; i++)
+    pthread_join(s->workers[i].thread, NULL);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->start);
+  pthread_cond_destroy(&s->done);
+  free(s);
+}
+
+int SCALE_fit(int width, int height) {
+  int x = width / DISPLAY_WIDTH, y = height / DISPLAY_HEIGHT;
+  int factor = x < y ? x : y;
+  if (factor < 1)
+    return 1;
+  return factor > SCALE_MAX_FACTOR ? SCALE_MAX_FACTOR : factor;
+}
+
+void SCALE_run(Scaler *s, const uint8_t *frame, const uint32_t *lut,
+               int factor, void *dst, int pitch) {
+  if (factor == 1) {
+    DISPLAY_expand(frame, lut, dst, pitch);
+    return;
+  }
+  // the palette is applied here, once per source pixel
+  for (int y = -1; y <= DISPLAY_HEIGHT; y++) {
+    int from = y < 0 ? 0 : y < DISPLAY_HEIGHT ? y : DISPLAY_HEIGHT - 1;
+    const uint8_t *src = frame + from * DISPLAY_WIDTH;
+    uint32_t *row = s->padded + (y + 1) * SCALE_PITCH;
+    for (int x = 0; x < DISPLAY_WIDTH; x++)
+      row[x + 1] = lut[src[x]];
+    row[0] = row[1];
+    row[DISPLAY_WIDTH + 1] = row[DISPLAY_WIDTH];
+  }
+  s->factor = factor;
+  s->dst = dst;
+  s->pitch = pitch;
+  if (s->map_factor != factor)
+    SCALE_map(s, factor);
+
+  pthread_mutex_lock(&s->lock);
+  s->pending = s->bands - 1;
+  s->job++;
+  pthread_cond_broadcast(&s->start);
+  pthread_mutex_unlock(&s->lock);
+
+  SCALE_band(s, 0);
+
+  pthread_mutex_lock(&s->lock);
+  while (s->pending)
+    pthread_cond_wait(&s->done, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// CPU side upscaling of the 160x144 frame by an integer factor, so the
+// output is sharp whether or not the renderer can scale (no GPU). The
+// filters work on 4 pixels at a time with vector instructions and the
+// output rows are split into bands across worker threads. A filter with a
+// native factor, like Scale2x, is stretched to the others with nearest
+// neighbour so every filter works at any size.
+
+#define SCALE_MAX_FACTOR 16
+#define SCALE_MAX_THREADS 8
+
+typedef enum {
+  SCALE_NEAREST, // plain pixel replication
+  SCALE_2X,      // Scale2x (EPX), rounds off diagonal edges
+  SCALE_3X,      // Scale3x
+  SCALE_HQ2X,    // Scale2x with the edges blended into the pixel, hq2x-like
+  SCALE_LCD,     // replication with a darker grid between the pixels
+  SCALE_FILTERS
+} ScaleFilter;
+
+typedef struct Scaler Scaler;
+
+// nearest, scale2x, scale3x, hq2x or lcd
+bool SCALE_parse(const char *name, ScaleFilter *filter);
+// threads counts the caller, 0 is one per core
+Scaler *SCALE_new(ScaleFilter filter, int threads);
+void SCALE_free(Scaler *s);
+// the largest factor whose output fits in width x height, at least 1
+int SCALE_fit(int width, int height);
+// frame is a render.h frame and lut its palette, dst gets factor times its
+// size in ARGB with pitch bytes per row, a locked streaming texture for
+// instance. At factor 1 every filter is a plain copy.
+void SCALE_run(Scaler *s, const uint8_t *frame, const uint32_t *lut,
+               int factor, void *dst, int pitch);
@@ -0,0 +1,401 @@
+#include "state.h"
+#include "cartridge.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// every field that is saved, in file order
+#define STATE_FIELDS(X)                                                        \
+  X(cpu->AF)                                                                   \
+  X(cpu->BC)                                                                   \
+  X(cpu->DE)                                                                   \
+  X(cpu->HL)                                                                   \
+  X(cpu->SP)                                                                   \
+  X(cpu->PC)                                                                   \
+  X(cpu->ly)                                                                   \
+  X(cpu->direction_state)                                                      \
+  X(cpu->button_state)                                                         \
+  X(cpu->joyp)                                                                 \
+  X(cpu->if_reg)                                                               \
+  X(cpu->ie_reg)                                                               \
+  X(cpu->lcdc)                                                                 \
+  X(cpu->scy)                                                                  \
+  X(cpu->scx)                                                                  \
+  X(cpu->wy)                                                                   \
+  X(cpu->wx)                                                                   \
+  X(cpu->bgp)                                                                  \
+  X(cpu->obp0)                                                                 \
+  X(cpu->obp1)                                                                 \
+  X(cpu->divr)                                                                 \
+  X(cpu->tima)                                                                 \
+  X(cpu->tma)                                                                  \
+  X(cpu->tac)                                                                  \
+  X(cpu->div_counter)                                                          \
+  X(cpu->tima_counter)                                                         \
+  X(cpu->stat)                                                                 \
+  X(cpu->lyc)                                                                  \
+  X(cpu->apu)                                                                  \
+  X(cpu->_memory)                                                              \
+  X(cpu->IME)                                                                  \
+  X(cpu->pending_IME)                                                          \
+  X(cpu->cycle_count)                                                          \
+  X(cpu->halted)                                                               \
+  X(cpu->bus_lock)                                                             \
+  X(cpu->dma_end)                                                              \
+  X(cart->rom_bank)                                                            \
+  X(cart->ram_bank)                                                            \
+  X(cart->ram_enable)                                                          \
+  X(cart->banking_mode)
+
+#define STATE_HEADER (8 + sizeof(uint64_t)) // magic, ROM hash
+// cartridge RAM comes last, MAX_RAM_SIZE bytes whatever the cartridge has
+#define STATE_RAM MAX_RAM_SIZE
+
+// a fork's memory is a table for every 64 pages, _memory then the
+// cartridge RAM, so a table nothing was written to is shared whole; the
+// last table of each may be partly used
+#define STATE_CPU_PAGES (MEM_SIZE / STATE_PAGE)
+#define STATE_CPU_TABLES ((STATE_CPU_PAGES + 63) / 64)
+#define STATE_TABLES (STATE_CPU_TABLES + MAX_RAM_SIZE / STATE_PAGE / 64)
+// the FFxx page, written all the time, is kept in the fork itself
+#define STATE_IO_TABLE (MEM_HIGH / STATE_PAGE / 64)
+#define STATE_IO_PAGE (MEM_HIGH / STATE_PAGE % 64)
+
+// the CPU around its memory array
+#define STATE_CPU_HEAD offsetof(CPU, _memory)
+#define STATE_CPU_REST (sizeof(CPU) - sizeof(((CPU *)0)->_memory))
+
+typedef struct {
+  _Atomic uint32_t refs;
+  uint8_t data[STATE_PAGE];
+} ForkPage;
+
+typedef struct {
+  _Atomic uint32_t refs;
+  ForkPage *pages[64];
+} ForkTable;
+
+struct Fork {
+  _Atomic uint32_t refs;
+  uint8_t cpu[STATE_CPU_REST];
+  Cartridge cart;
+  uint8_t io[STATE_PAGE];
+  ForkTable *tables[STATE_TABLES];
+};
+
+// the frontend's pointers, which stay in the CPU a state is put back into
+typedef struct {
+  Cartridge *cart;
+  uint8_t *rom;
+  uint8_t *ram;
+  Ppu *ppu;
+  Lines *lines;
+  Trace *trace;
+  Idle *idle;
+  Input *input;
+  ApuOutput *audio;
+  Fork *fork;
+  Debug *debug;
+  Aot *aot;
+} StateKeep;
+
+static StateKeep STATE_keep(CPU *cpu) {
+  return (StateKeep){cpu->cart,  cpu->cart->rom, cpu->cart->ram, cpu->ppu,
+                     cpu->lines, cpu->trace,     cpu->idle,      cpu->input,
+                     cpu->audio, cpu->fork,      cpu->debug,     cpu->aot};
+}
+
+static void STATE_put_back(CPU *cpu, StateKeep keep) {
+  cpu->cart = keep.cart;
+  cpu->cart->rom = keep.rom;
+  cpu->cart->ram = keep.ram;
+  cpu->ppu = keep.ppu;
+  cpu->lines = keep.lines;
+  cpu->trace = keep.trace;
+  cpu->idle = keep.idle;
+  cpu->input = keep.input;
+  cpu->audio = keep.audio;
+  cpu->fork = keep.fork;
+  cpu->debug = keep.debug;
+  cpu->aot = keep.aot;
+  // the pages come with bus_lock, the watched ones stay
+  CPU_bus_update(cpu);
+  // VRAM and OAM are not what the line renderer copied last
+  cpu->vram_dirty = true;
+}
+
+size_t STATE_size(void) {
+  CPU *cpu = NULL;
+  Cartridge *cart = NULL;
+  size_t size = STATE_HEADER + STATE_RAM;
+#define X(field) size += sizeof(field);
+  STATE_FIELDS(X)
+#undef X
+  (void)cpu;
+  (void)cart;
+  return size;
+}
+
+void STATE_save(CPU *cpu, uint8_t *buf) {
+  Cartridge *cart = cpu->cart;
+  uint64_t hash = cart_hash(cart);
+  memcpy(buf, STATE_MAGIC, 8);
+  memcpy(buf + 8, &hash, sizeof(hash));
+  buf += STATE_HEADER;
+#define X(field)                                                               \
+  memcpy(buf, &(field), sizeof(field));                                        \
+  buf += sizeof(field);
+  STATE_FIELDS(X)
+#undef X
+  if (cart->ram_size)
+    memcpy(buf, cart->ram, cart->ram_size);
+  memset(buf + cart->ram_size, 0, STATE_RAM - cart->ram_size);
+}
+
+bool STATE_load(CPU *cpu, const uint8_t *buf, size_t size) {
+  Cartridge *cart = cpu->cart;
+  uint64_t hash;
+  if (size != STATE_size())
+    return false;
+  memcpy(&hash, buf + 8, sizeof(hash));
+  if (memcmp(buf, STATE_MAGIC, 8) != 0 || hash != cart_hash(cart))
+    return false;
+  buf += STATE_HEADER;
+#define X(field)                                                               \
+  memcpy(&(field), buf, sizeof(field));                                        \
+  buf += sizeof(field);
+  STATE_FIELDS(X)
+#undef X
+  if (cart->ram_size)
+    memcpy(cart->ram, buf, cart->ram_size);
+  CPU_bus_update(cpu);
+  cpu->vram_dirty = true;
+  STATE_fork_forget(cpu);
+  return true;
+}
+
+bool STATE_save_file(CPU *cpu, const char *path) {
+  size_t size = STATE_size();
+  uint8_t *buf = malloc(size);
+  FILE *f = buf ? fopen(path, "wb") : NULL;
+  bool ok = f != NULL;
+  if (ok) {
+    STATE_save(cpu, buf);
+    ok = fwrite(buf, 1, size, f) == size;
+    ok = fclose(f) == 0 && ok;
+  }
+  free(buf);
+  return ok;
+}
+
+bool STATE_load_file(CPU *cpu, const char *path) {
+  size_t size = STATE_size();
+  uint8_t *buf = malloc(size + 1);
+  FILE *f = buf ? fopen(path, "rb") : NULL;
+  bool ok = false;
+  if (f) {
+    // one byte more than a state so a longer file fails the size check
+    ok = STATE_load(cpu, buf, fread(buf, 1, size + 1, f));
+    fclose(f);
+  }
+  free(buf);
+  return ok;
+}
+
+uint64_t STATE_hash(CPU *cpu) {
+  size_t size = STATE_size();
+  uint8_t *buf = malloc(size);
+  if (!buf)
+    return 0;
+  STATE_save(cpu, buf);
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= buf[i];
+    hash *= 0x100000001B3ull;
+  }
+  free(buf);
+  return hash;
+}
+
+void STATE_snapshot(CPU *cpu, Snapshot *snap) {
+  memcpy(&snap->cpu, cpu, sizeof(CPU));
+  memcpy(&snap->cart, cpu->cart, sizeof(Cartridge));
+  if (cpu->cart->ram_size)
+    memcpy(snap->ram, cpu->cart->ram, cpu->cart->ram_size);
+}
+
+void STATE_restore(CPU *cpu, const Snapshot *snap) {
+  StateKeep keep = STATE_keep(cpu);
+  memcpy(cpu, &snap->cpu, sizeof(CPU));
+  memcpy(keep.cart, &snap->cart, sizeof(Cartridge));
+  STATE_put_back(cpu, keep);
+  if (keep.cart->ram_size)
+    memcpy(keep.cart->ram, snap->ram, keep.cart->ram_size);
+  // every page may have changed
+  STATE_fork_forget(cpu);
+}
+
+// how many of table's 64 pages there are
+static size_t STATE_pages(CPU *cpu, size_t table) {
+  size_t first = table * 64, count = STATE_CPU_PAGES;
+  if (table >= STATE_CPU_TABLES) {
+    first = (table - STATE_CPU_TABLES) * 64;
+    count = cpu->cart->ram_size / STATE_PAGE;
+  }
+  return count <= first ? 0 : count - first < 64 ? count - first : 64;
+}
+
+static uint8_t *STATE_page(CPU *cpu, size_t table, size_t page) {
+  if (table < STATE_CPU_TABLES)
+    return &cpu->_memory[(table * 64 + page) * STATE_PAGE];
+  return &cpu->cart->ram[((table - STATE_CPU_TABLES) * 64 + page) * STATE_PAGE];
+}
+
+// the written flags of a table, NULL when none is set
+static const uint8_t *STATE_written(CPU *cpu, size_t table) {
+  const uint8_t *written = &cpu->written[table * 64];
+  if (table >= STATE_CPU_TABLES)
+    written = &cpu->cart->written[(table - STATE_CPU_TABLES) * 64];
+  size_t count = STATE_pages(cpu, table);
+  uint64_t any = 0;
+  for (size_t i = 0; i + 8 <= count; i += 8) {
+    uint64_t word;
+    memcpy(&word, written + i, sizeof(word));
+    any |= word;
+  }
+  for (size_t i = count & ~(size_t)7; i < count; i++)
+    any |= written[i];
+  return any ? written : NULL;
+}
+
+// cpu is at fork from now on, with nothing written
+static void STATE_fork_move(CPU *cpu, Fork *fork) {
+  Fork *from = cpu->fork;
+  memset(cpu->written, 0, sizeof(cpu->written));
+  memset(cpu->cart->written, 0, sizeof(cpu->cart->written));
+  cpu->fork = STATE_fork_ref(fork);
+  STATE_fork_free(from);
+}
+
+static void STATE_table_free(ForkTable *table) {
+  if (!table ||
+      atomic_fetch_sub_explicit(&table->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  for (int i = 0; i < 64; i++) {
+    ForkPage *page = table->pages[i];
+    if (page && atomic_fetch_sub_explicit(&page->refs, 1,
+                                          memory_order_acq_rel) == 1)
+      free(page);
+  }
+  free(table);
+}
+
+// the table of cpu's memory, sharing what was not written with from
+static ForkTable *STATE_table(CPU *cpu, ForkTable *from, size_t t) {
+  const uint8_t *written = STATE_written(cpu, t);
+  if (from && !written) {
+    atomic_fetch_add_explicit(&from->refs, 1, memory_order_relaxed);
+    return from;
+  }
+  ForkTable *table = calloc(1, sizeof(ForkTable));
+  if (!table)
+    return NULL;
+  atomic_init(&table->refs, 1);
+  size_t count = STATE_pages(cpu, t);
+  for (size_t i = 0; i < count; i++) {
+    if (t == STATE_IO_TABLE && i == STATE_IO_PAGE)
+      continue;
+    if (from && !written[i]) {
+      table->pages[i] = from->pages[i];
+      atomic_fetch_add_explicit(&table->pages[i]->refs, 1,
+                                memory_order_relaxed);
+      continue;
+    }
+    ForkPage *page = malloc(sizeof(ForkPage));
+    if (!page) {
+      STATE_table_free(table);
+      return NULL;
+    }
+    atomic_init(&page->refs, 1);
+    memcpy(page->data, STATE_page(cpu, t, i), STATE_PAGE);
+    table->pages[i] = page;
+  }
+  return table;
+}
+
+Fork *STATE_fork(CPU *cpu) {
+  Fork *fork = calloc(1, sizeof(Fork));
+  if (!fork)
+    return NULL;
+  atomic_init(&fork->refs, 1);
+  uint8_t *c = (uint8_t *)cpu;
+  memcpy(fork->cpu, c, STATE_CPU_HEAD);
+  memcpy(fork->cpu + STATE_CPU_HEAD, c + STATE_CPU_HEAD + sizeof(cpu->_memory),
+         STATE_CPU_REST - STATE_CPU_HEAD);
+  memcpy(&fork->cart, cpu->cart, sizeof(Cartridge));
+  memcpy(fork->io, &cpu->_memory[MEM_HIGH], STATE_PAGE);
+
+  Fork *from = cpu->fork;
+  for (size_t t = 0; t < STATE_TABLES; t++) {
+    if (!STATE_pages(cpu, t))
+      continue; // no cartridge RAM there
+    fork->tables[t] = STATE_table(cpu, from ? from->tables[t] : NULL, t);
+    if (!fork->tables[t]) {
+      STATE_fork_free(fork);
+      return NULL;
+    }
+  }
+  STATE_fork_move(cpu, fork);
+  return fork;
+}
+
+void STATE_fork_enter(CPU *cpu, Fork *fork) {
+  // a page is already right when cpu has not written it since a fork that
+  // shares it with this one
+  Fork *from = cpu->fork;
+  for (size_t t = 0; t < STATE_TABLES; t++) {
+    ForkTable *table = fork->tables[t];
+    ForkTable *had = from ? from->tables[t] : NULL;
+    const uint8_t *written = table ? STATE_written(cpu, t) : NULL;
+    if (had == table && !written)
+      continue;
+    size_t count = STATE_pages(cpu, t);
+    for (size_t i = 0; i < count; i++) {
+      ForkPage *page = table->pages[i];
+      if (!page || (had && had->pages[i] == page && !(written && written[i])))
+        continue;
+      memcpy(STATE_page(cpu, t, i), page->data, STATE_PAGE);
+    }
+  }
+  memcpy(&cpu->_memory[MEM_HIGH], fork->io, STATE_PAGE);
+
+  StateKeep keep = STATE_keep(cpu);
+  uint8_t *c = (uint8_t *)cpu;
+  memcpy(c, fork->cpu, STATE_CPU_HEAD);
+  memcpy(c + STATE_CPU_HEAD + sizeof(cpu->_memory), fork->cpu + STATE_CPU_HEAD,
+         STATE_CPU_REST - STATE_CPU_HEAD);
+  memcpy(keep.cart, &fork->cart, sizeof(Cartridge));
+  STATE_put_back(cpu, keep);
+  STATE_fork_move(cpu, fork);
+}
+
+void STATE_fork_forget(CPU *cpu) {
+  STATE_fork_free(cpu->fork);
+  cpu->fork = NULL;
+}
+
+Fork *STATE_fork_ref(Fork *fork) {
+  atomic_fetch_add_explicit(&fork->refs, 1, memory_order_relaxed);
+  return fork;
+}
+
+void STATE_fork_free(Fork *fork) {
+  if (!fork ||
+      atomic_fetch_sub_explicit(&fork->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  for (size_t t = 0; t < STATE_TABLES; t++)
+    STATE_table_free(fork->tables[t]);
+  free(fork);
+}
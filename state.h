@@ -0,0 +1,57 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Save states: everything that affects emulation, CPU and cartridge, in a
+// fixed layout. The ROM itself is not included, only its hash, and a state
+// only loads into a CPU running the same ROM.
+
+#define STATE_MAGIC "GBSTATE3"
+
+size_t STATE_size(void);
+void STATE_save(CPU *cpu, uint8_t *buf);
+bool STATE_load(CPU *cpu, const uint8_t *buf, size_t size);
+bool STATE_save_file(CPU *cpu, const char *path);
+bool STATE_load_file(CPU *cpu, const char *path);
+// hash of the current state, equal hashes mean identical emulation
+uint64_t STATE_hash(CPU *cpu);
+
+// In-memory snapshots, for run-ahead: the CPU, cartridge and its RAM copied
+// whole, with no header, layout or checks, so taking and restoring one is a
+// few memcpys. A snapshot only goes back into the CPU it was taken from, or one
+// set up the same way running the same ROM.
+typedef struct {
+  CPU cpu;
+  Cartridge cart;
+  uint8_t ram[MAX_RAM_SIZE];
+} Snapshot;
+
+void STATE_snapshot(CPU *cpu, Snapshot *snap);
+// the frontend's pointers (cartridge ROM, PPU, trace, idle, input, sound
+// output, debugger) stay as they are
+void STATE_restore(CPU *cpu, const Snapshot *snap);
+
+// Copy-on-write forks, for search: a fork is a frozen state whose memory
+// (_memory and cartridge RAM) is kept in STATE_PAGE byte pages shared with
+// the forks it was made from. The CPU and cartridge write paths mark the
+// pages they touch, so taking a fork of a CPU, or putting a CPU back at a
+// fork related to the last one it was at, only copies the pages written
+// since (plus the FFxx page and the registers), not the whole state. A CPU
+// holds a reference to its last fork until STATE_fork_forget; forks are
+// reference counted and can be shared between threads, a CPU cannot.
+#define STATE_PAGE 256
+
+typedef struct Fork Fork;
+
+// a new fork of the current state, cpu is now at it
+Fork *STATE_fork(CPU *cpu);
+// puts cpu in the state of fork, the frontend's pointers stay as they are
+void STATE_fork_enter(CPU *cpu, Fork *fork);
+// drops cpu's reference to its fork, before freeing the CPU or after its
+// memory was changed behind the write paths
+void STATE_fork_forget(CPU *cpu);
+Fork *STATE_fork_ref(Fork *fork);
+void STATE_fork_free(Fork *fork);
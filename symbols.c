@@ -0,0 +1,165 @@
+#define _POSIX_C_SOURCE 200809L
+#include "symbols.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYM_LINE 512
+
+typedef struct {
+  uint32_t key; // bank << 16 | address
+  bool local;
+  char *name;
+} Symbol;
+
+struct Symbols {
+  Symbol *labels; // sorted by key, in file order within a key
+  size_t count;
+  size_t capacity;
+};
+
+static bool SYM_add(Symbols *syms, unsigned bank, unsigned addr,
+                    const char *name) {
+  if (bank > 0xFF || addr > 0xFFFF)
+    return true; // not a label line after all
+  if (syms->count == syms->capacity) {
+    size_t capacity = syms->capacity ? syms->capacity * 2 : 256;
+    Symbol *labels = realloc(syms->labels, capacity * sizeof(Symbol));
+    if (!labels)
+      return false;
+    syms->labels = labels;
+    syms->capacity = capacity;
+  }
+  char *copy = strdup(name);
+  if (!copy)
+    return false;
+  syms->labels[syms->count++] =
+      (Symbol){bank << 16 | addr, strchr(name, '.') != NULL, copy};
+  return true;
+}
+
+static int SYM_by_key(const void *a, const void *b) {
+  const Symbol *sa = a, *sb = b;
+  if (sa->key != sb->key)
+    return sa->key < sb->key ? -1 : 1;
+  // globals first, so a local label at the same address does not hide one
+  if (sa->local != sb->local)
+    return sa->local ? 1 : -1;
+  return sa < sb ? -1 : sa > sb;
+}
+
+Symbols *SYM_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return NULL;
+  Symbols *syms = calloc(1, sizeof(Symbols));
+  if (!syms) {
+    fclose(f);
+    return NULL;
+  }
+
+  // .sym lines are "bank:address name"; a .map lists "$address = name"
+  // under a "ROMX bank #n:" heading for each bank
+  char line[SYM_LINE], name[SYM_LINE], area[16];
+  unsigned bank, addr, map_bank = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f)) {
+    char *comment = strchr(line, ';');
+    if (comment)
+      *comment = '\0';
+    if (sscanf(line, "%x:%x %511s", &bank, &addr, name) == 3)
+      ok = SYM_add(syms, bank, addr, name);
+    else if (sscanf(line, "%15s bank #%u", area, &bank) == 2)
+      map_bank = bank;
+    else if (sscanf(line, " $%x = %511s", &addr, name) == 2)
+      ok = SYM_add(syms, map_bank, addr, name);
+  }
+  fclose(f);
+  if (!ok || !syms->count) {
+    SYM_free(syms);
+    return NULL;
+  }
+  qsort(syms->labels, syms->count, sizeof(Symbol), SYM_by_key);
+  return syms;
+}
+
+Symbols *SYM_load_for(const char *rom) {
+  size_t length = strlen(rom);
+  const char *dot = strrchr(rom, '.');
+  const char *slash = strrchr(rom, '/');
+  if (dot && (!slash || dot > slash))
+    length = dot - rom;
+  char *path = malloc(length + 5);
+  if (!path)
+    return NULL;
+  memcpy(path, rom, length);
+  strcpy(path + length, ".sym");
+  Symbols *syms = SYM_load(path);
+  if (!syms) {
+    strcpy(path + length, ".map");
+    syms = SYM_load(path);
+  }
+  free(path);
+  return syms;
+}
+
+void SYM_free(Symbols *syms) {
+  if (!syms)
+    return;
+  for (size_t i = 0; i < syms->count; i++)
+    free(syms->labels[i].name);
+  free(syms->labels);
+  free(syms);
+}
+
+size_t SYM_count(const Symbols *syms) { return syms ? syms->count : 0; }
+
+// the first address of the memory area addr is in
+static uint16_t SYM_area(uint16_t addr) {
+  if (addr < 0x8000)
+    return addr & 0xC000;
+  return addr & 0xE000;
+}
+
+const char *SYM_lookup(const Symbols *syms, uint8_t bank, uint16_t addr,
+                       bool local, uint16_t *offset) {
+  if (!syms)
+    return NULL;
+  // the first label past addr, then back to the closest one that fits
+  uint32_t key = (uint32_t)bank << 16 | addr;
+  size_t low = 0, high = syms->count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (syms->labels[mid].key <= key)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  uint32_t floor = (uint32_t)bank << 16 | SYM_area(addr);
+  while (low-- > 0) {
+    const Symbol *s = &syms->labels[low];
+    if (s->key < floor)
+      break;
+    if (s->local && !local)
+      continue;
+    // of several labels at one address the first, a global if there is one
+    while (low > 0 && syms->labels[low - 1].key == s->key)
+      s = &syms->labels[--low];
+    if (offset)
+      *offset = addr - (s->key & 0xFFFF);
+    return s->name;
+  }
+  return NULL;
+}
+
+void SYM_format(const Symbols *syms, uint8_t bank, uint16_t addr, bool local,
+                char *buf, size_t len) {
+  uint16_t offset;
+  const char *name = SYM_lookup(syms, bank, addr, local, &offset);
+  if (!name)
+    snprintf(buf, len, "%02X:%04X", bank, addr);
+  else if (offset)
+    snprintf(buf, len, "%s+%X", name, offset);
+  else
+    snprintf(buf, len, "%s", name);
+}
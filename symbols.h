@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Guest symbols from the linker, for naming addresses: RGBDS .sym files
+// (rgblink -n, no$gmb uses the same "bank:address name" lines) or rgblink
+// .map files (rgblink -m). Labels with a dot, Parent.local, are local.
+
+typedef struct Symbols Symbols;
+
+// NULL when the file cannot be read or holds no labels
+Symbols *SYM_load(const char *path);
+// the .sym, else the .map, next to a ROM: game.gb gives game.sym, game.map
+Symbols *SYM_load_for(const char *rom);
+void SYM_free(Symbols *syms);
+size_t SYM_count(const Symbols *syms);
+
+// the closest label at or below addr in its bank and memory area (ROM0,
+// ROMX or an 8 KB block above 0x8000), NULL for none; offset is how far
+// addr is past it. Local labels are only considered when local is set.
+const char *SYM_lookup(const Symbols *syms, uint8_t bank, uint16_t addr,
+                       bool local, uint16_t *offset);
+// "Label" or "Label+1A", else "BB:AAAA"; syms may be NULL
+void SYM_format(const Symbols *syms, uint8_t bank, uint16_t addr, bool local,
+                char *buf, size_t len);
@@ -0,0 +1,162 @@
+#define _POSIX_C_SOURCE 200809L
+#include "telemetry.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct Telemetry {
+  TelemetryShm *shm;
+  size_t size;
+  char *name; // with the slash, for shm_unlink
+};
+
+// the object still there at exit is removed
+static Telemetry *publishing;
+
+static void TELEMETRY_exit(void) {
+  if (publishing)
+    TELEMETRY_close(publishing);
+}
+
+// whether the object name was left by an emulator that is gone; one whose
+// pid cannot be read yet may be being made, and is not
+static bool TELEMETRY_stale(const char *name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return errno == ENOENT; // removed since, free to make again
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(TelemetryShm))
+    map = mmap(NULL, sizeof(TelemetryShm), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  pid_t pid = ((TelemetryShm *)map)->pid;
+  munmap(map, sizeof(TelemetryShm));
+  return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+Telemetry *TELEMETRY_open(const char *name, const TelemetryRange *ranges,
+                          int range_count) {
+  static bool registered;
+  if (range_count < 0 || range_count > TELEMETRY_RANGES)
+    return NULL;
+  uint32_t data_size = 0;
+  for (int i = 0; i < range_count; i++) {
+    if (ranges[i].address + ranges[i].length > 0x10000)
+      return NULL;
+    data_size += ranges[i].length;
+  }
+
+  Telemetry *t = calloc(1, sizeof(Telemetry));
+  if (!t)
+    return NULL;
+  t->name = malloc(strlen(name) + 2);
+  if (!t->name) {
+    free(t);
+    return NULL;
+  }
+  sprintf(t->name, "%s%s", name[0] == '/' ? "" : "/", name);
+  t->size = sizeof(TelemetryShm) + data_size;
+
+  // never over another emulator's, only over one whose emulator died
+  // without removing it
+  int fd = shm_open(t->name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0 && errno == EEXIST && TELEMETRY_stale(t->name)) {
+    shm_unlink(t->name);
+    fd = shm_open(t->name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  }
+  if (fd < 0)
+    goto fail;
+  if (ftruncate(fd, t->size) != 0) {
+    close(fd);
+    shm_unlink(t->name);
+    goto fail;
+  }
+  void *map = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    shm_unlink(t->name);
+    goto fail;
+  }
+  t->shm = map;
+
+  // the magic last, a reader that finds it finds the rest
+  TelemetryShm *shm = t->shm;
+  shm->size = t->size;
+  shm->pid = getpid();
+  shm->range_count = range_count;
+  shm->data_size = data_size;
+  uint32_t offset = 0;
+  for (int i = 0; i < range_count; i++) {
+    shm->range[i] = ranges[i];
+    shm->range[i].offset = offset;
+    offset += ranges[i].length;
+  }
+  atomic_thread_fence(memory_order_release);
+  memcpy(shm->magic, TELEMETRY_MAGIC, sizeof(shm->magic));
+
+  publishing = t;
+  if (!registered) {
+    atexit(TELEMETRY_exit);
+    registered = true;
+  }
+  return t;
+
+fail:
+  free(t->name);
+  free(t);
+  return NULL;
+}
+
+void TELEMETRY_close(Telemetry *t) {
+  if (!t)
+    return;
+  if (publishing == t)
+    publishing = NULL;
+  // readers that have it mapped keep the last snapshot
+  munmap(t->shm, t->size);
+  shm_unlink(t->name);
+  free(t->name);
+  free(t);
+}
+
+void TELEMETRY_publish(Telemetry *t, CPU *cpu, uint64_t frame) {
+  TelemetryShm *shm = t->shm;
+  uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+  atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  shm->state = (TelemetryState){
+      .frame = frame,
+      .cycle_count = cpu->cycle_count,
+      .af = cpu->AF,
+      .bc = cpu->BC,
+      .de = cpu->DE,
+      .hl = cpu->HL,
+      .sp = cpu->SP,
+      .pc = cpu->PC,
+      .ime = cpu->IME,
+      .halted = cpu->halted,
+      .if_reg = cpu->if_reg,
+      .ie_reg = cpu->ie_reg,
+      .ly = cpu->ly,
+      .lcdc = cpu->lcdc,
+      .stat = cpu->stat,
+      .rom_bank = cpu->cart->rom_bank,
+      .direction_state = cpu->direction_state,
+      .button_state = cpu->button_state,
+  };
+  for (uint32_t i = 0; i < shm->range_count; i++) {
+    const TelemetryRange *r = &shm->range[i];
+    CPU_gather(cpu, r->address, r->length, shm->data + r->offset);
+  }
+
+  atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Live telemetry. With --telemetry NAME the emulator creates a POSIX shared
+// memory object (shm_open) and, at the end of every frame, publishes the
+// registers, the frame count and the chosen RAM ranges into it, for
+// dashboards and bots to watch a running game. The emulator never waits
+// for a reader: a sequence counter, odd while it writes, lets a reader
+// copy the snapshot and retry when it changed underneath (a seqlock).
+// telemetry_reader.c is the reader side, for other programs to link in,
+// and tools/telemetry prints what a running emulator publishes.
+//
+// Layout: a TelemetryShm, whose data holds the ranges back to back at their
+// offsets, native endian. Everything before seq is written once at
+// creation.
+
+#define TELEMETRY_MAGIC "GBTELEM1"
+#define TELEMETRY_RANGES 16
+
+typedef struct {
+  uint16_t address;
+  uint16_t length; // address + length stays within 0x10000
+  uint32_t offset; // of its bytes in data
+} TelemetryRange;
+
+typedef struct {
+  uint64_t frame; // frames run since the emulator started
+  uint64_t cycle_count;
+  uint16_t af, bc, de, hl, sp, pc;
+  uint8_t ime, halted;
+  uint8_t if_reg, ie_reg;
+  uint8_t ly, lcdc, stat;
+  uint8_t rom_bank;
+  uint8_t direction_state, button_state; // 0 is pressed
+  uint8_t reserved[2];
+} TelemetryState;
+
+_Static_assert(sizeof(TelemetryState) == 40, "telemetry states are 40 bytes");
+
+typedef struct {
+  char magic[8];
+  uint32_t size; // of the whole object
+  uint32_t pid;  // of the emulator
+  uint32_t range_count;
+  uint32_t data_size;
+  TelemetryRange range[TELEMETRY_RANGES];
+  // bumped before and after every snapshot, odd while one is written
+  _Alignas(64) _Atomic uint32_t seq;
+  TelemetryState state;
+  uint8_t data[];
+} TelemetryShm;
+
+typedef struct Telemetry Telemetry;
+
+// the emulator side: creates /NAME (the slash is added when missing) with
+// the ranges, whose offsets it fills in, and removes it on exit; NULL when
+// another running emulator publishes under the name (one left by an
+// emulator that died is replaced)
+Telemetry *TELEMETRY_open(const char *name, const TelemetryRange *ranges,
+                          int range_count);
+void TELEMETRY_close(Telemetry *t);
+void TELEMETRY_publish(Telemetry *t, CPU *cpu, uint64_t frame);
+
+// the reader side (telemetry_reader.c), needs nothing else of the emulator
+typedef struct TelemetryReader TelemetryReader;
+
+// NULL when there is no such object or it is not the emulator's
+TelemetryReader *TELEMETRY_attach(const char *name);
+void TELEMETRY_detach(TelemetryReader *r);
+// the layout, the ranges and data_size, which stay as they are
+const TelemetryShm *TELEMETRY_layout(const TelemetryReader *r);
+// a consistent copy of the last snapshot, data gets data_size bytes; spins
+// the few microseconds the emulator may be writing one
+void TELEMETRY_read(TelemetryReader *r, TelemetryState *state, uint8_t *data);
+// whether the emulator that made the object still runs
+bool TELEMETRY_alive(const TelemetryReader *r);
@@ -0,0 +1,87 @@
+#define _POSIX_C_SOURCE 200809L
+#include "telemetry.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the reader side of telemetry.h, which only needs the layout: programs
+// that watch the emulator build this file alone
+
+struct TelemetryReader {
+  TelemetryShm *shm;
+  size_t size;
+};
+
+TelemetryReader *TELEMETRY_attach(const char *name) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+  int fd = shm_open(path, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TelemetryShm)) {
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  TelemetryShm *shm = map;
+  bool valid = memcmp(shm->magic, TELEMETRY_MAGIC, sizeof(shm->magic)) == 0;
+  atomic_thread_fence(memory_order_acquire);
+  if (!valid || shm->size != (size_t)st.st_size ||
+      shm->range_count > TELEMETRY_RANGES ||
+      sizeof(TelemetryShm) + shm->data_size > shm->size) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  TelemetryReader *r = malloc(sizeof(TelemetryReader));
+  if (!r) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  r->shm = shm;
+  r->size = st.st_size;
+  return r;
+}
+
+void TELEMETRY_detach(TelemetryReader *r) {
+  if (!r)
+    return;
+  munmap(r->shm, r->size);
+  free(r);
+}
+
+const TelemetryShm *TELEMETRY_layout(const TelemetryReader *r) {
+  return r->shm;
+}
+
+void TELEMETRY_read(TelemetryReader *r, TelemetryState *state,
+                    uint8_t *data) {
+  TelemetryShm *shm = r->shm;
+  for (;;) {
+    uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_acquire);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    *state = shm->state;
+    memcpy(data, shm->data, shm->data_size);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&shm->seq, memory_order_relaxed) == seq)
+      return;
+  }
+}
+
+bool TELEMETRY_alive(const TelemetryReader *r) {
+  return kill(r->shm->pid, 0) == 0 || errno == EPERM;
+}
@@ -0,0 +1,564 @@
+// compiles the code of a ROM ahead of time for GBemu --aot (aot.h)
+//
+//   recompile game.gb aot        writes aot/<rom hash>.c, builds
+//                                aot/<rom hash>.so
+//   recompile -c game.gb aot     only writes the C
+//
+// The code is found by following jumps, calls and branches from 0x0100, the
+// interrupt vectors and the RST targets. A jump from bank 0 into 0x4000-
+// 0x7FFF is followed into every bank, as the bank is not known; jumps in a
+// bank stay in it. $CC (cc by default) builds the .so.
+
+#include "../aot.h"
+#include "../cartridge.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef AOT_INCLUDE
+#define AOT_INCLUDE "."
+#endif
+
+#define BANKS 32 // cart_read has 5 bank bits
+#define BANK_SIZE 0x4000
+
+static Cartridge *cart;
+static int banks;
+// CODE where an instruction starts, SEEN where one would run past the
+// bank
+static uint8_t code[BANKS][BANK_SIZE];
+#define CODE 1
+#define SEEN 2
+static uint32_t *work;
+static size_t work_count;
+
+// the interpreter's lengths: stop is one byte, the CB prefix takes two
+static int length(uint8_t op) {
+  switch (op) {
+  case 0x01: case 0x08: case 0x11: case 0x21: case 0x31: case 0xC2:
+  case 0xC3: case 0xC4: case 0xCA: case 0xCC: case 0xCD: case 0xD2:
+  case 0xD4: case 0xDA: case 0xDC: case 0xEA: case 0xFA:
+    return 3;
+  case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E:
+  case 0x36: case 0x3E: case 0x18: case 0x20: case 0x28: case 0x30:
+  case 0x38: case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6:
+  case 0xEE: case 0xF6: case 0xFE: case 0xE0: case 0xF0: case 0xE8:
+  case 0xF8: case 0xCB:
+    return 2;
+  }
+  return 1;
+}
+
+static bool invalid(uint8_t op) {
+  static const uint8_t ops[] = {0xD3, 0xDB, 0xDD, 0xE3, 0xE4, 0xEB,
+                                0xEC, 0xED, 0xF4, 0xFC, 0xFD};
+  return memchr(ops, op, sizeof(ops)) != NULL;
+}
+
+static const uint8_t *rom_at(int bank, uint16_t addr) {
+  return &cart->rom[bank * BANK_SIZE + (addr & (BANK_SIZE - 1))];
+}
+
+// the block being written
+static uint16_t block_start;
+
+// an instruction of the block's code at addr, which a goto reaches
+static bool compiled(int bank, uint16_t addr) {
+  return addr < 0x8000 && (addr < BANK_SIZE) == (bank == 0) &&
+         (addr & ~(AOT_BLOCK - 1)) == block_start &&
+         code[bank][addr & (BANK_SIZE - 1)] == CODE;
+}
+
+static void push(int bank, uint16_t addr) {
+  if (addr >= 0x8000)
+    return; // RAM, left to the interpreter
+  if (addr < BANK_SIZE) {
+    bank = 0;
+  } else if (bank == 0) {
+    for (int b = 1; b < banks; b++)
+      push(b, addr);
+    return;
+  }
+  if (code[bank][addr & (BANK_SIZE - 1)])
+    return;
+  // the bytes are read from the bank itself, so an instruction cut off at
+  // its end is not compiled
+  if ((addr & (BANK_SIZE - 1)) + length(*rom_at(bank, addr)) > BANK_SIZE) {
+    code[bank][addr & (BANK_SIZE - 1)] = SEEN;
+    return;
+  }
+  code[bank][addr & (BANK_SIZE - 1)] = CODE;
+  work[work_count++] = (uint32_t)bank << 16 | addr;
+}
+
+static void walk(void) {
+  push(0, 0x0100);
+  for (uint16_t vector = 0x40; vector <= 0x60; vector += 8)
+    push(0, vector);
+  for (uint16_t rst = 0x00; rst <= 0x38; rst += 8)
+    push(0, rst);
+
+  while (work_count) {
+    uint32_t item = work[--work_count];
+    int bank = item >> 16;
+    uint16_t addr = item & 0xFFFF;
+    const uint8_t *p = rom_at(bank, addr);
+    uint8_t op = p[0];
+    uint16_t next = addr + length(op);
+    uint16_t imm16 = length(op) == 3 ? p[1] | p[2] << 8 : 0;
+    switch (op) {
+    case 0x18: // jr
+      push(bank, next + (int8_t)p[1]);
+      continue;
+    case 0x20: case 0x28: case 0x30: case 0x38: // jr cc
+      push(bank, next + (int8_t)p[1]);
+      break;
+    case 0xC3: // jp
+      push(bank, imm16);
+      continue;
+    case 0xC2: case 0xCA: case 0xD2: case 0xDA: // jp cc
+    case 0xC4: case 0xCC: case 0xD4: case 0xDC: // call cc
+    case 0xCD:                                  // call
+      push(bank, imm16);
+      break;
+    case 0xC7: case 0xCF: case 0xD7: case 0xDF:
+    case 0xE7: case 0xEF: case 0xF7: case 0xFF: // rst
+      push(0, op & 0x38);
+      break;
+    case 0xC9: case 0xD9: case 0xE9: // ret, reti, jp hl
+      continue;
+    }
+    if (invalid(op))
+      continue;
+    push(bank, next);
+  }
+}
+
+static FILE *out;
+
+static const char *r8[] = {"cpu->B", "cpu->C", "cpu->D", "cpu->E",
+                           "cpu->H", "cpu->L", NULL,     "cpu->A"};
+static const char *r16[] = {"cpu->BC", "cpu->DE", "cpu->HL", "cpu->SP"};
+static const char *r16stk[] = {"cpu->BC", "cpu->DE", "cpu->HL", "cpu->AF"};
+static const char *cond[] = {"!(cpu->F & 0x80)", "(cpu->F & 0x80)",
+                             "!(cpu->F & 0x10)", "(cpu->F & 0x10)"};
+static const char *alu[] = {"AOT_add", "AOT_adc", "AOT_sub", "AOT_sbc",
+                            "AOT_and", "AOT_xor", "AOT_or",  "AOT_cp"};
+
+// an r8 operand as a value, (hl) read through the bus
+static void value(char *buf, size_t len, int r) {
+  if (r == 6)
+    snprintf(buf, len, "AOT_read(cpu, host, cpu->HL)");
+  else
+    snprintf(buf, len, "%s", r8[r]);
+}
+
+// the rest of an instruction that falls through to next
+static void next_of(int bank, uint16_t next, bool store) {
+  if (compiled(bank, next))
+    fprintf(out, "    %s(0x%04X);\n    goto l_%04X;\n",
+            store ? "AOT_NEXT_STORE" : "AOT_NEXT", next, next);
+  else
+    fprintf(out, "    AOT_LEAVE(0x%04X);\n", next);
+}
+
+// a taken static jump
+static void jump_to(int bank, uint16_t target, bool store) {
+  if (!compiled(bank, target))
+    fprintf(out, "    AOT_LEAVE(0x%04X);\n", target);
+  else if (store)
+    fprintf(out, "    AOT_NEXT_STORE(0x%04X);\n    goto l_%04X;\n", target,
+            target);
+  else
+    fprintf(out, "    AOT_GOTO(0x%04X, l_%04X);\n", target, target);
+}
+
+static void push_value(const char *val) {
+  fprintf(out,
+          "    AOT_write(cpu, host, --cpu->SP, (%s) >> 8);\n"
+          "    AOT_write(cpu, host, --cpu->SP, (%s) & 0xFF);\n",
+          val, val);
+}
+
+static void pop_pc(void) {
+  fprintf(out, "    cpu->PC = AOT_read(cpu, host, cpu->SP++);\n"
+               "    cpu->PC |= AOT_read(cpu, host, cpu->SP++) << 8;\n"
+               "    AOT_cycles(cpu);\n"
+               "    if (AOT_exit(cpu))\n"
+               "      return;\n"
+               "    goto dispatch;\n");
+}
+
+static void prefix(int bank, uint16_t addr, uint8_t cb) {
+  uint16_t next = addr + 2;
+  int r = cb & 0x07, bit = (cb >> 3) & 0x07;
+  char src[64];
+  value(src, sizeof(src), r);
+  fprintf(out, "    uint8_t v = %s;\n", src);
+  if (cb >= 0x40 && cb < 0x80) {
+    fprintf(out, "    AOT_bit(cpu, v, %d);\n", bit);
+    next_of(bank, next, false);
+    return;
+  }
+  static const char *ops[] = {
+      "AOT_cb_carry(cpu, v << 1 | v >> 7, v & 0x80)",
+      "AOT_cb_carry(cpu, v >> 1 | v << 7, v & 0x01)",
+      "AOT_rl(cpu, v)",
+      "AOT_rr(cpu, v)",
+      "AOT_cb_carry(cpu, v << 1, v & 0x80)",
+      "AOT_cb_carry(cpu, v >> 1 | (v & 0x80), v & 0x01)",
+      "AOT_swap(cpu, v)",
+      "AOT_cb_carry(cpu, v >> 1, v & 0x01)"};
+  char result[64];
+  if (cb < 0x40)
+    snprintf(result, sizeof(result), "%s", ops[bit]);
+  else if (cb < 0xC0)
+    snprintf(result, sizeof(result), "v & 0x%02X", (uint8_t) ~(1 << bit));
+  else
+    snprintf(result, sizeof(result), "v | 0x%02X", 1 << bit);
+  if (r == 6) {
+    fprintf(out, "    AOT_write(cpu, host, cpu->HL, %s);\n", result);
+    next_of(bank, next, true);
+  } else {
+    fprintf(out, "    %s = %s;\n", r8[r], result);
+    next_of(bank, next, false);
+  }
+}
+
+static void instruction(int bank, uint16_t addr) {
+  const uint8_t *p = rom_at(bank, addr);
+  uint8_t op = p[0];
+  int len = length(op);
+  uint16_t next = addr + len;
+  uint8_t imm8 = len > 1 ? p[1] : 0;
+  uint16_t imm16 = len == 3 ? p[1] | p[2] << 8 : 0;
+  char src[64];
+
+  fprintf(out, "  case 0x%04X:\n  l_%04X: // %02X", addr, addr, op);
+  for (int i = 1; i < len; i++)
+    fprintf(out, " %02X", p[i]);
+  fprintf(out, "\n  {\n");
+
+  // what the handler runs: rare ones and those that need its state
+  if (op == 0x08 || op == 0x10 || op == 0x27 || op == 0x76 || op == 0xD9 ||
+      op == 0xFB || invalid(op)) {
+    fprintf(out, "    AOT_EXECUTE(0x%04X, 0x%02X);\n", addr, op);
+    if (op == 0xD9 || invalid(op)) {
+      fprintf(out, "    goto dispatch;\n");
+    } else {
+      fprintf(out, "    if (cpu->PC != 0x%04X)\n      goto dispatch;\n", next);
+      if (compiled(bank, next))
+        fprintf(out, "    goto l_%04X;\n", next);
+      else
+        fprintf(out, "    return;\n");
+    }
+    fprintf(out, "  }\n");
+    return;
+  }
+  fprintf(out, "    AOT_HOOK(0x%04X, 0x%02X);\n", addr, op);
+
+  if (op >= 0x40 && op < 0x80) { // ld r8, r8
+    value(src, sizeof(src), op & 0x07);
+    int dst = (op >> 3) & 0x07;
+    if (dst == 6) {
+      fprintf(out, "    AOT_write(cpu, host, cpu->HL, %s);\n", src);
+      next_of(bank, next, true);
+    } else {
+      fprintf(out, "    %s = %s;\n", r8[dst], src);
+      next_of(bank, next, false);
+    }
+  } else if (op >= 0x80 && op < 0xC0) { // alu a, r8
+    value(src, sizeof(src), op & 0x07);
+    fprintf(out, "    %s(cpu, %s);\n", alu[(op >> 3) & 0x07], src);
+    next_of(bank, next, false);
+  } else if ((op & 0xC7) == 0xC6) { // alu a, imm8
+    fprintf(out, "    %s(cpu, 0x%02X);\n", alu[(op >> 3) & 0x07], imm8);
+    next_of(bank, next, false);
+  } else if (op < 0x40 && (op & 0x0F) == 0x01) { // ld r16, imm16
+    fprintf(out, "    %s = 0x%04X;\n", r16[op >> 4], imm16);
+    next_of(bank, next, false);
+  } else if (op < 0x40 && (op & 0x0F) == 0x03) { // inc r16
+    fprintf(out, "    %s++;\n", r16[op >> 4]);
+    next_of(bank, next, false);
+  } else if (op < 0x40 && (op & 0x0F) == 0x0B) { // dec r16
+    fprintf(out, "    %s--;\n", r16[op >> 4]);
+    next_of(bank, next, false);
+  } else if (op < 0x40 && (op & 0x0F) == 0x09) { // add hl, r16
+    fprintf(out, "    AOT_add_hl(cpu, %s);\n", r16[op >> 4]);
+    next_of(bank, next, false);
+  } else if (op < 0x40 && (op & 0x0F) == 0x02) { // ld [r16], a
+    const char *at = op < 0x20 ? r16[op >> 4] : "cpu->HL";
+    fprintf(out, "    AOT_write(cpu, host, %s, cpu->A);\n", at);
+    if (op >= 0x20)
+      fprintf(out, "    cpu->HL%s;\n", op == 0x22 ? "++" : "--");
+    next_of(bank, next, true);
+  } else if (op < 0x40 && (op & 0x0F) == 0x0A) { // ld a, [r16]
+    const char *at = op < 0x20 ? r16[op >> 4] : "cpu->HL";
+    fprintf(out, "    cpu->A = AOT_read(cpu, host, %s);\n", at);
+    if (op >= 0x20)
+      fprintf(out, "    cpu->HL%s;\n", op == 0x2A ? "++" : "--");
+    next_of(bank, next, false);
+  } else if (op < 0x40 && (op & 0x07) >= 0x04 && (op & 0x07) <= 0x06) {
+    int r = (op >> 3) & 0x07;
+    const char *how = (op & 0x07) == 0x04 ? "AOT_inc" : "AOT_dec";
+    if ((op & 0x07) == 0x06) { // ld r8, imm8
+      if (r == 6)
+        fprintf(out, "    AOT_write(cpu, host, cpu->HL, 0x%02X);\n", imm8);
+      else
+        fprintf(out, "    %s = 0x%02X;\n", r8[r], imm8);
+    } else if (r == 6) { // inc, dec [hl]
+      fprintf(out,
+              "    AOT_write(cpu, host, cpu->HL,\n"
+              "              %s(cpu, AOT_read(cpu, host, cpu->HL)));\n",
+              how);
+    } else {
+      fprintf(out, "    %s = %s(cpu, %s);\n", r8[r], how, r8[r]);
+    }
+    next_of(bank, next, r == 6);
+  } else {
+    switch (op) {
+    case 0x00: // nop
+      break;
+    case 0x07: // rlca
+      fprintf(out, "    uint8_t msb = cpu->A >> 7;\n"
+                   "    cpu->A = cpu->A << 1 | msb;\n"
+                   "    cpu->F = msb ? 0x10 : 0;\n");
+      break;
+    case 0x0F: // rrca
+      fprintf(out, "    uint8_t lsb = cpu->A & 0x01;\n"
+                   "    cpu->A = cpu->A >> 1 | lsb << 7;\n"
+                   "    cpu->F = lsb ? 0x10 : 0;\n");
+      break;
+    case 0x17: // rla
+      fprintf(out, "    uint8_t msb = cpu->A >> 7;\n"
+                   "    cpu->A = cpu->A << 1 | ((cpu->F & 0x10) ? 1 : 0);\n"
+                   "    cpu->F = msb ? 0x10 : 0;\n");
+      break;
+    case 0x1F: // rra
+      fprintf(out, "    uint8_t lsb = cpu->A & 0x01;\n"
+                   "    cpu->A = cpu->A >> 1 | ((cpu->F & 0x10) ? 0x80 : 0);\n"
+                   "    cpu->F = lsb ? 0x10 : 0;\n");
+      break;
+    case 0x2F: // cpl
+      fprintf(out, "    cpu->A = ~cpu->A;\n    cpu->F |= 0x60;\n");
+      break;
+    case 0x37: // scf
+      fprintf(out, "    cpu->F |= 0x10;\n");
+      break;
+    case 0x3F: // ccf
+      fprintf(out, "    cpu->F ^= 0x10;\n");
+      break;
+    case 0x18: // jr
+      jump_to(bank, next + (int8_t)imm8, false);
+      fprintf(out, "  }\n");
+      return;
+    case 0x20: case 0x28: case 0x30: case 0x38: // jr cc
+    case 0xC2: case 0xCA: case 0xD2: case 0xDA: // jp cc
+      fprintf(out, "    if (%s) {\n", cond[(op >> 3) & 0x03]);
+      jump_to(bank, op < 0x40 ? next + (int8_t)imm8 : imm16, false);
+      fprintf(out, "    }\n");
+      break;
+    case 0xC3: // jp
+      jump_to(bank, imm16, false);
+      fprintf(out, "  }\n");
+      return;
+    case 0xC4: case 0xCC: case 0xD4: case 0xDC: // call cc
+      fprintf(out, "    if (%s) {\n", cond[(op >> 3) & 0x03]);
+      snprintf(src, sizeof(src), "0x%04X", next);
+      push_value(src);
+      jump_to(bank, imm16, true);
+      fprintf(out, "    }\n");
+      next_of(bank, next, false);
+      fprintf(out, "  }\n");
+      return;
+    case 0xCD: // call
+      snprintf(src, sizeof(src), "0x%04X", next);
+      push_value(src);
+      jump_to(bank, imm16, true);
+      fprintf(out, "  }\n");
+      return;
+    case 0xC7: case 0xCF: case 0xD7: case 0xDF:
+    case 0xE7: case 0xEF: case 0xF7: case 0xFF: // rst
+      snprintf(src, sizeof(src), "0x%04X", next);
+      push_value(src);
+      jump_to(bank, op & 0x38, true);
+      fprintf(out, "  }\n");
+      return;
+    case 0xC0: case 0xC8: case 0xD0: case 0xD8: // ret cc
+      fprintf(out, "    if (%s) {\n", cond[(op >> 3) & 0x03]);
+      pop_pc();
+      fprintf(out, "    }\n");
+      break;
+    case 0xC9: // ret
+      pop_pc();
+      fprintf(out, "  }\n");
+      return;
+    case 0xE9: // jp hl
+      fprintf(out, "    cpu->PC = cpu->HL;\n"
+                   "    AOT_cycles(cpu);\n"
+                   "    if (AOT_exit(cpu))\n"
+                   "      return;\n"
+                   "    goto dispatch;\n  }\n");
+      return;
+    case 0xC1: case 0xD1: case 0xE1: case 0xF1: // pop
+      fprintf(out, "    uint16_t v = AOT_read(cpu, host, cpu->SP++);\n"
+                   "    v |= AOT_read(cpu, host, cpu->SP++) << 8;\n"
+                   "    %s = v%s;\n",
+              r16stk[(op >> 4) & 0x03], op == 0xF1 ? " & 0xFFF0" : "");
+      break;
+    case 0xC5: case 0xD5: case 0xE5: case 0xF5: // push
+      push_value(r16stk[(op >> 4) & 0x03]);
+      next_of(bank, next, true);
+      fprintf(out, "  }\n");
+      return;
+    case 0xCB:
+      prefix(bank, addr, imm8);
+      fprintf(out, "  }\n");
+      return;
+    case 0xE0: // ldh [imm8], a
+      fprintf(out, "    AOT_write(cpu, host, 0xFF%02X, cpu->A);\n", imm8);
+      next_of(bank, next, true);
+      fprintf(out, "  }\n");
+      return;
+    case 0xE2: // ldh [c], a
+      fprintf(out, "    AOT_write(cpu, host, 0xFF00 + cpu->C, cpu->A);\n");
+      next_of(bank, next, true);
+      fprintf(out, "  }\n");
+      return;
+    case 0xEA: // ld [imm16], a
+      fprintf(out, "    AOT_write(cpu, host, 0x%04X, cpu->A);\n", imm16);
+      next_of(bank, next, true);
+      fprintf(out, "  }\n");
+      return;
+    case 0xF0: // ldh a, [imm8]
+      fprintf(out, "    cpu->A = AOT_read(cpu, host, 0xFF%02X);\n", imm8);
+      break;
+    case 0xF2: // ldh a, [c]
+      fprintf(out, "    cpu->A = AOT_read(cpu, host, 0xFF00 + cpu->C);\n");
+      break;
+    case 0xFA: // ld a, [imm16]
+      fprintf(out, "    cpu->A = AOT_read(cpu, host, 0x%04X);\n", imm16);
+      break;
+    case 0xE8: // add sp, imm8
+      fprintf(out, "    cpu->SP = AOT_sp_offset(cpu, (int8_t)0x%02X);\n",
+              imm8);
+      break;
+    case 0xF8: // ld hl, sp + imm8
+      fprintf(out, "    cpu->HL = AOT_sp_offset(cpu, (int8_t)0x%02X);\n",
+              imm8);
+      break;
+    case 0xF9: // ld sp, hl
+      fprintf(out, "    cpu->SP = cpu->HL;\n");
+      break;
+    case 0xF3: // di
+      fprintf(out, "    cpu->IME = 0;\n");
+      break;
+    }
+    next_of(bank, next, false);
+  }
+  fprintf(out, "  }\n");
+}
+
+static bool block_has_code(int bank, int block) {
+  for (int i = block * AOT_BLOCK; i < (block + 1) * AOT_BLOCK; i++) {
+    if (code[bank][i] == CODE)
+      return true;
+  }
+  return false;
+}
+
+static void block_function(int bank, int block) {
+  fprintf(out,
+          "\nstatic void block_%02X_%02X(CPU *cpu, const AotHost *host) {\n"
+          "  const uint8_t rom_bank = cpu->cart->rom_bank;\n"
+          "dispatch:\n"
+          "  switch (cpu->PC) {\n"
+          "  default:\n"
+          "    return;\n",
+          bank, block);
+  block_start = (bank ? BANK_SIZE : 0) + block * AOT_BLOCK;
+  for (int i = 0; i < AOT_BLOCK; i++) {
+    if (code[bank][block * AOT_BLOCK + i] == CODE)
+      instruction(bank, block_start + i);
+  }
+  fprintf(out, "  }\n}\n");
+}
+
+int main(int argc, char **argv) {
+  bool c_only = argc == 4 && strcmp(argv[1], "-c") == 0;
+  if (argc != 3 + c_only) {
+    fprintf(stderr, "syntax: %s [-c] rom.gb dir\n", argv[0]);
+    return 1;
+  }
+  const char *rom = argv[1 + c_only], *dir = argv[2 + c_only];
+
+  cart = cart_load(rom);
+  if (!cart) {
+    fprintf(stderr, "cannot load %s\n", rom);
+    return 1;
+  }
+  if (cart->rom_size < 2 * BANK_SIZE || cart->rom_size % BANK_SIZE) {
+    fprintf(stderr, "%s is not a whole number of 16 KB banks\n", rom);
+    return 1;
+  }
+  banks = cart->rom_size / BANK_SIZE;
+  if (banks > BANKS)
+    banks = BANKS;
+  work = malloc(sizeof(uint32_t) * BANKS * BANK_SIZE);
+  if (!work) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  walk();
+
+  char so[4096], c[4096];
+  snprintf(so, sizeof(so), AOT_FILE, dir, (unsigned long long)cart_hash(cart));
+  snprintf(c, sizeof(c), "%.*s.c", (int)strlen(so) - 3, so);
+  out = fopen(c, "w");
+  if (!out) {
+    fprintf(stderr, "cannot write %s\n", c);
+    return 1;
+  }
+  fprintf(out, "// %s compiled by tools/recompile, do not edit\n\n"
+               "#include \"aot.h\"\n",
+          rom);
+  int instructions = 0;
+  for (int b = 0; b < banks; b++) {
+    for (int i = 0; i < BANK_SIZE; i++)
+      instructions += code[b][i] == CODE;
+    for (int k = 0; k < AOT_BLOCKS; k++) {
+      if (block_has_code(b, k))
+        block_function(b, k);
+    }
+  }
+  fprintf(out, "\nstatic const AotBlock blocks[%d] = {\n", banks * AOT_BLOCKS);
+  for (int b = 0; b < banks; b++) {
+    fprintf(out, "   ");
+    for (int k = 0; k < AOT_BLOCKS; k++) {
+      if (block_has_code(b, k))
+        fprintf(out, " block_%02X_%02X,", b, k);
+      else
+        fprintf(out, " NULL,");
+    }
+    fprintf(out, "\n");
+  }
+  fprintf(out, "};\n\nconst AotCode " AOT_SYMBOL " = {AOT_ABI, 0x%016llxull, "
+               "%d, blocks};\n",
+          (unsigned long long)cart_hash(cart), banks);
+  fclose(out);
+  printf("%d instructions in %d banks, %s\n", instructions, banks, c);
+  if (c_only)
+    return 0;
+
+  const char *cc = getenv("CC") ? getenv("CC") : "cc";
+  char command[3 * 4096];
+  snprintf(command, sizeof(command),
+           "%s -O2 -std=c11 -fPIC -shared -I'%s' -o '%s' '%s'", cc,
+           AOT_INCLUDE, so, c);
+  if (system(command) != 0) {
+    fprintf(stderr, "failed to build %s\n", so);
+    return 1;
+  }
+  printf("%s\n", so);
+  return 0;
+}
@@ -0,0 +1,71 @@
+// prints what a GBemu started with --telemetry NAME publishes
+//
+//   telemetry NAME             the registers and a hex dump of the ranges
+//   telemetry --follow NAME    the registers every frame, until GBemu exits
+
+#define _POSIX_C_SOURCE 200809L
+#include "../telemetry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void print_state(const TelemetryState *s) {
+  printf("%8llu %12llu AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X "
+         "bank=%02X LY=%02X IF=%02X IE=%02X IME=%d%s\n",
+         (unsigned long long)s->frame, (unsigned long long)s->cycle_count,
+         s->af, s->bc, s->de, s->hl, s->sp, s->pc, s->rom_bank, s->ly,
+         s->if_reg, s->ie_reg, s->ime, s->halted ? " halted" : "");
+}
+
+static void print_ranges(const TelemetryShm *layout, const uint8_t *data) {
+  for (uint32_t i = 0; i < layout->range_count; i++) {
+    const TelemetryRange *r = &layout->range[i];
+    for (uint32_t at = 0; at < r->length; at += 16) {
+      printf("%04X:", r->address + at);
+      for (uint32_t j = at; j < at + 16 && j < r->length; j++)
+        printf(" %02X", data[r->offset + j]);
+      printf("\n");
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int follow = argc == 3 && strcmp(argv[1], "--follow") == 0;
+  if (argc != 2 + follow) {
+    fprintf(stderr, "syntax: %s [--follow] NAME\n", argv[0]);
+    return 1;
+  }
+
+  TelemetryReader *r = TELEMETRY_attach(argv[1 + follow]);
+  if (!r) {
+    fprintf(stderr, "no telemetry named %s\n", argv[1 + follow]);
+    return 1;
+  }
+  const TelemetryShm *layout = TELEMETRY_layout(r);
+  uint8_t *data = malloc(layout->data_size ? layout->data_size : 1);
+  if (!data) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  TelemetryState state;
+  TELEMETRY_read(r, &state, data);
+  print_state(&state);
+  if (!follow)
+    print_ranges(layout, data);
+
+  // polls at a few times the frame rate, the emulator does not notice
+  uint64_t shown = state.frame;
+  while (follow && TELEMETRY_alive(r)) {
+    nanosleep(&(struct timespec){0, 4000000}, NULL);
+    TELEMETRY_read(r, &state, data);
+    if (state.frame != shown) {
+      shown = state.frame;
+      print_state(&state);
+      fflush(stdout);
+    }
+  }
+  TELEMETRY_detach(r);
+  free(data);
+  return 0;
+}
@@ -0,0 +1,59 @@
+// converts a binary trace written by GBemu --trace into text
+//
+//   tracedump trace.bin            one line per instruction
+//   tracedump --doctor trace.bin   Gameboy Doctor log format
+
+#include "../trace.h"
+#include <stdio.h>
+#include <string.h>
+
+static void print_text(const TraceRecord *r) {
+  printf("%12llu %02X:%04X %02X %02X %02X %02X  AF=%04X BC=%04X DE=%04X "
+         "HL=%04X SP=%04X LY=%02X IF=%02X IE=%02X IME=%d\n",
+         (unsigned long long)r->cycle, r->bank, r->pc, r->mem[0], r->mem[1],
+         r->mem[2], r->mem[3], r->af, r->bc, r->de, r->hl, r->sp, r->ly,
+         r->if_reg, r->ie_reg, r->flags & TRACE_IME);
+}
+
+static void print_doctor(const TraceRecord *r) {
+  printf("A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X "
+         "PC:%04X PCMEM:%02X,%02X,%02X,%02X\n",
+         r->af >> 8, r->af & 0xFF, r->bc >> 8, r->bc & 0xFF, r->de >> 8,
+         r->de & 0xFF, r->hl >> 8, r->hl & 0xFF, r->sp, r->pc, r->mem[0],
+         r->mem[1], r->mem[2], r->mem[3]);
+}
+
+int main(int argc, char **argv) {
+  int doctor = argc == 3 && strcmp(argv[1], "--doctor") == 0;
+  if (argc != 2 + doctor) {
+    fprintf(stderr, "syntax: %s [--doctor] trace.bin\n", argv[0]);
+    return 1;
+  }
+
+  FILE *f = fopen(argv[1 + doctor], "rb");
+  if (!f) {
+    fprintf(stderr, "cannot open %s\n", argv[1 + doctor]);
+    return 1;
+  }
+  TraceHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.record_size != sizeof(TraceRecord)) {
+    fprintf(stderr, "%s is not a trace file\n", argv[1 + doctor]);
+    fclose(f);
+    return 1;
+  }
+
+  TraceRecord records[4096];
+  size_t n;
+  while ((n = fread(records, sizeof(TraceRecord), 4096, f)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      if (doctor)
+        print_doctor(&records[i]);
+      else
+        print_text(&records[i]);
+    }
+  }
+  fclose(f);
+  return 0;
+}
@@ -0,0 +1,152 @@
+#define _POSIX_C_SOURCE 200809L
+#include "trace.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_RING (1 << 16) // records, must be a power of two
+
+// single producer (the emulator) and single consumer (the writer thread),
+// head and tail only ever grow and live on their own cache lines
+struct Trace {
+  TraceRecord ring[TRACE_RING];
+  _Alignas(64) _Atomic uint64_t head;
+  uint64_t tail_seen; // producer's last look at tail
+  uint64_t stalls;    // times the producer had to wait for the writer
+  _Alignas(64) _Atomic uint64_t tail;
+  _Atomic bool stop;
+  FILE *file;
+  char *path;
+  pthread_t writer;
+};
+
+// the trace still running at exit gets flushed
+static CPU *traced;
+
+static void *TRACE_writer(void *arg) {
+  Trace *t = arg;
+  uint64_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+  for (;;) {
+    // stop is read first so the head read after it is the final one
+    bool stopping = atomic_load(&t->stop);
+    uint64_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+    if (head == tail) {
+      if (stopping)
+        break;
+      nanosleep(&(struct timespec){0, 1000000}, NULL);
+      continue;
+    }
+
+    // up to the end of the ring, the wrapped part goes on the next pass
+    size_t start = tail & (TRACE_RING - 1);
+    size_t count = head - tail;
+    if (start + count > TRACE_RING)
+      count = TRACE_RING - start;
+    fwrite(&t->ring[start], sizeof(TraceRecord), count, t->file);
+    tail += count;
+    atomic_store_explicit(&t->tail, tail, memory_order_release);
+  }
+  return NULL;
+}
+
+static void TRACE_exit(void) {
+  if (traced)
+    TRACE_stop(traced);
+}
+
+bool TRACE_start(CPU *cpu, const char *path) {
+  static bool registered;
+  if (cpu->trace)
+    return true;
+
+  Trace *t = aligned_alloc(_Alignof(Trace), sizeof(Trace));
+  if (!t)
+    return false;
+  memset(t, 0, sizeof(Trace));
+  t->file = fopen(path, "wb");
+  if (!t->file) {
+    free(t);
+    return false;
+  }
+  TraceHeader header = {.record_size = sizeof(TraceRecord)};
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  fwrite(&header, sizeof(header), 1, t->file);
+  t->path = strdup(path);
+
+  if (pthread_create(&t->writer, NULL, TRACE_writer, t) != 0) {
+    fclose(t->file);
+    free(t->path);
+    free(t);
+    return false;
+  }
+
+  cpu->trace = t;
+  traced = cpu;
+  if (!registered) {
+    atexit(TRACE_exit);
+    registered = true;
+  }
+  return true;
+}
+
+void TRACE_stop(CPU *cpu) {
+  Trace *t = cpu->trace;
+  if (!t)
+    return;
+  cpu->trace = NULL;
+  if (traced == cpu)
+    traced = NULL;
+
+  atomic_store(&t->stop, true);
+  pthread_join(t->writer, NULL);
+  fclose(t->file);
+  printf("trace: %llu records written to %s (%llu stalls)\n",
+         (unsigned long long)atomic_load(&t->head), t->path,
+         (unsigned long long)t->stalls);
+  free(t->path);
+  free(t);
+}
+
+void TRACE_record(CPU *cpu) {
+  Trace *t = cpu->trace;
+  uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+
+  // a full ring waits for the writer instead of dropping records
+  if (head - t->tail_seen == TRACE_RING) {
+    for (;;) {
+      t->tail_seen = atomic_load_explicit(&t->tail, memory_order_acquire);
+      if (head - t->tail_seen < TRACE_RING)
+        break;
+      t->stalls++;
+      sched_yield();
+    }
+  }
+
+  TraceRecord *r = &t->ring[head & (TRACE_RING - 1)];
+  r->cycle = cpu->cycle_count;
+  r->pc = cpu->PC;
+  r->sp = cpu->SP;
+  r->af = cpu->AF;
+  r->bc = cpu->BC;
+  r->de = cpu->DE;
+  r->hl = cpu->HL;
+  r->bank = cpu->PC >= 0x4000 && cpu->PC < 0x8000
+                ? cpu->cart->rom_bank & 0x1F
+                : 0;
+  // read without the bus, which would fire watches and I/O side effects;
+  // nothing past FFFF
+  uint32_t n = 0x10000 - cpu->PC < 4 ? 0x10000 - cpu->PC : 4;
+  memset(r->mem, 0, sizeof(r->mem));
+  CPU_gather(cpu, cpu->PC, n, r->mem);
+  r->flags = cpu->IME ? TRACE_IME : 0;
+  r->ly = cpu->ly;
+  r->if_reg = cpu->if_reg;
+  r->ie_reg = cpu->ie_reg;
+  memset(r->reserved, 0, sizeof(r->reserved));
+
+  atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
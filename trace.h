@@ -0,0 +1,40 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Execution trace. While a trace is running CPU_run stores one fixed size
+// record per instruction, taken just before it executes, in a lock-free
+// ring buffer. A writer thread flushes the ring to disk and
+// tools/tracedump turns the file back into text.
+//
+// File layout: a TraceHeader followed by TraceRecords, native endian.
+
+#define TRACE_MAGIC "GBTRACE1"
+#define TRACE_IME 0x01
+
+typedef struct {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t reserved;
+} TraceHeader;
+
+typedef struct {
+  uint64_t cycle; // CPU.cycle_count before the instruction
+  uint16_t pc, sp;
+  uint16_t af, bc, de, hl;
+  uint8_t bank;   // ROM bank when pc is in 0x4000-0x7FFF, else 0
+  uint8_t mem[4]; // bytes at pc, mem[0] is the opcode, 0 past FFFF
+  uint8_t flags;  // TRACE_IME
+  uint8_t ly;
+  uint8_t if_reg;
+  uint8_t ie_reg;
+  uint8_t reserved[3];
+} TraceRecord;
+
+_Static_assert(sizeof(TraceRecord) == 32, "trace records are 32 bytes");
+
+bool TRACE_start(CPU *cpu, const char *path);
+void TRACE_stop(CPU *cpu);
+void TRACE_record(CPU *cpu);
@@ -0,0 +1,247 @@
+#define _POSIX_C_SOURCE 200809L
+#include "video.h"
+#include "render.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VIDEO_SLOTS 8 // frame buffers, must be a power of two
+
+typedef struct {
+  uint8_t frame[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+  uint32_t lut[DISPLAY_SHADES];
+  int frames; // times it is written
+} VideoSlot;
+
+// single producer (the emulator) and single consumer (the writer thread)
+// like the trace ring, head and tail only ever grow
+struct Video {
+  VideoSlot slots[VIDEO_SLOTS];
+  _Alignas(64) _Atomic uint64_t head;
+  uint64_t dropped; // frames that found every buffer queued
+  int missing;      // dropped since the last queued frame
+  bool wait;
+  _Alignas(64) _Atomic uint64_t tail;
+  _Atomic bool stop;
+
+  // writer side
+  VideoFormat format;
+  int factor;
+  Scaler *scaler;
+  uint32_t *scaled;
+  uint8_t *out; // one converted frame
+  size_t out_size;
+  uint64_t written;
+  bool failed;
+  FILE *file;
+  char *path;
+  pthread_t writer;
+};
+
+// the capture still running at exit gets flushed
+static Video *recording;
+
+static const char *formats[] = {[VIDEO_Y4M] = "y4m", [VIDEO_RGB] = "rgb"};
+
+// BT.601 studio range
+static void VIDEO_yuv(uint32_t argb, uint8_t *yuv) {
+  int r = argb >> 16 & 0xFF, g = argb >> 8 & 0xFF, b = argb & 0xFF;
+  yuv[0] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+  yuv[1] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+  yuv[2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+static void VIDEO_rgb(uint32_t argb, uint8_t *rgb) {
+  rgb[0] = argb >> 16;
+  rgb[1] = argb >> 8;
+  rgb[2] = argb;
+}
+
+// planar Y, U, V or packed RGB, 3 bytes per pixel either way
+static void VIDEO_put(Video *v, size_t i, size_t count, const uint8_t *px) {
+  if (v->format == VIDEO_Y4M) {
+    v->out[i] = px[0];
+    v->out[count + i] = px[1];
+    v->out[count * 2 + i] = px[2];
+  } else {
+    memcpy(v->out + i * 3, px, 3);
+  }
+}
+
+static void VIDEO_write(Video *v, VideoSlot *slot) {
+  if (v->failed)
+    return;
+  void (*convert)(uint32_t, uint8_t *) =
+      v->format == VIDEO_Y4M ? VIDEO_yuv : VIDEO_rgb;
+  size_t count = v->out_size / 3;
+  if (v->factor > 1) {
+    SCALE_run(v->scaler, slot->frame, slot->lut, v->factor, v->scaled,
+              DISPLAY_WIDTH * v->factor * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+      uint8_t px[3];
+      convert(v->scaled[i], px);
+      VIDEO_put(v, i, count, px);
+    }
+  } else {
+    // straight from the shades
+    uint8_t shades[DISPLAY_SHADES][3];
+    for (int i = 0; i < DISPLAY_SHADES; i++)
+      convert(slot->lut[i], shades[i]);
+    for (size_t i = 0; i < count; i++)
+      VIDEO_put(v, i, count, shades[slot->frame[i]]);
+  }
+
+  for (int i = 0; i < slot->frames; i++) {
+    if ((v->format == VIDEO_Y4M && fputs("FRAME\n", v->file) == EOF) ||
+        fwrite(v->out, v->out_size, 1, v->file) != 1) {
+      // the reader went away, the rest of the frames are thrown away
+      fprintf(stderr, "video: cannot write to %s\n", v->path);
+      v->failed = true;
+      return;
+    }
+    v->written++;
+  }
+}
+
+static void *VIDEO_writer(void *arg) {
+  Video *v = arg;
+  uint64_t tail = atomic_load_explicit(&v->tail, memory_order_relaxed);
+  for (;;) {
+    // stop is read first so the head read after it is the final one
+    bool stopping = atomic_load(&v->stop);
+    uint64_t head = atomic_load_explicit(&v->head, memory_order_acquire);
+    if (head == tail) {
+      if (stopping)
+        break;
+      nanosleep(&(struct timespec){0, 1000000}, NULL);
+      continue;
+    }
+    VIDEO_write(v, &v->slots[tail & (VIDEO_SLOTS - 1)]);
+    tail++;
+    atomic_store_explicit(&v->tail, tail, memory_order_release);
+  }
+  return NULL;
+}
+
+static void VIDEO_exit(void) {
+  if (recording)
+    VIDEO_close(recording);
+}
+
+bool VIDEO_parse(const char *name, VideoFormat *format) {
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    if (strcmp(name, formats[i]) == 0) {
+      *format = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+Video *VIDEO_open(const char *path, VideoFormat format, int factor,
+                  ScaleFilter filter, bool wait) {
+  static bool registered;
+  if (factor < 1 || factor > SCALE_MAX_FACTOR)
+    return NULL;
+
+  Video *v = aligned_alloc(_Alignof(Video), sizeof(Video));
+  if (!v)
+    return NULL;
+  memset(v, 0, sizeof(Video));
+  v->format = format;
+  v->factor = factor;
+  v->wait = wait;
+  int width = DISPLAY_WIDTH * factor, height = DISPLAY_HEIGHT * factor;
+  v->out_size = (size_t)width * height * 3;
+  v->out = malloc(v->out_size);
+  if (factor > 1) {
+    // the writer is a thread of its own already
+    v->scaler = SCALE_new(filter, 1);
+    v->scaled = malloc((size_t)width * height * sizeof(uint32_t));
+  }
+  if (!v->out || (factor > 1 && (!v->scaler || !v->scaled)))
+    goto fail;
+
+  if (strcmp(path, "-") == 0) {
+    // the video keeps stdout, printf goes to stderr from now on
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0 || !(v->file = fdopen(fd, "wb")))
+      goto fail;
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+  } else if (!(v->file = fopen(path, "wb"))) {
+    goto fail;
+  }
+  // an encoder that quits early must not kill the emulator
+  signal(SIGPIPE, SIG_IGN);
+  if (format == VIDEO_Y4M)
+    fprintf(v->file, "YUV4MPEG2 W%d H%d F4194304:70224 Ip A1:1 C444\n", width,
+            height);
+  v->path = strdup(path);
+
+  if (pthread_create(&v->writer, NULL, VIDEO_writer, v) != 0) {
+    fclose(v->file);
+    v->file = NULL;
+    goto fail;
+  }
+  recording = v;
+  if (!registered) {
+    atexit(VIDEO_exit);
+    registered = true;
+  }
+  return v;
+
+fail:
+  if (v->file)
+    fclose(v->file);
+  SCALE_free(v->scaler);
+  free(v->scaled);
+  free(v->out);
+  free(v->path);
+  free(v);
+  return NULL;
+}
+
+void VIDEO_frame(Video *v, const uint8_t *frame, const uint32_t *lut,
+                 int frames) {
+  uint64_t head = atomic_load_explicit(&v->head, memory_order_relaxed);
+  while (head - atomic_load_explicit(&v->tail, memory_order_acquire) ==
+         VIDEO_SLOTS) {
+    if (!v->wait) {
+      v->dropped += frames;
+      v->missing += frames;
+      return;
+    }
+    nanosleep(&(struct timespec){0, 100000}, NULL);
+  }
+  VideoSlot *slot = &v->slots[head & (VIDEO_SLOTS - 1)];
+  memcpy(slot->frame, frame, sizeof(slot->frame));
+  memcpy(slot->lut, lut, sizeof(slot->lut));
+  slot->frames = frames + v->missing;
+  v->missing = 0;
+  atomic_store_explicit(&v->head, head + 1, memory_order_release);
+}
+
+void VIDEO_close(Video *v) {
+  if (!v)
+    return;
+  if (recording == v)
+    recording = NULL;
+
+  atomic_store(&v->stop, true);
+  pthread_join(v->writer, NULL);
+  fclose(v->file);
+  printf("video: %llu frames written to %s (%llu dropped)\n",
+         (unsigned long long)v->written, v->path,
+         (unsigned long long)v->dropped);
+  SCALE_free(v->scaler);
+  free(v->scaled);
+  free(v->out);
+  free(v->path);
+  free(v);
+}
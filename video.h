@@ -0,0 +1,30 @@
+#pragma once
+
+#include "scale.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Video capture. Every emulated frame goes to a file or a pipe as Y4M
+// (4:4:4, 4194304/70224 fps) or as raw RGB24, at 160x144 or scaled with one
+// of the scale.c filters. The emulator copies the frame into one of a ring
+// of reusable buffers and a writer thread scales, converts and writes it,
+// so a slow disk or encoder does not hold up the emulation loop.
+//
+//   GBemu rom --headless --frames 3600 --video - | ffmpeg -i - out.mp4
+
+typedef enum { VIDEO_Y4M, VIDEO_RGB } VideoFormat;
+
+typedef struct Video Video;
+
+// y4m or rgb
+bool VIDEO_parse(const char *name, VideoFormat *format);
+// path - is stdout, whose other output then goes to stderr. With wait the
+// emulator waits for a free buffer, otherwise a frame that finds them all
+// queued is dropped and the next one written is repeated in its place.
+Video *VIDEO_open(const char *path, VideoFormat format, int factor,
+                  ScaleFilter filter, bool wait);
+// a render.h frame with its palette, standing for frames emulated frames
+// (more than one with the boost)
+void VIDEO_frame(Video *v, const uint8_t *frame, const uint32_t *lut,
+                 int frames);
+void VIDEO_close(Video *v);